@@ -6,6 +6,8 @@ CLANG_LIB="$1"/tools/clang/lib/Analysis/Til
 diff -u "$CLANG_INC"/base/SimpleArray.h  src/base/SimpleArray.h
 diff -u "$CLANG_INC"/base/MutArrayRef.h  src/base/MutArrayRef.h
 diff -u "$CLANG_INC"/base/ArrayTree.h    src/base/ArrayTree.h
+diff -u "$CLANG_INC"/base/LZCodec.h      src/base/LZCodec.h
+diff -u "$CLANG_INC"/base/MappedFile.h   src/base/MappedFile.h
 
 diff -u "$CLANG_INC"/TILOps.def          src/til/TILOps.def
 diff -u "$CLANG_INC"/TILAnnKinds.def     src/til/TILAnnKinds.def
@@ -22,9 +24,13 @@ diff -u "$CLANG_INC"/CopyReducer.h       src/til/CopyReducer.h
 diff -u "$CLANG_INC"/InplaceReducer.h    src/til/InplaceReducer.h
 diff -u "$CLANG_INC"/SSAPass.h           src/til/SSAPass.h
 diff -u "$CLANG_INC"/Bytecode.h          src/til/Bytecode.h
+diff -u "$CLANG_INC"/BytecodeContainer.h src/til/BytecodeContainer.h
 
 diff -u "$CLANG_LIB"/TIL.cpp             src/til/TIL.cpp
 diff -u "$CLANG_LIB"/CFGBuilder.cpp      src/til/CFGBuilder.cpp
 diff -u "$CLANG_LIB"/SSAPass.cpp         src/til/SSAPass.cpp
 diff -u "$CLANG_LIB"/AnnotationImpl.cpp  src/til/AnnotationImpl.cpp
 diff -u "$CLANG_LIB"/Bytecode.cpp        src/til/Bytecode.cpp
+diff -u "$CLANG_LIB"/BytecodeContainer.cpp src/til/BytecodeContainer.cpp
+diff -u "$CLANG_LIB"/LZCodec.cpp         src/base/LZCodec.cpp
+diff -u "$CLANG_LIB"/MappedFile.cpp      src/base/MappedFile.cpp
@@ -6,6 +6,8 @@ CLANG_LIB="$1"/tools/clang/lib/Analysis/Til
 cp -v "$CLANG_INC"/base/SimpleArray.h  src/base/
 cp -v "$CLANG_INC"/base/MutArrayRef.h  src/base/
 cp -v "$CLANG_INC"/base/ArrayTree.h    src/base/
+cp -v "$CLANG_INC"/base/LZCodec.h      src/base/
+cp -v "$CLANG_INC"/base/MappedFile.h   src/base/
 
 cp -v "$CLANG_INC"/TILOps.def          src/til/
 cp -v "$CLANG_INC"/TILAnnKinds.def     src/til/
@@ -22,9 +24,13 @@ cp -v "$CLANG_INC"/CopyReducer.h       src/til/
 cp -v "$CLANG_INC"/InplaceReducer.h    src/til/
 cp -v "$CLANG_INC"/SSAPass.h           src/til/
 cp -v "$CLANG_INC"/Bytecode.h          src/til/
+cp -v "$CLANG_INC"/BytecodeContainer.h src/til/
 
 cp -v "$CLANG_LIB"/TIL.cpp             src/til/
 cp -v "$CLANG_LIB"/CFGBuilder.cpp      src/til/
 cp -v "$CLANG_LIB"/SSAPass.cpp         src/til/
 cp -v "$CLANG_LIB"/AnnotationImpl.cpp  src/til/
 cp -v "$CLANG_LIB"/Bytecode.cpp        src/til/
+cp -v "$CLANG_LIB"/BytecodeContainer.cpp src/til/
+cp -v "$CLANG_LIB"/LZCodec.cpp         src/base/
+cp -v "$CLANG_LIB"/MappedFile.cpp      src/base/
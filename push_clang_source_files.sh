@@ -6,6 +6,8 @@ CLANG_LIB="$1"/tools/clang/lib/Analysis/Til
 cp -v src/base/SimpleArray.h      "$CLANG_INC"/base/
 cp -v src/base/MutArrayRef.h      "$CLANG_INC"/base/
 cp -v src/base/ArrayTree.h        "$CLANG_INC"/base/
+cp -v src/base/LZCodec.h          "$CLANG_INC"/base/
+cp -v src/base/MappedFile.h       "$CLANG_INC"/base/
 
 cp -v src/til/TILOps.def          "$CLANG_INC"
 cp -v src/til/TILAnnKinds.def     "$CLANG_INC"
@@ -22,9 +24,13 @@ cp -v src/til/CopyReducer.h       "$CLANG_INC"
 cp -v src/til/InplaceReducer.h    "$CLANG_INC"
 cp -v src/til/SSAPass.h           "$CLANG_INC"
 cp -v src/til/Bytecode.h          "$CLANG_INC"
+cp -v src/til/BytecodeContainer.h "$CLANG_INC"
 
 cp -v src/til/TIL.cpp             "$CLANG_LIB"
 cp -v src/til/CFGBuilder.cpp      "$CLANG_LIB"
 cp -v src/til/SSAPass.cpp         "$CLANG_LIB"
 cp -v src/til/AnnotationImpl.cpp  "$CLANG_LIB"
 cp -v src/til/Bytecode.cpp        "$CLANG_LIB"
+cp -v src/til/BytecodeContainer.cpp "$CLANG_LIB"
+cp -v src/base/LZCodec.cpp        "$CLANG_LIB"
+cp -v src/base/MappedFile.cpp     "$CLANG_LIB"
@@ -0,0 +1,278 @@
+//===- BlockLayout.cpp -----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "BlockLayout.h"
+
+#include <algorithm>
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+// Estimated weights of edges, when there is no profile.
+const uint64_t JumpWeight   = 2;
+const uint64_t BranchWeight = 1;
+
+
+/// A weighted edge between two blocks.
+struct LayoutEdge {
+  uint32_t From;
+  uint32_t To;
+  uint64_t Weight;
+};
+
+
+class BlockLayout {
+public:
+  BlockLayout(MachineFunction &MF, const BlockProfile *P, LayoutStats &S)
+      : MF(MF), Profile(P), Stats(S) { }
+
+  void run();
+
+private:
+  void findColdBlocks();
+  void computeWeights();
+  void buildChains();
+  void placeChains();
+  void reorder();
+
+  MachineFunction&    MF;
+  const BlockProfile* Profile;
+  LayoutStats&        Stats;
+
+  std::vector<bool>       Cold;
+  std::vector<LayoutEdge> Edges;
+  std::vector<uint64_t>   MaxIn;     ///< Heaviest edge into each block.
+
+  // Chains are linked lists of blocks, named by their head.
+  std::vector<uint32_t> ChainOf;     ///< Head of the chain of each block.
+  std::vector<uint32_t> NextInChain;
+  std::vector<uint32_t> Tail;        ///< Tail of each chain, by head.
+
+  std::vector<uint32_t> Order;
+};
+
+
+// With a profile, a block is cold if it never ran.  Otherwise, a block is
+// cold if every path from it ends in a trap.
+void BlockLayout::findColdBlocks() {
+  unsigned NumBlocks = MF.Blocks.size();
+  Cold.assign(NumBlocks, false);
+  if (Profile) {
+    for (unsigned b = 1; b < NumBlocks; ++b)
+      Cold[b] = Profile->BlockCounts[b] == 0;
+    return;
+  }
+
+  for (unsigned b = 1; b < NumBlocks; ++b) {
+    const MBlock &B = MF.Blocks[b];
+    Cold[b] = !B.Instrs.empty() && B.Instrs.back().Op == MOP_Trap;
+  }
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned b = 1; b < NumBlocks; ++b) {
+      if (Cold[b])
+        continue;
+      bool AllCold = true;
+      bool Any = false;
+      forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+        Any = true;
+        AllCold = AllCold && Cold[S];
+      });
+      if (Any && AllCold) {
+        Cold[b] = true;
+        Changed = true;
+      }
+    }
+  }
+}
+
+
+// Collect the edges between hot blocks, from the most to the least
+// frequent.  Ties go to edges which are already fall-throughs, so that
+// the original order is kept where nothing better is known.
+void BlockLayout::computeWeights() {
+  MaxIn.assign(MF.Blocks.size(), 0);
+  for (unsigned b = 0; b < MF.Blocks.size(); ++b) {
+    if (Cold[b])
+      continue;
+    std::vector<uint32_t> Succs;
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      if (std::find(Succs.begin(), Succs.end(), S) == Succs.end())
+        Succs.push_back(S);
+    });
+    for (uint32_t S : Succs) {
+      if (Cold[S] || S == 0)
+        continue;
+      uint64_t W;
+      if (Profile)
+        W = Profile->edgeCount(b, S);
+      else
+        W = Succs.size() == 1 ? JumpWeight : BranchWeight;
+      if (W > 0)
+        Edges.push_back(LayoutEdge{ b, S, W });
+      MaxIn[S] = std::max(MaxIn[S], W);
+    }
+  }
+
+  std::stable_sort(Edges.begin(), Edges.end(),
+    [](const LayoutEdge &A, const LayoutEdge &B) {
+      if (A.Weight != B.Weight)
+        return A.Weight > B.Weight;
+      return (A.To == A.From + 1) > (B.To == B.From + 1);
+    });
+}
+
+
+// An edge which is much rarer than another edge into the same block does
+// not become a fall-through, even if the other edge cannot.  Otherwise a
+// rare path which jumps back to a loop header would be placed in front of
+// the loop, since the back edge itself can never fall through.
+void BlockLayout::buildChains() {
+  unsigned NumBlocks = MF.Blocks.size();
+  ChainOf.resize(NumBlocks);
+  NextInChain.assign(NumBlocks, MInstr::NoReg);
+  Tail.resize(NumBlocks);
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    ChainOf[b] = b;
+    Tail[b] = b;
+  }
+
+  for (auto &E : Edges) {
+    uint32_t A = ChainOf[E.From];
+    uint32_t B = ChainOf[E.To];
+    if (A == B || Tail[A] != E.From || B != E.To)
+      continue;
+    if (2*E.Weight < MaxIn[E.To])
+      continue;
+    NextInChain[E.From] = E.To;
+    Tail[A] = Tail[B];
+    for (uint32_t b = B; b != MInstr::NoReg; b = NextInChain[b])
+      ChainOf[b] = A;
+  }
+}
+
+
+// Place the entry chain, and then repeatedly the hot chain with the most
+// frequent edges from the blocks placed so far.  Chains which are never
+// entered from placed blocks are taken in their original order, and cold
+// blocks come last.
+void BlockLayout::placeChains() {
+  unsigned NumBlocks = MF.Blocks.size();
+  std::vector<uint64_t> Score(NumBlocks, 0);
+  std::vector<bool> Placed(NumBlocks, false);
+
+  auto place = [&](uint32_t Head) {
+    Placed[Head] = true;
+    for (uint32_t b = Head; b != MInstr::NoReg; b = NextInChain[b])
+      Order.push_back(b);
+    for (uint32_t b = Head; b != MInstr::NoReg; b = NextInChain[b]) {
+      for (auto &E : Edges) {
+        if (E.From == b)
+          Score[ChainOf[E.To]] += E.Weight;
+      }
+    }
+  };
+
+  place(0);
+  while (true) {
+    uint32_t Best = MInstr::NoReg;
+    for (unsigned h = 1; h < NumBlocks; ++h) {
+      if (ChainOf[h] != h || Placed[h] || Cold[h])
+        continue;
+      if (Best == MInstr::NoReg || Score[h] > Score[Best])
+        Best = h;
+    }
+    if (Best == MInstr::NoReg)
+      break;
+    place(Best);
+  }
+
+  for (unsigned b = 1; b < NumBlocks; ++b) {
+    if (Cold[b]) {
+      Order.push_back(b);
+      ++Stats.NumColdBlocks;
+    }
+  }
+}
+
+
+void BlockLayout::reorder() {
+  unsigned NumBlocks = MF.Blocks.size();
+  std::vector<uint32_t> NewIndex(NumBlocks);
+  for (unsigned i = 0; i < NumBlocks; ++i) {
+    NewIndex[Order[i]] = i;
+    if (Order[i] != i)
+      ++Stats.NumMovedBlocks;
+  }
+
+  std::vector<MBlock> Blocks(NumBlocks);
+  for (unsigned i = 0; i < NumBlocks; ++i)
+    Blocks[i] = std::move(MF.Blocks[Order[i]]);
+  for (auto &B : Blocks) {
+    if (B.Instrs.empty())
+      continue;
+    MInstr &T = B.Instrs.back();
+    switch (T.Op) {
+      case MOP_Branch:
+      case MOP_CondBranch:
+      case MOP_BitTest:
+        T.Target1 = NewIndex[T.Target1];
+        // Fall through.
+      case MOP_Jump:
+        T.Target0 = NewIndex[T.Target0];
+        break;
+      case MOP_JumpTable:
+        for (uint32_t &S : B.JumpTable)
+          S = NewIndex[S];
+        break;
+      default:
+        break;
+    }
+  }
+  MF.Blocks = std::move(Blocks);
+}
+
+
+void BlockLayout::run() {
+  if (Profile && Profile->BlockCounts.size() != MF.Blocks.size())
+    Profile = nullptr;
+  ++Stats.NumFunctions;
+  if (Profile)
+    ++Stats.NumProfiled;
+
+  findColdBlocks();
+  computeWeights();
+  buildChains();
+  placeChains();
+  reorder();
+}
+
+}  // end anonymous namespace
+
+
+void layoutBlocks(MachineFunction &MF, const BlockProfile *Profile,
+                  LayoutStats *Stats) {
+  LayoutStats S;
+  BlockLayout(MF, Profile, Stats ? *Stats : S).run();
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
@@ -0,0 +1,68 @@
+//===- BlockLayout.h -------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Orders the blocks of a MachineFunction, so that frequently taken edges
+// become fall-throughs, and code which never runs is moved out of the way.
+//
+// Blocks are first joined into chains, in the manner of Pettis and Hansen:
+// edges are visited from the most to the least frequent, and an edge joins
+// two chains if it goes from the tail of one to the head of the other.
+// The chain holding the entry block is placed first, followed by whichever
+// chain is most often entered from the blocks placed so far.  Cold blocks
+// are placed last, after all of the hot code.
+//
+// Edge frequencies are taken from a BlockProfile if there is one.  Blocks
+// which the profile never saw run are cold.  Without a profile, the
+// unconditional edges are weighted above conditional ones, and blocks
+// which can only lead to a trap are cold.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_BLOCKLAYOUT_H
+#define OHMU_BACKEND_JIT_BLOCKLAYOUT_H
+
+#include "backend/jit/MachineIR.h"
+#include "backend/jit/Profile.h"
+
+namespace ohmu {
+namespace jit  {
+
+
+/// Statistics from block layout.
+struct LayoutStats {
+  LayoutStats()
+      : NumFunctions(0), NumProfiled(0), NumMovedBlocks(0),
+        NumColdBlocks(0) { }
+
+  unsigned NumFunctions;
+  unsigned NumProfiled;      ///< Functions laid out from a profile.
+  unsigned NumMovedBlocks;   ///< Blocks which changed position.
+  unsigned NumColdBlocks;    ///< Blocks placed after the hot code.
+};
+
+
+/// Reorder the blocks of MF.  Profile holds the counts for MF, or is null
+/// to estimate them.  Must be run before register allocation.  If Stats is
+/// non-null, the counts are added to it.
+void layoutBlocks(MachineFunction &MF, const BlockProfile *Profile,
+                  LayoutStats *Stats = nullptr);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_BLOCKLAYOUT_H
@@ -0,0 +1,445 @@
+//===- Coalesce.cpp --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Coalesce.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+// The number of registers available to the register allocator.
+const unsigned NumRegs = 11;
+
+
+/// A move which may be removed, and the loop depth of its block.
+struct CopyRef {
+  uint32_t Block;
+  uint32_t Index;
+  unsigned Depth;
+};
+
+
+class Coalescer {
+public:
+  Coalescer(MachineFunction &MF, CoalesceStats &S) : MF(MF), Stats(S) { }
+
+  void run();
+
+private:
+  void computeLiveness();
+  void buildGraph();
+  void collectCopies();
+  void coalesce();
+  void rewrite();
+  void removeEmptyBlocks();
+
+  uint32_t find(uint32_t V) {
+    while (Leader[V] != V)
+      V = Leader[V] = Leader[Leader[V]];
+    return V;
+  }
+
+  static uint64_t edgeKey(uint32_t A, uint32_t B) {
+    if (A > B)
+      std::swap(A, B);
+    return (uint64_t(A) << 32) | B;
+  }
+
+  bool interferes(uint32_t A, uint32_t B) const {
+    return Edges.count(edgeKey(A, B)) != 0;
+  }
+
+  void addEdge(uint32_t A, uint32_t B) {
+    if (A == B || !Edges.insert(edgeKey(A, B)).second)
+      return;
+    Adj[A].push_back(B);
+    Adj[B].push_back(A);
+  }
+
+  bool briggs(uint32_t A, uint32_t B) const;
+  bool george(uint32_t A, uint32_t B) const;
+  void merge(uint32_t Keep, uint32_t Gone);
+
+  bool test(const std::vector<uint64_t> &S, unsigned B, uint32_t V) const {
+    return (S[B*Words + V/64] >> (V % 64)) & 1;
+  }
+  void set(std::vector<uint64_t> &S, unsigned B, uint32_t V) {
+    S[B*Words + V/64] |= uint64_t(1) << (V % 64);
+  }
+
+  MachineFunction& MF;
+  CoalesceStats&   Stats;
+
+  unsigned Words;
+  std::vector<uint64_t> LiveOut;
+  std::vector<uint64_t> LiveIn;
+
+  std::unordered_set<uint64_t>       Edges;
+  std::vector<std::vector<uint32_t>> Adj;     ///< Neighbors of each leader.
+  std::vector<uint32_t>              Leader;  ///< Union-find parent.
+  std::vector<uint8_t>               DefSize; ///< Widest definition.
+  std::vector<CopyRef>               Copies;
+};
+
+
+void Coalescer::computeLiveness() {
+  unsigned NumBlocks = MF.Blocks.size();
+  Words = (MF.NumVRegs + 63) / 64;
+  std::vector<uint64_t> Gen(NumBlocks * Words, 0);
+  std::vector<uint64_t> Kill(NumBlocks * Words, 0);
+  LiveIn.assign(NumBlocks * Words, 0);
+  LiveOut.assign(NumBlocks * Words, 0);
+
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    for (auto &I : MF.Blocks[b].Instrs) {
+      forEachUse(MF, I, [&](uint32_t V) {
+        if (!test(Kill, b, V))
+          set(Gen, b, V);
+      });
+      if (I.Dst != MInstr::NoReg)
+        set(Kill, b, I.Dst);
+    }
+  }
+
+  std::vector<std::vector<unsigned>> Preds(NumBlocks);
+  for (unsigned b = 0; b < NumBlocks; ++b)
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) { Preds[S].push_back(b); });
+
+  std::vector<unsigned> Worklist;
+  std::vector<bool> Queued(NumBlocks, true);
+  for (unsigned b = 0; b < NumBlocks; ++b)
+    Worklist.push_back(b);
+  while (!Worklist.empty()) {
+    unsigned b = Worklist.back();
+    Worklist.pop_back();
+    Queued[b] = false;
+
+    uint64_t *Out = &LiveOut[b*Words];
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      const uint64_t *In = &LiveIn[S*Words];
+      for (unsigned w = 0; w < Words; ++w)
+        Out[w] |= In[w];
+    });
+    uint64_t *In = &LiveIn[b*Words];
+    bool Changed = false;
+    for (unsigned w = 0; w < Words; ++w) {
+      uint64_t NewIn = Gen[b*Words + w] | (Out[w] & ~Kill[b*Words + w]);
+      if (NewIn != In[w]) {
+        In[w] = NewIn;
+        Changed = true;
+      }
+    }
+    if (!Changed)
+      continue;
+    for (unsigned P : Preds[b]) {
+      if (!Queued[P]) {
+        Queued[P] = true;
+        Worklist.push_back(P);
+      }
+    }
+  }
+}
+
+
+// Walk each block backwards from its live-out set.  A definition
+// interferes with everything live after it, even if the definition itself
+// is dead, since it still overwrites its register.
+void Coalescer::buildGraph() {
+  Adj.resize(MF.NumVRegs);
+  Leader.resize(MF.NumVRegs);
+  DefSize.assign(MF.NumVRegs, 0);
+  for (uint32_t v = 0; v < MF.NumVRegs; ++v)
+    Leader[v] = v;
+  for (uint32_t v = 0; v < MF.NumParams; ++v)
+    DefSize[v] = 8;
+
+  std::vector<uint64_t> Live(Words);
+  for (unsigned b = 0; b < MF.Blocks.size(); ++b) {
+    std::copy(&LiveOut[b*Words], &LiveOut[b*Words] + Words, Live.begin());
+    auto &Instrs = MF.Blocks[b].Instrs;
+    for (unsigned i = Instrs.size(); i-- > 0;) {
+      const MInstr &I = Instrs[i];
+      if (I.Dst != MInstr::NoReg) {
+        uint32_t Skip = I.Op == MOP_Mov ? I.A : MInstr::NoReg;
+        for (unsigned w = 0; w < Words; ++w) {
+          for (uint64_t Bits = Live[w]; Bits; Bits &= Bits - 1) {
+            uint32_t V = w*64 + __builtin_ctzll(Bits);
+            if (V != Skip)
+              addEdge(I.Dst, V);
+          }
+        }
+        Live[I.Dst / 64] &= ~(uint64_t(1) << (I.Dst % 64));
+        DefSize[I.Dst] = std::max(DefSize[I.Dst], I.Size);
+      }
+      forEachUse(MF, I, [&](uint32_t V) {
+        Live[V / 64] |= uint64_t(1) << (V % 64);
+      });
+    }
+  }
+
+  // The parameters are all defined on entry.
+  for (uint32_t p = 0; p < MF.NumParams; ++p) {
+    for (uint32_t q = 0; q < MF.NumParams; ++q)
+      addEdge(p, q);
+    for (unsigned w = 0; w < Words; ++w) {
+      for (uint64_t Bits = LiveIn[w]; Bits; Bits &= Bits - 1)
+        addEdge(p, w*64 + __builtin_ctzll(Bits));
+    }
+  }
+}
+
+
+// A loop is approximated by the blocks between the target and source of a
+// back edge, in block order, as in the register allocator.
+void Coalescer::collectCopies() {
+  unsigned NumBlocks = MF.Blocks.size();
+  std::vector<int> Delta(NumBlocks + 1, 0);
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      if (S <= b) {
+        ++Delta[S];
+        --Delta[b + 1];
+      }
+    });
+  }
+  int Depth = 0;
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    Depth += Delta[b];
+    auto &Instrs = MF.Blocks[b].Instrs;
+    for (unsigned i = 0; i < Instrs.size(); ++i) {
+      const MInstr &I = Instrs[i];
+      if (I.Op == MOP_Mov && I.Dst != MInstr::NoReg && I.A != MInstr::NoReg)
+        Copies.push_back(CopyRef{ b, i, static_cast<unsigned>(Depth) });
+    }
+  }
+  std::stable_sort(Copies.begin(), Copies.end(),
+    [](const CopyRef &A, const CopyRef &B) { return A.Depth > B.Depth; });
+}
+
+
+// The merged node is colorable if fewer than NumRegs of its neighbors have
+// significant degree.  A common neighbor loses an edge in the merge.
+bool Coalescer::briggs(uint32_t A, uint32_t B) const {
+  unsigned NumSignificant = 0;
+  for (uint32_t T : Adj[A]) {
+    size_t Degree = Adj[T].size() - (interferes(T, B) ? 1 : 0);
+    if (Degree >= NumRegs)
+      ++NumSignificant;
+  }
+  for (uint32_t T : Adj[B]) {
+    if (!interferes(T, A) && Adj[T].size() >= NumRegs)
+      ++NumSignificant;
+  }
+  return NumSignificant < NumRegs;
+}
+
+
+// Merging A into B is safe if every neighbor of A is already a neighbor of
+// B, or can always be colored.
+bool Coalescer::george(uint32_t A, uint32_t B) const {
+  for (uint32_t T : Adj[A]) {
+    if (Adj[T].size() >= NumRegs && !interferes(T, B))
+      return false;
+  }
+  return true;
+}
+
+
+void Coalescer::merge(uint32_t Keep, uint32_t Gone) {
+  Leader[Gone] = Keep;
+  DefSize[Keep] = std::max(DefSize[Keep], DefSize[Gone]);
+  std::vector<uint32_t> Neighbors;
+  Neighbors.swap(Adj[Gone]);
+  for (uint32_t T : Neighbors) {
+    Edges.erase(edgeKey(T, Gone));
+    auto &L = Adj[T];
+    L.erase(std::find(L.begin(), L.end(), Gone));
+    addEdge(Keep, T);
+  }
+}
+
+
+void Coalescer::coalesce() {
+  for (auto &C : Copies) {
+    const MInstr &I = MF.Blocks[C.Block].Instrs[C.Index];
+    ++Stats.NumMoves;
+    uint32_t D = find(I.Dst);
+    uint32_t S = find(I.A);
+    if (D == S) {
+      ++Stats.NumCoalesced;
+      continue;
+    }
+    // A narrower move truncates its source, so it is not a plain copy.
+    if (interferes(D, S) || I.Size < DefSize[S]) {
+      ++Stats.NumConstrained;
+      continue;
+    }
+    if (!george(D, S) && !george(S, D) && !briggs(D, S)) {
+      ++Stats.NumConservative;
+      continue;
+    }
+    // Keep the lower number, so that parameters keep their registers.
+    merge(std::min(D, S), std::max(D, S));
+    ++Stats.NumCoalesced;
+  }
+}
+
+
+void Coalescer::rewrite() {
+  for (auto &B : MF.Blocks) {
+    std::vector<MInstr> Instrs;
+    Instrs.reserve(B.Instrs.size());
+    for (MInstr I : B.Instrs) {
+      if (I.Dst != MInstr::NoReg)
+        I.Dst = find(I.Dst);
+      if (I.A != MInstr::NoReg)
+        I.A = find(I.A);
+      if (I.B != MInstr::NoReg)
+        I.B = find(I.B);
+      if (I.Op == MOP_Mov && I.Dst == I.A)
+        continue;
+      Instrs.push_back(I);
+    }
+    B.Instrs = std::move(Instrs);
+  }
+  for (uint32_t &V : MF.ArgRegs)
+    V = find(V);
+}
+
+
+// Redirect jumps to blocks which hold nothing but a jump, and then remove
+// the blocks which can no longer be reached.
+void Coalescer::removeEmptyBlocks() {
+  unsigned NumBlocks = MF.Blocks.size();
+  std::vector<uint32_t> Forward(NumBlocks);
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    const auto &Instrs = MF.Blocks[b].Instrs;
+    bool Empty = b > 0 && Instrs.size() == 1 && Instrs[0].Op == MOP_Jump;
+    Forward[b] = Empty ? Instrs[0].Target0 : b;
+  }
+  auto resolve = [&](uint32_t T) {
+    // Stop after NumBlocks steps, in case of a cycle of empty blocks.
+    for (unsigned n = 0; n < NumBlocks && Forward[T] != T; ++n)
+      T = Forward[T];
+    return T;
+  };
+  for (auto &B : MF.Blocks) {
+    if (B.Instrs.empty())
+      continue;
+    MInstr &T = B.Instrs.back();
+    switch (T.Op) {
+      case MOP_Branch:
+      case MOP_CondBranch:
+      case MOP_BitTest:
+        T.Target1 = resolve(T.Target1);
+        T.Target0 = resolve(T.Target0);
+        if (T.Target0 == T.Target1) {
+          uint32_t Target = T.Target0;
+          T = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+          T.Target0 = Target;
+        }
+        break;
+      case MOP_Jump:
+        T.Target0 = resolve(T.Target0);
+        break;
+      case MOP_JumpTable:
+        for (uint32_t &S : B.JumpTable)
+          S = resolve(S);
+        break;
+      default:
+        break;
+    }
+  }
+
+  std::vector<bool> Reached(NumBlocks, false);
+  std::vector<uint32_t> Worklist(1, 0);
+  Reached[0] = true;
+  while (!Worklist.empty()) {
+    uint32_t b = Worklist.back();
+    Worklist.pop_back();
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      if (!Reached[S]) {
+        Reached[S] = true;
+        Worklist.push_back(S);
+      }
+    });
+  }
+
+  unsigned NumReached = std::count(Reached.begin(), Reached.end(), true);
+  if (NumReached == NumBlocks)
+    return;
+  Stats.NumRemovedBlocks += NumBlocks - NumReached;
+
+  std::vector<uint32_t> NewIndex(NumBlocks, MInstr::NoReg);
+  std::vector<MBlock> Blocks;
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    if (!Reached[b])
+      continue;
+    NewIndex[b] = Blocks.size();
+    Blocks.push_back(std::move(MF.Blocks[b]));
+  }
+  for (auto &B : Blocks) {
+    if (B.Instrs.empty())
+      continue;
+    MInstr &T = B.Instrs.back();
+    switch (T.Op) {
+      case MOP_Branch:
+      case MOP_CondBranch:
+      case MOP_BitTest:
+        T.Target1 = NewIndex[T.Target1];
+        // Fall through.
+      case MOP_Jump:
+        T.Target0 = NewIndex[T.Target0];
+        break;
+      case MOP_JumpTable:
+        for (uint32_t &S : B.JumpTable)
+          S = NewIndex[S];
+        break;
+      default:
+        break;
+    }
+  }
+  MF.Blocks = std::move(Blocks);
+}
+
+
+void Coalescer::run() {
+  if (MF.NumVRegs == 0 || MF.Blocks.empty())
+    return;
+  computeLiveness();
+  buildGraph();
+  collectCopies();
+  coalesce();
+  rewrite();
+  removeEmptyBlocks();
+}
+
+}  // end anonymous namespace
+
+
+void coalesceCopies(MachineFunction &MF, CoalesceStats *Stats) {
+  CoalesceStats S;
+  Coalescer(MF, Stats ? *Stats : S).run();
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
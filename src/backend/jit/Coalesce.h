@@ -0,0 +1,74 @@
+//===- Coalesce.h ----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Copy coalescing for MachineIR, which runs before register allocation.
+//
+// Lowering replaces each phi node by a move on every incoming edge, so loops
+// are full of moves from the values computed in one iteration to the phi
+// nodes of the next.  The coalescer merges the source and destination of a
+// move into a single virtual register, and deletes the move, whenever the
+// two are never live at the same time.
+//
+// An interference graph is built from block liveness, in the style of
+// Chaitin: each definition interferes with every value that is live after
+// it, except that a move does not make its destination interfere with its
+// source.  Moves are visited in order of loop depth, so that moves in inner
+// loops are removed first.  Merging two registers can make the combined
+// register harder to allocate, so merges are conservative: they must pass
+// either the Briggs test (the merged node has fewer than K neighbors of
+// significant degree) or the George test (every neighbor of one node either
+// already interferes with the other, or has insignificant degree), where K
+// is the number of allocatable registers.
+//
+// Blocks which only existed to hold moves on an edge are left with a single
+// jump once their moves are gone.  Jumps to such blocks are redirected to
+// their targets, and blocks which are no longer reachable are removed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_COALESCE_H
+#define OHMU_BACKEND_JIT_COALESCE_H
+
+#include "backend/jit/MachineIR.h"
+
+namespace ohmu {
+namespace jit  {
+
+
+/// Statistics from the copy coalescer.
+struct CoalesceStats {
+  CoalesceStats()
+      : NumMoves(0), NumCoalesced(0), NumConstrained(0), NumConservative(0),
+        NumRemovedBlocks(0) { }
+
+  unsigned NumMoves;          ///< Register to register moves seen.
+  unsigned NumCoalesced;      ///< Moves which were deleted.
+  unsigned NumConstrained;    ///< Operands interfere, or the move truncates.
+  unsigned NumConservative;   ///< Merges rejected by Briggs and George.
+  unsigned NumRemovedBlocks;  ///< Empty edge blocks which were bypassed.
+};
+
+
+/// Merge the operands of moves in MF where it is safe to do so, and remove
+/// the moves.  If Stats is non-null, the counts for MF are added to it.
+void coalesceCopies(MachineFunction &MF, CoalesceStats *Stats = nullptr);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_COALESCE_H
@@ -0,0 +1,97 @@
+//===- CodeBuffer.cpp ------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CodeBuffer.h"
+
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace ohmu {
+namespace jit  {
+
+
+// Generated code follows the System V calling convention, so it cannot be
+// called on Win64, where arguments are passed in different registers and
+// RSI and RDI are callee-saved.
+bool CodeBuffer::isSupported() {
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(_WIN32)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+bool CodeBuffer::create(const std::vector<uint8_t> &Code) {
+  release();
+  if (Code.empty() || !isSupported())
+    return false;
+
+#if defined(_WIN32)
+  void *P = VirtualAlloc(nullptr, Code.size(), MEM_COMMIT | MEM_RESERVE,
+                         PAGE_READWRITE);
+  if (!P)
+    return false;
+  memcpy(P, Code.data(), Code.size());
+  DWORD Old;
+  if (!VirtualProtect(P, Code.size(), PAGE_EXECUTE_READ, &Old)) {
+    VirtualFree(P, 0, MEM_RELEASE);
+    return false;
+  }
+  FlushInstructionCache(GetCurrentProcess(), P, Code.size());
+#else
+  size_t PageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  size_t Len = (Code.size() + PageSize - 1) & ~(PageSize - 1);
+  void *P = mmap(nullptr, Len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (P == MAP_FAILED)
+    return false;
+  memcpy(P, Code.data(), Code.size());
+  if (mprotect(P, Len, PROT_READ | PROT_EXEC) != 0) {
+    munmap(P, Len);
+    return false;
+  }
+#endif
+
+  Mem  = static_cast<uint8_t*>(P);
+  Size = Code.size();
+  return true;
+}
+
+
+void CodeBuffer::release() {
+  if (!Mem)
+    return;
+#if defined(_WIN32)
+  VirtualFree(Mem, 0, MEM_RELEASE);
+#else
+  size_t PageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  munmap(Mem, (Size + PageSize - 1) & ~(PageSize - 1));
+#endif
+  Mem  = nullptr;
+  Size = 0;
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
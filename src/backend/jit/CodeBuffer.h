@@ -0,0 +1,66 @@
+//===- CodeBuffer.h --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// CodeBuffer owns a block of executable memory.  Pages are never writable and
+// executable at the same time: code is copied in while the pages are
+// read-write, and the pages are then made read-execute.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_CODEBUFFER_H
+#define OHMU_BACKEND_JIT_CODEBUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ohmu {
+namespace jit  {
+
+
+class CodeBuffer {
+public:
+  CodeBuffer() : Mem(nullptr), Size(0) { }
+  ~CodeBuffer() { release(); }
+
+  CodeBuffer(const CodeBuffer&) = delete;
+  void operator=(const CodeBuffer&) = delete;
+
+  /// Copy Code into newly mapped executable memory, releasing any memory
+  /// that was previously held.  Returns false on failure.
+  bool create(const std::vector<uint8_t> &Code);
+
+  /// Unmap the memory.
+  void release();
+
+  uint8_t* data() { return Mem; }
+  size_t   size() const { return Size; }
+
+  /// Return true if the host can execute generated code, which requires
+  /// x86-64 and the System V calling convention.
+  static bool isSupported();
+
+private:
+  uint8_t* Mem;
+  size_t   Size;
+};
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_CODEBUFFER_H
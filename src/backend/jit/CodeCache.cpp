@@ -0,0 +1,326 @@
+//===- CodeCache.cpp -------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "CodeCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#define OHMU_HAVE_CPUID 1
+#endif
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+const char Magic[8] = { 'O', 'H', 'M', 'U', 'J', 'I', 'T', 'C' };
+
+struct CacheHeader {
+  char     Magic[8];
+  uint32_t Version;
+  uint32_t NumEntries;
+  uint64_t Features;
+  uint64_t FileSize;
+};
+
+struct CacheIndexEntry {
+  uint64_t Key;
+  uint64_t RelocOffset;   ///< File offsets of the parts of the entry.
+  uint64_t NamesOffset;
+  uint64_t CodeOffset;
+  uint32_t NumRelocs;
+  uint32_t NamesSize;
+  uint32_t CodeSize;
+  uint32_t Reserved;
+};
+
+uint64_t hashWord(uint64_t H, uint64_t V) {
+  for (unsigned i = 0; i < 8; ++i) {
+    H ^= (V >> (i*8)) & 0xFF;
+    H *= 1099511628211ULL;
+  }
+  return H;
+}
+
+size_t alignTo(size_t N, size_t A) { return (N + A - 1) & ~(A - 1); }
+
+// Return true if [Offset, Offset + Size) lies within a file of FileSize
+// bytes.
+bool inFile(uint64_t Offset, uint64_t Size, uint64_t FileSize) {
+  return Offset <= FileSize && Size <= FileSize - Offset;
+}
+
+}  // end anonymous namespace
+
+
+uint64_t CodeCache::hostFeatures() {
+  // cpuid is slow under a hypervisor, so it is only run once.
+  static const uint64_t Features = computeFeatures();
+  return Features;
+}
+
+
+uint64_t CodeCache::computeFeatures() {
+  uint64_t H = 14695981039346656037ULL;
+#if defined(OHMU_HAVE_CPUID)
+  unsigned A, B, C, D;
+  // Leaf 1 holds the basic feature flags; the rest of it varies from one
+  // core to the next.  Leaf 7 holds the extended features.
+  if (__get_cpuid(1, &A, &B, &C, &D)) {
+    H = hashWord(H, C);
+    H = hashWord(H, D);
+  }
+  if (__get_cpuid_max(0, nullptr) >= 7) {
+    __cpuid_count(7, 0, A, B, C, D);
+    H = hashWord(H, B);
+    H = hashWord(H, C);
+  }
+#endif
+  return H;
+}
+
+
+bool CodeCache::open(const std::string &Path) {
+  close();
+
+  const uint8_t *Data = nullptr;
+  size_t Size = 0;
+#if defined(_WIN32)
+  FILE *F = fopen(Path.c_str(), "rb");
+  if (!F)
+    return false;
+  uint8_t Buf[4096];
+  size_t N;
+  while ((N = fread(Buf, 1, sizeof(Buf), F)) > 0)
+    FileData.insert(FileData.end(), Buf, Buf + N);
+  fclose(F);
+  Data = FileData.data();
+  Size = FileData.size();
+#else
+  int Fd = ::open(Path.c_str(), O_RDONLY);
+  if (Fd < 0)
+    return false;
+  struct stat St;
+  if (fstat(Fd, &St) != 0 || St.st_size < 0 ||
+      static_cast<size_t>(St.st_size) < sizeof(CacheHeader)) {
+    ::close(Fd);
+    return false;
+  }
+  Size = static_cast<size_t>(St.st_size);
+  void *P = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+  ::close(Fd);
+  if (P == MAP_FAILED)
+    return false;
+  Mapped = P;
+  MappedSize = Size;
+  Data = static_cast<const uint8_t*>(P);
+#endif
+
+  // Check the whole index before using any of it.
+  CacheHeader H;
+  if (Size < sizeof(H)) {
+    close();
+    return false;
+  }
+  memcpy(&H, Data, sizeof(H));
+  bool Ok = memcmp(H.Magic, Magic, sizeof(Magic)) == 0 &&
+            H.Version == Version && H.Features == hostFeatures() &&
+            H.FileSize == Size &&
+            inFile(sizeof(H),
+                   uint64_t(H.NumEntries) * sizeof(CacheIndexEntry), Size);
+  const auto *Index =
+    reinterpret_cast<const CacheIndexEntry*>(Data + sizeof(H));
+  for (uint32_t i = 0; Ok && i < H.NumEntries; ++i) {
+    const CacheIndexEntry &E = Index[i];
+    Ok = (i == 0 || Index[i-1].Key < E.Key) &&
+         E.RelocOffset % alignof(CacheReloc) == 0 &&
+         inFile(E.RelocOffset, uint64_t(E.NumRelocs) * sizeof(CacheReloc),
+                Size) &&
+         inFile(E.NamesOffset, E.NamesSize, Size) &&
+         inFile(E.CodeOffset, E.CodeSize, Size);
+    if (!Ok)
+      break;
+    const auto *Relocs =
+      reinterpret_cast<const CacheReloc*>(Data + E.RelocOffset);
+    for (uint32_t r = 0; Ok && r < E.NumRelocs; ++r) {
+      const CacheReloc &R = Relocs[r];
+      Ok = inFile(R.Offset, 8, E.CodeSize) &&
+           inFile(R.NameOffset, R.NameSize, E.NamesSize) &&
+           (R.Kind == CRK_Trapped || R.Kind == CRK_Entry);
+    }
+    FileKeys.push_back(E.Key);
+    FileViews.push_back(CachedCode{
+      Data + E.CodeOffset, E.CodeSize, Relocs, E.NumRelocs,
+      reinterpret_cast<const char*>(Data + E.NamesOffset) });
+  }
+  if (!Ok) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+
+void CodeCache::close() {
+#if !defined(_WIN32)
+  if (Mapped)
+    munmap(Mapped, MappedSize);
+#endif
+  Mapped = nullptr;
+  MappedSize = 0;
+  FileData.clear();
+  FileKeys.clear();
+  FileViews.clear();
+  Added.clear();
+}
+
+
+const CachedCode* CodeCache::find(uint64_t Key) const {
+  auto It = Added.find(Key);
+  if (It != Added.end())
+    return &It->second.View;
+  auto Kt = std::lower_bound(FileKeys.begin(), FileKeys.end(), Key);
+  if (Kt == FileKeys.end() || *Kt != Key)
+    return nullptr;
+  return &FileViews[Kt - FileKeys.begin()];
+}
+
+
+void CodeCache::add(uint64_t Key, const uint8_t *Code, size_t CodeSize,
+                    const std::vector<NewReloc> &Relocs) {
+  OwnedEntry &E = Added[Key];
+  E.Code.assign(Code, Code + CodeSize);
+  E.Relocs.clear();
+  E.Names.clear();
+  for (auto &R : Relocs) {
+    if (!inFile(R.Offset, 8, CodeSize))
+      continue;
+    memset(&E.Code[R.Offset], 0, 8);
+    E.Relocs.push_back(CacheReloc{
+      R.Offset, R.Kind, static_cast<uint32_t>(E.Names.size()),
+      static_cast<uint32_t>(R.Name.size()), R.SigHash });
+    E.Names += R.Name;
+  }
+  E.View = CachedCode{ E.Code.data(), static_cast<uint32_t>(CodeSize),
+                       E.Relocs.data(), static_cast<uint32_t>(E.Relocs.size()),
+                       E.Names.data() };
+}
+
+
+size_t CodeCache::size() const {
+  size_t N = Added.size();
+  for (uint64_t K : FileKeys) {
+    if (Added.find(K) == Added.end())
+      ++N;
+  }
+  return N;
+}
+
+
+bool CodeCache::save(const std::string &Path) const {
+  std::vector<std::pair<uint64_t, const CachedCode*>> Entries;
+  for (size_t i = 0; i < FileKeys.size(); ++i) {
+    if (Added.find(FileKeys[i]) == Added.end())
+      Entries.push_back(std::make_pair(FileKeys[i], &FileViews[i]));
+  }
+  for (auto &A : Added)
+    Entries.push_back(std::make_pair(A.first, &A.second.View));
+  std::sort(Entries.begin(), Entries.end(),
+    [](const std::pair<uint64_t, const CachedCode*> &A,
+       const std::pair<uint64_t, const CachedCode*> &B) {
+      return A.first < B.first;
+    });
+
+  // Lay out the file, and then fill it in.
+  std::vector<CacheIndexEntry> Index(Entries.size());
+  size_t Pos = sizeof(CacheHeader) + Index.size() * sizeof(CacheIndexEntry);
+  for (size_t i = 0; i < Entries.size(); ++i) {
+    const CachedCode &C = *Entries[i].second;
+    size_t NamesSize = 0;
+    for (uint32_t r = 0; r < C.NumRelocs; ++r) {
+      NamesSize = std::max<size_t>(NamesSize,
+                                   C.Relocs[r].NameOffset +
+                                   C.Relocs[r].NameSize);
+    }
+    CacheIndexEntry &E = Index[i];
+    E.Key = Entries[i].first;
+    E.NumRelocs = C.NumRelocs;
+    E.NamesSize = static_cast<uint32_t>(NamesSize);
+    E.CodeSize = C.CodeSize;
+    E.Reserved = 0;
+    E.RelocOffset = Pos = alignTo(Pos, alignof(CacheReloc));
+    Pos += C.NumRelocs * sizeof(CacheReloc);
+    E.NamesOffset = Pos;
+    Pos += NamesSize;
+    E.CodeOffset = Pos = alignTo(Pos, 16);
+    Pos += C.CodeSize;
+  }
+
+  std::vector<uint8_t> Out(Pos, 0);
+  CacheHeader H;
+  memcpy(H.Magic, Magic, sizeof(Magic));
+  H.Version = Version;
+  H.NumEntries = static_cast<uint32_t>(Index.size());
+  H.Features = hostFeatures();
+  H.FileSize = Pos;
+  memcpy(&Out[0], &H, sizeof(H));
+  if (!Index.empty())
+    memcpy(&Out[sizeof(H)], Index.data(),
+           Index.size() * sizeof(CacheIndexEntry));
+  for (size_t i = 0; i < Entries.size(); ++i) {
+    const CachedCode &C = *Entries[i].second;
+    const CacheIndexEntry &E = Index[i];
+    if (C.NumRelocs > 0)
+      memcpy(&Out[E.RelocOffset], C.Relocs,
+             C.NumRelocs * sizeof(CacheReloc));
+    if (E.NamesSize > 0)
+      memcpy(&Out[E.NamesOffset], C.Names, E.NamesSize);
+    if (C.CodeSize > 0)
+      memcpy(&Out[E.CodeOffset], C.Code, C.CodeSize);
+  }
+
+  // Write to a temporary file first, so that other processes sharing the
+  // cache never see a partially written file.
+  std::string Tmp = Path + ".tmp";
+  FILE *F = fopen(Tmp.c_str(), "wb");
+  if (!F)
+    return false;
+  bool Ok = fwrite(Out.data(), 1, Out.size(), F) == Out.size();
+  Ok = fclose(F) == 0 && Ok;
+  if (Ok)
+    Ok = std::rename(Tmp.c_str(), Path.c_str()) == 0;
+  if (!Ok)
+    std::remove(Tmp.c_str());
+  return Ok;
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
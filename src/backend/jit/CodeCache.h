@@ -0,0 +1,173 @@
+//===- CodeCache.h ---------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A persistent cache of machine code generated by the JIT, so that a process
+// which runs the same functions as an earlier one can skip compiling them.
+//
+// Each entry holds the code of one function, keyed by a hash of its
+// bytecode, of the options it was compiled with, and of the features of the
+// host CPU.  Generated code refers to a few absolute addresses, which differ
+// from one process to the next: the entry table through which functions
+// call each other, and the flag which records a runtime error.  These are
+// listed as relocations, which name the symbol whose address belongs there,
+// and are patched when the code is loaded.  Calls also record a hash of the
+// callee's signature, so that code is not reused if a callee has changed.
+//
+// The cache file is mapped read-only when it is opened, and entries are
+// read directly from the mapping.  The file starts with a header, followed
+// by an index of entries sorted by key, followed by the relocations, symbol
+// names, and code of each entry:
+//
+//   CacheHeader
+//   CacheIndexEntry[NumEntries]
+//   { CacheReloc[NumRelocs], names, code }  for each entry
+//
+// New entries are kept in memory until save() is called, which rewrites the
+// whole file, and then atomically replaces the old one.  A CodeCache is not
+// thread-safe.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_CODECACHE_H
+#define OHMU_BACKEND_JIT_CODECACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ohmu {
+namespace jit  {
+
+
+/// The kinds of symbol which a relocation can refer to.
+enum CodeRelocKind : uint32_t {
+  CRK_Trapped,   ///< The runtime error flag of the module.
+  CRK_Entry      ///< The entry table slot of the function Name.
+};
+
+
+/// A relocation in cached code.  The 64-bit word at Offset must be set to
+/// the address of the symbol.
+struct CacheReloc {
+  uint32_t Offset;
+  uint32_t Kind;        ///< A CodeRelocKind.
+  uint32_t NameOffset;  ///< Symbol name, in the names of the entry.
+  uint32_t NameSize;
+  uint64_t SigHash;     ///< Signature of the function Name.
+};
+
+
+/// A view of the code of one function in the cache.
+struct CachedCode {
+  const uint8_t*    Code;
+  uint32_t          CodeSize;
+  const CacheReloc* Relocs;
+  uint32_t          NumRelocs;
+  const char*       Names;
+
+  std::string name(const CacheReloc &R) const {
+    return std::string(Names + R.NameOffset, R.NameSize);
+  }
+};
+
+
+/// A relocation of newly generated code, to be added to the cache.
+struct NewReloc {
+  uint32_t    Offset;
+  uint32_t    Kind;
+  std::string Name;
+  uint64_t    SigHash;
+};
+
+
+/// Statistics from the use of a CodeCache by a JITModule.
+struct CodeCacheStats {
+  CodeCacheStats() : NumHits(0), NumMisses(0), NumStored(0) { }
+
+  unsigned NumHits;
+  unsigned NumMisses;   ///< Includes entries whose callees have changed.
+  unsigned NumStored;
+};
+
+
+class CodeCache {
+public:
+  /// Version of the cache format and of the generated code.  Change this
+  /// whenever the JIT produces different code for the same function.
+  static const uint32_t Version = 2;
+
+  CodeCache() : Mapped(nullptr), MappedSize(0) { }
+  ~CodeCache() { close(); }
+
+  CodeCache(const CodeCache&) = delete;
+  void operator=(const CodeCache&) = delete;
+
+  /// Map the cache file at Path.  Returns false if there is no such file,
+  /// or if it is invalid or was written for another CPU, in which case the
+  /// cache is left empty.
+  bool open(const std::string &Path);
+
+  /// Unmap the cache file, and drop every entry.
+  void close();
+
+  /// Return the code with the given key, or null if there is none.  The
+  /// result is valid until the cache is closed, or the entry is replaced.
+  const CachedCode* find(uint64_t Key) const;
+
+  /// Add the code of a function.  The words named by relocations are
+  /// cleared, so that entries do not depend on the process which made them.
+  void add(uint64_t Key, const uint8_t *Code, size_t CodeSize,
+           const std::vector<NewReloc> &Relocs);
+
+  /// Return the number of entries.
+  size_t size() const;
+
+  /// Write every entry to the file at Path.  Returns false on an I/O error.
+  bool save(const std::string &Path) const;
+
+  /// Return a hash of the features of the host CPU.
+  static uint64_t hostFeatures();
+
+private:
+  static uint64_t computeFeatures();
+
+  struct OwnedEntry {
+    std::vector<uint8_t>    Code;
+    std::vector<CacheReloc> Relocs;
+    std::string             Names;
+    CachedCode              View;
+  };
+
+  void*          Mapped;        ///< The mapped file, or null.
+  size_t         MappedSize;
+  std::vector<uint8_t> FileData; ///< The file, where it cannot be mapped.
+
+  // Entries in the file, sorted by key.  Entries which have been replaced
+  // by add() are still listed, but are shadowed by Added.
+  std::vector<uint64_t>   FileKeys;
+  std::vector<CachedCode> FileViews;
+
+  std::map<uint64_t, OwnedEntry> Added;
+};
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_CODECACHE_H
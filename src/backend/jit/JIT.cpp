@@ -0,0 +1,1486 @@
+//===- JIT.cpp -------------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "JIT.h"
+#include "Peephole.h"
+#include "RegAlloc.h"
+#include "Schedule.h"
+#include "SwitchLowering.h"
+#include "X64Emitter.h"
+#include "til/Bytecode.h"
+#include "til/TILPrettyPrint.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ohmu {
+namespace jit  {
+
+
+const unsigned JITModule::MaxParams;
+const uint32_t MInstr::NoReg;
+const uint8_t  MInstr::NoPhysReg;
+
+
+namespace {
+
+// Stores the value of an integer literal in an int64_t.
+template<class Ty>
+struct LiteralToInt {
+  typedef bool ReturnType;
+
+  static bool defaultAction(Literal *L, int64_t *V) { return false; }
+
+  static bool action(Literal *L, int64_t *V) {
+    *V = static_cast<int64_t>(L->as<Ty>()->value());
+    return true;
+  }
+};
+
+// The relocation symbol for JITModule::Trapped.  Other symbols are the
+// indices of functions, whose entry table slots are being referred to.
+const unsigned TrappedSymbol = 0xFFFFFFFF;
+
+uint64_t hashCombine(uint64_t H, uint64_t V) {
+  for (unsigned i = 0; i < 8; ++i) {
+    H ^= (V >> (i*8)) & 0xFF;
+    H *= 1099511628211ULL;
+  }
+  return H;
+}
+
+uint64_t hashBytes(const std::string &S) {
+  uint64_t H = 14695981039346656037ULL;
+  for (unsigned char C : S) {
+    H ^= static_cast<uint8_t>(C);
+    H *= 1099511628211ULL;
+  }
+  return H;
+}
+
+// Return a hash of the parameter and return types of F.
+uint64_t signatureHash(const JITFunction &F) {
+  uint64_t H = hashCombine(14695981039346656037ULL, F.NumParams);
+  for (BaseType Bt : F.ParamTypes)
+    H = hashCombine(H, Bt.asUInt8());
+  BaseType Rt = F.ReturnType;
+  return hashCombine(H, Rt.asUInt8());
+}
+
+void addStats(RegAllocStats &Total, const RegAllocStats &S) {
+  Total.NumInstrs      += S.NumInstrs;
+  Total.NumIntervals   += S.NumIntervals;
+  Total.NumSpilled     += S.NumSpilled;
+  Total.NumSpillLoads  += S.NumSpillLoads;
+  Total.NumSpillStores += S.NumSpillStores;
+  Total.NumSavedRegs   += S.NumSavedRegs;
+}
+
+}  // end anonymous namespace
+
+
+bool JITModule::isSupportedType(BaseType Bt) {
+  if (Bt.VectSize > 1)
+    return false;
+  switch (Bt.Base) {
+    case BaseType::BT_Bool:
+      return true;
+    case BaseType::BT_Int:
+    case BaseType::BT_UnsignedInt:
+      return Bt.Size == BaseType::ST_32 || Bt.Size == BaseType::ST_64;
+    default:
+      return false;
+  }
+}
+
+
+/// Translates a single SCFG to MachineIR.
+/// Block 0 of the machine function initializes constants, and is followed
+/// by the blocks of the CFG in order, followed by blocks for edges which
+/// need phi moves.
+class MachineLowering {
+public:
+  MachineLowering(JITModule &M, JITFunction &F, MachineFunction &MF)
+      : Module(M), Fn(F), MF(MF), Success(true), Cur(0) { }
+
+  bool lower(const std::vector<VarDecl*> &Params);
+
+private:
+  struct EdgeStub {
+    unsigned    Block;
+    BasicBlock* Target;
+    unsigned    PhiIndex;
+  };
+
+  void fail(const char* Msg, SExpr *E = nullptr) {
+    if (Success) {
+      auto &Ds = Module.diag().error("Cannot compile ") << Fn.Name << ": "
+                                                        << Msg;
+      if (E)
+        TILDebugPrinter::print(E, Ds.outputStream());
+    }
+    Success = false;
+  }
+
+  void emit(const MInstr &I) { MF.Blocks[Cur].Instrs.push_back(I); }
+
+  static BaseType typeOf(SExpr *E) {
+    if (auto *I = dyn_cast_or_null<Instruction>(E))
+      return I->baseType();
+    return BaseType::getBaseType<void>();
+  }
+
+  /// Return the size of a value of type Bt in bytes, or 0 if unsupported.
+  static uint8_t sizeOf(BaseType Bt) {
+    if (!JITModule::isSupportedType(Bt))
+      return 0;
+    return Bt.Size == BaseType::ST_64 ? 8 : 4;
+  }
+
+  uint8_t  checkedSize(SExpr *E);
+  uint32_t reg(SExpr *E);
+  uint32_t paramReg(Variable *V);
+  bool     literalValue(Literal *L, int64_t *V, uint8_t *Sz);
+  uint32_t constantReg(Literal *L);
+  uint32_t immediateReg(int64_t V, uint8_t Size);
+
+  unsigned blockIndex(BasicBlock *B) { return B->blockID() + 1; }
+  unsigned edgeBlock(BasicBlock *From, BasicBlock *To);
+  void     emitEdgeMoves(BasicBlock *Target, unsigned PhiIndex);
+
+  void lowerInstruction(Instruction *I);
+  void lowerUnaryOp(UnaryOp *E, uint32_t Dst);
+  void lowerBinaryOp(BinaryOp *E, uint32_t Dst);
+  void lowerCast(Cast *E, uint32_t Dst);
+  void lowerCall(Call *E, uint32_t Dst);
+  void lowerSwitch(BasicBlock *B, Switch *Sw);
+  void lowerTerminator(BasicBlock *B);
+
+  JITModule&       Module;
+  JITFunction&     Fn;
+  MachineFunction& MF;
+  bool             Success;
+  unsigned         Cur;
+
+  std::unordered_map<VarDecl*, uint32_t> ParamVRegs;
+  std::unordered_map<Literal*, uint32_t> ConstVRegs;
+  std::vector<EdgeStub> Stubs;
+  std::vector<std::pair<uint32_t, uint32_t>> Moves;
+};
+
+
+uint8_t MachineLowering::checkedSize(SExpr *E) {
+  uint8_t Sz = sizeOf(typeOf(E));
+  if (!Sz)
+    fail("unsupported type ", E);
+  return Sz;
+}
+
+
+uint32_t MachineLowering::immediateReg(int64_t V, uint8_t Size) {
+  uint32_t R = MF.newVReg();
+  MInstr I = MInstr::make(MOP_MovImm, Size, R);
+  I.Imm = V;
+  MF.Blocks[0].Instrs.push_back(I);
+  return R;
+}
+
+
+bool MachineLowering::literalValue(Literal *L, int64_t *V, uint8_t *Sz) {
+  *Sz = sizeOf(L->baseType());
+  if (*Sz && L->baseType().Base == BaseType::BT_Bool) {
+    *V = L->as<bool>()->value() ? 1 : 0;
+    return true;
+  }
+  if (*Sz && BtBr<LiteralToInt>::branchOnIntegral(L->baseType(), L, V))
+    return true;
+  fail("unsupported literal ", L);
+  return false;
+}
+
+
+uint32_t MachineLowering::constantReg(Literal *L) {
+  auto It = ConstVRegs.find(L);
+  if (It != ConstVRegs.end())
+    return It->second;
+
+  int64_t V;
+  uint8_t Sz;
+  if (!literalValue(L, &V, &Sz))
+    return 0;
+  uint32_t R = immediateReg(V, Sz);
+  ConstVRegs[L] = R;
+  return R;
+}
+
+
+uint32_t MachineLowering::reg(SExpr *E) {
+  if (!E) {
+    fail("missing operand");
+    return 0;
+  }
+  if (Instruction *I = E->asCFGInstruction())
+    return MF.NumParams + I->instrID();
+
+  if (auto *L = dyn_cast<Literal>(E))
+    return constantReg(L);
+
+  if (auto *V = dyn_cast<Variable>(E))
+    return paramReg(V);
+
+  fail("unsupported operand ", E);
+  return 0;
+}
+
+
+uint32_t MachineLowering::paramReg(Variable *V) {
+  auto It = ParamVRegs.find(V->variableDecl());
+  if (It != ParamVRegs.end())
+    return It->second;
+  if (V->variableDecl()->kind() == VarDecl::VK_Let)
+    return reg(V->variableDecl()->definition());
+
+  fail("unsupported variable ", V);
+  return 0;
+}
+
+
+unsigned MachineLowering::edgeBlock(BasicBlock *From, BasicBlock *To) {
+  if (To->numArguments() == 0)
+    return blockIndex(To);
+
+  // The edge needs its own block, which moves values into the phi nodes.
+  unsigned PhiIndex = 0;
+  auto &Preds = To->predecessors();
+  while (PhiIndex < Preds.size() && Preds[PhiIndex].get() != From)
+    ++PhiIndex;
+
+  unsigned B = MF.Blocks.size();
+  MF.Blocks.emplace_back();
+  Stubs.push_back(EdgeStub{ B, To, PhiIndex });
+  return B;
+}
+
+
+void MachineLowering::emitEdgeMoves(BasicBlock *Target, unsigned PhiIndex) {
+  Moves.clear();
+  std::vector<uint8_t> Sizes;
+  for (Phi *Ph : Target->arguments()) {
+    if (!Ph || typeOf(Ph).Base == BaseType::BT_Void)
+      continue;
+    if (PhiIndex >= Ph->values().size()) {
+      fail("phi node has too few arguments ", Ph);
+      return;
+    }
+    uint8_t  Sz  = checkedSize(Ph);
+    uint32_t Dst = reg(Ph);
+    uint32_t Src = reg(Ph->values()[PhiIndex].get());
+    if (Dst != Src) {
+      Moves.emplace_back(Dst, Src);
+      Sizes.push_back(Sz);
+    }
+  }
+
+  // The moves happen in parallel.  A move can be done as soon as no other
+  // pending move reads its destination.  What remains are cycles, and each
+  // is broken by saving one destination in a temporary, which then stands
+  // in for it as a source.
+  while (!Moves.empty()) {
+    bool Progress = false;
+    for (unsigned i = 0; i < Moves.size();) {
+      uint32_t Dst = Moves[i].first;
+      bool Read = false;
+      for (auto &M : Moves)
+        Read = Read || M.second == Dst;
+      if (Read) {
+        ++i;
+        continue;
+      }
+      emit(MInstr::make(MOP_Mov, Sizes[i], Dst, Moves[i].second));
+      Moves.erase(Moves.begin() + i);
+      Sizes.erase(Sizes.begin() + i);
+      Progress = true;
+    }
+    if (Progress)
+      continue;
+    uint32_t Dst = Moves[0].first;
+    uint32_t T = MF.newVReg();
+    emit(MInstr::make(MOP_Mov, 8, T, Dst));
+    for (auto &M : Moves) {
+      if (M.second == Dst)
+        M.second = T;
+    }
+  }
+}
+
+
+void MachineLowering::lowerUnaryOp(UnaryOp *E, uint32_t Dst) {
+  uint8_t  Sz = checkedSize(E->expr());
+  uint32_t A  = reg(E->expr());
+  switch (E->unaryOpcode()) {
+    case UOP_Negative:
+      emit(MInstr::make(MOP_Neg, Sz, Dst, A));
+      break;
+    case UOP_BitNot:
+      emit(MInstr::make(MOP_Not, Sz, Dst, A));
+      break;
+    case UOP_LogicNot:
+      emit(MInstr::make(MOP_Xor, 4, Dst, A, immediateReg(1, 4)));
+      break;
+  }
+}
+
+
+void MachineLowering::lowerBinaryOp(BinaryOp *E, uint32_t Dst) {
+  BaseType Bt = typeOf(E->expr0());
+  uint8_t  Sz = checkedSize(E->expr0());
+  uint32_t A  = reg(E->expr0());
+  uint32_t B  = reg(E->expr1());
+  bool Signed = Bt.Base == BaseType::BT_Int;
+  bool IsInt  = Bt.Base != BaseType::BT_Bool;
+
+  MOpcode   Op = MOP_Mov;
+  MCondCode CC = MCC_EQ;
+  bool      IsCompare = false;
+  switch (E->binaryOpcode()) {
+    case BOP_Add:      Op = MOP_Add;  break;
+    case BOP_Sub:      Op = MOP_Sub;  break;
+    case BOP_Mul:      Op = MOP_Mul;  break;
+    case BOP_Div:      Op = Signed ? MOP_SDiv : MOP_UDiv;  break;
+    case BOP_Rem:      Op = Signed ? MOP_SRem : MOP_URem;  break;
+    case BOP_Shl:      Op = MOP_Shl;  break;
+    case BOP_Shr:      Op = Signed ? MOP_Sar : MOP_Shr;    break;
+    case BOP_BitAnd:   Op = MOP_And;  break;
+    case BOP_BitXor:   Op = MOP_Xor;  break;
+    case BOP_BitOr:    Op = MOP_Or;   break;
+    case BOP_LogicAnd: Op = MOP_And;  IsInt = true;  break;
+    case BOP_LogicOr:  Op = MOP_Or;   IsInt = true;  break;
+    case BOP_Eq:   CC = MCC_EQ;  IsCompare = true;  IsInt = true;  break;
+    case BOP_Neq:  CC = MCC_NE;  IsCompare = true;  IsInt = true;  break;
+    case BOP_Lt:   CC = Signed ? MCC_LT : MCC_ULT;  IsCompare = true;  break;
+    case BOP_Leq:  CC = Signed ? MCC_LE : MCC_ULE;  IsCompare = true;  break;
+    case BOP_Gt:   CC = Signed ? MCC_GT : MCC_UGT;  IsCompare = true;  break;
+    case BOP_Geq:  CC = Signed ? MCC_GE : MCC_UGE;  IsCompare = true;  break;
+  }
+  if (!IsInt) {
+    fail("unsupported type ", E);
+    return;
+  }
+
+  if (IsCompare) {
+    MInstr I = MInstr::make(MOP_SetCC, Sz, Dst, A, B);
+    I.CC = CC;
+    emit(I);
+    return;
+  }
+  emit(MInstr::make(Op, Sz, Dst, A, B));
+}
+
+
+void MachineLowering::lowerCast(Cast *E, uint32_t Dst) {
+  BaseType From = typeOf(E->expr());
+  BaseType To   = E->baseType();
+  uint8_t  FromSz = checkedSize(E->expr());
+  uint8_t  ToSz   = checkedSize(E);
+  uint32_t A = reg(E->expr());
+  if (!Success)
+    return;
+
+  switch (E->castOpcode()) {
+    case CAST_extendNum:
+    case CAST_truncNum:
+      if (From.Base == BaseType::BT_Bool || To.Base == BaseType::BT_Bool)
+        break;
+      if (FromSz < ToSz) {
+        MOpcode Op = From.Base == BaseType::BT_Int ? MOP_SExt : MOP_ZExt;
+        emit(MInstr::make(Op, 8, Dst, A));
+      }
+      else {
+        emit(MInstr::make(MOP_Mov, ToSz, Dst, A));
+      }
+      return;
+    case CAST_extendToFloat:
+    case CAST_truncToFloat:
+    case CAST_truncToInt:
+    case CAST_roundToInt:
+      break;
+    default:
+      // Bitwise casts do not change the register contents.
+      if (FromSz == ToSz) {
+        emit(MInstr::make(MOP_Mov, ToSz, Dst, A));
+        return;
+      }
+      break;
+  }
+  fail("unsupported cast ", E);
+}
+
+
+void MachineLowering::lowerCall(Call *E, uint32_t Dst) {
+  // Calls have the form global@().f(a1)...(an)().
+  std::vector<SExpr*> Args;
+  SExpr *T = E->target();
+  while (auto *Ap = dyn_cast_or_null<Apply>(T)) {
+    if (Ap->isSelfApplication())
+      break;
+    Args.push_back(Ap->arg());
+    T = Ap->fun();
+  }
+  std::reverse(Args.begin(), Args.end());
+
+  auto *Pj = dyn_cast_or_null<Project>(T);
+  auto *Self = Pj ? dyn_cast_or_null<Apply>(Pj->record()) : nullptr;
+  auto *Sv = Self ? dyn_cast_or_null<Variable>(Self->fun()) : nullptr;
+  if (!Sv || Sv->variableDecl() != Module.GlobalVd) {
+    fail("unsupported call ", E);
+    return;
+  }
+
+  auto It = Module.FunctionMap.find(Pj->slotName().str());
+  if (It == Module.FunctionMap.end()) {
+    fail("call to unknown function ", E);
+    return;
+  }
+  JITFunction *Callee = Module.Functions[It->second].get();
+  if (Callee->NumParams != Args.size()) {
+    fail("wrong number of arguments ", E);
+    return;
+  }
+
+  MInstr I = MInstr::make(MOP_Call, 8, Dst);
+  if (E->baseType().Base == BaseType::BT_Void)
+    I.Dst = MInstr::NoReg;
+  else
+    I.Size = checkedSize(E);
+  I.Imm = It->second;
+  I.Target0 = MF.ArgRegs.size();
+  I.Target1 = Args.size();
+  for (auto *A : Args)
+    MF.ArgRegs.push_back(reg(A));
+  emit(I);
+  Fn.Callees.push_back(It->second);
+}
+
+
+void MachineLowering::lowerInstruction(Instruction *I) {
+  uint32_t Dst = MF.NumParams + I->instrID();
+
+  switch (I->opcode()) {
+    case COP_Literal: {
+      MInstr Mi = MInstr::make(MOP_MovImm, 4, Dst);
+      if (literalValue(cast<Literal>(I), &Mi.Imm, &Mi.Size))
+        emit(Mi);
+      break;
+    }
+    case COP_Variable:
+      emit(MInstr::make(MOP_Mov, checkedSize(I), Dst,
+                        paramReg(cast<Variable>(I))));
+      break;
+    case COP_Call:
+      lowerCall(cast<Call>(I), Dst);
+      break;
+    case COP_UnaryOp:
+      lowerUnaryOp(cast<UnaryOp>(I), Dst);
+      break;
+    case COP_BinaryOp:
+      lowerBinaryOp(cast<BinaryOp>(I), Dst);
+      break;
+    case COP_Cast:
+      lowerCast(cast<Cast>(I), Dst);
+      break;
+    default:
+      fail("unsupported instruction ", I);
+      break;
+  }
+}
+
+
+void MachineLowering::lowerSwitch(BasicBlock *B, Switch *Sw) {
+  SExpr *C = Sw->condition();
+  SwitchInfo SI;
+  SI.Cond    = reg(C);
+  SI.Size    = checkedSize(C);
+  SI.Signed  = typeOf(C).Base == BaseType::BT_Int;
+  SI.Default = MInstr::NoReg;
+  for (int i = 0, n = Sw->numCases(); i < n && Success; ++i) {
+    uint32_t Target = edgeBlock(B, Sw->caseBlock(i));
+    SExpr *Lab = Sw->label(i);
+    if (isa<Wildcard>(Lab)) {
+      SI.Default = Target;
+      continue;
+    }
+    auto *L = dyn_cast<Literal>(Lab);
+    int64_t V;
+    uint8_t Sz;
+    if (!L) {
+      fail("unsupported case label ", Lab);
+      return;
+    }
+    if (literalValue(L, &V, &Sz))
+      SI.Cases.push_back(SwitchCase{ V, Target });
+  }
+  if (Success)
+    jit::lowerSwitch(MF, Cur, SI, Module.SwitchClustering,
+                     &Module.SwitchTotals);
+}
+
+
+void MachineLowering::lowerTerminator(BasicBlock *B) {
+  Terminator *T = B->terminator();
+  if (!T) {
+    fail("block has no terminator");
+    return;
+  }
+
+  switch (T->opcode()) {
+    case COP_Goto: {
+      auto *G = cast<Goto>(T);
+      emitEdgeMoves(G->targetBlock(), G->phiIndex());
+      MInstr J = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+      J.Target0 = blockIndex(G->targetBlock());
+      emit(J);
+      return;
+    }
+    case COP_Branch: {
+      auto *Br = cast<Branch>(T);
+      MInstr J = MInstr::make(MOP_Branch, 4, MInstr::NoReg,
+                              reg(Br->condition()));
+      J.Target0 = edgeBlock(B, Br->thenBlock());
+      J.Target1 = edgeBlock(B, Br->elseBlock());
+      emit(J);
+      return;
+    }
+    case COP_Switch:
+      lowerSwitch(B, cast<Switch>(T));
+      return;
+    case COP_Return: {
+      auto *R = cast<Return>(T);
+      SExpr *V = R->returnValue();
+      if (!V || typeOf(V).Base == BaseType::BT_Void)
+        emit(MInstr::make(MOP_Return, 8, MInstr::NoReg));
+      else
+        emit(MInstr::make(MOP_Return, checkedSize(V), MInstr::NoReg,
+                          reg(V)));
+      return;
+    }
+    default:
+      fail("unsupported terminator ", T);
+      return;
+  }
+}
+
+
+bool MachineLowering::lower(const std::vector<VarDecl*> &Params) {
+  SCFG *Cfg = Fn.Body;
+  if (Params.size() > JITModule::MaxParams) {
+    fail("too many parameters");
+    return false;
+  }
+  for (auto &Bt : Fn.ParamTypes) {
+    if (!JITModule::isSupportedType(Bt)) {
+      fail("unsupported parameter type");
+      return false;
+    }
+  }
+  if (Fn.ReturnType.Base != BaseType::BT_Void &&
+      !JITModule::isSupportedType(Fn.ReturnType)) {
+    fail("unsupported return type");
+    return false;
+  }
+
+  MF.NumParams = Params.size();
+  for (unsigned i = 0; i < Params.size(); ++i)
+    ParamVRegs[Params[i]] = i;
+  MF.NumVRegs = MF.NumParams + Cfg->numInstructions();
+
+  unsigned NumBlocks = Cfg->numBlocks();
+  MF.Blocks.resize(NumBlocks + 1);
+  for (unsigned i = 0; i < NumBlocks && Success; ++i) {
+    BasicBlock *B = Cfg->blocks()[i].get();
+    Cur = blockIndex(B);
+    for (auto *I : B->instructions()) {
+      if (I)
+        lowerInstruction(I);
+    }
+    lowerTerminator(B);
+  }
+
+  for (unsigned i = 0; i < Stubs.size() && Success; ++i) {
+    Cur = Stubs[i].Block;
+    emitEdgeMoves(Stubs[i].Target, Stubs[i].PhiIndex);
+    MInstr J = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+    J.Target0 = blockIndex(Stubs[i].Target);
+    emit(J);
+  }
+
+  // The constant block falls through to the entry block.
+  MInstr J = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+  J.Target0 = blockIndex(Cfg->entry());
+  MF.Blocks[0].Instrs.push_back(J);
+  return Success;
+}
+
+
+/// Generates x86-64 code for a MachineFunction, after register allocation.
+/// RAX, RCX, and RDX are never allocated, so they are free to hold spilled
+/// operands and temporaries, and the fixed operands of division and shifts.
+class X64CodeGen {
+public:
+  X64CodeGen(JITModule &M, MachineFunction &MF, X64Emitter &E,
+             uint64_t *Counters = nullptr)
+      : Module(M), MF(MF), Em(E), Counters(Counters), TrapLabel(0),
+        CurBlock(nullptr) { }
+
+  void generate();
+
+private:
+  typedef std::pair<X64Reg, X64Reg> RegMove;   // (Dst, Src)
+
+  bool    inReg(uint32_t V) const { return MF.Regs[V] != MInstr::NoPhysReg; }
+  X64Reg  reg(uint32_t V)   const { return static_cast<X64Reg>(MF.Regs[V]); }
+  int32_t slot(uint32_t V)  const { return MF.FrameOffsets[V]; }
+
+  /// Move V into R.
+  void get(X64Reg R, uint32_t V, unsigned Size) {
+    if (!inReg(V))
+      Em.load(R, RBP, slot(V), Size);
+    else if (reg(V) != R)
+      Em.movRR(R, reg(V), Size);
+  }
+  /// Return the register holding V, loading it into Scratch if needed.
+  X64Reg use(uint32_t V, X64Reg Scratch, unsigned Size) {
+    if (inReg(V))
+      return reg(V);
+    Em.load(Scratch, RBP, slot(V), Size);
+    return Scratch;
+  }
+  /// Return the register in which to compute V.
+  X64Reg target(uint32_t V, X64Reg Scratch) {
+    return inReg(V) ? reg(V) : Scratch;
+  }
+  /// Move R into V.
+  void put(uint32_t V, X64Reg R, unsigned Size) {
+    if (!inReg(V))
+      Em.store(RBP, slot(V), R, Size);
+    else if (reg(V) != R)
+      Em.movRR(reg(V), R, Size);
+  }
+  /// Dst = Dst <Op> V
+  void aluOperand(X64AluOp Op, X64Reg Dst, uint32_t V, unsigned Size) {
+    if (inReg(V))
+      Em.aluRR(Op, Dst, reg(V), Size);
+    else
+      Em.aluRM(Op, Dst, RBP, slot(V), Size);
+  }
+
+  static X64Cond  getCond(MCondCode CC);
+  static X64AluOp getAluOp(MOpcode Op);
+
+  void emitParallelMoves(std::vector<RegMove> &Moves);
+  void emitPrologue();
+  void emitEpilogue();
+  void emitBinaryOp(const MInstr &I);
+  void emitLea(const MInstr &I);
+  void emitCompare(const MInstr &I);
+  void emitShift(const MInstr &I);
+  void emitDivide(const MInstr &I);
+  void emitCall(const MInstr &I);
+  void emitJumpTable(const MInstr &I);
+  void emitCondJump(X64Cond C, const MInstr &I, unsigned Next);
+  void emitInstr(const MInstr &I, unsigned Next);
+
+  JITModule&       Module;
+  MachineFunction& MF;
+  X64Emitter&      Em;
+  uint64_t*        Counters;    ///< Profile counters, for MOP_Count.
+  std::vector<unsigned> BlockLabels;
+  unsigned TrapLabel;
+  const MBlock* CurBlock;
+
+  /// Jump tables, which are placed after the code: (Label, Block).
+  std::vector<std::pair<unsigned, const MBlock*>> JumpTables;
+};
+
+
+X64Cond X64CodeGen::getCond(MCondCode CC) {
+  switch (CC) {
+    case MCC_EQ:  return X64_E;
+    case MCC_NE:  return X64_NE;
+    case MCC_LT:  return X64_L;
+    case MCC_LE:  return X64_LE;
+    case MCC_GT:  return X64_G;
+    case MCC_GE:  return X64_GE;
+    case MCC_ULT: return X64_B;
+    case MCC_ULE: return X64_BE;
+    case MCC_UGT: return X64_A;
+    case MCC_UGE: return X64_AE;
+  }
+  return X64_E;
+}
+
+
+X64AluOp X64CodeGen::getAluOp(MOpcode Op) {
+  switch (Op) {
+    case MOP_Add: return X64_ADD;
+    case MOP_Sub: return X64_SUB;
+    case MOP_And: return X64_AND;
+    case MOP_Or:  return X64_OR;
+    default:      return X64_XOR;
+  }
+}
+
+
+// Do a set of register moves as if they happened at the same time.  A move
+// can be done once no other move reads its destination; moves which form a
+// cycle are broken by copying one destination to RAX.
+void X64CodeGen::emitParallelMoves(std::vector<RegMove> &Moves) {
+  Moves.erase(std::remove_if(Moves.begin(), Moves.end(),
+                             [](const RegMove &M) {
+                               return M.first == M.second;
+                             }),
+              Moves.end());
+  while (!Moves.empty()) {
+    bool Progress = false;
+    for (size_t i = 0; i < Moves.size();) {
+      X64Reg D = Moves[i].first;
+      bool Read = false;
+      for (auto &M : Moves)
+        Read = Read || M.second == D;
+      if (Read) {
+        ++i;
+        continue;
+      }
+      Em.movRR(D, Moves[i].second, 8);
+      Moves.erase(Moves.begin() + i);
+      Progress = true;
+    }
+    if (Progress || Moves.empty())
+      continue;
+
+    X64Reg D = Moves.front().first;
+    Em.movRR(RAX, D, 8);
+    for (auto &M : Moves) {
+      if (M.second == D)
+        M.second = RAX;
+    }
+  }
+}
+
+
+void X64CodeGen::emitPrologue() {
+  Em.push(RBP);
+  Em.movRR(RBP, RSP, 8);
+  if (MF.FrameSize > 0)
+    Em.aluRI(X64_SUB, RSP, MF.FrameSize, 8);
+  for (unsigned i = 0; i < MF.SavedRegs.size(); ++i)
+    Em.store(RBP, MF.SaveOffsets[i], static_cast<X64Reg>(MF.SavedRegs[i]), 8);
+
+  // Store spilled parameters before any parameter register is overwritten.
+  std::vector<RegMove> Moves;
+  for (unsigned i = 0; i < MF.NumParams; ++i) {
+    if (inReg(i))
+      Moves.push_back(RegMove(reg(i), ParamRegs[i]));
+    else if (slot(i) != 0)
+      Em.store(RBP, slot(i), ParamRegs[i], 8);
+  }
+  emitParallelMoves(Moves);
+}
+
+
+void X64CodeGen::emitEpilogue() {
+  for (unsigned i = 0; i < MF.SavedRegs.size(); ++i)
+    Em.load(static_cast<X64Reg>(MF.SavedRegs[i]), RBP, MF.SaveOffsets[i], 8);
+  Em.movRR(RSP, RBP, 8);
+  Em.pop(RBP);
+  Em.ret();
+}
+
+
+// x86 ALU instructions overwrite their first operand.  If the result is in
+// the same register as B, then B would be overwritten before it is read, so
+// either swap the operands, or compute the result in RAX.
+void X64CodeGen::emitBinaryOp(const MInstr &I) {
+  unsigned Sz = I.Size;
+  uint32_t A = I.A;
+  uint32_t B = I.B;
+  X64Reg   D = target(I.Dst, RAX);
+  if (A != B && inReg(B) && reg(B) == D) {
+    if (I.Op == MOP_Sub)
+      D = RAX;
+    else
+      std::swap(A, B);
+  }
+  get(D, A, Sz);
+  if (I.Op == MOP_Mul) {
+    if (inReg(B))
+      Em.imulRR(D, reg(B), Sz);
+    else
+      Em.imulRM(D, RBP, slot(B), Sz);
+  }
+  else {
+    aluOperand(getAluOp(I.Op), D, B, Sz);
+  }
+  put(I.Dst, D, Sz);
+}
+
+
+// Use add where lea is not needed, since it has a shorter encoding.
+void X64CodeGen::emitLea(const MInstr &I) {
+  unsigned Sz = I.Size;
+  int32_t  Disp = static_cast<int32_t>(I.Imm);
+  X64Reg   D = target(I.Dst, RAX);
+  if (I.A == MInstr::NoReg && I.B == MInstr::NoReg) {
+    Em.movImm(D, Disp, Sz);
+  }
+  else if (I.B == MInstr::NoReg) {
+    if (inReg(I.A) && reg(I.A) != D && Disp != 0) {
+      Em.lea(D, reg(I.A), Disp, Sz);
+    }
+    else {
+      get(D, I.A, Sz);
+      if (Disp != 0)
+        Em.aluRI(X64_ADD, D, Disp, Sz);
+    }
+  }
+  else if (I.A == MInstr::NoReg) {
+    X64Reg B = use(I.B, RCX, Sz);
+    if (I.Scale == 1)
+      Em.leaIndex(D, B, B, 0, Disp, Sz);
+    else
+      Em.leaScaled(D, B, I.Scale, Disp, Sz);
+  }
+  else {
+    X64Reg A = use(I.A, RAX, Sz);
+    X64Reg B = use(I.B, RCX, Sz);
+    if (I.Scale == 0 && Disp == 0 && D == A)
+      Em.aluRR(X64_ADD, D, B, Sz);
+    else if (I.Scale == 0 && Disp == 0 && D == B)
+      Em.aluRR(X64_ADD, D, A, Sz);
+    else
+      Em.leaIndex(D, A, B, I.Scale, Disp, Sz);
+  }
+  put(I.Dst, D, Sz);
+}
+
+
+void X64CodeGen::emitCompare(const MInstr &I) {
+  X64Reg A = use(I.A, RAX, I.Size);
+  if (I.B == MInstr::NoReg)
+    Em.aluRI(X64_CMP, A, static_cast<int32_t>(I.Imm), I.Size);
+  else
+    aluOperand(X64_CMP, A, I.B, I.Size);
+}
+
+
+void X64CodeGen::emitShift(const MInstr &I) {
+  unsigned Sz = I.Size;
+  get(RCX, I.B, 4);
+  X64Reg D = target(I.Dst, RAX);
+  get(D, I.A, Sz);
+  if (I.Op == MOP_Shl)
+    Em.shlCL(D, Sz);
+  else if (I.Op == MOP_Shr)
+    Em.shrCL(D, Sz);
+  else
+    Em.sarCL(D, Sz);
+  put(I.Dst, D, Sz);
+}
+
+
+void X64CodeGen::emitDivide(const MInstr &I) {
+  unsigned Sz = I.Size;
+  bool IsRem = I.Op == MOP_SRem || I.Op == MOP_URem;
+  get(RCX, I.B, Sz);
+  get(RAX, I.A, Sz);
+  Em.testRR(RCX, RCX, Sz);
+  Em.jcc(X64_E, TrapLabel);
+
+  if (I.Op == MOP_UDiv || I.Op == MOP_URem) {
+    Em.aluRR(X64_XOR, RDX, RDX, 4);
+    Em.div(RCX, Sz);
+    if (IsRem)
+      Em.movRR(RAX, RDX, Sz);
+    put(I.Dst, RAX, Sz);
+    return;
+  }
+
+  // idiv faults on MIN / -1, so handle a divisor of -1 separately.
+  unsigned NotMinus1 = Em.newLabel();
+  unsigned Done = Em.newLabel();
+  Em.aluRI(X64_CMP, RCX, -1, Sz);
+  Em.jcc(X64_NE, NotMinus1);
+  if (IsRem)
+    Em.aluRR(X64_XOR, RAX, RAX, 4);
+  else
+    Em.neg(RAX, Sz);
+  Em.jmp(Done);
+  Em.bind(NotMinus1);
+  Em.signExtendAX(Sz);
+  Em.idiv(RCX, Sz);
+  if (IsRem)
+    Em.movRR(RAX, RDX, Sz);
+  Em.bind(Done);
+  put(I.Dst, RAX, Sz);
+}
+
+
+// Values which are live across the call are never in caller-saved
+// registers, so the argument registers can be overwritten freely, once the
+// arguments in them have been read.
+void X64CodeGen::emitCall(const MInstr &I) {
+  std::vector<RegMove> Moves;
+  for (unsigned i = 0; i < I.Target1; ++i) {
+    uint32_t V = MF.ArgRegs[I.Target0 + i];
+    if (inReg(V))
+      Moves.push_back(RegMove(ParamRegs[i], reg(V)));
+  }
+  emitParallelMoves(Moves);
+  for (unsigned i = 0; i < I.Target1; ++i) {
+    uint32_t V = MF.ArgRegs[I.Target0 + i];
+    if (!inReg(V))
+      Em.load(ParamRegs[i], RBP, slot(V), 8);
+  }
+  Em.movAddress(RAX, reinterpret_cast<uint64_t>(&Module.EntryTable[I.Imm]),
+                static_cast<unsigned>(I.Imm));
+  Em.callIndirect(RAX);
+
+  // Unwind immediately if the callee trapped.
+  Em.movAddress(RCX, reinterpret_cast<uint64_t>(&Module.Trapped),
+                TrappedSymbol);
+  Em.load(RCX, RCX, 0, 4);
+  Em.testRR(RCX, RCX, 4);
+  Em.jcc(X64_NE, TrapLabel);
+  if (I.Dst != MInstr::NoReg)
+    put(I.Dst, RAX, I.Size);
+}
+
+
+void X64CodeGen::emitJumpTable(const MInstr &I) {
+  // The table holds the offset of each target from the table, so that it
+  // does not need to be relocated.  A 32-bit index is zero extended.
+  unsigned Table = Em.newLabel();
+  JumpTables.emplace_back(Table, CurBlock);
+  get(RAX, I.A, I.Size);
+  Em.leaLabel(RCX, Table);
+  Em.movsxdIndex(RAX, RCX, RAX, 2);
+  Em.aluRR(X64_ADD, RAX, RCX, 8);
+  Em.jmpIndirect(RAX);
+}
+
+
+// Jump to Target0 if C holds, and otherwise to Target1.
+void X64CodeGen::emitCondJump(X64Cond C, const MInstr &I, unsigned Next) {
+  if (I.Target0 == Next) {
+    // Flipping the low bit of a condition code negates it.
+    Em.jcc(static_cast<X64Cond>(C ^ 1), BlockLabels[I.Target1]);
+    return;
+  }
+  Em.jcc(C, BlockLabels[I.Target0]);
+  if (I.Target1 != Next)
+    Em.jmp(BlockLabels[I.Target1]);
+}
+
+
+void X64CodeGen::emitInstr(const MInstr &I, unsigned Next) {
+  unsigned Sz = I.Size;
+  switch (I.Op) {
+    case MOP_MovImm: {
+      bool IsImm32 = static_cast<int32_t>(I.Imm) == I.Imm || Sz == 4;
+      if (!inReg(I.Dst) && IsImm32) {
+        Em.storeImm(RBP, slot(I.Dst), static_cast<int32_t>(I.Imm), Sz);
+        return;
+      }
+      X64Reg D = target(I.Dst, RAX);
+      Em.movImm(D, I.Imm, Sz);
+      put(I.Dst, D, Sz);
+      return;
+    }
+    case MOP_Mov:
+      if (inReg(I.Dst))
+        get(reg(I.Dst), I.A, Sz);
+      else
+        put(I.Dst, use(I.A, RAX, Sz), Sz);
+      return;
+    case MOP_Add:
+    case MOP_Sub:
+    case MOP_Mul:
+    case MOP_And:
+    case MOP_Or:
+    case MOP_Xor:
+      emitBinaryOp(I);
+      return;
+    case MOP_Lea:
+      emitLea(I);
+      return;
+    case MOP_Shl:
+    case MOP_Shr:
+    case MOP_Sar:
+      emitShift(I);
+      return;
+    case MOP_SDiv:
+    case MOP_SRem:
+    case MOP_UDiv:
+    case MOP_URem:
+      emitDivide(I);
+      return;
+    case MOP_Neg:
+    case MOP_Not: {
+      X64Reg D = target(I.Dst, RAX);
+      get(D, I.A, Sz);
+      if (I.Op == MOP_Neg)
+        Em.neg(D, Sz);
+      else
+        Em.bitNot(D, Sz);
+      put(I.Dst, D, Sz);
+      return;
+    }
+    case MOP_SExt: {
+      X64Reg D = target(I.Dst, RAX);
+      if (inReg(I.A))
+        Em.movsxdRR(D, reg(I.A));
+      else
+        Em.movsxd(D, RBP, slot(I.A));
+      put(I.Dst, D, 8);
+      return;
+    }
+    case MOP_ZExt: {
+      // A 32-bit move clears the upper half of the register.
+      X64Reg D = target(I.Dst, RAX);
+      if (inReg(I.A))
+        Em.movRR(D, reg(I.A), 4);
+      else
+        Em.load(D, RBP, slot(I.A), 4);
+      put(I.Dst, D, 8);
+      return;
+    }
+    case MOP_SetCC: {
+      emitCompare(I);
+      X64Reg D = target(I.Dst, RAX);
+      Em.setcc(getCond(I.CC), D);
+      put(I.Dst, D, 4);
+      return;
+    }
+    case MOP_Call:
+      emitCall(I);
+      return;
+    case MOP_Count:
+      Em.movImm64(RCX, reinterpret_cast<uint64_t>(&Counters[I.Imm]));
+      Em.incMem(RCX, 0, 8);
+      return;
+    case MOP_Jump:
+      if (I.Target0 != Next)
+        Em.jmp(BlockLabels[I.Target0]);
+      return;
+    case MOP_Branch: {
+      X64Reg C = use(I.A, RAX, 4);
+      Em.testRR(C, C, 4);
+      if (I.Target0 == Next) {
+        Em.jcc(X64_E, BlockLabels[I.Target1]);
+        return;
+      }
+      Em.jcc(X64_NE, BlockLabels[I.Target0]);
+      if (I.Target1 != Next)
+        Em.jmp(BlockLabels[I.Target1]);
+      return;
+    }
+    case MOP_CondBranch:
+      emitCompare(I);
+      emitCondJump(getCond(I.CC), I, Next);
+      return;
+    case MOP_JumpTable:
+      emitJumpTable(I);
+      return;
+    case MOP_BitTest: {
+      // bt sets the carry flag, which is tested by jb.
+      X64Reg Bit = use(I.A, RCX, I.Size);
+      Em.movImm(RAX, I.Imm, 8);
+      Em.btRR(RAX, Bit, 8);
+      emitCondJump(X64_B, I, Next);
+      return;
+    }
+    case MOP_Trap:
+      Em.jmp(TrapLabel);
+      return;
+    case MOP_Return:
+      if (I.A != MInstr::NoReg)
+        get(RAX, I.A, Sz);
+      emitEpilogue();
+      return;
+  }
+}
+
+
+void X64CodeGen::generate() {
+  unsigned NumBlocks = MF.Blocks.size();
+  for (unsigned i = 0; i < NumBlocks; ++i)
+    BlockLabels.push_back(Em.newLabel());
+  TrapLabel = Em.newLabel();
+
+  emitPrologue();
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    Em.bind(BlockLabels[b]);
+    unsigned Next = b + 1 < NumBlocks ? b + 1 : MInstr::NoReg;
+    CurBlock = &MF.Blocks[b];
+    for (auto &I : MF.Blocks[b].Instrs)
+      emitInstr(I, Next);
+  }
+
+  // Record the error, and return zero.
+  Em.bind(TrapLabel);
+  Em.movAddress(RCX, reinterpret_cast<uint64_t>(&Module.Trapped),
+                TrappedSymbol);
+  Em.storeImm(RCX, 0, 1, 4);
+  Em.aluRR(X64_XOR, RAX, RAX, 4);
+  emitEpilogue();
+
+  for (auto &T : JumpTables) {
+    Em.bind(T.first);
+    for (uint32_t S : T.second->JumpTable)
+      Em.offsetWord(BlockLabels[S], T.first);
+  }
+}
+
+
+unsigned JITModule::declareModule(SExpr *Module) {
+  auto *GlobalFun = dyn_cast_or_null<Function>(Module);
+  auto *Rec = GlobalFun ? dyn_cast_or_null<Record>(GlobalFun->body())
+                        : nullptr;
+  if (!Rec) {
+    Diag.error("Module is not a lowered global record.");
+    return 0;
+  }
+  if (!isSupported()) {
+    Diag.error("The JIT is not supported on this platform.");
+    return 0;
+  }
+  GlobalVd = GlobalFun->variableDecl();
+
+  // Create all of the functions first, so that calls can be resolved.
+  for (auto &Slt : Rec->slots()) {
+    std::vector<VarDecl*> Ps;
+    SExpr *Def = Slt->definition();
+    while (auto *Fn = dyn_cast_or_null<Function>(Def)) {
+      Ps.push_back(Fn->variableDecl());
+      Def = Fn->body();
+    }
+    auto *C = dyn_cast_or_null<Code>(Def);
+    auto *Cfg = C ? dyn_cast_or_null<SCFG>(C->body()) : nullptr;
+    if (!Cfg)
+      continue;
+
+    auto *F = new JITFunction(Slt->slotName(), Cfg);
+    for (auto *Vd : Ps) {
+      auto *Ty = dyn_cast_or_null<ScalarType>(Vd->definition());
+      F->ParamTypes.push_back(Ty ? Ty->baseType()
+                                 : BaseType::getBaseType<void>());
+    }
+    auto *Rt = dyn_cast_or_null<ScalarType>(C->returnType());
+    F->ReturnType = Rt ? Rt->baseType() : BaseType::getBaseType<void>();
+    F->NumParams = Ps.size();
+
+    FunctionMap[Slt->slotName().str()] = Functions.size();
+    Functions.emplace_back(F);
+    Params.push_back(std::move(Ps));
+  }
+
+  // Generated code refers to the entry table, so it must not move.
+  EntryTable.assign(Functions.size(), nullptr);
+  return Functions.size();
+}
+
+
+unsigned JITModule::compileModule(SExpr *Module) {
+  if (declareModule(Module) == 0)
+    return 0;
+  std::vector<unsigned> All;
+  for (unsigned i = 0; i < Functions.size(); ++i)
+    All.push_back(i);
+  return compileFunctions(All);
+}
+
+
+bool JITModule::compileFunction(JITFunction *F) {
+  auto It = FunctionMap.find(F->Name.str());
+  if (It == FunctionMap.end())
+    return false;
+  if (!F->Compiled && !F->Failed)
+    compileFunctions(std::vector<unsigned>(1, It->second));
+  return F->Compiled;
+}
+
+
+unsigned JITModule::compileFunctions(std::vector<unsigned> Worklist) {
+  // Lower the requested functions, and everything they call which has not
+  // been compiled yet.
+  std::vector<unsigned> Batch;
+  std::vector<bool> InBatch(Functions.size(), false);
+  std::vector<std::unique_ptr<X64Emitter>> Emitters(Functions.size());
+  // Cached code is tied to the block order, and to the absence of counters.
+  bool UseCache = Cache && !Instrumenting && !Profile;
+  std::vector<uint64_t> CacheKeys(Functions.size(), 0);
+  std::vector<const CachedCode*> Cached(Functions.size(), nullptr);
+  for (unsigned k = 0; k < Worklist.size(); ++k) {
+    unsigned i = Worklist[k];
+    JITFunction *F = Functions[i].get();
+    if (F->Compiled || F->Failed || InBatch[i])
+      continue;
+    InBatch[i] = true;
+    Batch.push_back(i);
+
+    if (UseCache) {
+      CacheKeys[i] = cacheKey(*F);
+      const CachedCode *C = Cache->find(CacheKeys[i]);
+      if (C && bindCachedCode(*F, *C)) {
+        ++CacheTotals.NumHits;
+        Cached[i] = C;
+        for (unsigned Ci : F->Callees)
+          Worklist.push_back(Ci);
+        continue;
+      }
+      ++CacheTotals.NumMisses;
+    }
+
+    MachineFunction MF;
+    MachineLowering Lowering(*this, *F, MF);
+    if (!Lowering.lower(Params[i])) {
+      F->Failed = true;
+      continue;
+    }
+    if (Peephole)
+      optimizePeepholes(MF, &PeepholeTotals);
+    if (Coalescing)
+      coalesceCopies(MF, &CoalesceTotals);
+    if (Scheduling)
+      scheduleInstructions(MF, &ScheduleTotals);
+    F->Hash = hashFunction(MF);
+    const BlockProfile *BP = Profile ? Profile->find(F->Hash) : nullptr;
+    if (Instrumenting) {
+      F->NumProfileBlocks = MF.Blocks.size();
+      F->Counters.assign(instrumentFunction(MF, F->Probes), 0);
+      BP = nullptr;
+    }
+    if (Layout)
+      layoutBlocks(MF, BP, &LayoutTotals);
+    RegAllocStats RS;
+    allocateRegisters(MF, &RS);
+    addStats(RegAllocTotals, RS);
+    Emitters[i].reset(new X64Emitter());
+    X64CodeGen(*this, MF, *Emitters[i], F->Counters.data()).generate();
+    for (unsigned Ci : F->Callees)
+      Worklist.push_back(Ci);
+  }
+
+  // A function can only be run if everything it calls was compiled.
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned i : Batch) {
+      JITFunction *F = Functions[i].get();
+      if (F->Failed)
+        continue;
+      for (unsigned Ci : F->Callees) {
+        if (!Functions[Ci]->Failed)
+          continue;
+        Diag.error("Cannot compile ") << F->Name << ": calls "
+                                      << Functions[Ci]->Name;
+        F->Failed = true;
+        Changed = true;
+        break;
+      }
+    }
+  }
+
+  // Place the new functions in a single buffer.
+  std::vector<uint8_t> Bytes;
+  std::vector<size_t>  Offsets(Functions.size(), 0);
+  unsigned NumCompiled = 0;
+  for (unsigned i : Batch) {
+    if (Functions[i]->Failed)
+      continue;
+    while (Bytes.size() % 16 != 0)
+      Bytes.push_back(0xCC);    // int3
+    Offsets[i] = Bytes.size();
+    if (const CachedCode *C = Cached[i]) {
+      Bytes.insert(Bytes.end(), C->Code, C->Code + C->CodeSize);
+      for (uint32_t r = 0; r < C->NumRelocs; ++r) {
+        uint64_t Addr = relocAddress(*C, C->Relocs[r]);
+        memcpy(&Bytes[Offsets[i] + C->Relocs[r].Offset], &Addr, 8);
+      }
+    }
+    else {
+      std::vector<X64Emitter::Relocation> Relocs;
+      Emitters[i]->encode(Bytes, UseCache ? &Relocs : nullptr);
+      if (UseCache) {
+        std::vector<NewReloc> NewRelocs;
+        for (auto &R : Relocs) {
+          if (R.Symbol == TrappedSymbol) {
+            NewRelocs.push_back(NewReloc{ R.Offset, CRK_Trapped, "", 0 });
+            continue;
+          }
+          JITFunction *Callee = Functions[R.Symbol].get();
+          NewRelocs.push_back(NewReloc{ R.Offset, CRK_Entry,
+                                        Callee->Name.str(),
+                                        signatureHash(*Callee) });
+        }
+        Cache->add(CacheKeys[i], &Bytes[Offsets[i]],
+                   Bytes.size() - Offsets[i], NewRelocs);
+        ++CacheTotals.NumStored;
+      }
+    }
+    Functions[i]->CodeSize = Bytes.size() - Offsets[i];
+    ++NumCompiled;
+  }
+  if (NumCompiled == 0)
+    return 0;
+
+  std::unique_ptr<CodeBuffer> Buf(new CodeBuffer());
+  if (!Buf->create(Bytes)) {
+    Diag.error("Could not allocate executable memory.");
+    for (unsigned i : Batch)
+      Functions[i]->Failed = true;
+    return 0;
+  }
+  for (unsigned i : Batch) {
+    if (Functions[i]->Failed)
+      continue;
+    Functions[i]->Entry = Buf->data() + Offsets[i];
+    EntryTable[i] = Functions[i]->Entry;
+    Functions[i]->Compiled = true;
+  }
+  CodeSize += Buf->size();
+  CodeBufs.push_back(std::move(Buf));
+  return NumCompiled;
+}
+
+
+uint64_t JITModule::cacheKey(const JITFunction &F) const {
+  BytecodeStringWriter Ws;
+  {
+    BytecodeWriter Writer(&Ws);
+    Writer.write(F.Body);
+  }
+  uint64_t H = hashBytes(Ws.str());
+  H = hashCombine(H, CodeCache::Version);
+  H = hashCombine(H, CodeCache::hostFeatures());
+  H = hashCombine(H, signatureHash(F));
+  unsigned Options = (Peephole ? 1 : 0) | (Scheduling ? 2 : 0) |
+                     (SwitchClustering ? 4 : 0) | (Layout ? 8 : 0) |
+                     (Coalescing ? 16 : 0);
+  return hashCombine(H, Options);
+}
+
+
+bool JITModule::bindCachedCode(JITFunction &F, const CachedCode &C) {
+  std::vector<unsigned> Callees;
+  for (uint32_t r = 0; r < C.NumRelocs; ++r) {
+    const CacheReloc &R = C.Relocs[r];
+    if (R.Kind != CRK_Entry)
+      continue;
+    auto It = FunctionMap.find(C.name(R));
+    if (It == FunctionMap.end() ||
+        signatureHash(*Functions[It->second]) != R.SigHash)
+      return false;
+    if (std::find(Callees.begin(), Callees.end(), It->second) == Callees.end())
+      Callees.push_back(It->second);
+  }
+  F.Callees = std::move(Callees);
+  return true;
+}
+
+
+uint64_t JITModule::relocAddress(const CachedCode &C, const CacheReloc &R) {
+  if (R.Kind == CRK_Trapped)
+    return reinterpret_cast<uint64_t>(&Trapped);
+  unsigned Fi = FunctionMap.find(C.name(R))->second;
+  return reinterpret_cast<uint64_t>(&EntryTable[Fi]);
+}
+
+
+void JITModule::collectProfile(ProfileData &P) const {
+  for (auto &F : Functions) {
+    if (!F->Compiled || F->Counters.empty())
+      continue;
+    BlockProfile BP;
+    addCounts(F->Probes, F->Counters.data(), F->NumProfileBlocks, BP);
+    P.add(F->Hash, BP);
+  }
+}
+
+
+JITFunction* JITModule::findFunction(StringRef Name) {
+  auto It = FunctionMap.find(Name.str());
+  if (It == FunctionMap.end())
+    return nullptr;
+  return Functions[It->second].get();
+}
+
+
+bool JITModule::run(JITFunction *F, const int64_t *Args, int64_t *Result) {
+  if (!F->Compiled)
+    return false;
+
+  typedef int64_t I;
+  void *P = F->Entry;
+  int64_t R = 0;
+  Trapped = 0;
+  switch (F->NumParams) {
+    case 0:
+      R = reinterpret_cast<I(*)()>(P)();
+      break;
+    case 1:
+      R = reinterpret_cast<I(*)(I)>(P)(Args[0]);
+      break;
+    case 2:
+      R = reinterpret_cast<I(*)(I, I)>(P)(Args[0], Args[1]);
+      break;
+    case 3:
+      R = reinterpret_cast<I(*)(I, I, I)>(P)(Args[0], Args[1], Args[2]);
+      break;
+    case 4:
+      R = reinterpret_cast<I(*)(I, I, I, I)>(P)(Args[0], Args[1], Args[2],
+                                                Args[3]);
+      break;
+    case 5:
+      R = reinterpret_cast<I(*)(I, I, I, I, I)>(P)(Args[0], Args[1], Args[2],
+                                                   Args[3], Args[4]);
+      break;
+    case 6:
+      R = reinterpret_cast<I(*)(I, I, I, I, I, I)>(P)(Args[0], Args[1],
+                                                      Args[2], Args[3],
+                                                      Args[4], Args[5]);
+      break;
+    default:
+      return false;
+  }
+  if (Trapped)
+    return false;
+
+  // Only the low bits of 32-bit results are defined.
+  BaseType Bt = F->ReturnType;
+  if (Bt.Base == BaseType::BT_Void)
+    R = 0;
+  else if (Bt.Base == BaseType::BT_Int && Bt.Size == BaseType::ST_32)
+    R = static_cast<int32_t>(R);
+  else if (Bt.Size != BaseType::ST_64)
+    R = static_cast<uint32_t>(R);
+  *Result = R;
+  return true;
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
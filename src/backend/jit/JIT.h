@@ -0,0 +1,268 @@
+//===- JIT.h ---------------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// An in-process JIT compiler, which translates lowered SCFGs to x86-64
+// machine code.
+//
+// Each SCFG is lowered to MachineIR, with switches lowered to jump tables,
+// bit tests, and binary search, then simplified by the peephole optimizer,
+// stripped of the moves that replaced phi nodes where possible, reordered
+// by the list scheduler, laid out so that frequent edges fall through, and
+// given registers by the linear-scan allocator, and the result is encoded
+// with X64Emitter.  The functions
+// compiled by each call to compileModule() or compileFunction() are placed
+// in a single CodeBuffer.  Generated functions use the System V C calling
+// convention, so they can be called directly.  Win64 is not supported.
+//
+// Functions can be compiled with counters on their blocks and edges.  The
+// counts are gathered into a ProfileData, which can be saved, and then used
+// to lay out the same functions when they are compiled again.
+//
+// Generated code can be saved in a CodeCache, so that later processes can
+// load it instead of compiling the same functions again.
+//
+// Only 32 and 64-bit integers and booleans are supported; functions which
+// use anything else are reported and skipped, and may still be run on the
+// Interpreter.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_JIT_H
+#define OHMU_BACKEND_JIT_JIT_H
+
+#include "backend/jit/BlockLayout.h"
+#include "backend/jit/Coalesce.h"
+#include "backend/jit/CodeBuffer.h"
+#include "backend/jit/CodeCache.h"
+#include "backend/jit/MachineIR.h"
+#include "backend/jit/Peephole.h"
+#include "backend/jit/Profile.h"
+#include "backend/jit/RegAlloc.h"
+#include "backend/jit/Schedule.h"
+#include "backend/jit/SwitchLowering.h"
+#include "base/DiagnosticEmitter.h"
+#include "til/TIL.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ohmu {
+namespace jit  {
+
+using namespace ohmu::til;
+
+
+/// A function which has been compiled to machine code.
+struct JITFunction {
+  JITFunction(StringRef N, SCFG *Cfg)
+      : Name(N), Body(Cfg), NumParams(0), Compiled(false), Failed(false),
+        Entry(nullptr), CodeSize(0), Hash(0), NumProfileBlocks(0) { }
+
+  StringRef              Name;
+  SCFG*                  Body;
+  std::vector<BaseType>  ParamTypes;
+  BaseType               ReturnType;
+  unsigned               NumParams;
+  bool                   Compiled;
+  bool                   Failed;     ///< Cannot be compiled.
+  void*                  Entry;      ///< Address of the machine code.
+  size_t                 CodeSize;   ///< Size of the machine code in bytes.
+  std::vector<unsigned>  Callees;    ///< Indices of called functions.
+
+  // Set if the function was compiled with profile counters.
+  uint64_t                  Hash;             ///< See hashFunction().
+  unsigned                  NumProfileBlocks; ///< Blocks before profiling.
+  std::vector<ProfileProbe> Probes;
+  std::vector<uint64_t>     Counters;   ///< Updated by the generated code.
+};
+
+
+/// Compiles the functions in a lowered module to machine code.
+class JITModule {
+public:
+  /// The maximum number of parameters, which are all passed in registers.
+  static const unsigned MaxParams = 6;
+
+  JITModule()
+      : GlobalVd(nullptr), CodeSize(0), Peephole(true), Coalescing(true),
+        Scheduling(true), SwitchClustering(true), Layout(true),
+        Instrumenting(false),
+        Profile(nullptr), Cache(nullptr), Trapped(0) { }
+
+  /// Compile every function in Module, which is the lowered global
+  /// function, e.g. Global::global().  Functions which cannot be compiled,
+  /// or which call functions that cannot be compiled, are reported and
+  /// skipped.  Returns the number of compiled functions.
+  unsigned compileModule(SExpr *Module);
+
+  /// Create the functions in Module, without compiling any of them.
+  /// Functions can then be compiled on demand with compileFunction().
+  /// Returns the number of functions.
+  unsigned declareModule(SExpr *Module);
+
+  /// Compile F, along with every function it calls that has not been
+  /// compiled yet.  Returns true if F can be run.  Code for functions which
+  /// have already been compiled is never changed, so this may be called on
+  /// one thread while another is running generated code.
+  bool compileFunction(JITFunction *F);
+
+  /// Return the function with the given name, or null if there is none.
+  JITFunction* findFunction(StringRef Name);
+
+  /// Return all of the functions in the module.
+  std::vector<std::unique_ptr<JITFunction>>& functions() { return Functions; }
+
+  /// Call F.  Arguments and results are passed as 64-bit integers, which
+  /// are sign or zero extended according to their type.  Returns false if
+  /// F has not been compiled, or if the generated code trapped.
+  bool run(JITFunction *F, const int64_t *Args, int64_t *Result);
+
+  /// Return the total size of the generated code in bytes.
+  size_t codeSize() const { return CodeSize; }
+
+  /// Enable or disable the peephole optimizer, which is on by default.
+  /// Only affects functions which are compiled afterwards.
+  void setPeephole(bool Enable) { Peephole = Enable; }
+
+  /// Return statistics from the peephole optimizer, summed over every
+  /// compiled function.
+  const PeepholeStats& peepholeStats() const { return PeepholeTotals; }
+
+  /// Enable or disable copy coalescing, which is on by default.  Only
+  /// affects functions which are compiled afterwards.
+  void setCoalescing(bool Enable) { Coalescing = Enable; }
+
+  /// Return statistics from the copy coalescer, summed over every compiled
+  /// function.
+  const CoalesceStats& coalesceStats() const { return CoalesceTotals; }
+
+  /// Enable or disable instruction scheduling, which is on by default.
+  /// Only affects functions which are compiled afterwards.
+  void setScheduling(bool Enable) { Scheduling = Enable; }
+
+  /// Return statistics from the instruction scheduler, summed over every
+  /// compiled function.
+  const ScheduleStats& scheduleStats() const { return ScheduleTotals; }
+
+  /// Return statistics from the register allocator, summed over every
+  /// compiled function.
+  const RegAllocStats& regAllocStats() const { return RegAllocTotals; }
+
+  /// Enable or disable jump tables, bit tests, and binary search for
+  /// switches, which are on by default.  When disabled, each case of a
+  /// switch is compared in turn.  Only affects functions which are compiled
+  /// afterwards.
+  void setSwitchClustering(bool Enable) { SwitchClustering = Enable; }
+
+  /// Return statistics from switch lowering, summed over every compiled
+  /// function.
+  const SwitchStats& switchStats() const { return SwitchTotals; }
+
+  /// Enable or disable block layout, which is on by default.  Only affects
+  /// functions which are compiled afterwards.
+  void setBlockLayout(bool Enable) { Layout = Enable; }
+
+  /// Return statistics from block layout, summed over every compiled
+  /// function.
+  const LayoutStats& layoutStats() const { return LayoutTotals; }
+
+  /// Enable or disable profile counters, which are off by default.  Only
+  /// affects functions which are compiled afterwards.  Instrumented
+  /// functions are laid out without a profile.
+  void setInstrumentation(bool Enable) { Instrumenting = Enable; }
+
+  /// Add the counts gathered so far by instrumented functions to P.
+  void collectProfile(ProfileData &P) const;
+
+  /// Lay out functions which are compiled afterwards according to P, which
+  /// must outlive this module.  Functions whose code does not match a
+  /// profile in P are laid out as if there were none.
+  void setProfile(const ProfileData *P) { Profile = P; }
+
+  /// Look up functions in C before compiling them, and add the code of
+  /// newly compiled functions to C, which must outlive this module.  The
+  /// cache is not used while instrumentation is on or a profile is set.
+  void setCodeCache(CodeCache *C) { Cache = C; }
+
+  /// Return statistics from the code cache.
+  const CodeCacheStats& codeCacheStats() const { return CacheTotals; }
+
+  DiagnosticEmitter& diag() { return Diag; }
+
+  /// Return true if the host can run generated code.
+  static bool isSupported() { return CodeBuffer::isSupported(); }
+
+  /// Return true if Bt is supported by the JIT.
+  static bool isSupportedType(BaseType Bt);
+
+private:
+  friend class MachineLowering;
+  friend class X64CodeGen;
+
+  /// Compile the functions with the given indices, and their callees, into
+  /// a new CodeBuffer.  Returns the number of newly compiled functions.
+  unsigned compileFunctions(std::vector<unsigned> Worklist);
+
+  /// Return the key of F in the code cache.
+  uint64_t cacheKey(const JITFunction &F) const;
+
+  /// Check that the callees of cached code C still exist with the same
+  /// signatures, and if so, set the callees of F.
+  bool bindCachedCode(JITFunction &F, const CachedCode &C);
+
+  /// Return the address that relocation R of cached code C refers to.
+  uint64_t relocAddress(const CachedCode &C, const CacheReloc &R);
+
+  DiagnosticEmitter Diag;
+  VarDecl*          GlobalVd;
+  size_t            CodeSize;
+  bool              Peephole;
+  PeepholeStats     PeepholeTotals;
+  bool              Coalescing;
+  CoalesceStats     CoalesceTotals;
+  bool              Scheduling;
+  ScheduleStats     ScheduleTotals;
+  RegAllocStats     RegAllocTotals;
+  bool              SwitchClustering;
+  SwitchStats       SwitchTotals;
+  bool              Layout;
+  LayoutStats       LayoutTotals;
+  bool              Instrumenting;
+  const ProfileData* Profile;
+  CodeCache*        Cache;
+  CodeCacheStats    CacheTotals;
+
+  std::vector<std::unique_ptr<JITFunction>> Functions;
+  std::vector<std::vector<VarDecl*>>        Params;
+  std::unordered_map<std::string, unsigned> FunctionMap;
+  std::vector<std::unique_ptr<CodeBuffer>>  CodeBufs;
+
+  /// Generated code calls other functions through this table, so that
+  /// functions can be placed before their entry points are known.
+  std::vector<void*> EntryTable;
+
+  /// Set to non-zero by generated code on a runtime error.
+  int32_t Trapped;
+};
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_JIT_H
@@ -0,0 +1,200 @@
+//===- MachineIR.h ---------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A simple machine-level IR, which sits between a lowered SCFG and x86-64
+// machine code.  Instructions operate on an unbounded set of virtual
+// registers, and phi nodes have already been replaced by moves, so a
+// MachineFunction can be handed directly to register allocation and code
+// generation.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_MACHINEIR_H
+#define OHMU_BACKEND_JIT_MACHINEIR_H
+
+#include <cstdint>
+#include <vector>
+
+namespace ohmu {
+namespace jit  {
+
+
+/// Machine opcodes.  Unless otherwise noted, Dst, A, and B are virtual
+/// registers, and the operation is done at the width given by MInstr::Size.
+enum MOpcode : uint8_t {
+  MOP_MovImm,   ///< Dst = Imm
+  MOP_Mov,      ///< Dst = A
+  MOP_Add,      ///< Dst = A + B
+  MOP_Sub,
+  MOP_Mul,
+  MOP_And,
+  MOP_Or,
+  MOP_Xor,
+  MOP_Shl,
+  MOP_Shr,      ///< Logical shift right.
+  MOP_Sar,      ///< Arithmetic shift right.
+  MOP_SDiv,     ///< Signed and unsigned division and remainder, which trap
+  MOP_SRem,     ///< on a zero divisor.
+  MOP_UDiv,
+  MOP_URem,
+  MOP_Neg,      ///< Dst = -A
+  MOP_Not,      ///< Dst = ~A
+  MOP_SExt,     ///< Dst = sign extend 32-bit A to 64 bits.
+  MOP_ZExt,     ///< Dst = zero extend 32-bit A to 64 bits.
+  MOP_SetCC,    ///< Dst = A <CC> B, as a 32-bit 0 or 1, or if B is NoReg,
+                ///< Dst = A <CC> Imm.
+  MOP_Lea,      ///< Dst = A + (B << Scale) + Imm, where A and B may be NoReg.
+  MOP_Call,     ///< Dst = call function Imm with NumArgs args from ArgRegs.
+  MOP_Count,    ///< Increment profile counter Imm of the function.
+  MOP_Jump,     ///< Jump to block Target0.
+  MOP_Branch,   ///< If A goto Target0 else goto Target1.
+  MOP_CondBranch, ///< If A <CC> B (or Imm) goto Target0 else goto Target1.
+  MOP_JumpTable,  ///< Goto MBlock::JumpTable[A], where A is in range.
+  MOP_BitTest,  ///< If bit A of Imm is set goto Target0 else goto Target1.
+  MOP_Trap,     ///< Report a runtime error.
+  MOP_Return    ///< Return A, or nothing if A is NoReg.
+};
+
+
+/// Comparison conditions for MOP_SetCC and MOP_CondBranch.
+enum MCondCode : uint8_t {
+  MCC_EQ,
+  MCC_NE,
+  MCC_LT,       ///< Signed comparisons.
+  MCC_LE,
+  MCC_GT,
+  MCC_GE,
+  MCC_ULT,      ///< Unsigned comparisons.
+  MCC_ULE,
+  MCC_UGT,
+  MCC_UGE
+};
+
+
+/// A single machine instruction.
+struct MInstr {
+  /// Register number that stands for "no register".
+  static const uint32_t NoReg = 0xFFFFFFFF;
+
+  /// Physical register number that stands for "in memory".
+  static const uint8_t NoPhysReg = 0xFF;
+
+  MOpcode   Op;
+  uint8_t   Size;      ///< Operand size in bytes; either 4 or 8.
+  MCondCode CC;
+  uint8_t   Scale;     ///< For MOP_Lea, B is multiplied by 1 << Scale.
+  uint32_t  Dst;
+  uint32_t  A;
+  uint32_t  B;
+  uint32_t  Target0;   ///< Jump targets, or for calls, the offset of the
+  uint32_t  Target1;   ///< first argument in ArgRegs, and the argument count.
+  int64_t   Imm;
+
+  static MInstr make(MOpcode Op, uint8_t Size, uint32_t Dst,
+                     uint32_t A = NoReg, uint32_t B = NoReg) {
+    MInstr I;
+    I.Op = Op;
+    I.Size = Size;
+    I.CC = MCC_EQ;
+    I.Scale = 0;
+    I.Dst = Dst;
+    I.A = A;
+    I.B = B;
+    I.Target0 = 0;
+    I.Target1 = 0;
+    I.Imm = 0;
+    return I;
+  }
+
+  bool isTerminator() const {
+    return Op == MOP_Jump || Op == MOP_Branch || Op == MOP_CondBranch ||
+           Op == MOP_JumpTable || Op == MOP_BitTest || Op == MOP_Trap ||
+           Op == MOP_Return;
+  }
+};
+
+
+/// A straight-line sequence of instructions, which ends in a terminator.
+struct MBlock {
+  std::vector<MInstr>   Instrs;
+  std::vector<uint32_t> JumpTable;   ///< Targets of a MOP_JumpTable.
+};
+
+
+/// A function in machine IR.
+/// Virtual registers [0, NumParams) hold the parameters.
+struct MachineFunction {
+  MachineFunction() : NumParams(0), NumVRegs(0), FrameSize(0) { }
+
+  unsigned newVReg() { return NumVRegs++; }
+
+  std::vector<MBlock>   Blocks;     ///< Blocks[0] is the entry block.
+  std::vector<uint32_t> ArgRegs;    ///< Arguments of calls.
+  unsigned NumParams;
+  unsigned NumVRegs;
+
+  // Filled in by register allocation.  A vreg lives in Regs[V] for its
+  // whole lifetime, or if that is NoPhysReg, in the stack slot at
+  // FrameOffsets[V] from the frame pointer.  A vreg which is never live
+  // has neither, and a FrameOffset of 0.
+  std::vector<uint8_t>  Regs;           ///< Physical register for each vreg.
+  std::vector<int32_t>  FrameOffsets;   ///< Stack slot for each vreg.
+  std::vector<uint8_t>  SavedRegs;      ///< Callee-saved registers used.
+  std::vector<int32_t>  SaveOffsets;    ///< Stack slot for each SavedReg.
+  unsigned FrameSize;                   ///< Size of the stack frame.
+};
+
+
+/// Call Fn on each virtual register read by I.
+template<class F>
+void forEachUse(const MachineFunction &MF, const MInstr &I, F Fn) {
+  if (I.A != MInstr::NoReg)
+    Fn(I.A);
+  if (I.B != MInstr::NoReg)
+    Fn(I.B);
+  if (I.Op == MOP_Call) {
+    for (unsigned i = 0; i < I.Target1; ++i)
+      Fn(MF.ArgRegs[I.Target0 + i]);
+  }
+}
+
+
+/// Call Fn on the index of each successor of B.
+template<class F>
+void forEachSuccessor(const MBlock &B, F Fn) {
+  if (B.Instrs.empty())
+    return;
+  const MInstr &T = B.Instrs.back();
+  if (T.Op == MOP_Jump) {
+    Fn(T.Target0);
+  }
+  else if (T.Op == MOP_Branch || T.Op == MOP_CondBranch ||
+           T.Op == MOP_BitTest) {
+    Fn(T.Target0);
+    Fn(T.Target1);
+  }
+  else if (T.Op == MOP_JumpTable) {
+    for (uint32_t S : B.JumpTable)
+      Fn(S);
+  }
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_MACHINEIR_H
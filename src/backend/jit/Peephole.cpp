@@ -0,0 +1,643 @@
+//===- Peephole.cpp --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Peephole.h"
+
+#include <algorithm>
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+const unsigned NumMOpcodes = MOP_Return + 1;
+
+// Bounds on the number of times rules are applied, to guarantee
+// termination.
+const unsigned MaxRulesPerInstr = 8;
+const unsigned MaxIterations = 4;
+
+
+// Return V as seen by an operation of the given size.  32-bit operations
+// only read the low half of their operands.
+int64_t truncate(int64_t V, uint8_t Size) {
+  return Size == 4 ? static_cast<int32_t>(V) : V;
+}
+
+// Return A + (B << Shift), wrapped to the given size.
+int64_t addScaled(int64_t A, int64_t B, unsigned Shift, uint8_t Size) {
+  uint64_t R = static_cast<uint64_t>(A) + (static_cast<uint64_t>(B) << Shift);
+  return truncate(static_cast<int64_t>(R), Size);
+}
+
+// Return true if V can be encoded as a 32-bit immediate or displacement in
+// an operation of the given size.
+bool fitsImm(int64_t V, uint8_t Size) {
+  return Size == 4 || static_cast<int32_t>(V) == V;
+}
+
+// Return the condition which holds for (B, A) whenever CC holds for (A, B).
+MCondCode swapCondition(MCondCode CC) {
+  switch (CC) {
+    case MCC_LT:  return MCC_GT;
+    case MCC_LE:  return MCC_GE;
+    case MCC_GT:  return MCC_LT;
+    case MCC_GE:  return MCC_LE;
+    case MCC_ULT: return MCC_UGT;
+    case MCC_ULE: return MCC_UGE;
+    case MCC_UGT: return MCC_ULT;
+    case MCC_UGE: return MCC_ULE;
+    default:      return CC;
+  }
+}
+
+// Return the condition which holds whenever CC does not.
+MCondCode invertCondition(MCondCode CC) {
+  switch (CC) {
+    case MCC_EQ:  return MCC_NE;
+    case MCC_NE:  return MCC_EQ;
+    case MCC_LT:  return MCC_GE;
+    case MCC_LE:  return MCC_GT;
+    case MCC_GT:  return MCC_LE;
+    case MCC_GE:  return MCC_LT;
+    case MCC_ULT: return MCC_UGE;
+    case MCC_ULE: return MCC_UGT;
+    case MCC_UGT: return MCC_ULE;
+    case MCC_UGE: return MCC_ULT;
+  }
+  return CC;
+}
+
+// Return true if I can be deleted when its result is unused.  Division
+// can trap, so it is kept.
+bool isPure(const MInstr &I) {
+  switch (I.Op) {
+    case MOP_SDiv: case MOP_SRem: case MOP_UDiv: case MOP_URem:
+    case MOP_Call:
+      return false;
+    default:
+      return !I.isTerminator() && I.Dst != MInstr::NoReg;
+  }
+}
+
+
+class PeepholeOptimizer;
+
+/// A rewrite rule.  Returns true if I was changed.
+typedef bool (*PeepholeRule)(PeepholeOptimizer &P, MInstr &I);
+
+
+class PeepholeOptimizer {
+public:
+  PeepholeOptimizer(MachineFunction &MF, PeepholeStats &S)
+      : MF(MF), Stats(S), CurBlock(nullptr) { }
+
+  void run();
+
+  /// Return true if V has exactly one definition.
+  bool isSSA(uint32_t V) const {
+    return V != MInstr::NoReg && NumDefs[V] == 1;
+  }
+
+  /// Return the only definition of V, or null if V has several, or is a
+  /// parameter.
+  MInstr* def(uint32_t V) const { return isSSA(V) ? Defs[V] : nullptr; }
+
+  /// Return the definition of V if it has opcode Op, and can be folded
+  /// into its only use, Use.  Every register that the definition reads
+  /// must hold the same value at Use.
+  MInstr* foldable(uint32_t V, MOpcode Op, const MInstr &Use) const;
+
+  /// Return true and set C if V always holds a constant.  Constants which
+  /// are narrower than Size are not used.
+  bool constant(uint32_t V, uint8_t Size, int64_t *C) const;
+
+  /// Replace the operands of I, and delete instructions whose results are
+  /// no longer used.
+  void setOperands(MInstr &I, uint32_t A, uint32_t B);
+
+  PeepholeStats& stats() { return Stats; }
+
+private:
+  static bool isErased(const MInstr &I) {
+    return I.Op == MOP_Mov && I.Dst == MInstr::NoReg;
+  }
+
+  void countUses();
+  void release(uint32_t V);
+  void erase(MInstr &I);
+  bool forwardCopy(uint32_t &Operand);
+  bool forwardCopies(MInstr &I);
+  bool applyRules(MInstr &I);
+  void deleteDeadInstrs();
+  unsigned numInstrs() const;
+
+  MachineFunction& MF;
+  PeepholeStats&   Stats;
+  std::vector<unsigned> NumDefs;
+  std::vector<unsigned> NumUses;
+  std::vector<MInstr*>  Defs;      ///< Last definition of each vreg.
+  MBlock*               CurBlock;  ///< The block being rewritten.
+};
+
+
+// A register with a single definition has the same value everywhere.
+// Others, such as phi nodes, are only known to be unchanged when the
+// definition and the use are in the same block, with no assignment between
+// them.
+MInstr* PeepholeOptimizer::foldable(uint32_t V, MOpcode Op,
+                                    const MInstr &Use) const {
+  MInstr *D = def(V);
+  if (!D || D->Op != Op || NumUses[V] != 1)
+    return nullptr;
+  if ((D->A == MInstr::NoReg || isSSA(D->A)) &&
+      (D->B == MInstr::NoReg || isSSA(D->B)))
+    return D;
+
+  const MInstr *Begin = CurBlock->Instrs.data();
+  if (D < Begin || D >= &Use || &Use >= Begin + CurBlock->Instrs.size())
+    return nullptr;
+  for (const MInstr *I = D + 1; I < &Use; ++I) {
+    if (I->Dst != MInstr::NoReg && (I->Dst == D->A || I->Dst == D->B))
+      return nullptr;
+  }
+  return D;
+}
+
+
+bool PeepholeOptimizer::constant(uint32_t V, uint8_t Size, int64_t *C) const {
+  MInstr *D = def(V);
+  if (!D || D->Op != MOP_MovImm || D->Size < Size)
+    return false;
+  *C = truncate(D->Imm, Size);
+  return true;
+}
+
+
+void PeepholeOptimizer::setOperands(MInstr &I, uint32_t A, uint32_t B) {
+  // Count the new uses first, so that nothing they read is deleted.
+  uint32_t OldA = I.A;
+  uint32_t OldB = I.B;
+  if (A != MInstr::NoReg)
+    ++NumUses[A];
+  if (B != MInstr::NoReg)
+    ++NumUses[B];
+  I.A = A;
+  I.B = B;
+  if (OldA != MInstr::NoReg)
+    release(OldA);
+  if (OldB != MInstr::NoReg)
+    release(OldB);
+}
+
+
+void PeepholeOptimizer::release(uint32_t V) {
+  if (--NumUses[V] > 0)
+    return;
+  MInstr *D = def(V);
+  if (D && isPure(*D))
+    erase(*D);
+}
+
+
+void PeepholeOptimizer::erase(MInstr &I) {
+  --NumDefs[I.Dst];
+  Defs[I.Dst] = nullptr;
+  I.Dst = MInstr::NoReg;
+  setOperands(I, MInstr::NoReg, MInstr::NoReg);
+  I.Op = MOP_Mov;
+  ++Stats.NumDeleted;
+}
+
+
+void PeepholeOptimizer::countUses() {
+  NumDefs.assign(MF.NumVRegs, 0);
+  NumUses.assign(MF.NumVRegs, 0);
+  Defs.assign(MF.NumVRegs, nullptr);
+  for (unsigned i = 0; i < MF.NumParams; ++i)
+    NumDefs[i] = 1;
+  for (auto &B : MF.Blocks) {
+    for (auto &I : B.Instrs) {
+      if (I.Dst != MInstr::NoReg) {
+        ++NumDefs[I.Dst];
+        Defs[I.Dst] = &I;
+      }
+      forEachUse(MF, I, [&](uint32_t V) { ++NumUses[V]; });
+    }
+  }
+}
+
+
+// A copy can be bypassed if both it and its source have a single
+// definition.  A 32-bit copy of a 64-bit value may be bypassed too, since
+// every use of its result reads only the low half.
+bool PeepholeOptimizer::forwardCopy(uint32_t &Operand) {
+  bool Changed = false;
+  while (MInstr *D = def(Operand)) {
+    if (D->Op != MOP_Mov || !isSSA(D->A))
+      break;
+    uint32_t Src = D->A;
+    ++NumUses[Src];
+    uint32_t Old = Operand;
+    Operand = Src;
+    release(Old);
+    ++Stats.NumCopies;
+    Changed = true;
+  }
+  return Changed;
+}
+
+
+bool PeepholeOptimizer::forwardCopies(MInstr &I) {
+  bool Changed = false;
+  if (I.A != MInstr::NoReg)
+    Changed |= forwardCopy(I.A);
+  if (I.B != MInstr::NoReg)
+    Changed |= forwardCopy(I.B);
+  if (I.Op == MOP_Call) {
+    for (unsigned i = 0; i < I.Target1; ++i)
+      Changed |= forwardCopy(MF.ArgRegs[I.Target0 + i]);
+  }
+  return Changed;
+}
+
+
+//===----------------------------------------------------------------------===//
+// Rules
+//===----------------------------------------------------------------------===//
+
+void makeLea(PeepholeOptimizer &P, MInstr &I, uint32_t A, uint32_t B,
+             unsigned Scale, int64_t Imm) {
+  I.Op = MOP_Lea;
+  I.Scale = Scale;
+  I.Imm = Imm;
+  P.setOperands(I, A, B);
+  ++P.stats().NumLeas;
+}
+
+
+// A + C  =>  lea [A + C]
+// A + B  =>  lea [A + B]
+bool leaFromAdd(PeepholeOptimizer &P, MInstr &I) {
+  int64_t C;
+  if (P.constant(I.B, I.Size, &C) && fitsImm(C, I.Size)) {
+    makeLea(P, I, I.A, MInstr::NoReg, 0, C);
+    ++P.stats().NumImmediates;
+  }
+  else if (P.constant(I.A, I.Size, &C) && fitsImm(C, I.Size)) {
+    makeLea(P, I, I.B, MInstr::NoReg, 0, C);
+    ++P.stats().NumImmediates;
+  }
+  else {
+    makeLea(P, I, I.A, I.B, 0, 0);
+  }
+  return true;
+}
+
+
+// A - C  =>  lea [A - C]
+bool leaFromSub(PeepholeOptimizer &P, MInstr &I) {
+  int64_t C;
+  if (!P.constant(I.B, I.Size, &C))
+    return false;
+  int64_t D = truncate(static_cast<int64_t>(0 - static_cast<uint64_t>(C)),
+                       I.Size);
+  if (!fitsImm(D, I.Size))
+    return false;
+  makeLea(P, I, I.A, MInstr::NoReg, 0, D);
+  ++P.stats().NumImmediates;
+  return true;
+}
+
+
+// A * 1  =>  A
+// A * 2, 4, 8  =>  lea [A * 2, 4, 8]
+// A * 3, 5, 9  =>  lea [A + A * 2, 4, 8]
+bool leaFromMul(PeepholeOptimizer &P, MInstr &I) {
+  int64_t  C;
+  uint32_t X = I.A;
+  if (!P.constant(I.B, I.Size, &C)) {
+    if (!P.constant(I.A, I.Size, &C))
+      return false;
+    X = I.B;
+  }
+  switch (C) {
+    case 1:
+      I.Op = MOP_Mov;
+      P.setOperands(I, X, MInstr::NoReg);
+      ++P.stats().NumImmediates;
+      return true;
+    case 2: makeLea(P, I, MInstr::NoReg, X, 1, 0); return true;
+    case 4: makeLea(P, I, MInstr::NoReg, X, 2, 0); return true;
+    case 8: makeLea(P, I, MInstr::NoReg, X, 3, 0); return true;
+    case 3: makeLea(P, I, X, X, 1, 0); return true;
+    case 5: makeLea(P, I, X, X, 2, 0); return true;
+    case 9: makeLea(P, I, X, X, 3, 0); return true;
+    default:
+      return false;
+  }
+}
+
+
+// A << C  =>  lea [A * (1 << C)], for C <= 3.  Shift counts are masked to
+// the operand size, as they are by the shift instructions.
+bool leaFromShl(PeepholeOptimizer &P, MInstr &I) {
+  int64_t C;
+  if (!P.constant(I.B, I.Size, &C))
+    return false;
+  C &= I.Size * 8 - 1;
+  if (C == 0) {
+    I.Op = MOP_Mov;
+    P.setOperands(I, I.A, MInstr::NoReg);
+    return true;
+  }
+  if (C > 3)
+    return false;
+  makeLea(P, I, MInstr::NoReg, I.A, static_cast<unsigned>(C), 0);
+  return true;
+}
+
+
+// Fold constants, and other leas whose results have no other uses, into
+// the operands of a lea.
+bool foldLea(PeepholeOptimizer &P, MInstr &I) {
+  const uint32_t NoReg = MInstr::NoReg;
+  uint8_t Sz = I.Size;
+  int64_t C;
+
+  // lea [B] => lea [A]
+  if (I.A == NoReg && I.B != NoReg && I.Scale == 0) {
+    P.setOperands(I, I.B, NoReg);
+    return true;
+  }
+
+  if (I.A != NoReg && P.constant(I.A, Sz, &C)) {
+    int64_t D = addScaled(I.Imm, C, 0, Sz);
+    if (fitsImm(D, Sz)) {
+      I.Imm = D;
+      P.setOperands(I, NoReg, I.B);
+      ++P.stats().NumImmediates;
+      return true;
+    }
+  }
+  if (I.B != NoReg && P.constant(I.B, Sz, &C)) {
+    int64_t D = addScaled(I.Imm, C, I.Scale, Sz);
+    if (fitsImm(D, Sz)) {
+      I.Imm = D;
+      P.setOperands(I, I.A, NoReg);
+      ++P.stats().NumImmediates;
+      return true;
+    }
+  }
+
+  MInstr *L = I.A != NoReg ? P.foldable(I.A, MOP_Lea, I) : nullptr;
+  if (L && L->Size == Sz) {
+    int64_t D = addScaled(I.Imm, L->Imm, 0, Sz);
+    if (fitsImm(D, Sz)) {
+      // lea [lea [X + Y * s + d] + e]  =>  lea [X + Y * s + d + e]
+      if (I.B == NoReg) {
+        makeLea(P, I, L->A, L->B, L->Scale, D);
+        return true;
+      }
+      // lea [lea [X + d] + B * s + e]  =>  lea [X + B * s + d + e]
+      if (L->B == NoReg) {
+        makeLea(P, I, L->A, I.B, I.Scale, D);
+        return true;
+      }
+      // lea [lea [Y * s + d] + B + e]  =>  lea [B + Y * s + d + e]
+      if (L->A == NoReg && I.Scale == 0) {
+        makeLea(P, I, I.B, L->B, L->Scale, D);
+        return true;
+      }
+    }
+  }
+
+  L = I.B != NoReg ? P.foldable(I.B, MOP_Lea, I) : nullptr;
+  if (L && L->Size == Sz) {
+    int64_t D = addScaled(I.Imm, L->Imm, I.Scale, Sz);
+    if (fitsImm(D, Sz)) {
+      // lea [A + lea [X + d] * s + e]  =>  lea [A + X * s + d * s + e]
+      if (L->B == NoReg && L->A != NoReg) {
+        makeLea(P, I, I.A, L->A, I.Scale, D);
+        return true;
+      }
+      // lea [A + lea [Y * t + d] * s + e]  =>  lea [A + Y * st + ds + e]
+      if (L->A == NoReg && L->B != NoReg && I.Scale + L->Scale <= 3) {
+        makeLea(P, I, I.A, L->B, I.Scale + L->Scale, D);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+// Compare against an immediate rather than a constant register.
+bool compareImmediate(PeepholeOptimizer &P, MInstr &I) {
+  int64_t C;
+  if (I.B == MInstr::NoReg)
+    return false;
+  if (P.constant(I.B, I.Size, &C) && fitsImm(C, I.Size)) {
+    I.Imm = C;
+    P.setOperands(I, I.A, MInstr::NoReg);
+    ++P.stats().NumImmediates;
+    return true;
+  }
+  if (P.constant(I.A, I.Size, &C) && fitsImm(C, I.Size)) {
+    I.Imm = C;
+    I.CC = swapCondition(I.CC);
+    P.setOperands(I, I.B, MInstr::NoReg);
+    ++P.stats().NumImmediates;
+    return true;
+  }
+  return false;
+}
+
+
+// if (A <CC> B)   =>  if A <CC> B
+// if !(A <CC> B)  =>  if A <!CC> B
+bool fuseBranch(PeepholeOptimizer &P, MInstr &I) {
+  MCondCode CC;
+  MInstr *S = P.foldable(I.A, MOP_SetCC, I);
+  if (S) {
+    CC = S->CC;
+  }
+  else {
+    // Logical not is lowered to xor with 1.
+    int64_t C;
+    MInstr *X = P.foldable(I.A, MOP_Xor, I);
+    if (!X || !P.constant(X->B, 4, &C) || C != 1)
+      return false;
+    S = P.foldable(X->A, MOP_SetCC, I);
+    if (!S)
+      return false;
+    CC = invertCondition(S->CC);
+  }
+
+  I.Op = MOP_CondBranch;
+  I.Size = S->Size;
+  I.CC = CC;
+  I.Imm = S->Imm;
+  P.setOperands(I, S->A, S->B);
+  ++P.stats().NumCondBranches;
+  return true;
+}
+
+
+// Dst = C  =>  Dst = imm
+bool constantCopy(PeepholeOptimizer &P, MInstr &I) {
+  int64_t C;
+  if (!P.constant(I.A, I.Size, &C))
+    return false;
+  I.Op = MOP_MovImm;
+  I.Imm = C;
+  P.setOperands(I, MInstr::NoReg, MInstr::NoReg);
+  ++P.stats().NumImmediates;
+  return true;
+}
+
+
+// Truncating an extended value gives the original value.
+bool truncateExtension(PeepholeOptimizer &P, MInstr &I) {
+  MInstr *D = P.def(I.A);
+  if (I.Size != 4 || !D || (D->Op != MOP_SExt && D->Op != MOP_ZExt) ||
+      !P.isSSA(D->A))
+    return false;
+  P.setOperands(I, D->A, MInstr::NoReg);
+  ++P.stats().NumCopies;
+  return true;
+}
+
+
+struct RuleEntry {
+  MOpcode      Op;
+  PeepholeRule Rule;
+};
+
+// Copies are forwarded separately, for every opcode.  That also handles
+// extensions of truncations, since a truncation is a 32-bit copy.
+const RuleEntry Rules[] = {
+  { MOP_Add,        leaFromAdd        },
+  { MOP_Sub,        leaFromSub        },
+  { MOP_Mul,        leaFromMul        },
+  { MOP_Shl,        leaFromShl        },
+  { MOP_Lea,        foldLea           },
+  { MOP_SetCC,      compareImmediate  },
+  { MOP_CondBranch, compareImmediate  },
+  { MOP_Branch,     fuseBranch        },
+  { MOP_Mov,        constantCopy      },
+  { MOP_Mov,        truncateExtension },
+};
+
+
+/// The rules for each opcode.
+struct RuleTable {
+  RuleTable() {
+    for (auto &R : Rules)
+      ByOpcode[R.Op].push_back(R.Rule);
+  }
+
+  std::vector<PeepholeRule> ByOpcode[NumMOpcodes];
+};
+
+const RuleTable& getRuleTable() {
+  static RuleTable Table;
+  return Table;
+}
+
+
+bool PeepholeOptimizer::applyRules(MInstr &I) {
+  const RuleTable &Table = getRuleTable();
+  bool Changed = false;
+  for (unsigned n = 0; n < MaxRulesPerInstr; ++n) {
+    bool Applied = forwardCopies(I);
+    for (PeepholeRule R : Table.ByOpcode[I.Op]) {
+      if (isErased(I))
+        break;
+      if (R(*this, I)) {
+        Applied = true;
+        break;
+      }
+    }
+    if (!Applied || isErased(I))
+      break;
+    Changed = true;
+  }
+  return Changed;
+}
+
+
+void PeepholeOptimizer::deleteDeadInstrs() {
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (auto &B : MF.Blocks) {
+      for (auto &I : B.Instrs) {
+        if (!isErased(I) && isPure(I) && NumUses[I.Dst] == 0) {
+          erase(I);
+          Changed = true;
+        }
+      }
+    }
+  }
+  for (auto &B : MF.Blocks) {
+    B.Instrs.erase(std::remove_if(B.Instrs.begin(), B.Instrs.end(),
+                                  isErased),
+                   B.Instrs.end());
+  }
+}
+
+
+unsigned PeepholeOptimizer::numInstrs() const {
+  unsigned N = 0;
+  for (auto &B : MF.Blocks)
+    N += B.Instrs.size();
+  return N;
+}
+
+
+void PeepholeOptimizer::run() {
+  Stats.NumInstrsBefore += numInstrs();
+  countUses();
+
+  bool Changed = true;
+  for (unsigned n = 0; n < MaxIterations && Changed; ++n) {
+    Changed = false;
+    for (auto &B : MF.Blocks) {
+      CurBlock = &B;
+      for (auto &I : B.Instrs) {
+        if (!isErased(I))
+          Changed |= applyRules(I);
+      }
+    }
+  }
+
+  deleteDeadInstrs();
+  Stats.NumInstrsAfter += numInstrs();
+}
+
+}  // end anonymous namespace
+
+
+void optimizePeepholes(MachineFunction &MF, PeepholeStats *Stats) {
+  PeepholeStats S;
+  PeepholeOptimizer(MF, Stats ? *Stats : S).run();
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
@@ -0,0 +1,77 @@
+//===- Peephole.h ----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A peephole optimizer for MachineIR, which runs before register allocation.
+//
+// Lowering maps each TIL operation to a single machine instruction, and
+// keeps every constant in a virtual register.  The peephole pass rewrites
+// short patterns into the richer forms that x86-64 provides:
+//
+//   - Adds, and subtracts, shifts and multiplies by small constants, become
+//     three-address MOP_Lea instructions, and chains of them are folded
+//     into a single base + index * scale + displacement.
+//   - Constant operands of comparisons become immediates.
+//   - A comparison whose only use is a branch, possibly through a logical
+//     not, becomes a MOP_CondBranch, so no boolean is materialized.
+//   - Copies are forwarded to their source, and extensions of truncations
+//     and truncations of extensions read the original value, so chains of
+//     MOP_Mov, MOP_SExt, and MOP_ZExt collapse.
+//
+// The rules are kept in a table indexed by opcode.  Instructions whose
+// results are no longer used are deleted, unless they have side effects.
+//
+// Instructions are only combined when every virtual register involved has
+// a single definition, so that it holds the same value at the combined
+// instruction as it did where it was read.  Phi nodes, which are assigned
+// on each incoming edge, are never combined.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_PEEPHOLE_H
+#define OHMU_BACKEND_JIT_PEEPHOLE_H
+
+#include "backend/jit/MachineIR.h"
+
+namespace ohmu {
+namespace jit  {
+
+
+/// Statistics from the peephole optimizer.
+struct PeepholeStats {
+  PeepholeStats()
+      : NumInstrsBefore(0), NumInstrsAfter(0), NumLeas(0), NumImmediates(0),
+        NumCondBranches(0), NumCopies(0), NumDeleted(0) { }
+
+  unsigned NumInstrsBefore;
+  unsigned NumInstrsAfter;
+  unsigned NumLeas;           ///< Instructions rewritten or folded into leas.
+  unsigned NumImmediates;     ///< Constant operands folded into immediates.
+  unsigned NumCondBranches;   ///< Comparisons fused into branches.
+  unsigned NumCopies;         ///< Operands forwarded through copies.
+  unsigned NumDeleted;        ///< Unused instructions removed.
+};
+
+
+/// Run the peephole optimizer on MF.  If Stats is non-null, the counts
+/// for MF are added to it.
+void optimizePeepholes(MachineFunction &MF, PeepholeStats *Stats = nullptr);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_PEEPHOLE_H
@@ -0,0 +1,285 @@
+//===- Profile.cpp ---------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Profile.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+bool edgeLess(const ProfileEdge &A, const ProfileEdge &B) {
+  return A.From < B.From || (A.From == B.From && A.To < B.To);
+}
+
+// Sort Edges, add up the counts of duplicates, and drop edges which were
+// never taken.
+void canonicalize(std::vector<ProfileEdge> &Edges) {
+  std::sort(Edges.begin(), Edges.end(), edgeLess);
+  size_t N = 0;
+  for (size_t i = 0; i < Edges.size(); ++i) {
+    if (N > 0 && Edges[N-1].From == Edges[i].From &&
+        Edges[N-1].To == Edges[i].To)
+      Edges[N-1].Count += Edges[i].Count;
+    else
+      Edges[N++] = Edges[i];
+  }
+  Edges.resize(N);
+  Edges.erase(std::remove_if(Edges.begin(), Edges.end(),
+                [](const ProfileEdge &E) { return E.Count == 0; }),
+              Edges.end());
+}
+
+
+/// 64-bit FNV-1a.
+class Hasher {
+public:
+  Hasher() : H(0xcbf29ce484222325ULL) { }
+
+  void add(uint64_t V, unsigned Bytes) {
+    for (unsigned i = 0; i < Bytes; ++i) {
+      H ^= (V >> (8*i)) & 0xFF;
+      H *= 0x100000001b3ULL;
+    }
+  }
+
+  uint64_t get() const { return H; }
+
+private:
+  uint64_t H;
+};
+
+}  // end anonymous namespace
+
+
+uint64_t BlockProfile::edgeCount(uint32_t From, uint32_t To) const {
+  ProfileEdge Key = { From, To, 0 };
+  auto It = std::lower_bound(Edges.begin(), Edges.end(), Key, edgeLess);
+  if (It == Edges.end() || It->From != From || It->To != To)
+    return 0;
+  return It->Count;
+}
+
+
+void BlockProfile::add(const BlockProfile &P) {
+  if (BlockCounts.size() < P.BlockCounts.size())
+    BlockCounts.resize(P.BlockCounts.size(), 0);
+  for (size_t b = 0; b < P.BlockCounts.size(); ++b)
+    BlockCounts[b] += P.BlockCounts[b];
+  Edges.insert(Edges.end(), P.Edges.begin(), P.Edges.end());
+  canonicalize(Edges);
+}
+
+
+const BlockProfile* ProfileData::find(uint64_t Hash) const {
+  auto It = Profiles.find(Hash);
+  return It == Profiles.end() ? nullptr : &It->second;
+}
+
+
+void ProfileData::add(uint64_t Hash, const BlockProfile &P) {
+  BlockProfile &Old = Profiles[Hash];
+  if (Old.BlockCounts.size() != P.BlockCounts.size())
+    Old = BlockProfile();
+  Old.add(P);
+}
+
+
+// The file holds one record per function:
+//
+//   function <hash> <number of blocks>
+//   block <index> <count>
+//   edge <from> <to> <count>
+//
+// Blocks and edges which never ran are left out.
+bool ProfileData::save(const char *Path) const {
+  FILE *F = fopen(Path, "w");
+  if (!F)
+    return false;
+  fprintf(F, "# ohmu block profile\n");
+  for (auto &Pr : Profiles) {
+    const BlockProfile &P = Pr.second;
+    fprintf(F, "function %016" PRIx64 " %zu\n", Pr.first,
+            P.BlockCounts.size());
+    for (size_t b = 0; b < P.BlockCounts.size(); ++b) {
+      if (P.BlockCounts[b] != 0)
+        fprintf(F, "block %zu %" PRIu64 "\n", b, P.BlockCounts[b]);
+    }
+    for (auto &E : P.Edges)
+      fprintf(F, "edge %u %u %" PRIu64 "\n", E.From, E.To, E.Count);
+  }
+  bool Ok = !ferror(F);
+  return fclose(F) == 0 && Ok;
+}
+
+
+bool ProfileData::load(const char *Path) {
+  FILE *F = fopen(Path, "r");
+  if (!F)
+    return false;
+
+  std::map<uint64_t, BlockProfile> Loaded;
+  BlockProfile *Cur = nullptr;
+  bool Ok = true;
+  char Line[256];
+  while (Ok && fgets(Line, sizeof(Line), F)) {
+    uint64_t H, C;
+    unsigned A, B;
+    size_t   N;
+    if (Line[0] == '#' || Line[0] == '\n')
+      continue;
+    if (sscanf(Line, "function %" SCNx64 " %zu", &H, &N) == 2) {
+      Cur = &Loaded[H];
+      *Cur = BlockProfile();
+      Cur->BlockCounts.assign(N, 0);
+    }
+    else if (sscanf(Line, "block %u %" SCNu64, &A, &C) == 2) {
+      Ok = Cur && A < Cur->BlockCounts.size();
+      if (Ok)
+        Cur->BlockCounts[A] += C;
+    }
+    else if (sscanf(Line, "edge %u %u %" SCNu64, &A, &B, &C) == 3) {
+      Ok = Cur && A < Cur->BlockCounts.size() && B < Cur->BlockCounts.size();
+      if (Ok)
+        Cur->Edges.push_back(ProfileEdge{ A, B, C });
+    }
+    else {
+      Ok = false;
+    }
+  }
+  Ok = Ok && !ferror(F);
+  fclose(F);
+  if (!Ok)
+    return false;
+
+  for (auto &Pr : Loaded) {
+    canonicalize(Pr.second.Edges);
+    add(Pr.first, Pr.second);
+  }
+  return true;
+}
+
+
+uint64_t hashFunction(const MachineFunction &MF) {
+  Hasher H;
+  H.add(MF.NumParams, 4);
+  H.add(MF.Blocks.size(), 4);
+  for (auto &B : MF.Blocks) {
+    H.add(B.Instrs.size(), 4);
+    for (auto &I : B.Instrs) {
+      H.add(I.Op, 1);
+      H.add(I.Size, 1);
+      H.add(I.CC, 1);
+      H.add(I.Scale, 1);
+      H.add(I.Dst, 4);
+      H.add(I.A, 4);
+      H.add(I.B, 4);
+      H.add(I.Target0, 4);
+      H.add(I.Target1, 4);
+      H.add(static_cast<uint64_t>(I.Imm), 8);
+    }
+    for (uint32_t S : B.JumpTable)
+      H.add(S, 4);
+  }
+  for (uint32_t V : MF.ArgRegs)
+    H.add(V, 4);
+  return H.get();
+}
+
+
+unsigned instrumentFunction(MachineFunction &MF,
+                            std::vector<ProfileProbe> &Probes) {
+  unsigned NumBlocks = MF.Blocks.size();
+  unsigned NumCounters = 0;
+  auto newCounter = [&]() {
+    MInstr I = MInstr::make(MOP_Count, 8, MInstr::NoReg);
+    I.Imm = NumCounters++;
+    return I;
+  };
+
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    MInstr Cnt = newCounter();
+    uint32_t C = static_cast<uint32_t>(Cnt.Imm);
+    MF.Blocks[b].Instrs.insert(MF.Blocks[b].Instrs.begin(), Cnt);
+    Probes.push_back(ProfileProbe{ b, MInstr::NoReg, C });
+
+    std::vector<uint32_t> Succs;
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      if (std::find(Succs.begin(), Succs.end(), S) == Succs.end())
+        Succs.push_back(S);
+    });
+    // An edge which is always taken has the count of its block.
+    if (Succs.size() == 1) {
+      Probes.push_back(ProfileProbe{ b, Succs[0], C });
+      continue;
+    }
+
+    for (uint32_t S : Succs) {
+      uint32_t E = MF.Blocks.size();
+      MF.Blocks.emplace_back();
+      MInstr ECnt = newCounter();
+      MInstr J = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+      J.Target0 = S;
+      MF.Blocks[E].Instrs.push_back(ECnt);
+      MF.Blocks[E].Instrs.push_back(J);
+      Probes.push_back(
+        ProfileProbe{ b, S, static_cast<uint32_t>(ECnt.Imm) });
+
+      MBlock &Bl = MF.Blocks[b];
+      MInstr &T = Bl.Instrs.back();
+      if (T.Op == MOP_JumpTable) {
+        for (uint32_t &Jt : Bl.JumpTable) {
+          if (Jt == S)
+            Jt = E;
+        }
+      }
+      else {
+        if (T.Target0 == S)
+          T.Target0 = E;
+        if (T.Target1 == S)
+          T.Target1 = E;
+      }
+    }
+  }
+  return NumCounters;
+}
+
+
+void addCounts(const std::vector<ProfileProbe> &Probes,
+               const uint64_t *Counters, unsigned NumBlocks,
+               BlockProfile &P) {
+  BlockProfile New;
+  New.BlockCounts.assign(NumBlocks, 0);
+  for (auto &Pr : Probes) {
+    uint64_t C = Counters[Pr.Counter];
+    if (Pr.To == MInstr::NoReg)
+      New.BlockCounts[Pr.From] += C;
+    else
+      New.Edges.push_back(ProfileEdge{ Pr.From, Pr.To, C });
+  }
+  canonicalize(New.Edges);
+  P.add(New);
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
@@ -0,0 +1,120 @@
+//===- Profile.h -----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Block and edge execution profiles for MachineIR.
+//
+// An instrumented function counts how often each of its blocks runs, and
+// how often each edge out of a block with more than one successor is
+// taken.  Edges are counted by splitting them with a new block, which
+// holds a counter and a jump, so that a single counter is incremented on
+// every path through a terminator.
+//
+// Counts are kept in terms of the blocks of the MachineFunction as it was
+// before instrumentation, and are keyed by a hash of that function, so a
+// profile gathered by one run can be used to compile the same function in
+// another.  A profile which no longer matches the code is never found.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_PROFILE_H
+#define OHMU_BACKEND_JIT_PROFILE_H
+
+#include "backend/jit/MachineIR.h"
+
+#include <cstddef>
+#include <map>
+
+namespace ohmu {
+namespace jit  {
+
+
+/// The number of times control passed from block From to block To.
+struct ProfileEdge {
+  uint32_t From;
+  uint32_t To;
+  uint64_t Count;
+};
+
+
+/// Execution counts for a single function.
+struct BlockProfile {
+  /// Return the count of the edge From -> To, or 0 if it was never taken.
+  uint64_t edgeCount(uint32_t From, uint32_t To) const;
+
+  /// Add the counts in P to this profile.
+  void add(const BlockProfile &P);
+
+  std::vector<uint64_t>    BlockCounts;   ///< Indexed by block.
+  std::vector<ProfileEdge> Edges;         ///< Sorted by (From, To).
+};
+
+
+/// Profiles for a set of functions, keyed by hashFunction().
+class ProfileData {
+public:
+  /// Return the profile for the function with the given hash, or null.
+  const BlockProfile* find(uint64_t Hash) const;
+
+  /// Add P to the profile of the function with the given hash.  If the
+  /// existing profile has a different number of blocks, it is replaced.
+  void add(uint64_t Hash, const BlockProfile &P);
+
+  size_t size() const { return Profiles.size(); }
+  void   clear()      { Profiles.clear(); }
+
+  /// Write every profile to a text file.  Returns false on an I/O error.
+  bool save(const char *Path) const;
+
+  /// Read profiles from a file written by save(), and add them to this
+  /// one.  Returns false if the file cannot be read or is malformed.
+  bool load(const char *Path);
+
+private:
+  std::map<uint64_t, BlockProfile> Profiles;
+};
+
+
+/// A counter in an instrumented function.  The counter is the number of
+/// times the edge From -> To was taken, or if To is NoReg, the number of
+/// times block From was run.  Several probes can share a counter.
+struct ProfileProbe {
+  uint32_t From;
+  uint32_t To;
+  uint32_t Counter;
+};
+
+
+/// Return a hash of the code of MF.
+uint64_t hashFunction(const MachineFunction &MF);
+
+/// Add a MOP_Count to every block of MF, and split the edges out of blocks
+/// with more than one successor, so that they can be counted.  The probes
+/// are added to Probes, and the number of counters is returned.
+unsigned instrumentFunction(MachineFunction &MF,
+                            std::vector<ProfileProbe> &Probes);
+
+/// Turn the counters of a function instrumented with the given probes into
+/// a profile, and add it to P.
+void addCounts(const std::vector<ProfileProbe> &Probes,
+               const uint64_t *Counters, unsigned NumBlocks,
+               BlockProfile &P);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_PROFILE_H
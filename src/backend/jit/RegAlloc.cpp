@@ -0,0 +1,740 @@
+//===- RegAlloc.cpp --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "RegAlloc.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <queue>
+
+namespace ohmu {
+namespace jit  {
+
+
+const X64Reg ParamRegs[NumParamRegs] = { RDI, RSI, RDX, RCX, R8, R9 };
+
+
+namespace {
+
+const uint32_t MaxPos = 0xFFFFFFFF;
+const unsigned NumX64Regs = 16;
+
+// Allocatable registers, in order of preference.  Caller-saved registers
+// come first, so that callee-saved registers only have to be saved in
+// functions which keep values live across calls.
+const X64Reg AllocRegs[] = {
+  RSI, RDI, R8, R9, R10, R11, RBX, R12, R13, R14, R15
+};
+const unsigned NumAllocRegs = sizeof(AllocRegs) / sizeof(AllocRegs[0]);
+
+const char* const RegNames[NumX64Regs] = {
+  "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+  "r8",  "r9",  "r10", "r11", "r12", "r13", "r14", "r15"
+};
+
+bool isAllocatable(uint8_t R) {
+  for (X64Reg Ar : AllocRegs) {
+    if (Ar == R)
+      return true;
+  }
+  return false;
+}
+
+
+/// A half-open range of positions [Start, End).
+struct LiveRange {
+  uint32_t Start;
+  uint32_t End;
+};
+
+
+/// The positions at which a virtual register is live, or for a fixed
+/// interval, at which a physical register is unavailable.
+struct Interval {
+  Interval()
+      : VReg(MInstr::NoReg), Reg(MInstr::NoPhysReg),
+        HintReg(MInstr::NoPhysReg), HintVReg(MInstr::NoReg), Fixed(false),
+        Spilled(false), NumUses(0), NumDefs(0), Weight(0), List(nullptr),
+        ListIndex(0), NextRange(0), Boundary(MaxPos) { }
+
+  bool     empty() const { return Ranges.empty(); }
+  uint32_t start() const { return Ranges.front().Start; }
+  uint32_t end()   const { return Ranges.back().End; }
+
+  /// Return the index of the first range which ends after P.
+  size_t findRange(uint32_t P) const {
+    auto It = std::upper_bound(Ranges.begin(), Ranges.end(), P,
+      [](uint32_t P, const LiveRange &R) { return P < R.End; });
+    return It - Ranges.begin();
+  }
+
+  bool covers(uint32_t P) const {
+    size_t i = findRange(P);
+    return i < Ranges.size() && Ranges[i].Start <= P;
+  }
+
+  /// Return the first position at which both intervals are live, or MaxPos.
+  uint32_t intersect(const Interval &O) const {
+    uint32_t S = std::max(start(), O.start());
+    uint32_t E = std::min(end(), O.end());
+    if (S >= E)
+      return MaxPos;
+    size_t i = findRange(S);
+    size_t j = O.findRange(S);
+    while (i < Ranges.size() && j < O.Ranges.size()) {
+      const LiveRange &A = Ranges[i];
+      const LiveRange &B = O.Ranges[j];
+      if (A.Start >= E || B.Start >= E)
+        return MaxPos;
+      if (A.End <= B.Start)
+        ++i;
+      else if (B.End <= A.Start)
+        ++j;
+      else
+        return std::max(A.Start, B.Start);
+    }
+    return MaxPos;
+  }
+
+  // While intervals are being built, ranges are added in order of
+  // decreasing position, and are kept in reverse order.
+  void addRange(uint32_t S, uint32_t E) {
+    if (!Ranges.empty() && E >= Ranges.back().Start) {
+      LiveRange &R = Ranges.back();
+      R.Start = std::min(R.Start, S);
+      R.End   = std::max(R.End, E);
+      return;
+    }
+    Ranges.push_back(LiveRange{ S, E });
+  }
+
+  void addDef(uint32_t D) {
+    if (!Ranges.empty() && Ranges.back().Start <= D && D < Ranges.back().End)
+      Ranges.back().Start = D;
+    else
+      Ranges.push_back(LiveRange{ D, D + 1 });   // The value is never used.
+  }
+
+  std::vector<LiveRange> Ranges;
+  uint32_t VReg;
+  uint8_t  Reg;
+  uint8_t  HintReg;     ///< Preferred physical register.
+  uint32_t HintVReg;    ///< Preferably share a register with this vreg.
+  bool     Fixed;
+  bool     Spilled;
+  unsigned NumUses;
+  unsigned NumDefs;
+  double   Weight;      ///< Uses and defs, weighted by loop depth.
+
+  // State of the interval during linear scan.
+  std::vector<Interval*> *List;   ///< Active, Inactive, or null.
+  size_t   ListIndex;   ///< Index in List.
+  size_t   NextRange;   ///< First range which ends after the last position.
+  uint32_t Boundary;    ///< Next position at which the interval changes list.
+};
+
+
+/// Computes live intervals for every virtual register in a function.
+///
+/// Instructions are numbered consecutively from 1, in block order.
+/// Instruction N reads its operands at position 2N, and writes its result
+/// at 2N+1, so the result may share a register with an operand that dies.
+/// A call clobbers the caller-saved registers at 2N+1, and writes its
+/// result at 2N+2.  Block 0 starts at position 0, where the parameters are
+/// defined.
+class LiveIntervals {
+public:
+  explicit LiveIntervals(const MachineFunction &MF) : MF(MF), Words(0) { }
+
+  void compute();
+
+  std::vector<Interval> VRegs;                ///< Indexed by vreg.
+  Interval              Fixed[NumX64Regs];    ///< Indexed by register.
+  std::vector<uint32_t> CallPositions;        ///< Clobber positions.
+  unsigned              NumInstrs;
+
+private:
+  void numberInstructions();
+  void computeLoopDepth();
+  void computeLiveness();
+  void buildIntervals();
+
+  bool test(const std::vector<uint64_t> &S, unsigned B, uint32_t V) const {
+    return (S[B*Words + V/64] >> (V % 64)) & 1;
+  }
+  void set(std::vector<uint64_t> &S, unsigned B, uint32_t V) {
+    S[B*Words + V/64] |= uint64_t(1) << (V % 64);
+  }
+
+  const MachineFunction& MF;
+  unsigned Words;
+  std::vector<uint32_t> FirstInstr;
+  std::vector<unsigned> LoopDepth;
+  std::vector<uint64_t> Gen;       ///< Vregs read before they are written.
+  std::vector<uint64_t> Kill;      ///< Vregs written.
+  std::vector<uint64_t> LiveIn;
+  std::vector<uint64_t> LiveOut;
+};
+
+
+void LiveIntervals::compute() {
+  numberInstructions();
+  computeLoopDepth();
+  computeLiveness();
+  buildIntervals();
+}
+
+
+void LiveIntervals::numberInstructions() {
+  uint32_t N = 1;
+  for (auto &B : MF.Blocks) {
+    FirstInstr.push_back(N);
+    N += B.Instrs.size();
+  }
+  FirstInstr.push_back(N);
+  NumInstrs = N - 1;
+}
+
+
+// A loop is approximated by the blocks between the target and source of a
+// back edge, in block order.
+void LiveIntervals::computeLoopDepth() {
+  unsigned NumBlocks = MF.Blocks.size();
+  std::vector<int> Delta(NumBlocks + 1, 0);
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      if (S <= b) {
+        ++Delta[S];
+        --Delta[b + 1];
+      }
+    });
+  }
+  LoopDepth.resize(NumBlocks);
+  int Depth = 0;
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    Depth += Delta[b];
+    LoopDepth[b] = Depth;
+  }
+}
+
+
+void LiveIntervals::computeLiveness() {
+  unsigned NumBlocks = MF.Blocks.size();
+  Words = (MF.NumVRegs + 63) / 64;
+  Gen.assign(NumBlocks * Words, 0);
+  Kill.assign(NumBlocks * Words, 0);
+  LiveIn.assign(NumBlocks * Words, 0);
+  LiveOut.assign(NumBlocks * Words, 0);
+
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    for (auto &I : MF.Blocks[b].Instrs) {
+      forEachUse(MF, I, [&](uint32_t V) {
+        if (!test(Kill, b, V))
+          set(Gen, b, V);
+      });
+      if (I.Dst != MInstr::NoReg)
+        set(Kill, b, I.Dst);
+    }
+  }
+
+  // Solve backwards from a worklist, which starts with every block in
+  // reverse order.  When the live-in set of a block grows, its
+  // predecessors are revisited.
+  std::vector<std::vector<unsigned>> Preds(NumBlocks);
+  for (unsigned b = 0; b < NumBlocks; ++b)
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) { Preds[S].push_back(b); });
+
+  std::vector<unsigned> Worklist;
+  std::vector<bool> Queued(NumBlocks, true);
+  for (unsigned b = 0; b < NumBlocks; ++b)
+    Worklist.push_back(b);
+  while (!Worklist.empty()) {
+    unsigned b = Worklist.back();
+    Worklist.pop_back();
+    Queued[b] = false;
+
+    uint64_t *Out = &LiveOut[b*Words];
+    forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+      const uint64_t *In = &LiveIn[S*Words];
+      for (unsigned w = 0; w < Words; ++w)
+        Out[w] |= In[w];
+    });
+    uint64_t *In = &LiveIn[b*Words];
+    bool Changed = false;
+    for (unsigned w = 0; w < Words; ++w) {
+      uint64_t NewIn = Gen[b*Words + w] | (Out[w] & ~Kill[b*Words + w]);
+      if (NewIn != In[w]) {
+        In[w] = NewIn;
+        Changed = true;
+      }
+    }
+    if (!Changed)
+      continue;
+    for (unsigned P : Preds[b]) {
+      if (!Queued[P]) {
+        Queued[P] = true;
+        Worklist.push_back(P);
+      }
+    }
+  }
+}
+
+
+void LiveIntervals::buildIntervals() {
+  VRegs.resize(MF.NumVRegs);
+  for (unsigned v = 0; v < MF.NumVRegs; ++v)
+    VRegs[v].VReg = v;
+
+  for (unsigned b = MF.Blocks.size(); b-- > 0;) {
+    uint32_t BS = b == 0 ? 0 : 2 * FirstInstr[b];
+    uint32_t BE = 2 * FirstInstr[b + 1];
+    double   W  = 1;
+    for (unsigned d = 0; d < LoopDepth[b] && d < 4; ++d)
+      W *= 8;
+
+    const uint64_t *Out = &LiveOut[b*Words];
+    for (unsigned w = 0; w < Words; ++w) {
+      for (uint64_t Bits = Out[w]; Bits; Bits &= Bits - 1)
+        VRegs[w*64 + __builtin_ctzll(Bits)].addRange(BS, BE);
+    }
+
+    auto &Instrs = MF.Blocks[b].Instrs;
+    for (unsigned i = Instrs.size(); i-- > 0;) {
+      const MInstr &I = Instrs[i];
+      uint32_t N = FirstInstr[b] + i;
+      uint32_t Def = 2*N + 1;
+      if (I.Op == MOP_Call) {
+        CallPositions.push_back(Def);
+        ++Def;
+      }
+      if (I.Dst != MInstr::NoReg) {
+        Interval &It = VRegs[I.Dst];
+        It.addDef(Def);
+        ++It.NumDefs;
+        It.Weight += W;
+      }
+      forEachUse(MF, I, [&](uint32_t V) {
+        Interval &It = VRegs[V];
+        It.addRange(BS, 2*N + 1);
+        ++It.NumUses;
+        It.Weight += W;
+      });
+    }
+  }
+
+  for (auto &It : VRegs)
+    std::reverse(It.Ranges.begin(), It.Ranges.end());
+  std::reverse(CallPositions.begin(), CallPositions.end());
+
+  for (unsigned r = 0; r < NumX64Regs; ++r) {
+    Interval &F = Fixed[r];
+    F.Reg = r;
+    F.Fixed = true;
+    if (!isAllocatable(r) || !isCallerSaved(static_cast<X64Reg>(r)))
+      continue;
+    for (uint32_t P : CallPositions)
+      F.Ranges.push_back(LiveRange{ P, P + 1 });
+  }
+}
+
+
+/// Allocates registers by a linear scan over intervals in order of start
+/// position.  Intervals which are assigned a register are kept on the
+/// active list while they are live, and on the inactive list while they
+/// are in a lifetime hole.
+class LinearScan {
+public:
+  LinearScan(MachineFunction &MF, RegAllocStats *S)
+      : MF(MF), LI(MF), Stats(S) { }
+
+  void run();
+
+private:
+  void computeHints();
+  void expire(uint32_t Pos);
+  bool tryAllocateFree(Interval *Cur);
+  void allocateBlocked(Interval *Cur);
+  void assignFrame();
+
+  void insert(std::vector<Interval*> &L, Interval *It, uint32_t Pos);
+  void schedule(Interval *It, uint32_t Pos);
+
+  static void remove(std::vector<Interval*> &L, size_t i) {
+    L[i]->List = nullptr;
+    L[i] = L.back();
+    L[i]->ListIndex = i;
+    L.pop_back();
+  }
+
+  // A boundary of an interval, at which it must be moved between Active and
+  // Inactive, or removed from both.
+  typedef std::pair<uint32_t, Interval*> Event;
+
+  MachineFunction&       MF;
+  LiveIntervals          LI;
+  RegAllocStats*         Stats;
+  std::vector<Interval*> Active;
+  std::vector<Interval*> Inactive;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> Events;
+};
+
+
+void LinearScan::run() {
+  LI.compute();
+  computeHints();
+
+  std::vector<Interval*> Unhandled;
+  for (auto &It : LI.VRegs) {
+    if (!It.empty())
+      Unhandled.push_back(&It);
+  }
+  std::stable_sort(Unhandled.begin(), Unhandled.end(),
+    [](const Interval *A, const Interval *B) {
+      return A->start() < B->start();
+    });
+
+  for (auto &F : LI.Fixed) {
+    if (!F.empty())
+      insert(Inactive, &F, 0);
+  }
+
+  for (Interval *Cur : Unhandled) {
+    expire(Cur->start());
+    if (!tryAllocateFree(Cur))
+      allocateBlocked(Cur);
+  }
+  assignFrame();
+}
+
+
+// The code generator can avoid a move when the result of an instruction is
+// in the same register as its first operand, and when parameters and
+// arguments are already in the registers of the calling convention.
+void LinearScan::computeHints() {
+  for (unsigned i = 0; i < MF.NumParams && i < NumParamRegs; ++i)
+    LI.VRegs[i].HintReg = ParamRegs[i];
+
+  for (auto &B : MF.Blocks) {
+    for (auto &I : B.Instrs) {
+      switch (I.Op) {
+        case MOP_Mov: case MOP_Add: case MOP_Sub: case MOP_Mul:
+        case MOP_And: case MOP_Or:  case MOP_Xor: case MOP_Shl:
+        case MOP_Shr: case MOP_Sar: case MOP_Neg: case MOP_Not:
+        case MOP_SExt: case MOP_ZExt:
+          if (LI.VRegs[I.Dst].HintVReg == MInstr::NoReg)
+            LI.VRegs[I.Dst].HintVReg = I.A;
+          break;
+        case MOP_Lea:
+          if (LI.VRegs[I.Dst].HintVReg == MInstr::NoReg)
+            LI.VRegs[I.Dst].HintVReg = I.A != MInstr::NoReg ? I.A : I.B;
+          break;
+        case MOP_Call:
+          for (unsigned i = 0; i < I.Target1 && i < NumParamRegs; ++i) {
+            Interval &It = LI.VRegs[MF.ArgRegs[I.Target0 + i]];
+            if (It.HintReg == MInstr::NoPhysReg)
+              It.HintReg = ParamRegs[i];
+          }
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+
+// Add It to L, and schedule its next boundary after Pos.
+void LinearScan::insert(std::vector<Interval*> &L, Interval *It,
+                        uint32_t Pos) {
+  It->List = &L;
+  It->ListIndex = L.size();
+  L.push_back(It);
+  schedule(It, Pos);
+}
+
+
+// An active interval changes at the end of its current range, and an
+// inactive one at the start of its next range.  Positions only increase, so
+// NextRange is advanced rather than searched for.
+void LinearScan::schedule(Interval *It, uint32_t Pos) {
+  while (It->NextRange < It->Ranges.size() &&
+         It->Ranges[It->NextRange].End <= Pos)
+    ++It->NextRange;
+  if (It->NextRange == It->Ranges.size()) {
+    It->Boundary = MaxPos;
+    return;
+  }
+  const LiveRange &R = It->Ranges[It->NextRange];
+  It->Boundary = It->List == &Active ? R.End : R.Start;
+  Events.push(Event(It->Boundary, It));
+}
+
+
+// Only intervals which have a boundary at or before Pos are revisited.
+// Events for intervals which have since been evicted or rescheduled are
+// stale, and are skipped.
+void LinearScan::expire(uint32_t Pos) {
+  while (!Events.empty() && Events.top().first <= Pos) {
+    Interval *It = Events.top().second;
+    uint32_t  B  = Events.top().first;
+    Events.pop();
+    if (!It->List || It->Boundary != B)
+      continue;
+
+    std::vector<Interval*> &L = *It->List;
+    remove(L, It->ListIndex);
+    if (It->end() <= Pos)
+      continue;
+    insert(It->covers(Pos) ? Active : Inactive, It, Pos);
+  }
+}
+
+
+// Look for a register which is free for the whole of Cur.  An inactive
+// interval only blocks its register if Cur overlaps one of its ranges.
+bool LinearScan::tryAllocateFree(Interval *Cur) {
+  bool Free[NumX64Regs];
+  for (unsigned r = 0; r < NumX64Regs; ++r)
+    Free[r] = isAllocatable(r);
+  for (Interval *It : Active)
+    Free[It->Reg] = false;
+  for (Interval *It : Inactive) {
+    if (Free[It->Reg] && It->intersect(*Cur) != MaxPos)
+      Free[It->Reg] = false;
+  }
+
+  uint8_t Reg = MInstr::NoPhysReg;
+  if (Cur->HintVReg != MInstr::NoReg) {
+    uint8_t H = LI.VRegs[Cur->HintVReg].Reg;
+    if (H != MInstr::NoPhysReg && Free[H])
+      Reg = H;
+  }
+  if (Reg == MInstr::NoPhysReg && Cur->HintReg != MInstr::NoPhysReg &&
+      Free[Cur->HintReg])
+    Reg = Cur->HintReg;
+  for (unsigned i = 0; Reg == MInstr::NoPhysReg && i < NumAllocRegs; ++i) {
+    if (Free[AllocRegs[i]])
+      Reg = AllocRegs[i];
+  }
+  if (Reg == MInstr::NoPhysReg)
+    return false;
+
+  Cur->Reg = Reg;
+  insert(Active, Cur, Cur->start());
+  return true;
+}
+
+
+// Every register is in use somewhere in Cur.  Free the register whose
+// occupants have the lowest total weight, if that is less than the weight
+// of Cur; otherwise spill Cur.  Registers which are clobbered by a call
+// during Cur cannot be freed.
+void LinearScan::allocateBlocked(Interval *Cur) {
+  double Cost[NumX64Regs];
+  bool   Blocked[NumX64Regs];
+  for (unsigned r = 0; r < NumX64Regs; ++r) {
+    Cost[r] = 0;
+    Blocked[r] = !isAllocatable(r);
+  }
+  auto Weigh = [&](Interval *It) {
+    if (It->intersect(*Cur) == MaxPos)
+      return;
+    if (It->Fixed)
+      Blocked[It->Reg] = true;
+    else
+      Cost[It->Reg] += It->Weight;
+  };
+  for (Interval *It : Active)
+    Weigh(It);
+  for (Interval *It : Inactive)
+    Weigh(It);
+
+  uint8_t Reg = MInstr::NoPhysReg;
+  for (X64Reg R : AllocRegs) {
+    if (!Blocked[R] && (Reg == MInstr::NoPhysReg || Cost[R] < Cost[Reg]))
+      Reg = R;
+  }
+  if (Reg == MInstr::NoPhysReg || Cost[Reg] >= Cur->Weight) {
+    Cur->Spilled = true;
+    return;
+  }
+
+  // A spilled interval lives in memory for its whole lifetime, so
+  // spilling it here also covers the code before Cur.
+  auto Evict = [&](std::vector<Interval*> &L) {
+    for (size_t i = 0; i < L.size();) {
+      Interval *It = L[i];
+      if (It->Reg == Reg && !It->Fixed && It->intersect(*Cur) != MaxPos) {
+        It->Reg = MInstr::NoPhysReg;
+        It->Spilled = true;
+        remove(L, i);
+      }
+      else {
+        ++i;
+      }
+    }
+  };
+  Evict(Active);
+  Evict(Inactive);
+  Cur->Reg = Reg;
+  insert(Active, Cur, Cur->start());
+}
+
+
+void LinearScan::assignFrame() {
+  MF.Regs.assign(MF.NumVRegs, MInstr::NoPhysReg);
+  MF.FrameOffsets.assign(MF.NumVRegs, 0);
+  MF.SavedRegs.clear();
+  MF.SaveOffsets.clear();
+
+  bool Used[NumX64Regs] = { false };
+  for (auto &It : LI.VRegs) {
+    if (!It.empty() && !It.Spilled) {
+      MF.Regs[It.VReg] = It.Reg;
+      Used[It.Reg] = true;
+    }
+  }
+  for (X64Reg R : AllocRegs) {
+    if (Used[R] && !isCallerSaved(R)) {
+      MF.SavedRegs.push_back(R);
+      MF.SaveOffsets.push_back(-8 * static_cast<int32_t>(MF.SavedRegs.size()));
+    }
+  }
+
+  int32_t NumSlots = MF.SavedRegs.size();
+  RegAllocStats S;
+  for (auto &It : LI.VRegs) {
+    if (It.empty())
+      continue;
+    ++S.NumIntervals;
+    if (!It.Spilled)
+      continue;
+    MF.FrameOffsets[It.VReg] = -8 * ++NumSlots;
+    ++S.NumSpilled;
+    S.NumSpillLoads  += It.NumUses;
+    S.NumSpillStores += It.NumDefs;
+  }
+  // Keep the stack pointer 16-byte aligned at calls.
+  MF.FrameSize = (8 * NumSlots + 15) & ~15u;
+
+  if (Stats) {
+    S.NumInstrs = LI.NumInstrs;
+    S.NumSavedRegs = MF.SavedRegs.size();
+    *Stats = S;
+  }
+}
+
+}  // end anonymous namespace
+
+
+void allocateRegisters(MachineFunction &MF, RegAllocStats *Stats) {
+  LinearScan(MF, Stats).run();
+}
+
+
+bool verifyRegisters(const MachineFunction &MF, std::string *Err) {
+  LiveIntervals LI(MF);
+  LI.compute();
+
+  struct Owner {
+    uint32_t Start;
+    uint32_t End;
+    uint32_t VReg;    ///< NoReg for a call clobber.
+  };
+  std::vector<Owner> Owners[NumX64Regs];
+  std::vector<int32_t> Slots;
+  char Buf[128];
+
+  for (auto &It : LI.VRegs) {
+    if (It.empty())
+      continue;
+    uint8_t R = MF.Regs[It.VReg];
+    if (R == MInstr::NoPhysReg) {
+      int32_t Off = MF.FrameOffsets[It.VReg];
+      if (Off >= 0 || static_cast<uint32_t>(-Off) > MF.FrameSize) {
+        snprintf(Buf, sizeof(Buf), "v%u has no location", It.VReg);
+        *Err = Buf;
+        return false;
+      }
+      Slots.push_back(Off);
+      continue;
+    }
+    if (!isAllocatable(R)) {
+      snprintf(Buf, sizeof(Buf), "v%u is in reserved register %s",
+               It.VReg, RegNames[R]);
+      *Err = Buf;
+      return false;
+    }
+    for (auto &Rg : It.Ranges)
+      Owners[R].push_back(Owner{ Rg.Start, Rg.End, It.VReg });
+  }
+  for (unsigned r = 0; r < NumX64Regs; ++r) {
+    for (auto &Rg : LI.Fixed[r].Ranges)
+      Owners[r].push_back(Owner{ Rg.Start, Rg.End, MInstr::NoReg });
+  }
+
+  for (int32_t Off : MF.SaveOffsets)
+    Slots.push_back(Off);
+  std::sort(Slots.begin(), Slots.end());
+  if (std::adjacent_find(Slots.begin(), Slots.end()) != Slots.end()) {
+    *Err = "two values share a stack slot";
+    return false;
+  }
+
+  // Ranges of the same owner never overlap, so if a range starts before
+  // the furthest end seen so far, it overlaps the range with that end.
+  for (unsigned r = 0; r < NumX64Regs; ++r) {
+    auto &Os = Owners[r];
+    std::sort(Os.begin(), Os.end(), [](const Owner &A, const Owner &B) {
+      return A.Start < B.Start;
+    });
+    const Owner *Last = nullptr;
+    for (auto &O : Os) {
+      if (Last && O.Start < Last->End) {
+        if (Last->VReg == MInstr::NoReg || O.VReg == MInstr::NoReg)
+          snprintf(Buf, sizeof(Buf), "v%u is live in %s across a call at %u",
+                   Last->VReg == MInstr::NoReg ? O.VReg : Last->VReg,
+                   RegNames[r], O.Start);
+        else
+          snprintf(Buf, sizeof(Buf), "v%u and v%u are both in %s at %u",
+                   Last->VReg, O.VReg, RegNames[r], O.Start);
+        *Err = Buf;
+        return false;
+      }
+      if (!Last || O.End > Last->End)
+        Last = &O;
+    }
+  }
+
+  for (unsigned r = 0; r < NumX64Regs; ++r) {
+    bool Saved = std::find(MF.SavedRegs.begin(), MF.SavedRegs.end(), r) !=
+                 MF.SavedRegs.end();
+    bool NeedsSave = !Owners[r].empty() && !isCallerSaved(X64Reg(r));
+    if (Saved != NeedsSave) {
+      snprintf(Buf, sizeof(Buf), "%s is %s", RegNames[r],
+               Saved ? "saved but not used" : "used but not saved");
+      *Err = Buf;
+      return false;
+    }
+  }
+  return true;
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
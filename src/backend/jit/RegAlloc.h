@@ -0,0 +1,95 @@
+//===- RegAlloc.h ----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A linear-scan register allocator for MachineIR.
+//
+// Instructions are numbered in block order, and the live interval of each
+// virtual register is computed from block liveness as a list of ranges, so
+// that lifetime holes are preserved.  Intervals are then allocated in order
+// of their start position, in the style of second-chance binpacking: an
+// interval may be placed in a register which is occupied by another
+// interval, as long as it fits into that interval's holes.
+//
+// Register constraints of the target are modeled as fixed intervals, which
+// block a physical register over a range of positions: calls clobber the
+// caller-saved registers.  Two-address instructions are honoured by hinting
+// the result of an instruction into the register of its first operand, and
+// parameters and call arguments are hinted into the registers of the
+// calling convention.  RAX, RCX, and RDX are never allocated; the code
+// generator uses them as scratch registers, and for instructions which
+// need fixed operands, such as division and shifts.
+//
+// When no register is free for the whole of an interval, either the
+// interval or the intervals which block it are spilled, whichever has the
+// lower spill weight.  Weights count the uses and definitions of an
+// interval, scaled by loop depth.  A spilled interval lives in a stack slot
+// for its whole lifetime, and the code generator reloads it into a scratch
+// register at each use.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_REGALLOC_H
+#define OHMU_BACKEND_JIT_REGALLOC_H
+
+#include "backend/jit/MachineIR.h"
+#include "backend/jit/X64Emitter.h"
+
+#include <string>
+
+namespace ohmu {
+namespace jit  {
+
+
+/// The registers which hold the integer arguments of a call, in order.
+static const unsigned NumParamRegs = 6;
+extern const X64Reg ParamRegs[NumParamRegs];
+
+/// Return true if R is not preserved across calls.
+inline bool isCallerSaved(X64Reg R) {
+  return R <= RDX || R == RSI || R == RDI || (R >= R8 && R <= R11);
+}
+
+
+/// Statistics from a run of the register allocator.
+struct RegAllocStats {
+  RegAllocStats()
+      : NumInstrs(0), NumIntervals(0), NumSpilled(0), NumSpillLoads(0),
+        NumSpillStores(0), NumSavedRegs(0) { }
+
+  unsigned NumInstrs;
+  unsigned NumIntervals;     ///< Virtual registers which are live somewhere.
+  unsigned NumSpilled;       ///< Intervals which were assigned to memory.
+  unsigned NumSpillLoads;    ///< Uses of spilled intervals.
+  unsigned NumSpillStores;   ///< Definitions of spilled intervals.
+  unsigned NumSavedRegs;     ///< Callee-saved registers used.
+};
+
+
+/// Assign every virtual register in MF to a register or a stack slot, and
+/// lay out the frame.  If Stats is non-null, it is filled in.
+void allocateRegisters(MachineFunction &MF, RegAllocStats *Stats = nullptr);
+
+/// Check that no two virtual registers which are live at the same time
+/// share a register, and that no register which is clobbered by a call
+/// holds a value across it.  Returns false and sets Err on failure.
+bool verifyRegisters(const MachineFunction &MF, std::string *Err);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_REGALLOC_H
@@ -0,0 +1,506 @@
+//===- Schedule.cpp --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Schedule.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+// Execution ports, numbered as on Intel cores from Haswell onwards.  Only
+// the integer ALU ports are modeled; loads and stores are not known until
+// after register allocation.
+const uint8_t P0   = 1 << 0;
+const uint8_t P1   = 1 << 1;
+const uint8_t P5   = 1 << 2;
+const uint8_t P6   = 1 << 3;
+const uint8_t PAlu = P0 | P1 | P5 | P6;
+
+// The number of instructions which issue per cycle.
+const unsigned IssueWidth = 4;
+
+// The number of registers available to the register allocator.
+const unsigned NumRegs = 11;
+
+
+/// The latency of an opcode in cycles, and the ports it can issue to.
+struct OpModel {
+  uint8_t Latency;
+  uint8_t Ports;
+};
+
+const OpModel Models[] = {
+  { 1,  PAlu    },   // MOP_MovImm
+  { 1,  PAlu    },   // MOP_Mov
+  { 1,  PAlu    },   // MOP_Add
+  { 1,  PAlu    },   // MOP_Sub
+  { 3,  P1      },   // MOP_Mul
+  { 1,  PAlu    },   // MOP_And
+  { 1,  PAlu    },   // MOP_Or
+  { 1,  PAlu    },   // MOP_Xor
+  { 2,  P0 | P6 },   // MOP_Shl, by CL
+  { 2,  P0 | P6 },   // MOP_Shr
+  { 2,  P0 | P6 },   // MOP_Sar
+  { 26, P0      },   // MOP_SDiv
+  { 26, P0      },   // MOP_SRem
+  { 26, P0      },   // MOP_UDiv
+  { 26, P0      },   // MOP_URem
+  { 1,  PAlu    },   // MOP_Neg
+  { 1,  PAlu    },   // MOP_Not
+  { 1,  PAlu    },   // MOP_SExt
+  { 1,  PAlu    },   // MOP_ZExt
+  { 2,  P0 | P6 },   // MOP_SetCC: cmp, setcc, movzx
+  { 1,  P1 | P5 },   // MOP_Lea, with at most two components
+  { 1,  PAlu    },   // MOP_Call
+  { 1,  PAlu    },   // MOP_Count
+  { 1,  P0 | P6 },   // MOP_Jump
+  { 1,  P0 | P6 },   // MOP_Branch
+  { 1,  P0 | P6 },   // MOP_CondBranch
+  { 1,  P0 | P6 },   // MOP_JumpTable
+  { 1,  P0 | P6 },   // MOP_BitTest
+  { 1,  P0 | P6 },   // MOP_Trap
+  { 1,  P0 | P6 }    // MOP_Return
+};
+
+static_assert(sizeof(Models) / sizeof(Models[0]) == MOP_Return + 1,
+              "Models must have an entry for every opcode");
+
+OpModel getModel(const MInstr &I) {
+  // A lea with a base, an index, and a displacement is slow.
+  if (I.Op == MOP_Lea && I.A != MInstr::NoReg && I.B != MInstr::NoReg &&
+      I.Imm != 0)
+    return OpModel{ 3, P1 };
+  return Models[I.Op];
+}
+
+
+/// An instruction in the dependence graph of a region.
+struct SchedNode {
+  unsigned Latency;
+  uint8_t  Ports;
+  unsigned Height;     ///< Longest latency path to the end of the region.
+  unsigned NumPreds;
+  std::vector<std::pair<unsigned, unsigned>> Succs;   ///< Node, latency.
+};
+
+
+class Scheduler {
+public:
+  Scheduler(MachineFunction &MF, ScheduleStats &S)
+      : MF(MF), Stats(S), Words((MF.NumVRegs + 63) / 64), Current(0) { }
+
+  void run();
+
+private:
+  bool test(const uint64_t *S, uint32_t V) const {
+    return (S[V/64] >> (V % 64)) & 1;
+  }
+  void set(uint64_t *S, uint32_t V)   { S[V/64] |= uint64_t(1) << (V % 64); }
+  void clear(uint64_t *S, uint32_t V) { S[V/64] &= ~(uint64_t(1) << (V % 64)); }
+
+  /// Update S from the values live after I to those live before it.
+  void stepBack(uint64_t *S, const MInstr &I) {
+    if (I.Dst != MInstr::NoReg)
+      clear(S, I.Dst);
+    forEachUse(MF, I, [&](uint32_t V) { set(S, V); });
+  }
+
+  void computeLiveOut();
+  void scheduleBlock(unsigned b);
+  void scheduleRegion(MBlock &B, unsigned Begin, unsigned End);
+  void buildGraph();
+  std::vector<unsigned> listSchedule();
+  unsigned estimateCycles(const std::vector<unsigned> &Order) const;
+  unsigned peakPressure(const std::vector<unsigned> &Order);
+
+  void resetPressure();
+  int  updatePressure(const MInstr &I, bool Apply);
+  bool better(unsigned X, unsigned Y);
+
+  MachineFunction &MF;
+  ScheduleStats   &Stats;
+  unsigned         Words;
+  std::vector<uint64_t> LiveOut;     ///< Per block.
+  std::vector<uint64_t> Live;        ///< Before the current region.
+  std::vector<uint64_t> LiveAfter;   ///< After the current region.
+
+  std::vector<MInstr>    Region;
+  std::vector<SchedNode> Nodes;
+  std::unordered_map<uint32_t, unsigned>              LastDef;
+  std::unordered_map<uint32_t, std::vector<unsigned>> Readers;
+
+  // Register pressure, while the current region is issued.
+  std::vector<unsigned> Remaining;   ///< Unissued uses of each vreg.
+  std::vector<uint8_t>  IsLive;
+  unsigned              Current;     ///< Number of live vregs.
+};
+
+
+void Scheduler::run() {
+  computeLiveOut();
+  Live.resize(Words);
+  LiveAfter.resize(Words);
+  Remaining.assign(MF.NumVRegs, 0);
+  IsLive.assign(MF.NumVRegs, 0);
+  for (unsigned b = 0; b < MF.Blocks.size(); ++b)
+    scheduleBlock(b);
+}
+
+
+void Scheduler::computeLiveOut() {
+  unsigned NumBlocks = MF.Blocks.size();
+  std::vector<uint64_t> Gen(NumBlocks * Words, 0);
+  std::vector<uint64_t> Kill(NumBlocks * Words, 0);
+  std::vector<uint64_t> LiveIn(NumBlocks * Words, 0);
+  LiveOut.assign(NumBlocks * Words, 0);
+
+  for (unsigned b = 0; b < NumBlocks; ++b) {
+    for (auto &I : MF.Blocks[b].Instrs) {
+      forEachUse(MF, I, [&](uint32_t V) {
+        if (!test(&Kill[b*Words], V))
+          set(&Gen[b*Words], V);
+      });
+      if (I.Dst != MInstr::NoReg)
+        set(&Kill[b*Words], I.Dst);
+    }
+  }
+
+  // Iterate to a fixed point, visiting blocks in reverse order.
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned b = NumBlocks; b-- > 0;) {
+      uint64_t *Out = &LiveOut[b*Words];
+      forEachSuccessor(MF.Blocks[b], [&](uint32_t S) {
+        for (unsigned w = 0; w < Words; ++w)
+          Out[w] |= LiveIn[S*Words + w];
+      });
+      for (unsigned w = 0; w < Words; ++w) {
+        uint64_t In = Gen[b*Words + w] | (Out[w] & ~Kill[b*Words + w]);
+        if (In != LiveIn[b*Words + w]) {
+          LiveIn[b*Words + w] = In;
+          Changed = true;
+        }
+      }
+    }
+  }
+}
+
+
+// Calls, profile counters, and the terminator stay where they are, and
+// split the block into regions.  Regions are scheduled from the end of the
+// block, so that the values live after each one are known.
+void Scheduler::scheduleBlock(unsigned b) {
+  MBlock &B = MF.Blocks[b];
+  if (B.Instrs.empty())
+    return;
+  std::copy(&LiveOut[b*Words], &LiveOut[(b + 1)*Words], Live.begin());
+
+  unsigned End = B.Instrs.size();
+  for (unsigned i = End; i-- > 0;) {
+    const MInstr &I = B.Instrs[i];
+    if (I.Op != MOP_Call && I.Op != MOP_Count && !I.isTerminator())
+      continue;
+    scheduleRegion(B, i + 1, End);
+    stepBack(Live.data(), B.Instrs[i]);
+    End = i;
+  }
+  scheduleRegion(B, 0, End);
+}
+
+
+void Scheduler::scheduleRegion(MBlock &B, unsigned Begin, unsigned End) {
+  LiveAfter = Live;
+  for (unsigned i = End; i-- > Begin;)
+    stepBack(Live.data(), B.Instrs[i]);
+  if (End - Begin < 2)
+    return;
+
+  ++Stats.NumRegions;
+  Region.assign(B.Instrs.begin() + Begin, B.Instrs.begin() + End);
+  buildGraph();
+
+  std::vector<unsigned> Original(Region.size());
+  for (unsigned i = 0; i < Region.size(); ++i)
+    Original[i] = i;
+  std::vector<unsigned> Order = listSchedule();
+
+  unsigned OldCycles = estimateCycles(Original);
+  unsigned NewCycles = estimateCycles(Order);
+  bool Faster = NewCycles < OldCycles;
+  bool Fits = Faster &&
+      peakPressure(Order) <= std::max(peakPressure(Original), NumRegs);
+  if (Faster && !Fits)
+    ++Stats.NumPressureLimited;
+  Stats.CyclesBefore += OldCycles;
+  if (!Fits) {
+    Stats.CyclesAfter += OldCycles;
+    return;
+  }
+
+  Stats.CyclesAfter += NewCycles;
+  ++Stats.NumReordered;
+  for (unsigned i = 0; i < Order.size(); ++i)
+    B.Instrs[Begin + i] = Region[Order[i]];
+}
+
+
+// An instruction depends on the last write of each register it reads.  A
+// write must also follow the last write of its register, and every read of
+// the previous value.
+void Scheduler::buildGraph() {
+  unsigned N = Region.size();
+  Nodes.assign(N, SchedNode());
+  LastDef.clear();
+  Readers.clear();
+
+  auto addEdge = [&](unsigned From, unsigned To, unsigned Latency) {
+    Nodes[From].Succs.push_back(std::make_pair(To, Latency));
+    ++Nodes[To].NumPreds;
+  };
+
+  for (unsigned i = 0; i < N; ++i) {
+    const MInstr &I = Region[i];
+    OpModel M = getModel(I);
+    Nodes[i].Latency = M.Latency;
+    Nodes[i].Ports = M.Ports;
+    Nodes[i].NumPreds = 0;
+
+    forEachUse(MF, I, [&](uint32_t V) {
+      auto It = LastDef.find(V);
+      if (It != LastDef.end())
+        addEdge(It->second, i, Nodes[It->second].Latency);
+      Readers[V].push_back(i);
+    });
+    if (I.Dst == MInstr::NoReg)
+      continue;
+    auto It = LastDef.find(I.Dst);
+    if (It != LastDef.end())
+      addEdge(It->second, i, 0);
+    std::vector<unsigned> &Rs = Readers[I.Dst];
+    for (unsigned R : Rs) {
+      if (R != i)
+        addEdge(R, i, 0);
+    }
+    Rs.clear();
+    LastDef[I.Dst] = i;
+  }
+
+  for (unsigned i = N; i-- > 0;) {
+    SchedNode &Nd = Nodes[i];
+    Nd.Height = Nd.Latency;
+    for (auto &S : Nd.Succs)
+      Nd.Height = std::max(Nd.Height, S.second + Nodes[S.first].Height);
+  }
+}
+
+
+// Return true if X should be issued before Y.
+bool Scheduler::better(unsigned X, unsigned Y) {
+  if (Current >= NumRegs) {
+    bool XGrows = updatePressure(Region[X], false) > 0;
+    bool YGrows = updatePressure(Region[Y], false) > 0;
+    if (XGrows != YGrows)
+      return YGrows;
+  }
+  if (Nodes[X].Height != Nodes[Y].Height)
+    return Nodes[X].Height > Nodes[Y].Height;
+  return X < Y;
+}
+
+
+// Issue instructions cycle by cycle.  In each cycle, the best instruction
+// whose operands are ready, and which has a free port, is issued, until
+// the issue width is reached or nothing else can issue.
+std::vector<unsigned> Scheduler::listSchedule() {
+  unsigned N = Region.size();
+  std::vector<unsigned> Order;
+  std::vector<unsigned> NumPreds(N);
+  std::vector<unsigned> Earliest(N, 0);
+  std::vector<unsigned> Ready;
+  for (unsigned i = 0; i < N; ++i) {
+    NumPreds[i] = Nodes[i].NumPreds;
+    if (NumPreds[i] == 0)
+      Ready.push_back(i);
+  }
+
+  resetPressure();
+  unsigned Cycle = 0;
+  unsigned Issued = 0;
+  uint8_t  Busy = 0;
+  while (Order.size() < N) {
+    int Best = -1;
+    if (Issued < IssueWidth) {
+      for (unsigned k = 0; k < Ready.size(); ++k) {
+        unsigned i = Ready[k];
+        if (Earliest[i] > Cycle || (Nodes[i].Ports & ~Busy) == 0)
+          continue;
+        if (Best < 0 || better(i, Ready[Best]))
+          Best = k;
+      }
+    }
+    if (Best < 0) {
+      ++Cycle;
+      Issued = 0;
+      Busy = 0;
+      continue;
+    }
+
+    unsigned i = Ready[Best];
+    Ready[Best] = Ready.back();
+    Ready.pop_back();
+    Order.push_back(i);
+    uint8_t Free = Nodes[i].Ports & ~Busy;
+    Busy |= Free & -Free;
+    ++Issued;
+    updatePressure(Region[i], true);
+    for (auto &S : Nodes[i].Succs) {
+      Earliest[S.first] = std::max(Earliest[S.first], Cycle + S.second);
+      if (--NumPreds[S.first] == 0)
+        Ready.push_back(S.first);
+    }
+  }
+  return Order;
+}
+
+
+// Return the number of cycles until every instruction has completed, when
+// the instructions are issued strictly in the given order.
+unsigned Scheduler::estimateCycles(const std::vector<unsigned> &Order) const {
+  std::vector<unsigned> Earliest(Region.size(), 0);
+  unsigned Cycle = 0;
+  unsigned Issued = 0;
+  uint8_t  Busy = 0;
+  unsigned Done = 0;
+  for (unsigned i : Order) {
+    const SchedNode &Nd = Nodes[i];
+    if (Earliest[i] > Cycle) {
+      Cycle = Earliest[i];
+      Issued = 0;
+      Busy = 0;
+    }
+    while (Issued == IssueWidth || (Nd.Ports & ~Busy) == 0) {
+      ++Cycle;
+      Issued = 0;
+      Busy = 0;
+    }
+    uint8_t Free = Nd.Ports & ~Busy;
+    Busy |= Free & -Free;
+    ++Issued;
+    Done = std::max(Done, Cycle + Nd.Latency);
+    for (auto &S : Nd.Succs)
+      Earliest[S.first] = std::max(Earliest[S.first], Cycle + S.second);
+  }
+  return Done;
+}
+
+
+// Return the largest number of values which are live between two
+// instructions, when the region is issued in the given order.
+unsigned Scheduler::peakPressure(const std::vector<unsigned> &Order) {
+  resetPressure();
+  unsigned Peak = Current;
+  for (unsigned i : Order) {
+    updatePressure(Region[i], true);
+    Peak = std::max(Peak, Current);
+  }
+  return Peak;
+}
+
+
+void Scheduler::resetPressure() {
+  Current = 0;
+  for (unsigned w = 0; w < Words; ++w)
+    Current += __builtin_popcountll(Live[w]);
+  for (auto &I : Region) {
+    forEachUse(MF, I, [&](uint32_t V) {
+      Remaining[V] = 0;
+      IsLive[V] = test(Live.data(), V);
+    });
+    if (I.Dst != MInstr::NoReg)
+      IsLive[I.Dst] = test(Live.data(), I.Dst);
+  }
+  for (auto &I : Region)
+    forEachUse(MF, I, [&](uint32_t V) { ++Remaining[V]; });
+}
+
+
+// Return the change in the number of live values when I is issued, and if
+// Apply is true, issue it.  A value dies at its last use in the region,
+// unless it is live after the region.
+int Scheduler::updatePressure(const MInstr &I, bool Apply) {
+  // Regions contain no calls, so I reads at most A and B.
+  uint32_t Uses[2] = { I.A, I.B };
+  unsigned Counts[2] = { 1, 1 };
+  if (I.B == I.A) {
+    Uses[1] = MInstr::NoReg;
+    Counts[0] = 2;
+  }
+
+  int Delta = 0;
+  bool DstKilled = false;
+  unsigned DstUses = 0;
+  for (unsigned k = 0; k < 2; ++k) {
+    uint32_t V = Uses[k];
+    if (V == MInstr::NoReg)
+      continue;
+    unsigned Rem = Remaining[V] - Counts[k];
+    if (V == I.Dst)
+      DstUses = Counts[k];
+    if (Apply)
+      Remaining[V] = Rem;
+    if (IsLive[V] && Rem == 0 && !test(LiveAfter.data(), V)) {
+      --Delta;
+      if (V == I.Dst)
+        DstKilled = true;
+      if (Apply)
+        IsLive[V] = 0;
+    }
+  }
+
+  if (I.Dst != MInstr::NoReg) {
+    bool WasLive = IsLive[I.Dst] && !DstKilled;
+    bool Needed = Remaining[I.Dst] - (Apply ? 0 : DstUses) > 0 ||
+                  test(LiveAfter.data(), I.Dst);
+    if (Needed != WasLive) {
+      Delta += Needed ? 1 : -1;
+      if (Apply)
+        IsLive[I.Dst] = Needed;
+    }
+  }
+  if (Apply)
+    Current += Delta;
+  return Delta;
+}
+
+
+}  // end anonymous namespace
+
+
+void scheduleInstructions(MachineFunction &MF, ScheduleStats *Stats) {
+  ScheduleStats S;
+  Scheduler(MF, Stats ? *Stats : S).run();
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
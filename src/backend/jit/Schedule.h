@@ -0,0 +1,75 @@
+//===- Schedule.h ----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A list scheduler for MachineIR, which runs before register allocation.
+//
+// Lowering emits instructions in the order of the TIL expressions, so that
+// long-latency operations such as multiplies are often followed directly
+// by their uses.  The scheduler reorders the instructions in each block to
+// overlap independent work, using a small model of a modern x86-64 core:
+// every opcode has a latency, and a set of execution ports it can issue
+// to, and up to four instructions issue per cycle.
+//
+// Each block is split into regions at calls, which are never moved, and
+// the terminator stays last.  Within a region, a dependence graph is built
+// from the virtual registers that each instruction reads and writes.  A
+// register may have more than one definition (phi nodes are assigned on
+// every incoming edge), so writes are ordered after earlier reads and
+// writes of the same register.  Instructions are then issued cycle by
+// cycle, in order of the longest latency path to the end of the region.
+//
+// Scheduling for latency tends to start many computations at once, which
+// raises register pressure.  The scheduler tracks the number of live
+// values, and once it reaches the number of allocatable registers, prefers
+// instructions that do not increase it.  A new order is only kept if the
+// model predicts that it is faster, and its peak pressure is no higher than
+// that of the original order, or fits in the registers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_SCHEDULE_H
+#define OHMU_BACKEND_JIT_SCHEDULE_H
+
+#include "backend/jit/MachineIR.h"
+
+namespace ohmu {
+namespace jit  {
+
+
+/// Statistics from the instruction scheduler.
+struct ScheduleStats {
+  ScheduleStats()
+      : NumRegions(0), NumReordered(0), NumPressureLimited(0),
+        CyclesBefore(0), CyclesAfter(0) { }
+
+  unsigned NumRegions;           ///< Regions with more than one instruction.
+  unsigned NumReordered;         ///< Regions whose order was changed.
+  unsigned NumPressureLimited;   ///< Faster orders rejected for pressure.
+  unsigned CyclesBefore;         ///< Estimated cycles, summed over regions.
+  unsigned CyclesAfter;
+};
+
+
+/// Reorder the instructions within each block of MF.  If Stats is
+/// non-null, the counts for MF are added to it.
+void scheduleInstructions(MachineFunction &MF, ScheduleStats *Stats = nullptr);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_SCHEDULE_H
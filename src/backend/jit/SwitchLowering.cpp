@@ -0,0 +1,456 @@
+//===- SwitchLowering.cpp --------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "SwitchLowering.h"
+
+#include <algorithm>
+
+namespace ohmu {
+namespace jit  {
+
+namespace {
+
+// A jump table must have at least this many ranges, and this percentage of
+// its entries must be labels.
+const unsigned MinJumpTableRanges = 4;
+const unsigned MinJumpTableDensity = 40;
+const uint64_t MaxJumpTableSize = 4096;
+
+// A bit test cluster spans at most 64 values, and goes to at most three
+// blocks, each of which needs a separate test.
+const uint64_t MaxBitTestSpan = 64;
+const unsigned MaxBitTestTargets = 3;
+
+// Clusters are tested in turn once there are this few of them.
+const unsigned MaxLinearClusters = 3;
+
+
+// Return a mask of the low N bits, where N <= 64.
+uint64_t lowBits(uint64_t N) {
+  return N >= 64 ? ~uint64_t(0) : (uint64_t(1) << N) - 1;
+}
+
+
+/// Consecutive labels with the same target.  Labels are stored as keys,
+/// which are ordered as unsigned integers.
+struct CaseRange {
+  uint64_t Low;
+  uint64_t High;
+  uint32_t Target;
+};
+
+
+enum ClusterKind { CK_Range, CK_JumpTable, CK_BitTest };
+
+/// A set of ranges which is dispatched in a single step.
+struct CaseCluster {
+  ClusterKind Kind;
+  uint64_t    Low;
+  uint64_t    High;
+  unsigned    First;   ///< Ranges[First, Last) are in the cluster.
+  unsigned    Last;
+};
+
+
+class SwitchLowering {
+public:
+  SwitchLowering(MachineFunction &MF, const SwitchInfo &SI, SwitchStats &S)
+      : MF(MF), SI(SI), Stats(S), Default(SI.Default) {
+    SignBit = SI.Signed ? (SI.Size == 4 ? 0x80000000 : uint64_t(1) << 63) : 0;
+    MaxKey  = SI.Size == 4 ? 0xFFFFFFFF : ~uint64_t(0);
+  }
+
+  void lower(unsigned B, bool Clustered);
+
+private:
+  /// Map labels to keys, so that the order of keys as unsigned integers
+  /// is the order of labels, and keys differ by the same amount as labels
+  /// modulo 2^Size.
+  uint64_t key(int64_t V) const {
+    uint64_t K = SI.Size == 4 ? static_cast<uint32_t>(V)
+                              : static_cast<uint64_t>(V);
+    return K ^ SignBit;
+  }
+  int64_t value(uint64_t K) const {
+    K ^= SignBit;
+    return SI.Size == 4 ? static_cast<int32_t>(K) : static_cast<int64_t>(K);
+  }
+
+  unsigned newBlock() {
+    MF.Blocks.emplace_back();
+    return MF.Blocks.size() - 1;
+  }
+  void emit(unsigned B, const MInstr &I) { MF.Blocks[B].Instrs.push_back(I); }
+
+  uint32_t defaultBlock();
+  uint32_t subtract(unsigned B, uint64_t K);
+  void     jump(unsigned B, uint32_t Target);
+  void     branch(unsigned B, MCondCode CC, uint32_t A, int64_t C,
+                  uint32_t Then, uint32_t Else);
+
+  void buildRanges();
+  bool findJumpTable(unsigned First, unsigned *Last);
+  bool findBitTest(unsigned First, unsigned *Last);
+  void buildClusters();
+
+  void lowerTree(unsigned B, unsigned First, unsigned Last,
+                 uint64_t Lo, uint64_t Hi);
+  void lowerCluster(unsigned B, const CaseCluster &C, uint64_t Lo,
+                    uint64_t Hi, uint32_t Fail);
+  void lowerJumpTable(unsigned B, const CaseCluster &C, uint32_t Index);
+  void lowerBitTests(unsigned B, const CaseCluster &C, uint32_t Index);
+  void lowerLinear(unsigned B);
+
+  MachineFunction  &MF;
+  const SwitchInfo &SI;
+  SwitchStats      &Stats;
+  uint32_t          Default;
+  uint64_t          SignBit;
+  uint64_t          MaxKey;
+
+  std::vector<CaseRange>   Ranges;
+  std::vector<CaseCluster> Clusters;
+};
+
+
+uint32_t SwitchLowering::defaultBlock() {
+  if (Default == MInstr::NoReg) {
+    Default = newBlock();
+    emit(Default, MInstr::make(MOP_Trap, 4, MInstr::NoReg));
+  }
+  return Default;
+}
+
+
+// Return a register which holds the value minus the label with key K.
+uint32_t SwitchLowering::subtract(unsigned B, uint64_t K) {
+  int64_t V = value(K);
+  if (V == 0)
+    return SI.Cond;
+  uint32_t R = MF.newVReg();
+  int64_t  NegV = static_cast<int64_t>(0 - static_cast<uint64_t>(V));
+  if (SI.Size == 4 || static_cast<int32_t>(NegV) == NegV) {
+    MInstr I = MInstr::make(MOP_Lea, SI.Size, R, SI.Cond);
+    I.Imm = SI.Size == 4 ? static_cast<int32_t>(NegV) : NegV;
+    emit(B, I);
+    return R;
+  }
+  uint32_t C = MF.newVReg();
+  MInstr Mi = MInstr::make(MOP_MovImm, SI.Size, C);
+  Mi.Imm = V;
+  emit(B, Mi);
+  emit(B, MInstr::make(MOP_Sub, SI.Size, R, SI.Cond, C));
+  return R;
+}
+
+
+void SwitchLowering::jump(unsigned B, uint32_t Target) {
+  MInstr J = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+  J.Target0 = Target;
+  emit(B, J);
+}
+
+
+// Branch on A <CC> C, where C is a constant.
+void SwitchLowering::branch(unsigned B, MCondCode CC, uint32_t A, int64_t C,
+                            uint32_t Then, uint32_t Else) {
+  int64_t V = SI.Size == 4 ? static_cast<int32_t>(C) : C;
+  MInstr I = MInstr::make(MOP_CondBranch, SI.Size, MInstr::NoReg, A);
+  if (static_cast<int32_t>(V) != V) {
+    I.B = MF.newVReg();
+    MInstr Mi = MInstr::make(MOP_MovImm, SI.Size, I.B);
+    Mi.Imm = V;
+    emit(B, Mi);
+  }
+  I.CC = CC;
+  I.Imm = V;
+  I.Target0 = Then;
+  I.Target1 = Else;
+  emit(B, I);
+  ++Stats.NumCompares;
+}
+
+
+void SwitchLowering::buildRanges() {
+  std::vector<CaseRange> Cases;
+  for (auto &C : SI.Cases) {
+    uint64_t K = key(C.Label);
+    Cases.push_back(CaseRange{ K, K, C.Target });
+  }
+  // Keep the first case with each label.
+  std::stable_sort(Cases.begin(), Cases.end(),
+                   [](const CaseRange &X, const CaseRange &Y) {
+    return X.Low < Y.Low;
+  });
+  Cases.erase(std::unique(Cases.begin(), Cases.end(),
+                          [](const CaseRange &X, const CaseRange &Y) {
+    return X.Low == Y.Low;
+  }), Cases.end());
+
+  for (auto &C : Cases) {
+    if (!Ranges.empty() && Ranges.back().High + 1 == C.Low &&
+        Ranges.back().Target == C.Target)
+      Ranges.back().High = C.Low;
+    else
+      Ranges.push_back(C);
+  }
+}
+
+
+// Find the largest jump table that starts with Ranges[First].
+bool SwitchLowering::findJumpTable(unsigned First, unsigned *Last) {
+  uint64_t Low = Ranges[First].Low;
+  unsigned End = First;
+  uint64_t NumLabels = 0;
+  unsigned Best = 0;
+  while (End < Ranges.size() && Ranges[End].High - Low < MaxJumpTableSize) {
+    NumLabels += Ranges[End].High - Ranges[End].Low + 1;
+    ++End;
+    uint64_t Span = Ranges[End - 1].High - Low + 1;
+    if (End - First >= MinJumpTableRanges &&
+        NumLabels * 100 >= Span * MinJumpTableDensity)
+      Best = End;
+  }
+  if (!Best)
+    return false;
+  *Last = Best;
+  return true;
+}
+
+
+// Find the largest set of bit tests that starts with Ranges[First], and
+// which needs fewer branches than comparing each range.
+bool SwitchLowering::findBitTest(unsigned First, unsigned *Last) {
+  uint64_t Low = Ranges[First].Low;
+  std::vector<uint32_t> Targets;
+  unsigned NumCompares = 0;
+  unsigned Best = 0;
+  for (unsigned End = First; End < Ranges.size(); ++End) {
+    const CaseRange &R = Ranges[End];
+    if (R.High - Low >= MaxBitTestSpan)
+      break;
+    if (std::find(Targets.begin(), Targets.end(), R.Target) == Targets.end()) {
+      if (Targets.size() == MaxBitTestTargets)
+        break;
+      Targets.push_back(R.Target);
+    }
+    NumCompares += R.Low == R.High ? 1 : 2;
+    // A bit test cluster needs a range check, and one test per target.
+    if (NumCompares >= 2 * Targets.size() + 1)
+      Best = End + 1;
+  }
+  if (!Best)
+    return false;
+  *Last = Best;
+  return true;
+}
+
+
+void SwitchLowering::buildClusters() {
+  unsigned i = 0;
+  while (i < Ranges.size()) {
+    // Take whichever covers more ranges.  Bit tests avoid an indirect jump,
+    // so they win a tie.
+    unsigned TableLast = 0, BitsLast = 0, Last;
+    bool IsTable = findJumpTable(i, &TableLast);
+    bool IsBits  = findBitTest(i, &BitsLast);
+    if (IsBits && BitsLast >= TableLast) {
+      Last = BitsLast;
+      Clusters.push_back(CaseCluster{ CK_BitTest, Ranges[i].Low,
+                                      Ranges[Last - 1].High, i, Last });
+      ++Stats.NumBitTests;
+    }
+    else if (IsTable) {
+      Last = TableLast;
+      Clusters.push_back(CaseCluster{ CK_JumpTable, Ranges[i].Low,
+                                      Ranges[Last - 1].High, i, Last });
+      ++Stats.NumJumpTables;
+    }
+    else {
+      Last = i + 1;
+      Clusters.push_back(CaseCluster{ CK_Range, Ranges[i].Low,
+                                      Ranges[i].High, i, Last });
+    }
+    i = Last;
+  }
+}
+
+
+// Search Clusters[First, Last), given that the value is in [Lo, Hi].
+void SwitchLowering::lowerTree(unsigned B, unsigned First, unsigned Last,
+                               uint64_t Lo, uint64_t Hi) {
+  if (Last - First > MaxLinearClusters) {
+    unsigned Mid = First + (Last - First) / 2;
+    uint64_t Pivot = Clusters[Mid].Low;
+    unsigned Left  = newBlock();
+    unsigned Right = newBlock();
+    branch(B, SI.Signed ? MCC_LT : MCC_ULT, SI.Cond, value(Pivot),
+           Left, Right);
+    lowerTree(Left, First, Mid, Lo, Pivot - 1);
+    lowerTree(Right, Mid, Last, Pivot, Hi);
+    return;
+  }
+
+  for (unsigned i = First; i < Last; ++i) {
+    const CaseCluster &C = Clusters[i];
+    if (C.Low <= Lo && C.High >= Hi) {
+      // Every remaining value is in the cluster.
+      lowerCluster(B, C, Lo, Hi, MInstr::NoReg);
+      return;
+    }
+    uint32_t Fail = i + 1 < Last ? newBlock() : defaultBlock();
+    lowerCluster(B, C, Lo, Hi, Fail);
+    // Values which fail the test are outside of the cluster.
+    if (C.Low <= Lo && C.High < Hi)
+      Lo = C.High + 1;
+    else if (C.High >= Hi && C.Low > Lo)
+      Hi = C.Low - 1;
+    B = Fail;
+  }
+}
+
+
+// Test cluster C in block B, and go to Fail if the value is outside of it,
+// which is only needed if C does not cover [Lo, Hi].
+void SwitchLowering::lowerCluster(unsigned B, const CaseCluster &C,
+                                  uint64_t Lo, uint64_t Hi, uint32_t Fail) {
+  bool Inside = C.Low <= Lo && C.High >= Hi;
+  if (C.Kind == CK_Range) {
+    uint32_t Target = Ranges[C.First].Target;
+    MCondCode LE = SI.Signed ? MCC_LE : MCC_ULE;
+    MCondCode GE = SI.Signed ? MCC_GE : MCC_UGE;
+    if (Inside)
+      jump(B, Target);
+    else if (C.Low == C.High)
+      branch(B, MCC_EQ, SI.Cond, value(C.Low), Target, Fail);
+    else if (C.Low <= Lo)
+      branch(B, LE, SI.Cond, value(C.High), Target, Fail);
+    else if (C.High >= Hi)
+      branch(B, GE, SI.Cond, value(C.Low), Target, Fail);
+    else
+      branch(B, MCC_ULE, subtract(B, C.Low), C.High - C.Low, Target, Fail);
+    return;
+  }
+
+  uint32_t Index = subtract(B, C.Low);
+  if (!Inside) {
+    // A single unsigned compare checks both ends of the cluster.
+    unsigned In = newBlock();
+    branch(B, MCC_UGT, Index, C.High - C.Low, Fail, In);
+    B = In;
+  }
+  if (C.Kind == CK_JumpTable)
+    lowerJumpTable(B, C, Index);
+  else
+    lowerBitTests(B, C, Index);
+}
+
+
+void SwitchLowering::lowerJumpTable(unsigned B, const CaseCluster &C,
+                                    uint32_t Index) {
+  std::vector<uint32_t> Table;
+  for (unsigned i = C.First; i < C.Last; ++i) {
+    const CaseRange &R = Ranges[i];
+    while (C.Low + Table.size() < R.Low)
+      Table.push_back(defaultBlock());
+    Table.resize(R.High - C.Low + 1, R.Target);
+  }
+  emit(B, MInstr::make(MOP_JumpTable, SI.Size, MInstr::NoReg, Index));
+  MF.Blocks[B].JumpTable = std::move(Table);
+}
+
+
+void SwitchLowering::lowerBitTests(unsigned B, const CaseCluster &C,
+                                   uint32_t Index) {
+  std::vector<std::pair<uint64_t, uint32_t>> Masks;   // Mask, target
+  uint64_t All = 0;
+  for (unsigned i = C.First; i < C.Last; ++i) {
+    const CaseRange &R = Ranges[i];
+    uint64_t Bits = lowBits(R.High - R.Low + 1) << (R.Low - C.Low);
+    auto It = std::find_if(Masks.begin(), Masks.end(),
+                           [&](const std::pair<uint64_t, uint32_t> &M) {
+      return M.second == R.Target;
+    });
+    if (It == Masks.end())
+      Masks.emplace_back(Bits, R.Target);
+    else
+      It->first |= Bits;
+    All |= Bits;
+  }
+  // Test the targets with the most labels first.
+  std::stable_sort(Masks.begin(), Masks.end(),
+                   [](const std::pair<uint64_t, uint32_t> &X,
+                      const std::pair<uint64_t, uint32_t> &Y) {
+    return __builtin_popcountll(X.first) > __builtin_popcountll(Y.first);
+  });
+
+  uint64_t Full = lowBits(C.High - C.Low + 1);
+  for (unsigned i = 0; i < Masks.size(); ++i) {
+    bool IsLast = i + 1 == Masks.size();
+    if (IsLast && All == Full) {
+      // Every value in the cluster goes to the last target.
+      jump(B, Masks[i].second);
+      return;
+    }
+    uint32_t Next = IsLast ? defaultBlock() : newBlock();
+    MInstr I = MInstr::make(MOP_BitTest, SI.Size, MInstr::NoReg, Index);
+    I.Imm = static_cast<int64_t>(Masks[i].first);
+    I.Target0 = Masks[i].second;
+    I.Target1 = Next;
+    emit(B, I);
+    B = Next;
+  }
+}
+
+
+// Compare the value with each label in turn.
+void SwitchLowering::lowerLinear(unsigned B) {
+  for (unsigned i = 0; i < SI.Cases.size(); ++i) {
+    uint32_t Next = i + 1 < SI.Cases.size() ? newBlock() : defaultBlock();
+    branch(B, MCC_EQ, SI.Cond, SI.Cases[i].Label, SI.Cases[i].Target, Next);
+    B = Next;
+  }
+}
+
+
+void SwitchLowering::lower(unsigned B, bool Clustered) {
+  ++Stats.NumSwitches;
+  if (SI.Cases.empty()) {
+    jump(B, defaultBlock());
+    return;
+  }
+  if (!Clustered) {
+    lowerLinear(B);
+    return;
+  }
+  buildRanges();
+  buildClusters();
+  lowerTree(B, 0, Clusters.size(), 0, MaxKey);
+}
+
+}  // end anonymous namespace
+
+
+void lowerSwitch(MachineFunction &MF, unsigned B, const SwitchInfo &SI,
+                 bool Clustered, SwitchStats *Stats) {
+  SwitchStats S;
+  SwitchLowering(MF, SI, Stats ? *Stats : S).lower(B, Clustered);
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
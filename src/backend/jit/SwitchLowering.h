@@ -0,0 +1,90 @@
+//===- SwitchLowering.h ----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Lowers switch terminators to MachineIR.
+//
+// The cases of a switch are sorted by label, and consecutive labels with
+// the same target are merged into ranges.  The ranges are then grouped
+// into clusters, each of which is dispatched in a single step:
+//
+//  - A run of at least four ranges whose labels are dense enough becomes a
+//    jump table: the lowest label is subtracted from the value, which then
+//    indexes a table of block offsets.
+//  - A run of ranges which spans fewer than 64 values, and goes to at most
+//    three blocks, becomes a sequence of bit tests: the lowest label is
+//    subtracted from the value, and a mask of the labels for each target
+//    is tested with bt.
+//  - Any other range is compared directly.
+//
+// The clusters are searched with a balanced binary tree of compares, until
+// only a few are left, which are tested in turn.  Each node of the tree
+// knows the bounds of the value, so that checks which are implied by
+// earlier compares are left out.  Values which match no label go to the
+// default block, or trap if there is none.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_SWITCHLOWERING_H
+#define OHMU_BACKEND_JIT_SWITCHLOWERING_H
+
+#include "backend/jit/MachineIR.h"
+
+namespace ohmu {
+namespace jit  {
+
+
+/// A single case of a switch.
+struct SwitchCase {
+  int64_t  Label;
+  uint32_t Target;    ///< Block index.
+};
+
+
+/// A switch to be lowered.  If more than one case has the same label, the
+/// first one is taken.
+struct SwitchInfo {
+  uint32_t Cond;                   ///< Virtual register to switch on.
+  uint8_t  Size;                   ///< Size of Cond in bytes.
+  bool     Signed;                 ///< Labels are signed integers.
+  uint32_t Default;                ///< Default block, or NoReg to trap.
+  std::vector<SwitchCase> Cases;
+};
+
+
+/// Statistics from switch lowering.
+struct SwitchStats {
+  SwitchStats()
+      : NumSwitches(0), NumJumpTables(0), NumBitTests(0), NumCompares(0) { }
+
+  unsigned NumSwitches;
+  unsigned NumJumpTables;
+  unsigned NumBitTests;     ///< Bit test clusters.
+  unsigned NumCompares;     ///< Conditional branches on the value.
+};
+
+
+/// Lower the switch SI, which terminates block B of MF.  New blocks are
+/// added to the end of MF.  If Clustered is false, each case is simply
+/// compared in turn.  If Stats is non-null, the counts are added to it.
+void lowerSwitch(MachineFunction &MF, unsigned B, const SwitchInfo &SI,
+                 bool Clustered = true, SwitchStats *Stats = nullptr);
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_SWITCHLOWERING_H
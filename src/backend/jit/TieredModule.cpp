@@ -0,0 +1,151 @@
+//===- TieredModule.cpp ----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "backend/jit/TieredModule.h"
+
+namespace ohmu {
+namespace jit  {
+
+
+TieredModule::TieredModule(MemRegionRef A, uint32_t Threshold, bool Bg)
+    : Interp(A), Background(Bg), NumNative(0), Busy(false), Stopping(false) {
+  Interp.setHotFunctionHandler(Threshold, &TieredModule::onHotFunction, this);
+}
+
+
+TieredModule::~TieredModule() {
+  if (!Compiler.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stopping = true;
+  }
+  Ready.notify_one();
+  Compiler.join();
+}
+
+
+unsigned TieredModule::compileModule(SExpr *Module) {
+  unsigned NumCompiled = Interp.compileModule(Module);
+  if (!JITModule::isSupported())
+    return NumCompiled;
+
+  Jit.declareModule(Module);
+  auto &Fns = Interp.functions();
+  for (unsigned i = 0; i < Fns.size(); ++i) {
+    NativeStub *S = new NativeStub();
+    S->Invoke = &TieredModule::invokeNative;
+    S->Jit = &Jit;
+    S->Fn  = Jit.findFunction(Fns[i]->Name);
+    for (auto &Bt : Fns[i]->ParamTypes)
+      S->ArgTypes.push_back(Interpreter::getVMType(Bt));
+    Stubs.emplace_back(S);
+    StubIndex[Fns[i].get()] = i;
+  }
+
+  if (Background)
+    Compiler = std::thread(&TieredModule::compilerLoop, this);
+  return NumCompiled;
+}
+
+
+bool TieredModule::invokeNative(VMNativeCode *Code, const VMValue *Args,
+                                VMValue *Result) {
+  auto *S = static_cast<NativeStub*>(Code);
+  JITFunction *F = S->Fn;
+
+  // The JIT only supports booleans and 32 and 64-bit integers.
+  int64_t NArgs[JITModule::MaxParams];
+  for (unsigned i = 0; i < F->NumParams; ++i) {
+    switch (S->ArgTypes[i]) {
+      case VT_I32:  NArgs[i] = Args[i].I32;  break;
+      case VT_U32:  NArgs[i] = Args[i].U32;  break;
+      case VT_Bool: NArgs[i] = Args[i].Bool; break;
+      default:      NArgs[i] = Args[i].I64;  break;
+    }
+  }
+  // Results are already extended to 64 bits, so the low-order bytes hold
+  // the value for every type.
+  return S->Jit->run(F, NArgs, &Result->I64);
+}
+
+
+void TieredModule::onHotFunction(void *Data, VMFunction *F) {
+  auto *M = static_cast<TieredModule*>(Data);
+  auto It = M->StubIndex.find(F);
+  if (It == M->StubIndex.end() || !M->Stubs[It->second]->Fn)
+    return;
+
+  if (!M->Background) {
+    M->compile(It->second);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> Lock(M->Mutex);
+    M->Queue.push_back(It->second);
+  }
+  M->Ready.notify_one();
+}
+
+
+void TieredModule::compile(unsigned Index) {
+  if (!Jit.compileFunction(Stubs[Index]->Fn))
+    return;
+
+  // Patch the entry of every function that was compiled, including any
+  // callees which were compiled along with this one.
+  auto &Fns = Interp.functions();
+  for (unsigned i = 0; i < Fns.size(); ++i) {
+    NativeStub *S = Stubs[i].get();
+    if (!S->Fn || !S->Fn->Compiled ||
+        Fns[i]->Native.load(std::memory_order_relaxed))
+      continue;
+    Interpreter::installNativeCode(Fns[i].get(), S);
+    ++NumNative;
+  }
+}
+
+
+void TieredModule::compilerLoop() {
+  std::unique_lock<std::mutex> Lock(Mutex);
+  while (true) {
+    Ready.wait(Lock, [this]() { return Stopping || !Queue.empty(); });
+    if (Stopping)
+      return;
+    unsigned Index = Queue.front();
+    Queue.pop_front();
+    Busy = true;
+    Lock.unlock();
+    compile(Index);
+    Lock.lock();
+    Busy = false;
+    if (Queue.empty())
+      Idle.notify_all();
+  }
+}
+
+
+void TieredModule::waitForCompiles() {
+  if (!Background)
+    return;
+  std::unique_lock<std::mutex> Lock(Mutex);
+  Idle.wait(Lock, [this]() { return Queue.empty() && !Busy; });
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
@@ -0,0 +1,123 @@
+//===- TieredModule.h ------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A tiered runtime for lowered modules.
+//
+// Every function starts out on the Interpreter, which is cheap to compile
+// for.  When the number of calls plus loop back edges of a function reaches
+// a threshold, the function is queued for the JIT, which compiles it on a
+// background thread.  When compilation finishes, the function's entry in the
+// interpreter is patched, so that further calls run the native code.
+// Functions which the JIT cannot compile stay on the interpreter.
+//
+// Execution never waits for the JIT.  A call which is already running in the
+// interpreter finishes there; there is no on-stack replacement.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_TIEREDMODULE_H
+#define OHMU_BACKEND_JIT_TIEREDMODULE_H
+
+#include "backend/jit/JIT.h"
+#include "til/Interpreter.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace ohmu {
+namespace jit  {
+
+
+class TieredModule {
+public:
+  /// The default number of calls plus back edges before a function is
+  /// compiled.
+  static const uint32_t DefaultThreshold = 1000;
+
+  /// Allocations made by interpreted code are taken from A.  If Background
+  /// is false, hot functions are compiled immediately, on the thread which
+  /// is running the interpreter.
+  TieredModule(MemRegionRef A, uint32_t Threshold = DefaultThreshold,
+               bool Background = true);
+  ~TieredModule();
+
+  TieredModule(const TieredModule&) = delete;
+  void operator=(const TieredModule&) = delete;
+
+  /// Compile every function in Module for the interpreter, and prepare them
+  /// for the JIT.  Returns the number of functions that can be run.
+  unsigned compileModule(SExpr *Module);
+
+  /// Return the function with the given name, or null if there is none.
+  VMFunction* findFunction(StringRef Name) {
+    return Interp.findFunction(Name);
+  }
+
+  /// Call F with the given arguments.  Returns false on a runtime error.
+  bool run(VMFunction *F, const VMValue *Args, VMValue *Result) {
+    return Interp.run(F, Args, Result);
+  }
+
+  /// Block until every function that has been queued has been compiled.
+  void waitForCompiles();
+
+  /// Return the number of functions which are running native code.
+  unsigned numNative() const { return NumNative; }
+
+  Interpreter& interpreter() { return Interp; }
+  JITModule&   jit()         { return Jit; }
+
+private:
+  /// The native entry point for a function.
+  struct NativeStub : public VMNativeCode {
+    JITModule*          Jit;
+    JITFunction*        Fn;
+    std::vector<VMType> ArgTypes;
+  };
+
+  static bool invokeNative(VMNativeCode *Code, const VMValue *Args,
+                           VMValue *Result);
+  static void onHotFunction(void *Data, VMFunction *F);
+
+  void compile(unsigned Index);
+  void compilerLoop();
+
+  Interpreter Interp;
+  JITModule   Jit;
+  bool        Background;
+
+  /// Indexed by the function's position in Interp.functions().
+  std::vector<std::unique_ptr<NativeStub>> Stubs;
+  std::unordered_map<VMFunction*, unsigned> StubIndex;
+  std::atomic<unsigned> NumNative;
+
+  std::thread             Compiler;
+  std::mutex              Mutex;
+  std::condition_variable Ready;     ///< Signalled when work is queued.
+  std::condition_variable Idle;      ///< Signalled when the queue empties.
+  std::deque<unsigned>    Queue;
+  bool                    Busy;
+  bool                    Stopping;
+};
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_TIEREDMODULE_H
@@ -0,0 +1,489 @@
+//===- X64Emitter.cpp ------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "X64Emitter.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace ohmu {
+namespace jit  {
+
+
+const unsigned X64Emitter::NoLabel;
+
+
+Instr X64Emitter::makeInstr(uint8_t Opcode, unsigned Size) {
+  Instr I(0, 0, 0);
+  I.opcode = Opcode;
+  if (Size == 8) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+    I.w = 1;
+  }
+  return I;
+}
+
+
+void X64Emitter::setRegs(Instr &I, unsigned Reg, unsigned Rm) {
+  I.has_modrm = 1;
+  I.mod = 3;
+  I.reg = Reg & 7;
+  I.rm  = Rm & 7;
+  if (Reg >= 8 || Rm >= 8) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+    I.r = Reg >> 3;
+    I.b = Rm >> 3;
+  }
+}
+
+
+void X64Emitter::setMem(Instr &I, unsigned Reg, X64Reg Base, int32_t Disp) {
+  I.has_modrm = 1;
+  I.mod = 0;        // The encoder picks the displacement size.
+  I.reg = Reg & 7;
+  I.rm  = Base & 7;
+  I.disp32 = Disp;
+  if (Reg >= 8 || Base >= 8) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+    I.r = Reg >> 3;
+    I.b = Base >> 3;
+  }
+  // RSP and R12 can only be used as a base with a SIB byte.
+  if ((Base & 7) == RSP) {
+    I.has_sib = 1;
+    I.base = RSP;
+    I.index = RSP;    // No index.
+  }
+  // RBP and R13 with no displacement would mean RIP-relative.
+  if ((Base & 7) == RBP)
+    I.force_disp = 1;
+}
+
+
+// Add a scaled index register to a memory operand made by setMem.  The
+// base register moves from the modrm byte to the SIB byte.
+void X64Emitter::setIndex(Instr &I, X64Reg Index, unsigned Scale) {
+  I.has_sib = 1;
+  I.base = I.rm;
+  I.rm = RSP;       // A SIB byte follows.
+  I.index = Index & 7;
+  I.scale = Scale;
+  if (Index >= 8) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+    I.x = 1;
+  }
+}
+
+
+void X64Emitter::push(X64Reg R) {
+  Instr I = makeInstr(0x50 | (R & 7), 4);
+  if (R >= 8) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+    I.b = 1;
+  }
+  emit(I);
+}
+
+
+void X64Emitter::pop(X64Reg R) {
+  Instr I = makeInstr(0x58 | (R & 7), 4);
+  if (R >= 8) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+    I.b = 1;
+  }
+  emit(I);
+}
+
+
+void X64Emitter::ret() {
+  emit(makeInstr(0xC3, 4));
+}
+
+
+void X64Emitter::movRR(X64Reg Dst, X64Reg Src, unsigned Size) {
+  Instr I = makeInstr(0x89, Size);
+  setRegs(I, Src, Dst);
+  emit(I);
+}
+
+
+void X64Emitter::load(X64Reg Dst, X64Reg Base, int32_t Disp, unsigned Size) {
+  Instr I = makeInstr(0x8B, Size);
+  setMem(I, Dst, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::store(X64Reg Base, int32_t Disp, X64Reg Src, unsigned Size) {
+  Instr I = makeInstr(0x89, Size);
+  setMem(I, Src, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::storeImm(X64Reg Base, int32_t Disp, int32_t Imm,
+                          unsigned Size) {
+  Instr I = makeInstr(0xC7, Size);
+  setMem(I, 0, Base, Disp);
+  I.has_imm = 1;
+  I.imm_size = 2;
+  I.imm32 = Imm;
+  emit(I);
+}
+
+
+void X64Emitter::movImm64(X64Reg Dst, uint64_t Imm) {
+  Instr I = makeInstr(0xB8 | (Dst & 7), 8);
+  I.b = Dst >> 3;
+  I.has_imm = 1;
+  I.imm_size = 3;
+  // A 64-bit immediate is stored across the imm32 and disp32 fields.
+  I.imm32  = static_cast<int32_t>(Imm & 0xFFFFFFFF);
+  I.disp32 = static_cast<int32_t>(Imm >> 32);
+  emit(I);
+}
+
+
+void X64Emitter::movAddress(X64Reg Dst, uint64_t Addr, unsigned Symbol) {
+  Addresses.push_back(std::make_pair(Code.size(), Symbol));
+  movImm64(Dst, Addr);
+}
+
+
+void X64Emitter::movImm(X64Reg Dst, int64_t Imm, unsigned Size) {
+  if (Size == 8 && static_cast<int32_t>(Imm) != Imm) {
+    movImm64(Dst, static_cast<uint64_t>(Imm));
+    return;
+  }
+  if (Size == 4 || (Imm >= 0 && Imm <= 0xFFFFFFFF)) {
+    // mov r32, imm32 zero extends to 64 bits.
+    Instr I = makeInstr(0xB8 | (Dst & 7), 4);
+    if (Dst >= 8) {
+      I.use_rex = 1;
+      I.rex_1 = 1;
+      I.b = 1;
+    }
+    I.has_imm = 1;
+    I.imm_size = 2;
+    I.imm32 = static_cast<int32_t>(Imm);
+    emit(I);
+    return;
+  }
+  // mov r/m64, imm32 sign extends to 64 bits.
+  Instr I = makeInstr(0xC7, 8);
+  setRegs(I, 0, Dst);
+  I.has_imm = 1;
+  I.imm_size = 2;
+  I.imm32 = static_cast<int32_t>(Imm);
+  emit(I);
+}
+
+
+void X64Emitter::aluRM(X64AluOp Op, X64Reg Dst, X64Reg Base, int32_t Disp,
+                       unsigned Size) {
+  Instr I = makeInstr(Op, Size);
+  setMem(I, Dst, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::aluRR(X64AluOp Op, X64Reg Dst, X64Reg Src, unsigned Size) {
+  Instr I = makeInstr(Op, Size);
+  setRegs(I, Dst, Src);
+  emit(I);
+}
+
+
+void X64Emitter::aluRI(X64AluOp Op, X64Reg Dst, int32_t Imm, unsigned Size) {
+  // The immediate forms encode the operation in the reg field of modrm.
+  bool Short = static_cast<int8_t>(Imm) == Imm;
+  Instr I = makeInstr(Short ? 0x83 : 0x81, Size);
+  setRegs(I, Op >> 3, Dst);
+  I.has_imm = 1;
+  I.imm_size = Short ? 0 : 2;
+  I.imm32 = Imm;
+  emit(I);
+}
+
+
+void X64Emitter::imulRM(X64Reg Dst, X64Reg Base, int32_t Disp,
+                        unsigned Size) {
+  Instr I = makeInstr(0xAF, Size);
+  I.code_map = 1;
+  setMem(I, Dst, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::imulRR(X64Reg Dst, X64Reg Src, unsigned Size) {
+  Instr I = makeInstr(0xAF, Size);
+  I.code_map = 1;
+  setRegs(I, Dst, Src);
+  emit(I);
+}
+
+
+void X64Emitter::testRR(X64Reg A, X64Reg B, unsigned Size) {
+  Instr I = makeInstr(0x85, Size);
+  setRegs(I, B, A);
+  emit(I);
+}
+
+
+void X64Emitter::lea(X64Reg Dst, X64Reg Base, int32_t Disp, unsigned Size) {
+  Instr I = makeInstr(0x8D, Size);
+  setMem(I, Dst, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::leaIndex(X64Reg Dst, X64Reg Base, X64Reg Index,
+                          unsigned Scale, int32_t Disp, unsigned Size) {
+  Instr I = makeInstr(0x8D, Size);
+  setMem(I, Dst, Base, Disp);
+  setIndex(I, Index, Scale);
+  emit(I);
+}
+
+
+void X64Emitter::leaScaled(X64Reg Dst, X64Reg Index, unsigned Scale,
+                           int32_t Disp, unsigned Size) {
+  // A base of RBP with mod 0 means no base, and a 32-bit displacement.
+  Instr I = makeInstr(0x8D, Size);
+  setMem(I, Dst, RBP, Disp);
+  I.fixed_base = 1;
+  setIndex(I, Index, Scale);
+  emit(I);
+}
+
+
+void X64Emitter::leaLabel(X64Reg Dst, unsigned L) {
+  // A base of RBP with mod 0 and no SIB byte means RIP-relative, and the
+  // displacement is patched like that of a jump.
+  Instr I = makeInstr(0x8D, 8);
+  setMem(I, Dst, RBP, 0);
+  I.fixed_base = 1;
+  emit(I, L);
+}
+
+
+void X64Emitter::neg(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xF7, Size);
+  setRegs(I, 3, R);
+  emit(I);
+}
+
+
+void X64Emitter::bitNot(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xF7, Size);
+  setRegs(I, 2, R);
+  emit(I);
+}
+
+
+void X64Emitter::incMem(X64Reg Base, int32_t Disp, unsigned Size) {
+  Instr I = makeInstr(0xFF, Size);
+  setMem(I, 0, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::shlCL(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xD3, Size);
+  setRegs(I, 4, R);
+  emit(I);
+}
+
+
+void X64Emitter::shrCL(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xD3, Size);
+  setRegs(I, 5, R);
+  emit(I);
+}
+
+
+void X64Emitter::sarCL(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xD3, Size);
+  setRegs(I, 7, R);
+  emit(I);
+}
+
+
+void X64Emitter::signExtendAX(unsigned Size) {
+  emit(makeInstr(0x99, Size));
+}
+
+
+void X64Emitter::idiv(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xF7, Size);
+  setRegs(I, 7, R);
+  emit(I);
+}
+
+
+void X64Emitter::div(X64Reg R, unsigned Size) {
+  Instr I = makeInstr(0xF7, Size);
+  setRegs(I, 6, R);
+  emit(I);
+}
+
+
+void X64Emitter::movsxd(X64Reg Dst, X64Reg Base, int32_t Disp) {
+  Instr I = makeInstr(0x63, 8);
+  setMem(I, Dst, Base, Disp);
+  emit(I);
+}
+
+
+void X64Emitter::movsxdRR(X64Reg Dst, X64Reg Src) {
+  Instr I = makeInstr(0x63, 8);
+  setRegs(I, Dst, Src);
+  emit(I);
+}
+
+
+void X64Emitter::movsxdIndex(X64Reg Dst, X64Reg Base, X64Reg Index,
+                             unsigned Scale) {
+  Instr I = makeInstr(0x63, 8);
+  setMem(I, Dst, Base, 0);
+  setIndex(I, Index, Scale);
+  emit(I);
+}
+
+
+void X64Emitter::setcc(X64Cond C, X64Reg R) {
+  // SPL, BPL, SIL, and DIL need a REX prefix to be used as byte registers.
+  Instr I = makeInstr(0x90 | C, 4);
+  I.code_map = 1;
+  setRegs(I, 0, R);
+  if (R >= 4) {
+    I.use_rex = 1;
+    I.rex_1 = 1;
+  }
+  emit(I);
+
+  // movzx R32, R8
+  Instr Z = makeInstr(0xB6, 4);
+  Z.code_map = 1;
+  setRegs(Z, R, R);
+  if (R >= 4) {
+    Z.use_rex = 1;
+    Z.rex_1 = 1;
+  }
+  emit(Z);
+}
+
+
+void X64Emitter::btRR(X64Reg R, X64Reg Bit, unsigned Size) {
+  Instr I = makeInstr(0xA3, Size);
+  I.code_map = 1;
+  setRegs(I, Bit, R);
+  emit(I);
+}
+
+
+void X64Emitter::jmp(unsigned Label) {
+  Instr I = makeInstr(0xE9, 4);
+  I.has_imm = 1;
+  I.imm_size = 2;
+  emit(I, Label);
+}
+
+
+void X64Emitter::jcc(X64Cond C, unsigned Label) {
+  Instr I = makeInstr(0x80 | C, 4);
+  I.code_map = 1;
+  I.has_imm = 1;
+  I.imm_size = 2;
+  emit(I, Label);
+}
+
+
+void X64Emitter::jmpIndirect(X64Reg R) {
+  Instr I = makeInstr(0xFF, 4);
+  setRegs(I, 4, R);
+  emit(I);
+}
+
+
+void X64Emitter::callIndirect(X64Reg R) {
+  Instr I = makeInstr(0xFF, 4);
+  setMem(I, 2, R, 0);
+  emit(I);
+}
+
+
+void X64Emitter::offsetWord(unsigned L, unsigned Base) {
+  // Raw data is recorded as an invalid instruction with an immediate.
+  Instr I = makeInstr(0, 4);
+  I.invalid = 1;
+  I.imm_payload = 1;
+  I.has_imm = 1;
+  I.imm_size = 2;
+  Offsets.push_back(LabelOffset{ Code.size(), L, Base });
+  emit(I);
+}
+
+
+void X64Emitter::encode(std::vector<uint8_t> &Out,
+                        std::vector<Relocation> *Relocs) const {
+  // Jumps always use a 32-bit displacement, so the size of each instruction
+  // does not depend on the displacement.  Encode everything in one batch,
+  // then patch the displacements, which are the last four bytes of each
+  // jump, or RIP-relative lea.
+  size_t Start = Out.size();
+  Out.resize(Start + Code.size() * Instr::MAX_SIZE + Instr::ENCODE_SLACK);
+  std::vector<unsigned> Ends(Code.size());
+  Instr::byte *Base = &Out[Start];
+  Instr::byte *End = Instr::encodeAll(Code.data(), Code.size(), Base,
+                                      Ends.data());
+
+  auto Offset = [&](unsigned L) -> int32_t {
+    unsigned Target = LabelPos[L];
+    assert(Target != NoLabel && "Jump to unbound label.");
+    return Target == 0 ? 0 : Ends[Target - 1];
+  };
+  for (size_t i = 0, n = Code.size(); i < n; ++i) {
+    if (JumpLabels[i] == NoLabel)
+      continue;
+    assert((Code[i].has_imm && Code[i].imm_size == 2) ||
+           (!Code[i].has_imm && Code[i].fixed_base));
+    int32_t Disp = Offset(JumpLabels[i]) -
+                   static_cast<int32_t>(Ends[i]);
+    memcpy(Base + Ends[i] - 4, &Disp, 4);
+  }
+  for (auto &O : Offsets) {
+    int32_t Disp = Offset(O.Label) - Offset(O.Base);
+    memcpy(Base + Ends[O.Index] - 4, &Disp, 4);
+  }
+  // The address is the last eight bytes of a movabs.
+  if (Relocs) {
+    for (auto &A : Addresses)
+      Relocs->push_back(Relocation{ Ends[A.first] - 8, A.second });
+  }
+  Out.resize(Start + (End - Base));
+}
+
+
+}  // end namespace jit
+}  // end namespace ohmu
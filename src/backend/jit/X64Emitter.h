@@ -0,0 +1,201 @@
+//===- X64Emitter.h --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A small x86-64 assembler.  Instructions are recorded in the fixed-width
+// format defined in x64builder/instr.h, and are encoded to bytes only once
+// the whole function has been emitted, when the targets of all jumps are
+// known.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_JIT_X64EMITTER_H
+#define OHMU_BACKEND_JIT_X64EMITTER_H
+
+#include "backend/x64builder/instr.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace ohmu {
+namespace jit  {
+
+
+/// x86-64 general purpose registers, in encoding order.
+enum X64Reg : uint8_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8,  R9,  R10, R11, R12, R13, R14, R15
+};
+
+
+/// x86-64 condition codes, in encoding order.
+enum X64Cond : uint8_t {
+  X64_O, X64_NO, X64_B,  X64_AE, X64_E,  X64_NE, X64_BE, X64_A,
+  X64_S, X64_NS, X64_P,  X64_NP, X64_L,  X64_GE, X64_LE, X64_G
+};
+
+
+/// Opcodes for the two-operand ALU instructions, in the "reg, r/m" form.
+enum X64AluOp : uint8_t {
+  X64_ADD = 0x03,
+  X64_OR  = 0x0B,
+  X64_AND = 0x23,
+  X64_SUB = 0x2B,
+  X64_XOR = 0x33,
+  X64_CMP = 0x3B
+};
+
+
+/// Records x86-64 instructions, and encodes them to machine code.
+/// Size arguments are the operand size in bytes, either 4 or 8.
+class X64Emitter {
+public:
+  static const unsigned NoLabel = 0xFFFFFFFF;
+
+  /// An absolute address in the encoded code, which must be patched if the
+  /// code is loaded into another process.
+  struct Relocation {
+    uint32_t Offset;   ///< Offset of the 64-bit address from the start.
+    unsigned Symbol;   ///< The symbol passed to movAddress().
+  };
+
+  /// Create a new label, which must be bound before encode() is called.
+  unsigned newLabel() {
+    LabelPos.push_back(NoLabel);
+    return LabelPos.size() - 1;
+  }
+
+  /// Bind label L to the next instruction.
+  void bind(unsigned L) { LabelPos[L] = Code.size(); }
+
+  /// Return the number of recorded instructions.
+  size_t numInstrs() const { return Code.size(); }
+
+  /// Return the recorded instructions.  The displacements of jumps are not
+  /// filled in until encode() is called.
+  const std::vector<Instr>& instrs() const { return Code; }
+
+  void push(X64Reg R);
+  void pop(X64Reg R);
+  void ret();
+
+  void movRR(X64Reg Dst, X64Reg Src, unsigned Size);
+  void load(X64Reg Dst, X64Reg Base, int32_t Disp, unsigned Size);
+  void store(X64Reg Base, int32_t Disp, X64Reg Src, unsigned Size);
+  void storeImm(X64Reg Base, int32_t Disp, int32_t Imm, unsigned Size);
+  void movImm64(X64Reg Dst, uint64_t Imm);
+  /// Dst = Addr, which is the address of a symbol chosen by the caller, and
+  /// is reported as a relocation by encode().
+  void movAddress(X64Reg Dst, uint64_t Addr, unsigned Symbol);
+  /// Dst = Imm, using the shortest encoding for the operand size.
+  void movImm(X64Reg Dst, int64_t Imm, unsigned Size);
+
+  /// Dst = Dst <Op> [Base + Disp]
+  void aluRM(X64AluOp Op, X64Reg Dst, X64Reg Base, int32_t Disp,
+             unsigned Size);
+  /// Dst = Dst <Op> Src
+  void aluRR(X64AluOp Op, X64Reg Dst, X64Reg Src, unsigned Size);
+  /// Dst = Dst <Op> Imm
+  void aluRI(X64AluOp Op, X64Reg Dst, int32_t Imm, unsigned Size);
+  /// Dst = Dst * [Base + Disp]
+  void imulRM(X64Reg Dst, X64Reg Base, int32_t Disp, unsigned Size);
+  /// Dst = Dst * Src
+  void imulRR(X64Reg Dst, X64Reg Src, unsigned Size);
+  void testRR(X64Reg A, X64Reg B, unsigned Size);
+
+  /// Dst = Base + Disp
+  void lea(X64Reg Dst, X64Reg Base, int32_t Disp, unsigned Size);
+  /// Dst = Base + (Index << Scale) + Disp
+  void leaIndex(X64Reg Dst, X64Reg Base, X64Reg Index, unsigned Scale,
+                int32_t Disp, unsigned Size);
+  /// Dst = (Index << Scale) + Disp
+  void leaScaled(X64Reg Dst, X64Reg Index, unsigned Scale, int32_t Disp,
+                 unsigned Size);
+  /// Dst = the address of label L.
+  void leaLabel(X64Reg Dst, unsigned L);
+
+  void neg(X64Reg R, unsigned Size);
+  void bitNot(X64Reg R, unsigned Size);
+  /// [Base + Disp] += 1
+  void incMem(X64Reg Base, int32_t Disp, unsigned Size);
+  void shlCL(X64Reg R, unsigned Size);
+  void shrCL(X64Reg R, unsigned Size);
+  void sarCL(X64Reg R, unsigned Size);
+
+  /// Sign extend RAX into RDX, i.e. cdq or cqo.
+  void signExtendAX(unsigned Size);
+  void idiv(X64Reg R, unsigned Size);
+  void div(X64Reg R, unsigned Size);
+
+  /// Dst = sign extend the 32-bit value at [Base + Disp].
+  void movsxd(X64Reg Dst, X64Reg Base, int32_t Disp);
+  /// Dst = sign extend the low 32 bits of Src.
+  void movsxdRR(X64Reg Dst, X64Reg Src);
+  /// Dst = sign extend the 32-bit value at [Base + (Index << Scale)].
+  void movsxdIndex(X64Reg Dst, X64Reg Base, X64Reg Index, unsigned Scale);
+  /// Set the low byte of R to the condition, and zero the rest of R.
+  void setcc(X64Cond C, X64Reg R);
+  /// Set the carry flag to bit Bit of R.
+  void btRR(X64Reg R, X64Reg Bit, unsigned Size);
+
+  void jmp(unsigned Label);
+  void jcc(X64Cond C, unsigned Label);
+  /// Jump to the address in R.
+  void jmpIndirect(X64Reg R);
+  /// Call the function whose address is stored at [R].
+  void callIndirect(X64Reg R);
+
+  /// Emit a 32-bit word which holds the offset of label L from label Base,
+  /// for use in jump tables.
+  void offsetWord(unsigned L, unsigned Base);
+
+  /// Encode all recorded instructions, and append them to Out.  If Relocs
+  /// is non-null, the addresses emitted by movAddress() are added to it.
+  void encode(std::vector<uint8_t> &Out,
+              std::vector<Relocation> *Relocs = nullptr) const;
+
+private:
+  static Instr makeInstr(uint8_t Opcode, unsigned Size);
+  static void  setRegs(Instr &I, unsigned Reg, unsigned Rm);
+  static void  setMem(Instr &I, unsigned Reg, X64Reg Base, int32_t Disp);
+  static void  setIndex(Instr &I, X64Reg Index, unsigned Scale);
+
+  void emit(const Instr &I, unsigned Label = NoLabel) {
+    Code.push_back(I);
+    JumpLabels.push_back(Label);
+  }
+
+  /// A 32-bit word which holds the offset of one label from another.
+  struct LabelOffset {
+    size_t   Index;    ///< Index of the data word in Code.
+    unsigned Label;
+    unsigned Base;
+  };
+
+  std::vector<Instr>    Code;
+  std::vector<unsigned> JumpLabels;   ///< Target of each rel32 operand.
+  std::vector<unsigned> LabelPos;     ///< Instruction index of each label.
+  std::vector<LabelOffset> Offsets;
+  std::vector<std::pair<size_t, unsigned>> Addresses;   ///< (Index, Symbol)
+};
+
+
+}  // end namespace jit
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_JIT_X64EMITTER_H
@@ -16,236 +16,811 @@
 //===----------------------------------------------------------------------===//
 
 #include "backend/llvm/IRGen.h"
-#include "clang/Analysis/Analyses/ThreadSafetyTraverse.h"
+#include "til/TILPrettyPrint.h"
 
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/raw_ostream.h"
 
-#include <cstddef>
-
+#include <algorithm>
+#include <type_traits>
 
 namespace ohmu {
 namespace backend_llvm {
 
-// Map SExpr* to llvm::Value* in general.
-template <class T> struct LLVMTypeMap { typedef llvm::Value* Ty; };
 
-// Map other types, e.g. BasicBlock* to llvm::BasicBlock*.
-// We define these here b/c template specializations cannot be class members.
-template<> struct LLVMTypeMap<Phi>        { typedef llvm::PHINode*    Ty; };
-template<> struct LLVMTypeMap<BasicBlock> { typedef llvm::BasicBlock* Ty; };
-template<> struct LLVMTypeMap<SCFG>       { typedef llvm::Function*   Ty; };
+namespace {
 
+template<class T>
+llvm::Constant* makeConstant(T V, llvm::Type *Ty) {
+  return llvm::ConstantInt::get(Ty, static_cast<uint64_t>(V),
+                                std::is_signed<T>::value);
+}
 
-class LLVMReducerMap {
-public:
-  template <class T> struct TypeMap : public LLVMTypeMap<T> { };
-  typedef std::nullptr_t NullType;
+llvm::Constant* makeConstant(bool V, llvm::Type *Ty) {
+  return llvm::ConstantInt::get(Ty, V ? 1 : 0);
+}
 
-  // default result of all undefined reduce methods.
-  static NullType reduceNull() { return nullptr; }
-};
+llvm::Constant* makeConstant(float V, llvm::Type *Ty) {
+  return llvm::ConstantFP::get(Ty, V);
+}
+
+llvm::Constant* makeConstant(double V, llvm::Type *Ty) {
+  return llvm::ConstantFP::get(Ty, V);
+}
+
+llvm::Constant* makeConstant(StringRef V, llvm::Type *Ty) {
+  return nullptr;    // Strings need a global, and are handled by IRGen.
+}
 
+llvm::Constant* makeConstant(void* V, llvm::Type *Ty) {
+  auto *I = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ty->getContext()),
+                                   reinterpret_cast<uint64_t>(V));
+  return llvm::ConstantExpr::getIntToPtr(I, Ty);
+}
+
+// Converts a literal to an LLVM constant.
+template<class Ty>
+struct LiteralToConstant {
+  typedef llvm::Constant* ReturnType;
 
-class LLVMReducer : public Traversal<LLVMReducer, LLVMReducerMap>,
-                    public DefaultReducer<LLVMReducer, LLVMReducerMap>,
-                    public DefaultScopeHandler<LLVMReducerMap> {
-public:
-  LLVMReducer() :  currentFunction_(nullptr), builder_(ctx()) {
-    // The module holds all of the llvm output.
-    outModule_ = new llvm::Module("ohmu_output", ctx());
+  static llvm::Constant* defaultAction(Literal *L, llvm::Type *T) {
+    return nullptr;
   }
 
-  ~LLVMReducer() {
-     delete outModule_;
+  static llvm::Constant* action(Literal *L, llvm::Type *T) {
+    return makeConstant(L->as<Ty>()->value(), T);
   }
+};
 
-  static llvm::LLVMContext& ctx() { return llvm::getGlobalContext(); }
-  llvm::Module* module() { return outModule_; }
+BaseType typeOf(SExpr *E) {
+  if (auto *I = dyn_cast_or_null<Instruction>(E))
+    return I->baseType();
+  return BaseType::getBaseType<void>();
+}
 
-public:
-  /*
-   * FIXME -- move into traverse
-   *
-  template <class T>
-  llvm::Value* exitSubExpr(T *e, llvm::Value* v, TraversalKind K) {
-    if (Instruction *inst = e->asCFGInstruction())
-      currentValues_[inst->instrID()] = v;
-    return v;
-  }
-  llvm::PHINode* exitSubExpr(Phi *e, llvm::Value* v, TraversalKind K) {
-    return llvm::cast<llvm::PHINode>(v);
+}  // end anonymous namespace
+
+
+IRGen::IRGen(llvm::Module &M, DiagnosticEmitter &D, int32_t *TrapFlag,
+             void *AllocFn, void *AllocArg)
+    : Mod(M), Ctx(M.getContext()), Builder(Ctx), Diag(D), TrapFlag(TrapFlag),
+      AllocFn(AllocFn), AllocArg(AllocArg), CurrentFn(nullptr),
+      CurrentCfg(nullptr), Success(true), TrapBB(nullptr), GlobalVd(nullptr),
+      CalleeMap(nullptr) { }
+
+
+void IRGen::fail(const char* Msg, SExpr *E) {
+  if (Success) {
+    auto &Ds = Diag.error("Cannot generate IR for ")
+                 << CurrentFn->getName().str().c_str() << ": " << Msg;
+    if (E)
+      TILDebugPrinter::print(E, Ds.outputStream());
   }
-  llvm::BasicBlock* exitSubExpr(BasicBlock *e, llvm::BasicBlock* v,
-                                TraversalKind K) {
-    return v;
+  Success = false;
+}
+
+
+llvm::Type* IRGen::getType(BaseType Bt) {
+  if (Bt.VectSize > 1)
+    return nullptr;
+
+  switch (Bt.Base) {
+    case BaseType::BT_Void:
+      return Builder.getVoidTy();
+    case BaseType::BT_Bool:
+      return Builder.getInt1Ty();
+    case BaseType::BT_Int:
+    case BaseType::BT_UnsignedInt:
+      switch (Bt.Size) {
+        case BaseType::ST_8:  return Builder.getInt8Ty();
+        case BaseType::ST_16: return Builder.getInt16Ty();
+        case BaseType::ST_32: return Builder.getInt32Ty();
+        case BaseType::ST_64: return Builder.getInt64Ty();
+        default:              return nullptr;
+      }
+    case BaseType::BT_Float:
+      switch (Bt.Size) {
+        case BaseType::ST_32: return Builder.getFloatTy();
+        case BaseType::ST_64: return Builder.getDoubleTy();
+        default:              return nullptr;
+      }
+    case BaseType::BT_String:
+    case BaseType::BT_Pointer:
+      return Builder.getInt8PtrTy();
   }
-  */
+  return nullptr;
+}
+
+
+llvm::Type* IRGen::memoryType(llvm::Type *Ty) {
+  // Booleans are stored as bytes, as in C++.
+  if (Ty->isIntegerTy(1))
+    return Builder.getInt8Ty();
+  return Ty;
+}
+
+
+llvm::Value* IRGen::loadCell(llvm::Value *Ptr, llvm::Type *Ty) {
+  llvm::Type *MTy = memoryType(Ty);
+  llvm::Value *P = Builder.CreateBitCast(Ptr, MTy->getPointerTo());
+  llvm::Value *V = Builder.CreateLoad(MTy, P);
+  if (MTy != Ty)
+    V = Builder.CreateTrunc(V, Ty);
+  return V;
+}
+
+
+void IRGen::storeCell(llvm::Value *Ptr, llvm::Value *V) {
+  llvm::Type *MTy = memoryType(V->getType());
+  if (MTy != V->getType())
+    V = Builder.CreateZExt(V, MTy);
+  Builder.CreateStore(V, Builder.CreateBitCast(Ptr, MTy->getPointerTo()));
+}
+
 
-  llvm::Value* reduceWeak(Instruction* e) {
-    return currentValues_[e->instrID()];
+llvm::Value* IRGen::constantFlagPtr() {
+  auto *Addr = Builder.getInt64(reinterpret_cast<uint64_t>(TrapFlag));
+  return llvm::ConstantExpr::getIntToPtr(Addr,
+                                         Builder.getInt32Ty()->getPointerTo());
+}
+
+
+llvm::BasicBlock* IRGen::trapBlock() {
+  if (TrapBB)
+    return TrapBB;
+
+  llvm::IRBuilderBase::InsertPointGuard Guard(Builder);
+  TrapBB = llvm::BasicBlock::Create(Ctx, "trap", CurrentFn);
+  Builder.SetInsertPoint(TrapBB);
+  Builder.CreateStore(Builder.getInt32(1), constantFlagPtr());
+  llvm::Type *RTy = CurrentFn->getReturnType();
+  if (RTy->isVoidTy())
+    Builder.CreateRetVoid();
+  else
+    Builder.CreateRet(llvm::Constant::getNullValue(RTy));
+  return TrapBB;
+}
+
+
+void IRGen::trapIf(llvm::Value *Cond) {
+  auto *Cont = llvm::BasicBlock::Create(Ctx, "", CurrentFn);
+  Builder.CreateCondBr(Cond, trapBlock(), Cont);
+  Builder.SetInsertPoint(Cont);
+}
+
+
+llvm::Value* IRGen::literal(Literal *L) {
+  if (L->baseType().Base == BaseType::BT_String)
+    return Builder.CreateGlobalStringPtr(L->as<StringRef>()->value().str());
+
+  llvm::Type *Ty = getType(L->baseType());
+  llvm::Constant *C = nullptr;
+  if (Ty)
+    C = BtBr<LiteralToConstant>::branch(L->baseType(), L, Ty);
+  if (!C)
+    fail("unsupported literal ", L);
+  return C;
+}
+
+
+llvm::Value* IRGen::value(SExpr *E) {
+  if (!E) {
+    fail("missing operand");
+    return nullptr;
+  }
+  if (Instruction *I = E->asCFGInstruction()) {
+    llvm::Value *V = Values[I->instrID()];
+    if (!V)
+      fail("undefined value ", E);
+    return V;
   }
 
-  llvm::BasicBlock* reduceWeak(BasicBlock* b) {
-    auto *lbb = currentBlocks_[b->blockID()];
-    if (!lbb) {
-      if (!currentFunction_)
-        return nullptr;
-      lbb = llvm::BasicBlock::Create(ctx(), "", currentFunction_);
-      currentBlocks_[b->blockID()] = lbb;
-    }
-    return lbb;
+  if (auto *L = dyn_cast<Literal>(E))
+    return literal(L);
+
+  if (auto *V = dyn_cast<Variable>(E)) {
+    auto It = ParamValues.find(V->variableDecl());
+    if (It != ParamValues.end())
+      return It->second;
+    if (V->variableDecl()->kind() == VarDecl::VK_Let)
+      return value(V->variableDecl()->definition());
   }
 
-  std::nullptr_t reduceWeak(VarDecl *vd) { return nullptr; }
+  fail("unsupported operand ", E);
+  return nullptr;
+}
+
 
-  llvm::Value* reduceVarDecl(VarDecl& orig, llvm::Value* v) {
-    // Eliminate vardecls -- just return the definition.
-    return v;
+llvm::Value* IRGen::convert(llvm::Value *V, BaseType From, BaseType To) {
+  llvm::Type *ToTy = getType(To);
+  if (!V || !ToTy)
+    return nullptr;
+
+  bool FromFloat = From.Base == BaseType::BT_Float;
+  bool FromInt   = From.isIntegral() || From.Base == BaseType::BT_Bool;
+  bool Signed    = From.Base == BaseType::BT_Int;
+  if (!FromFloat && !FromInt)
+    return V->getType() == ToTy ? V : nullptr;
+
+  switch (To.Base) {
+    case BaseType::BT_Bool:
+      if (FromFloat)
+        return Builder.CreateFCmpUNE(V,
+                 llvm::ConstantFP::get(V->getType(), 0.0));
+      return Builder.CreateICmpNE(V,
+               llvm::ConstantInt::get(V->getType(), 0));
+    case BaseType::BT_Int:
+    case BaseType::BT_UnsignedInt:
+      if (FromFloat) {
+        if (To.Base == BaseType::BT_Int)
+          return Builder.CreateFPToSI(V, ToTy);
+        return Builder.CreateFPToUI(V, ToTy);
+      }
+      return Builder.CreateIntCast(V, ToTy, Signed);
+    case BaseType::BT_Float:
+      if (FromFloat)
+        return Builder.CreateFPCast(V, ToTy);
+      if (Signed)
+        return Builder.CreateSIToFP(V, ToTy);
+      return Builder.CreateUIToFP(V, ToTy);
+    default:
+      return nullptr;
   }
+}
 
-  llvm::Value* reduceLiteral(Literal& e) { return nullptr; }
 
-  template <class T>
-  llvm::Value* reduceLiteralT(LiteralT<T>& e) { return nullptr; }
+// The address of an element is checked by checking its array instead.  An
+// element of a null array is only null at index 0, and any other index is
+// invalid anyway.  The array is usually loop-invariant, so LLVM can hoist
+// the check out of the loop, and vectorize the loop.
+llvm::Value* IRGen::checkedPointer(SExpr *E) {
+  llvm::Value *P = value(E);
+  if (!P)
+    return nullptr;
+  if (!P->getType()->isPointerTy()) {
+    fail("operand is not a pointer ", E);
+    return nullptr;
+  }
+  llvm::Value *Checked = P;
+  if (auto *Ai = dyn_cast<ArrayIndex>(E))
+    Checked = value(Ai->array());
+  else if (auto *Aa = dyn_cast<ArrayAdd>(E))
+    Checked = value(Aa->array());
+  trapIf(Builder.CreateIsNull(Checked));
+  return P;
+}
+
 
-  llvm::Value* reduceLiteralT(LiteralT<int32_t>& e) {
-    llvm::Constant* c =
-      llvm::ConstantInt::getSigned(llvm::Type::getInt32Ty(ctx()), e.value());
-    // return builder_.Insert(c);
-    return c;
+llvm::Value* IRGen::cellAddress(SExpr *Array, SExpr *Index) {
+  llvm::Value *P = value(Array);
+  llvm::Value *I = value(Index);
+  if (!P || !I)
+    return nullptr;
+  if (!P->getType()->isPointerTy() || !I->getType()->isIntegerTy()) {
+    fail("unsupported array index ", Index);
+    return nullptr;
   }
+  bool Signed = typeOf(Index).Base == BaseType::BT_Int;
+  I = Builder.CreateIntCast(I, Builder.getInt64Ty(), Signed);
+  llvm::Type  *CellTy = Builder.getInt64Ty();
+  llvm::Value *Cells  = Builder.CreateBitCast(P, CellTy->getPointerTo());
+  llvm::Value *Addr   = Builder.CreateGEP(CellTy, Cells, I);
+  return Builder.CreateBitCast(Addr, Builder.getInt8PtrTy());
+}
 
-  llvm::Value* reduceUnaryOp(UnaryOp& orig, llvm::Value* e0) {
-    if (!e0)
-      return nullptr;
 
-    switch (orig.unaryOpcode()) {
-      case UOP_Minus:
-        return builder_.CreateNeg(e0);
-      case UOP_BitNot:
-        return builder_.CreateNot(e0);
-      case UOP_LogicNot:
-        return builder_.CreateNot(e0);
-    }
+llvm::Value* IRGen::generateUnaryOp(UnaryOp *E) {
+  llvm::Value *A = value(E->expr());
+  if (!A)
     return nullptr;
+  switch (E->unaryOpcode()) {
+    case UOP_Negative:
+      if (A->getType()->isFloatingPointTy())
+        return Builder.CreateFNeg(A);
+      return Builder.CreateNeg(A);
+    case UOP_BitNot:
+    case UOP_LogicNot:
+      return Builder.CreateNot(A);
   }
+  return nullptr;
+}
 
-  llvm::Value* reduceBinaryOp(BinaryOp& orig, llvm::Value* e0, llvm::Value* e1) {
-    if (!e0 || !e1)
-      return nullptr;
 
-    switch (orig.binaryOpcode()) {
-      case BOP_Add:
-        return builder_.CreateAdd(e0, e1);
-      case BOP_Sub:
-        return builder_.CreateSub(e0, e1);
-      case BOP_Mul:
-        return builder_.CreateMul(e0, e1);
-      case BOP_Div:
-        return builder_.CreateSDiv(e0, e1);
-      case BOP_Rem:
-        return builder_.CreateSRem(e0, e1);
-      case BOP_Shl:
-        return builder_.CreateShl(e0, e1);
-      case BOP_Shr:
-        return builder_.CreateLShr(e0, e1);
-      case BOP_BitAnd:
-        return builder_.CreateAnd(e0, e1);
-      case BOP_BitXor:
-        return builder_.CreateXor(e0, e1);
-      case BOP_BitOr:
-        return builder_.CreateOr(e0, e1);
-      case BOP_Eq:
-        return builder_.CreateICmpEQ(e0, e1);
-      case BOP_Neq:
-        return builder_.CreateICmpNE(e0, e1);
-      case BOP_Lt:
-        return builder_.CreateICmpSLT(e0, e1);
-      case BOP_Leq:
-        return builder_.CreateICmpSLE(e0, e1);
-      case BOP_LogicAnd:
-        return builder_.CreateAnd(e0, e1);
-      case BOP_LogicOr:
-        return builder_.CreateOr(e0, e1);
-    }
+llvm::Value* IRGen::generateDivide(BinaryOp *E, llvm::Value *A,
+                                   llvm::Value *B, bool Signed) {
+  bool IsRem = E->binaryOpcode() == BOP_Rem;
+  llvm::Type *Ty = A->getType();
+  llvm::Constant *Zero = llvm::ConstantInt::get(Ty, 0);
+  trapIf(Builder.CreateICmpEQ(B, Zero));
+
+  if (!Signed)
+    return IsRem ? Builder.CreateURem(A, B) : Builder.CreateUDiv(A, B);
+
+  // MIN / -1 overflows, so a divisor of -1 is handled separately.
+  llvm::Value *IsMinus1 =
+    Builder.CreateICmpEQ(B, llvm::ConstantInt::getSigned(Ty, -1));
+  llvm::Value *SafeB =
+    Builder.CreateSelect(IsMinus1, llvm::ConstantInt::get(Ty, 1), B);
+  llvm::Value *Q = IsRem ? Builder.CreateSRem(A, SafeB)
+                         : Builder.CreateSDiv(A, SafeB);
+  return Builder.CreateSelect(IsMinus1,
+                              IsRem ? Zero : Builder.CreateNeg(A), Q);
+}
+
+
+llvm::Value* IRGen::generateBinaryOp(BinaryOp *E) {
+  BaseType Bt = typeOf(E->expr0());
+  llvm::Value *A = value(E->expr0());
+  llvm::Value *B = value(E->expr1());
+  if (!A || !B)
     return nullptr;
+
+  bool IsFloat = Bt.Base == BaseType::BT_Float;
+  bool Signed  = Bt.Base == BaseType::BT_Int;
+  switch (E->binaryOpcode()) {
+    case BOP_Add:
+      return IsFloat ? Builder.CreateFAdd(A, B) : Builder.CreateAdd(A, B);
+    case BOP_Sub:
+      return IsFloat ? Builder.CreateFSub(A, B) : Builder.CreateSub(A, B);
+    case BOP_Mul:
+      return IsFloat ? Builder.CreateFMul(A, B) : Builder.CreateMul(A, B);
+    case BOP_Div:
+      if (IsFloat)
+        return Builder.CreateFDiv(A, B);
+      return generateDivide(E, A, B, Signed);
+    case BOP_Rem:
+      if (IsFloat)
+        return Builder.CreateFRem(A, B);
+      return generateDivide(E, A, B, Signed);
+    case BOP_Shl:
+    case BOP_Shr: {
+      // The shift amount is taken modulo the bit width, as in the VM.
+      llvm::Type *Ty = A->getType();
+      unsigned Bits = Ty->getIntegerBitWidth();
+      B = Builder.CreateIntCast(B, Ty, false);
+      B = Builder.CreateAnd(B, llvm::ConstantInt::get(Ty, Bits - 1));
+      if (E->binaryOpcode() == BOP_Shl)
+        return Builder.CreateShl(A, B);
+      return Signed ? Builder.CreateAShr(A, B) : Builder.CreateLShr(A, B);
+    }
+    case BOP_BitAnd:
+    case BOP_LogicAnd:
+      return Builder.CreateAnd(A, B);
+    case BOP_BitXor:
+      return Builder.CreateXor(A, B);
+    case BOP_BitOr:
+    case BOP_LogicOr:
+      return Builder.CreateOr(A, B);
+    case BOP_Eq:
+      return IsFloat ? Builder.CreateFCmpOEQ(A, B) : Builder.CreateICmpEQ(A, B);
+    case BOP_Neq:
+      return IsFloat ? Builder.CreateFCmpUNE(A, B) : Builder.CreateICmpNE(A, B);
+    case BOP_Lt:
+      if (IsFloat)
+        return Builder.CreateFCmpOLT(A, B);
+      return Signed ? Builder.CreateICmpSLT(A, B) : Builder.CreateICmpULT(A, B);
+    case BOP_Leq:
+      if (IsFloat)
+        return Builder.CreateFCmpOLE(A, B);
+      return Signed ? Builder.CreateICmpSLE(A, B) : Builder.CreateICmpULE(A, B);
+    case BOP_Gt:
+      if (IsFloat)
+        return Builder.CreateFCmpOGT(A, B);
+      return Signed ? Builder.CreateICmpSGT(A, B) : Builder.CreateICmpUGT(A, B);
+    case BOP_Geq:
+      if (IsFloat)
+        return Builder.CreateFCmpOGE(A, B);
+      return Signed ? Builder.CreateICmpSGE(A, B) : Builder.CreateICmpUGE(A, B);
   }
+  return nullptr;
+}
+
 
-  llvm::PHINode* reducePhiBegin(Phi& orig) {
-    llvm::Type* ty = llvm::Type::getInt32Ty(ctx());
-    llvm::PHINode* lph = builder_.CreatePHI(ty, orig.values().size());
-    return lph;
+llvm::Value* IRGen::generateCast(Cast *E) {
+  BaseType From = typeOf(E->expr());
+  BaseType To   = E->baseType();
+  llvm::Value *V  = value(E->expr());
+  llvm::Type  *Ty = getType(To);
+  if (!V || !Ty)
+    return nullptr;
+
+  llvm::Value *R = nullptr;
+  switch (E->castOpcode()) {
+    case CAST_extendNum:
+    case CAST_truncNum:
+    case CAST_extendToFloat:
+    case CAST_truncToFloat:
+    case CAST_truncToInt:
+    case CAST_roundToInt:
+      R = convert(V, From, To);
+      break;
+    case CAST_toBits:
+      if (V->getType()->isPointerTy())
+        R = Builder.CreatePtrToInt(V, Ty);
+      else if (V->getType()->getPrimitiveSizeInBits() ==
+               Ty->getPrimitiveSizeInBits())
+        R = Builder.CreateBitCast(V, Ty);
+      break;
+    case CAST_bitsToFloat:
+      if (V->getType()->getPrimitiveSizeInBits() ==
+          Ty->getPrimitiveSizeInBits())
+        R = Builder.CreateBitCast(V, Ty);
+      break;
+    case CAST_unsafeBitsToPtr:
+      if (V->getType()->isIntegerTy())
+        R = Builder.CreateIntToPtr(V, Ty);
+      break;
+    default:
+      // Pointer casts do not change the value.
+      if (V->getType() == Ty)
+        R = V;
+      break;
   }
+  if (!R)
+    fail("unsupported cast ", E);
+  return R;
+}
 
-  void reducePhiArg(Phi& orig, llvm::PHINode* lph, unsigned i, llvm::Value *v) {
-    if (!v)
-      return;
-    BasicBlock* bb = orig.block();
-    auto* lbb = reduceWeak(bb->predecessors()[i]);
-    lph->addIncoming(v, lbb);
+
+llvm::Value* IRGen::generateCall(Call *E) {
+  // Calls have the form global@().f(a1)...(an)().
+  std::vector<SExpr*> Args;
+  SExpr *T = E->target();
+  while (auto *Ap = dyn_cast_or_null<Apply>(T)) {
+    if (Ap->isSelfApplication())
+      break;
+    Args.push_back(Ap->arg());
+    T = Ap->fun();
   }
+  std::reverse(Args.begin(), Args.end());
 
-  llvm::Value* reduceGoto(Goto& orig, llvm::BasicBlock* lbb) {
-    builder_.CreateBr(lbb);
+  auto *Pj = dyn_cast_or_null<Project>(T);
+  auto *Self = Pj ? dyn_cast_or_null<Apply>(Pj->record()) : nullptr;
+  auto *Sv = Self ? dyn_cast_or_null<Variable>(Self->fun()) : nullptr;
+  if (!Sv || Sv->variableDecl() != GlobalVd) {
+    fail("unsupported call ", E);
     return nullptr;
   }
 
-  llvm::Value* reduceBranch(Branch& orig, llvm::Value* c,
-                            llvm::Value* ntb, llvm::Value* neb) {
+  auto It = CalleeMap->find(Pj->slotName().str());
+  if (It == CalleeMap->end()) {
+    fail("call to unknown function ", E);
+    return nullptr;
+  }
+  llvm::Function *Callee = It->second;
+  if (Callee->arg_size() != Args.size()) {
+    fail("wrong number of arguments ", E);
     return nullptr;
   }
 
-  llvm::Value* reduceReturn(Return& orig, llvm::Value *rv) {
-    if (!rv)
+  std::vector<llvm::Value*> ArgVals;
+  for (unsigned i = 0; i < Args.size(); ++i) {
+    llvm::Value *V = value(Args[i]);
+    if (!V)
+      return nullptr;
+    if (V->getType() != Callee->getFunctionType()->getParamType(i)) {
+      fail("argument type mismatch ", Args[i]);
+      return nullptr;
+    }
+    ArgVals.push_back(V);
+  }
+  llvm::Value *R = Builder.CreateCall(Callee, ArgVals);
+
+  // Return immediately if the callee trapped.
+  llvm::Value *Flag = Builder.CreateLoad(Builder.getInt32Ty(),
+                                         constantFlagPtr());
+  trapIf(Builder.CreateICmpNE(Flag, Builder.getInt32(0)));
+  return Callee->getReturnType()->isVoidTy() ? nullptr : R;
+}
+
+
+llvm::Value* IRGen::generateAlloc(Alloc *E) {
+  llvm::Value *P;
+  if (E->isHeap()) {
+    auto *PtrTy = Builder.getInt8PtrTy();
+    auto *FTy = llvm::FunctionType::get(PtrTy, { PtrTy }, false);
+    auto *Fn = llvm::ConstantExpr::getIntToPtr(
+        Builder.getInt64(reinterpret_cast<uint64_t>(AllocFn)),
+        FTy->getPointerTo());
+    auto *Arg = llvm::ConstantExpr::getIntToPtr(
+        Builder.getInt64(reinterpret_cast<uint64_t>(AllocArg)), PtrTy);
+    P = Builder.CreateCall(FTy, Fn, { Arg });
+  }
+  else {
+    // Stack cells are allocated once, in the entry block.
+    llvm::BasicBlock &Entry = CurrentFn->getEntryBlock();
+    llvm::IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+    auto *Cell = EntryBuilder.CreateAlloca(Builder.getInt64Ty());
+    Builder.CreateStore(Builder.getInt64(0), Cell);
+    P = Builder.CreateBitCast(Cell, Builder.getInt8PtrTy());
+  }
+
+  if (SExpr *Init = E->initializer()) {
+    llvm::Value *V = value(Init);
+    if (!V)
+      return nullptr;
+    storeCell(P, V);
+  }
+  return P;
+}
+
+
+llvm::Value* IRGen::generateInstruction(Instruction *I) {
+  switch (I->opcode()) {
+    case COP_Literal:
+      return literal(cast<Literal>(I));
+    case COP_Variable:
+      return value(I->asCFGInstruction() == I ?
+                   static_cast<SExpr*>(nullptr) : I);
+    case COP_Call:
+      return generateCall(cast<Call>(I));
+    case COP_Alloc:
+      return generateAlloc(cast<Alloc>(I));
+    case COP_Load: {
+      llvm::Type  *Ty = getType(I->baseType());
+      llvm::Value *P  = checkedPointer(cast<Load>(I)->pointer());
+      if (!Ty || !P)
+        return nullptr;
+      return loadCell(P, Ty);
+    }
+    case COP_Store: {
+      auto *S = cast<Store>(I);
+      llvm::Value *P = checkedPointer(S->destination());
+      llvm::Value *V = value(S->source());
+      if (P && V)
+        storeCell(P, V);
+      return nullptr;
+    }
+    case COP_ArrayIndex: {
+      auto *Ai = cast<ArrayIndex>(I);
+      return cellAddress(Ai->array(), Ai->index());
+    }
+    case COP_ArrayAdd: {
+      auto *Aa = cast<ArrayAdd>(I);
+      return cellAddress(Aa->array(), Aa->index());
+    }
+    case COP_UnaryOp:
+      return generateUnaryOp(cast<UnaryOp>(I));
+    case COP_BinaryOp:
+      return generateBinaryOp(cast<BinaryOp>(I));
+    case COP_Cast:
+      return generateCast(cast<Cast>(I));
+    default:
+      fail("unsupported instruction ", I);
       return nullptr;
-    return builder_.CreateRet(rv);
   }
+}
+
 
-  llvm::BasicBlock* reduceBasicBlockBegin(BasicBlock &orig) {
-    auto* lbb = reduceWeak(&orig);
-    builder_.SetInsertPoint(lbb);
-    return lbb;
+void IRGen::generateSwitch(Switch *Sw) {
+  llvm::Value *Cond = value(Sw->condition());
+  if (!Cond)
+    return;
+  if (!Cond->getType()->isIntegerTy()) {
+    fail("unsupported switch ", Sw);
+    return;
+  }
+  bool Signed = typeOf(Sw->condition()).Base == BaseType::BT_Int;
+
+  llvm::BasicBlock *Default = nullptr;
+  std::vector<std::pair<llvm::ConstantInt*, llvm::BasicBlock*>> Cases;
+  for (int i = 0, n = Sw->numCases(); i < n; ++i) {
+    llvm::BasicBlock *Target = Blocks[Sw->caseBlock(i)->blockID()];
+    SExpr *Lab = Sw->label(i);
+    if (isa<Wildcard>(Lab)) {
+      Default = Target;
+      continue;
+    }
+    auto *Lit = dyn_cast<Literal>(Lab);
+    llvm::Constant *C = nullptr;
+    if (Lit)
+      C = llvm::dyn_cast_or_null<llvm::Constant>(literal(Lit));
+    if (!C || !C->getType()->isIntegerTy()) {
+      fail("unsupported case label ", Lab);
+      return;
+    }
+    C = llvm::ConstantExpr::getIntegerCast(C, Cond->getType(), Signed);
+    auto *Ci = llvm::cast<llvm::ConstantInt>(C);
+    // The first matching case wins.
+    bool Dup = false;
+    for (auto &P : Cases)
+      Dup = Dup || P.first == Ci;
+    if (!Dup)
+      Cases.emplace_back(Ci, Target);
   }
 
-  llvm::Function* reduceSCFG_Begin(SCFG& orig) {
-    currentBlocks_.clear();
-    currentBlocks_.resize(orig.numBlocks(), nullptr);
-    currentValues_.clear();
-    currentValues_.resize(orig.numInstructions(), nullptr);
+  // A switch with no matching case is a runtime error.
+  if (!Default)
+    Default = trapBlock();
+  auto *Si = Builder.CreateSwitch(Cond, Default, Cases.size());
+  for (auto &P : Cases)
+    Si->addCase(P.first, P.second);
+}
 
-    // Create a new function in outModule_
-    std::vector<llvm::Type*> argTypes;
-    llvm::FunctionType *ft =
-      llvm::FunctionType::get(llvm::Type::getVoidTy(ctx()), argTypes, false);
-    currentFunction_ =
-      llvm::Function::Create(ft, llvm::Function::ExternalLinkage, "ohmu_main",
-                             outModule_);
 
-    // The current CFG is implicit.
-    return currentFunction_;
+void IRGen::generateTerminator(BasicBlock *B) {
+  Terminator *T = B->terminator();
+  if (!T) {
+    fail("block has no terminator");
+    return;
   }
 
-  llvm::Function* reduceSCFG_End(llvm::Function* cfg) {
-    llvm::verifyFunction(*currentFunction_);
-    currentFunction_->dump();
-    return cfg;
+  switch (T->opcode()) {
+    case COP_Goto:
+      Builder.CreateBr(Blocks[cast<Goto>(T)->targetBlock()->blockID()]);
+      return;
+    case COP_Branch: {
+      auto *Br = cast<Branch>(T);
+      llvm::Value *C = value(Br->condition());
+      if (!C)
+        return;
+      Builder.CreateCondBr(C, Blocks[Br->thenBlock()->blockID()],
+                              Blocks[Br->elseBlock()->blockID()]);
+      return;
+    }
+    case COP_Switch:
+      generateSwitch(cast<Switch>(T));
+      return;
+    case COP_Return: {
+      SExpr *V = cast<Return>(T)->returnValue();
+      if (CurrentFn->getReturnType()->isVoidTy()) {
+        Builder.CreateRetVoid();
+        return;
+      }
+      llvm::Value *R = value(V);
+      if (!R)
+        return;
+      if (R->getType() != CurrentFn->getReturnType()) {
+        fail("return type mismatch ", V);
+        return;
+      }
+      Builder.CreateRet(R);
+      return;
+    }
+    default:
+      fail("unsupported terminator ", T);
+      return;
   }
+}
 
 
-private:
-  llvm::Module*     outModule_;
-  llvm::Function*   currentFunction_;
-  llvm::IRBuilder<> builder_;
+llvm::Function* IRGen::declareFunction(StringRef Name,
+                                       const std::vector<BaseType> &ParamTypes,
+                                       BaseType ReturnType) {
+  std::vector<llvm::Type*> Tys;
+  for (auto &Bt : ParamTypes) {
+    llvm::Type *Ty = getType(Bt);
+    if (!Ty || Ty->isVoidTy())
+      return nullptr;
+    Tys.push_back(Ty);
+  }
+  llvm::Type *RTy = getType(ReturnType);
+  if (!RTy)
+    return nullptr;
 
-  std::vector<llvm::BasicBlock*> currentBlocks_;
-  std::vector<llvm::Value*> currentValues_;
-};
+  auto *FTy = llvm::FunctionType::get(RTy, Tys, false);
+  return llvm::Function::Create(FTy, llvm::Function::InternalLinkage,
+                                Name.str(), &Mod);
+}
 
 
+bool IRGen::generateFunction(llvm::Function *F, SCFG *Cfg,
+                             const std::vector<VarDecl*> &Params,
+                             VarDecl *GVd,
+                             const std::unordered_map<std::string,
+                                                      llvm::Function*> &Cm) {
+  CurrentFn  = F;
+  CurrentCfg = Cfg;
+  Success    = true;
+  TrapBB     = nullptr;
+  GlobalVd   = GVd;
+  CalleeMap  = &Cm;
+
+  Blocks.assign(Cfg->numBlocks(), nullptr);
+  EndBlocks.assign(Cfg->numBlocks(), nullptr);
+  Values.assign(Cfg->numInstructions(), nullptr);
+  ParamValues.clear();
+  unsigned Ai = 0;
+  for (auto &Arg : F->args())
+    ParamValues[Params[Ai++]] = &Arg;
+
+  // The entry block holds stack allocations, and jumps to the CFG entry.
+  auto *Entry = llvm::BasicBlock::Create(Ctx, "entry", F);
+  for (auto &Bp : Cfg->blocks())
+    Blocks[Bp->blockID()] = llvm::BasicBlock::Create(Ctx, "", F);
+  Builder.SetInsertPoint(Entry);
+  Builder.CreateBr(Blocks[Cfg->entry()->blockID()]);
+
+  for (auto &Bp : Cfg->blocks()) {
+    BasicBlock *B = Bp.get();
+    Builder.SetInsertPoint(Blocks[B->blockID()]);
+    for (Phi *Ph : B->arguments()) {
+      if (!Ph || Ph->baseType().Base == BaseType::BT_Void)
+        continue;
+      llvm::Type *Ty = getType(Ph->baseType());
+      if (!Ty) {
+        fail("unsupported type ", Ph);
+        break;
+      }
+      Values[Ph->instrID()] = Builder.CreatePHI(Ty, Ph->values().size());
+    }
+    for (auto *I : B->instructions()) {
+      if (!I || !Success)
+        continue;
+      Values[I->instrID()] = generateInstruction(I);
+    }
+    if (Success)
+      generateTerminator(B);
+    EndBlocks[B->blockID()] = Builder.GetInsertBlock();
+    if (!Success)
+      break;
+  }
 
-void generate_LLVM_IR(SExpr* E) {
-  LLVMReducer Reducer;
-  Reducer.traverseAll(E);
-  // Reducer.module()->dump();
+  // Phi arguments may refer to values which are defined later.
+  for (auto &Bp : Cfg->blocks()) {
+    if (!Success)
+      break;
+    for (Phi *Ph : Bp->arguments()) {
+      auto *Lph = llvm::dyn_cast_or_null<llvm::PHINode>(
+          Ph ? Values[Ph->instrID()] : nullptr);
+      if (!Lph)
+        continue;
+      auto &Preds = Bp->predecessors();
+      for (unsigned i = 0; i < Preds.size() && i < Ph->values().size(); ++i) {
+        llvm::Value *V = value(Ph->values()[i].get());
+        if (!V)
+          break;
+        Lph->addIncoming(V, EndBlocks[Preds[i]->blockID()]);
+      }
+    }
+  }
+
+  if (Success) {
+    std::string Msg;
+    llvm::raw_string_ostream OS(Msg);
+    if (llvm::verifyFunction(*F, &OS)) {
+      OS.flush();
+      fail(Msg.c_str());
+    }
+  }
+  if (Success)
+    return true;
+
+  // Replace the body with one that traps, so that callers still link.
+  F->deleteBody();
+  F->setLinkage(llvm::Function::InternalLinkage);
+  TrapBB = nullptr;
+  Builder.SetInsertPoint(llvm::BasicBlock::Create(Ctx, "entry", F));
+  Builder.CreateBr(trapBlock());
+  return false;
+}
+
+
+llvm::Function* IRGen::generateWrapper(llvm::Function *F, StringRef Name) {
+  auto *PtrTy = Builder.getInt8PtrTy();
+  auto *FTy = llvm::FunctionType::get(Builder.getVoidTy(), { PtrTy, PtrTy },
+                                      false);
+  auto *W = llvm::Function::Create(FTy, llvm::Function::ExternalLinkage,
+                                   Name.str(), &Mod);
+  Builder.SetInsertPoint(llvm::BasicBlock::Create(Ctx, "entry", W));
+
+  // Arguments and results are VMValues, which are 8-byte cells.
+  llvm::Value *Args = W->getArg(0);
+  llvm::Value *Result = W->getArg(1);
+  llvm::Value *Cells = Builder.CreateBitCast(Args,
+                         Builder.getInt64Ty()->getPointerTo());
+  std::vector<llvm::Value*> ArgVals;
+  for (unsigned i = 0; i < F->arg_size(); ++i) {
+    llvm::Value *P = Builder.CreateGEP(Builder.getInt64Ty(), Cells,
+                                       Builder.getInt64(i));
+    P = Builder.CreateBitCast(P, PtrTy);
+    ArgVals.push_back(loadCell(P, F->getFunctionType()->getParamType(i)));
+  }
+  llvm::Value *R = Builder.CreateCall(F, ArgVals);
+  if (!F->getReturnType()->isVoidTy())
+    storeCell(Result, R);
+  Builder.CreateRetVoid();
+  return W;
 }
 
 
@@ -17,28 +17,119 @@
 //
 // Defines the LLVM IR Generation layer.
 //
+// IRGen translates lowered SCFGs to LLVM functions.  The memory model is the
+// same as the interpreter's: every allocation and array element is an 8-byte
+// cell, which holds its value in the low-order bytes.  Runtime errors, such
+// as division by zero, set a trap flag and return to the caller, which
+// returns immediately in turn.
+//
+// This header exposes LLVM types, and is only included by the backend
+// itself; clients should use LLVMModule in LLVMJIT.h instead.
+//
 //===----------------------------------------------------------------------===//
 
 #ifndef OHMU_BACKEND_LLVM_IRGEN_H
 #define OHMU_BACKEND_LLVM_IRGEN_H
 
-#include "clang/Analysis/Analyses/ThreadSafetyTIL.h"
-
+#include "base/DiagnosticEmitter.h"
+#include "til/TIL.h"
 
-#include "llvm/IR/Verifier.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
-#include "llvm/Support/Casting.h"
 
+#include <unordered_map>
+#include <vector>
 
 namespace ohmu {
 namespace backend_llvm {
 
-using namespace clang::threadSafety::til;
+using namespace ohmu::til;
+
+
+/// Translates the functions in a lowered module to LLVM IR.
+class IRGen {
+public:
+  /// Generated code sets *TrapFlag to 1 on a runtime error, and calls
+  /// AllocFn(AllocArg) to allocate a heap cell.
+  IRGen(llvm::Module &M, DiagnosticEmitter &D, int32_t *TrapFlag,
+        void *AllocFn, void *AllocArg);
+
+  /// Return the LLVM type for Bt, or null if Bt is not supported.
+  llvm::Type* getType(BaseType Bt);
+
+  /// Declare a function with the given signature.  Every function in the
+  /// module must be declared before any bodies are generated.
+  llvm::Function* declareFunction(StringRef Name,
+                                  const std::vector<BaseType> &ParamTypes,
+                                  BaseType ReturnType);
+
+  /// Generate the body of F from Cfg.  Params are the VarDecls of F's
+  /// parameters.  Calls to global@().f are resolved using Callees, which
+  /// maps slot names to functions.  On failure, F is given a body which
+  /// traps, and false is returned.
+  bool generateFunction(llvm::Function *F, SCFG *Cfg,
+                        const std::vector<VarDecl*> &Params,
+                        VarDecl *GlobalVd,
+                        const std::unordered_map<std::string,
+                                                 llvm::Function*> &Callees);
+
+  /// Generate an externally visible wrapper for F, with the signature
+  /// void(const VMValue *Args, VMValue *Result).
+  llvm::Function* generateWrapper(llvm::Function *F, StringRef Name);
+
+private:
+  void fail(const char* Msg, SExpr *E = nullptr);
+
+  /// Return the type used to hold a value of type Ty in memory.
+  llvm::Type*  memoryType(llvm::Type *Ty);
+  llvm::Value* loadCell(llvm::Value *Ptr, llvm::Type *Ty);
+  void         storeCell(llvm::Value *Ptr, llvm::Value *V);
+
+  llvm::Value*      constantFlagPtr();
+  llvm::BasicBlock* trapBlock();
+  void              trapIf(llvm::Value *Cond);
+
+  llvm::Value* value(SExpr *E);
+  llvm::Value* literal(Literal *L);
+  llvm::Value* convert(llvm::Value *V, BaseType From, BaseType To);
+  llvm::Value* checkedPointer(SExpr *E);
+  llvm::Value* cellAddress(SExpr *Array, SExpr *Index);
+
+  llvm::Value* generateInstruction(Instruction *I);
+  llvm::Value* generateUnaryOp(UnaryOp *E);
+  llvm::Value* generateBinaryOp(BinaryOp *E);
+  llvm::Value* generateDivide(BinaryOp *E, llvm::Value *A, llvm::Value *B,
+                              bool Signed);
+  llvm::Value* generateCast(Cast *E);
+  llvm::Value* generateCall(Call *E);
+  llvm::Value* generateAlloc(Alloc *E);
+  void         generateTerminator(BasicBlock *B);
+  void         generateSwitch(Switch *Sw);
+
+  llvm::Module&      Mod;
+  llvm::LLVMContext& Ctx;
+  llvm::IRBuilder<>  Builder;
+  DiagnosticEmitter& Diag;
+  int32_t*           TrapFlag;
+  void*              AllocFn;
+  void*              AllocArg;
+
+  // State for the current function.
+  llvm::Function*  CurrentFn;
+  SCFG*            CurrentCfg;
+  bool             Success;
+  llvm::BasicBlock* TrapBB;
+  VarDecl*         GlobalVd;
+  const std::unordered_map<std::string, llvm::Function*> *CalleeMap;
+
+  std::vector<llvm::BasicBlock*> Blocks;     ///< Indexed by blockID.
+  std::vector<llvm::BasicBlock*> EndBlocks;  ///< Block with the terminator.
+  std::vector<llvm::Value*>      Values;     ///< Indexed by instrID.
+  std::unordered_map<VarDecl*, llvm::Value*> ParamValues;
+};
 
-void generate_LLVM_IR(SExpr* E);
 
 }  // end namespace backend_llvm
 }  // end namespace ohmu
@@ -0,0 +1,318 @@
+//===- LLVMJIT.cpp ---------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "backend/llvm/LLVMJIT.h"
+#include "backend/llvm/IRGen.h"
+
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <chrono>
+
+namespace ohmu {
+namespace backend_llvm {
+
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point T0) {
+  return std::chrono::duration<double>(Clock::now() - T0).count();
+}
+
+bool initializeNativeTarget() {
+  return !llvm::InitializeNativeTarget() &&
+         !llvm::InitializeNativeTargetAsmPrinter();
+}
+
+std::string wrapperName(StringRef Name) {
+  return "ohmu." + Name.str();
+}
+
+}  // end anonymous namespace
+
+
+LLVMModule::LLVMModule(MemRegionRef A)
+    : Arena(A), Vectorize(true), Context(new llvm::LLVMContext()),
+      Trapped(0) {
+  Mod.reset(new llvm::Module("ohmu", *Context));
+}
+
+
+LLVMModule::~LLVMModule() { }
+
+
+void* LLVMModule::allocateCell(void *A) {
+  VMValue *Cell = static_cast<MemRegionRef*>(A)->allocateT<VMValue>();
+  Cell->U64 = 0;
+  return Cell;
+}
+
+
+unsigned LLVMModule::generate(SExpr *Module) {
+  auto *GlobalFun = dyn_cast_or_null<Function>(Module);
+  auto *Rec = GlobalFun ? dyn_cast_or_null<Record>(GlobalFun->body())
+                        : nullptr;
+  if (!Rec) {
+    Diag.error("Module is not a lowered global record.");
+    return 0;
+  }
+  if (!Mod) {
+    Diag.error("Module has already been compiled.");
+    return 0;
+  }
+
+  auto T0 = Clock::now();
+  IRGen Gen(*Mod, Diag, &Trapped,
+            reinterpret_cast<void*>(&LLVMModule::allocateCell), &Arena);
+
+  // Declare all of the functions first, so that calls can be resolved.
+  std::vector<std::vector<VarDecl*>> Params;
+  std::vector<llvm::Function*> Decls;
+  std::unordered_map<std::string, llvm::Function*> Callees;
+  for (auto &Slt : Rec->slots()) {
+    std::vector<VarDecl*> Ps;
+    SExpr *Def = Slt->definition();
+    while (auto *Fn = dyn_cast_or_null<Function>(Def)) {
+      Ps.push_back(Fn->variableDecl());
+      Def = Fn->body();
+    }
+    auto *C = dyn_cast_or_null<Code>(Def);
+    auto *Cfg = C ? dyn_cast_or_null<SCFG>(C->body()) : nullptr;
+    if (!Cfg)
+      continue;
+
+    auto *F = new LLVMFunction(Slt->slotName(), Cfg);
+    for (auto *Vd : Ps) {
+      auto *Ty = dyn_cast_or_null<ScalarType>(Vd->definition());
+      F->ParamTypes.push_back(Ty ? Ty->baseType()
+                                 : BaseType::getBaseType<void>());
+    }
+    auto *Rt = dyn_cast_or_null<ScalarType>(C->returnType());
+    F->ReturnType = Rt ? Rt->baseType() : BaseType::getBaseType<void>();
+    F->NumParams = Ps.size();
+
+    llvm::Function *Lf = Gen.declareFunction(F->Name, F->ParamTypes,
+                                             F->ReturnType);
+    if (Lf)
+      Callees[F->Name.str()] = Lf;
+    else
+      Diag.error("Cannot compile ") << F->Name << ": unsupported type";
+
+    FunctionMap[Slt->slotName().str()] = Functions.size();
+    Functions.emplace_back(F);
+    Params.push_back(std::move(Ps));
+    Decls.push_back(Lf);
+  }
+
+  std::unordered_map<llvm::Function*, unsigned> Index;
+  for (unsigned i = 0; i < Decls.size(); ++i) {
+    if (Decls[i])
+      Index[Decls[i]] = i;
+  }
+
+  for (unsigned i = 0; i < Functions.size(); ++i) {
+    if (!Decls[i])
+      continue;
+    LLVMFunction *F = Functions[i].get();
+    F->Compiled = Gen.generateFunction(Decls[i], F->Body, Params[i],
+                                       GlobalFun->variableDecl(), Callees);
+  }
+
+  // A function can only be run if everything it calls was translated.
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (unsigned i = 0; i < Functions.size(); ++i) {
+      if (!Functions[i]->Compiled)
+        continue;
+      for (auto &BB : *Decls[i]) {
+        for (auto &I : BB) {
+          auto *Ci = llvm::dyn_cast<llvm::CallInst>(&I);
+          auto It = Index.find(Ci ? Ci->getCalledFunction() : nullptr);
+          if (It == Index.end() || Functions[It->second]->Compiled)
+            continue;
+          if (Functions[i]->Compiled) {
+            Diag.error("Cannot compile ") << Functions[i]->Name << ": calls "
+                                          << Functions[It->second]->Name;
+          }
+          Functions[i]->Compiled = false;
+          Changed = true;
+        }
+      }
+    }
+  }
+
+  unsigned NumCompiled = 0;
+  for (unsigned i = 0; i < Functions.size(); ++i) {
+    if (!Functions[i]->Compiled)
+      continue;
+    Gen.generateWrapper(Decls[i], wrapperName(Functions[i]->Name).c_str());
+    ++NumCompiled;
+  }
+  Stats.IRGenSeconds = secondsSince(T0);
+  return NumCompiled;
+}
+
+
+bool LLVMModule::compile(unsigned OptLevel, std::string *OptimizedIR) {
+  static bool Initialized = initializeNativeTarget();
+  if (!Initialized) {
+    Diag.error("LLVM does not support the host target.");
+    return false;
+  }
+  if (!Mod) {
+    Diag.error("Module has already been compiled.");
+    return false;
+  }
+  if (OptLevel > 3)
+    OptLevel = 3;
+  Stats.OptLevel = OptLevel;
+
+  auto Jtmb = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!Jtmb) {
+    Diag.error("Cannot create target: ")
+      << llvm::toString(Jtmb.takeError()).c_str();
+    return false;
+  }
+  static const llvm::CodeGenOpt::Level CodeGenLevels[] = {
+    llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+    llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive
+  };
+  Jtmb->setCodeGenOptLevel(CodeGenLevels[OptLevel]);
+  auto TM = Jtmb->createTargetMachine();
+  if (!TM) {
+    Diag.error("Cannot create target machine: ")
+      << llvm::toString(TM.takeError()).c_str();
+    return false;
+  }
+  Mod->setDataLayout((*TM)->createDataLayout());
+  Mod->setTargetTriple((*TM)->getTargetTriple().str());
+
+  // Optimize.
+  auto T0 = Clock::now();
+  {
+    llvm::LoopAnalysisManager     LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager    CGAM;
+    llvm::ModuleAnalysisManager   MAM;
+    // As in clang, the vectorizers only run at O2 and above.
+    llvm::PipelineTuningOptions PTO;
+    PTO.LoopVectorization = Vectorize && OptLevel >= 2;
+    PTO.SLPVectorization  = Vectorize && OptLevel >= 2;
+    llvm::PassBuilder PB(TM->get(), PTO);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    static const llvm::OptimizationLevel OptLevels[] = {
+      llvm::OptimizationLevel::O0, llvm::OptimizationLevel::O1,
+      llvm::OptimizationLevel::O2, llvm::OptimizationLevel::O3
+    };
+    llvm::ModulePassManager MPM = OptLevel == 0
+      ? PB.buildO0DefaultPipeline(OptLevels[0])
+      : PB.buildPerModuleDefaultPipeline(OptLevels[OptLevel]);
+    MPM.run(*Mod, MAM);
+  }
+  Stats.OptSeconds = secondsSince(T0);
+
+  Stats.NumInstructions = Mod->getInstructionCount();
+  Stats.NumVectorInstructions = 0;
+  for (auto &F : *Mod) {
+    for (auto &I : llvm::instructions(F))
+      Stats.NumVectorInstructions += I.getType()->isVectorTy();
+  }
+  if (OptimizedIR)
+    *OptimizedIR = printIR();
+
+  // Generate code.  LLJIT compiles the whole module on the first lookup.
+  T0 = Clock::now();
+  auto J = llvm::orc::LLJITBuilder()
+             .setJITTargetMachineBuilder(std::move(*Jtmb))
+             .create();
+  if (!J) {
+    Diag.error("Cannot create JIT: ") << llvm::toString(J.takeError()).c_str();
+    return false;
+  }
+  Jit = std::move(*J);
+
+  llvm::orc::ThreadSafeModule Tsm(std::move(Mod), std::move(Context));
+  if (auto Err = Jit->addIRModule(std::move(Tsm))) {
+    Diag.error("Cannot add module: ") << llvm::toString(std::move(Err)).c_str();
+    return false;
+  }
+
+  bool Success = true;
+  for (auto &F : Functions) {
+    if (!F->Compiled)
+      continue;
+    auto Sym = Jit->lookup(wrapperName(F->Name));
+    if (!Sym) {
+      Diag.error("Cannot find ") << F->Name << ": "
+                                 << llvm::toString(Sym.takeError()).c_str();
+      F->Compiled = false;
+      Success = false;
+      continue;
+    }
+    F->Entry = reinterpret_cast<LLVMFunction::EntryFn>(Sym->getAddress());
+  }
+  Stats.CodegenSeconds = secondsSince(T0);
+  return Success;
+}
+
+
+std::string LLVMModule::printIR() {
+  std::string S;
+  if (!Mod)
+    return S;
+  llvm::raw_string_ostream OS(S);
+  Mod->print(OS, nullptr);
+  OS.flush();
+  return S;
+}
+
+
+LLVMFunction* LLVMModule::findFunction(StringRef Name) {
+  auto It = FunctionMap.find(Name.str());
+  if (It == FunctionMap.end())
+    return nullptr;
+  return Functions[It->second].get();
+}
+
+
+bool LLVMModule::run(LLVMFunction *F, const VMValue *Args, VMValue *Result) {
+  Result->U64 = 0;
+  if (!F->Compiled || !F->Entry)
+    return false;
+  Trapped = 0;
+  F->Entry(Args, Result);
+  return Trapped == 0;
+}
+
+
+}  // end namespace backend_llvm
+}  // end namespace ohmu
@@ -0,0 +1,152 @@
+//===- LLVMJIT.h -----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compiles a lowered module to native code with LLVM.
+//
+// The module is translated to LLVM IR by IRGen, optimized with one of the
+// standard O0-O3 pipelines, and compiled in-process with an ORC JIT.  At O2
+// and above, the pipeline includes the loop and SLP vectorizers, which
+// target the vector width of the host; loops over arrays are vectorized
+// when they are counted, access cells with unit stride, and either cannot
+// alias or pass a runtime overlap check.  Each
+// function gets a wrapper which takes its arguments and result as VMValues,
+// so generated code can be compared directly against the Interpreter.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_BACKEND_LLVM_LLVMJIT_H
+#define OHMU_BACKEND_LLVM_LLVMJIT_H
+
+#include "base/DiagnosticEmitter.h"
+#include "base/MemRegion.h"
+#include "til/Interpreter.h"
+#include "til/TIL.h"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm {
+class LLVMContext;
+class Module;
+namespace orc {
+class LLJIT;
+}
+}
+
+namespace ohmu {
+namespace backend_llvm {
+
+using namespace ohmu::til;
+
+
+/// A function in an LLVMModule.
+struct LLVMFunction {
+  typedef void (*EntryFn)(const VMValue *Args, VMValue *Result);
+
+  LLVMFunction(StringRef N, SCFG *Cfg)
+      : Name(N), Body(Cfg), NumParams(0), Compiled(false), Entry(nullptr) { }
+
+  StringRef              Name;
+  SCFG*                  Body;
+  std::vector<BaseType>  ParamTypes;
+  BaseType               ReturnType;
+  unsigned               NumParams;
+  bool                   Compiled;
+  EntryFn                Entry;      ///< Wrapper, set by compile().
+};
+
+
+/// Time spent in each phase of compilation, in seconds.
+struct LLVMCompileStats {
+  LLVMCompileStats()
+      : OptLevel(0), IRGenSeconds(0), OptSeconds(0), CodegenSeconds(0),
+        NumInstructions(0), NumVectorInstructions(0) { }
+
+  unsigned OptLevel;
+  double   IRGenSeconds;
+  double   OptSeconds;
+  double   CodegenSeconds;
+  unsigned NumInstructions;   ///< LLVM instructions after optimization.
+  unsigned NumVectorInstructions;   ///< Of those, with a vector result.
+};
+
+
+/// Compiles the functions in a lowered module to native code.
+class LLVMModule {
+public:
+  /// Heap allocations made by generated code are taken from Arena.
+  explicit LLVMModule(MemRegionRef A);
+  ~LLVMModule();
+
+  /// Generate LLVM IR for every function in Module, which is the lowered
+  /// global function, e.g. Global::global().  Functions which cannot be
+  /// translated, or which call functions that cannot be translated, are
+  /// reported and skipped.  Returns the number of translated functions.
+  unsigned generate(SExpr *Module);
+
+  /// Optimize the module at OptLevel (0-3), and compile it to native code.
+  /// If OptimizedIR is non-null, the optimized IR is written to it.
+  /// A module can only be compiled once.  Returns false on failure.
+  bool compile(unsigned OptLevel, std::string *OptimizedIR = nullptr);
+
+  /// Enable or disable the loop and SLP vectorizers, which are on by
+  /// default at O2 and above.  Must be called before compile().
+  void setVectorize(bool Enable) { Vectorize = Enable; }
+
+  /// Return the IR for the module, which must not have been compiled yet.
+  std::string printIR();
+
+  /// Return the function with the given name, or null if there is none.
+  LLVMFunction* findFunction(StringRef Name);
+
+  /// Return all of the functions in the module.
+  std::vector<std::unique_ptr<LLVMFunction>>& functions() { return Functions; }
+
+  /// Call F, which must have been compiled.  Returns false if F has not
+  /// been compiled, or if the generated code trapped.
+  bool run(LLVMFunction *F, const VMValue *Args, VMValue *Result);
+
+  const LLVMCompileStats& stats() const { return Stats; }
+
+  DiagnosticEmitter& diag() { return Diag; }
+
+private:
+  static void* allocateCell(void *Arena);
+
+  MemRegionRef      Arena;
+  DiagnosticEmitter Diag;
+  LLVMCompileStats  Stats;
+  bool              Vectorize;
+
+  std::unique_ptr<llvm::LLVMContext> Context;
+  std::unique_ptr<llvm::Module>      Mod;
+  std::unique_ptr<llvm::orc::LLJIT>  Jit;
+
+  std::vector<std::unique_ptr<LLVMFunction>> Functions;
+  std::unordered_map<std::string, unsigned>  FunctionMap;
+
+  /// Set to non-zero by generated code on a runtime error.
+  int32_t Trapped;
+};
+
+
+}  // end namespace backend_llvm
+}  // end namespace ohmu
+
+#endif  // OHMU_BACKEND_LLVM_LLVMJIT_H
@@ -22,7 +22,11 @@
 // information.
 //
 // This file also defines an encode function that encodes the fixed width format
-// into the variable width format that can be executed.
+// into the variable width format that can be executed, and encodeAll, which
+// encodes a whole stream of instructions at once.  encodeAll looks up the
+// prefix, opcode map and immediate bytes in tables, and writes fixed-size
+// chunks which are overwritten by the next field, so the common forms are
+// encoded with few branches.  Its output is identical to that of encode.
 //
 // This format and encoding are designed to be both compact and efficient and
 // sacrifice some amount of readability to do so.  We do not expect any of this
@@ -37,6 +41,9 @@
 //===----------------------------------------------------------------------===//
 #pragma once
 
+#include <cstddef>
+#include <cstring>
+
 enum SegmentEncoding { DEFAULT_SEGMENT, INVALD_SEGMENT, FS, GS };
 enum LockRepEncoding { NO_LOCKREP, LOCK_PREFIX, REPZ_PREFIX, REPNZ_PREFIX };
 enum AddressEncoding { DEFAULT_ADDRESS_SIZE, ADDRESS_SIZE_OVERRIDE };
@@ -48,8 +55,22 @@ struct /*__declspec(align(16))*/ Instr {
   Instr(unsigned long long instr, int imm32, int disp32)
     : instr(instr), imm32(imm32), disp32(disp32) {}
 
+  // The most bytes that encode can write for one instruction.  Valid x64
+  // instructions are at most 15 bytes, but not every combination of fields
+  // is valid.
+  enum { MAX_SIZE = 22 };
+  // The number of bytes past the end of its output that encodeAll may
+  // overwrite.
+  enum { ENCODE_SLACK = 8 };
+
   byte* encode(byte* p) const;
 
+  // Encodes n instructions into p, and returns the end of the encoded
+  // bytes.  If ends is not null, ends[i] is set to the offset of the end of
+  // instruction i from p.
+  static byte* encodeAll(const Instr* instrs, size_t n, byte* p,
+                         unsigned* ends = 0);
+
   union {
     struct {
       // Vex byte 3.
@@ -192,7 +213,99 @@ ENCODE_NO_DISP:
     if (imm_size == 0) { *p++ = (byte)imm32; }
     else if (imm_size == 2) { *(int*)p = imm32; p += 4; }
     else if (imm_size <  2) { *(short*)p = (short)imm32; p += 2; }
-    else                    { *(long long*)p = *(long long*)&imm32; p += 8; }
+    else {
+      // A 64-bit immediate continues into the displacement field.
+      *(unsigned long long*)p = (unsigned)imm32 |
+                                ((unsigned long long)(unsigned)disp32 << 32);
+      p += 8;
+    }
+  }
+  return p;
+}
+
+// Tables for encodeAll, indexed by the byte of the fixed width format that
+// holds the relevant fields.
+struct InstrEncodeTables {
+  typedef Instr::byte byte;
+
+  InstrEncodeTables() {
+    for (int v = 0; v < 256; v++) {
+      Instr t(0, 0, 0);
+      t.prefix = (byte)v;
+      byte legacy[4] = { 0, 0, 0, 0 };
+      byte n = 0;
+      if (t.segment) legacy[n++] = t.segment ^ 0x66;
+      if (t.lock_rep) legacy[n++] = t.lock_rep ^ 0xf1;
+      if (t.size_prefix) legacy[n++] = 0x66;
+      if (t.addr_prefix) legacy[n++] = 0x67;
+      memcpy(&prefix_bytes[v], legacy, 4);
+      prefix_size[v] = n;
+
+      t.vex1 = (byte)v;
+      byte map[2] = { 0x0f, (byte)((t.vex1 ^ 0xfe) << 1) };
+      memcpy(&map_bytes[v], map, 2);
+      map_size[v] = t.code_map ? (t.code_map & 0x02 ? 2 : 1) : 0;
+
+      t.flags = (byte)v;
+      static const byte imm_sizes[] = { 1, 2, 4, 8 };
+      imm_size[v] = t.has_imm ? imm_sizes[t.imm_size] : 0;
+    }
+  }
+
+  static const InstrEncodeTables& get() {
+    static const InstrEncodeTables tables;
+    return tables;
+  }
+
+  unsigned prefix_bytes[256];       // Legacy prefixes, in encoding order.
+  byte prefix_size[256];
+  unsigned short map_bytes[256];    // Opcode map escape bytes.
+  byte map_size[256];
+  byte imm_size[256];
+};
+
+inline Instr::byte* Instr::encodeAll(const Instr* instrs, size_t n, byte* p,
+                                     unsigned* ends) {
+  const InstrEncodeTables& t = InstrEncodeTables::get();
+  byte* start = p;
+  for (size_t i = 0; i < n; i++) {
+    const Instr& in = instrs[i];
+    // Raw data and vex instructions are rare, and take the slow path.
+    if (in.invalid | in.use_vex) {
+      p = in.encode(p);
+      if (ends) ends[i] = (unsigned)(p - start);
+      continue;
+    }
+    memcpy(p, &t.prefix_bytes[in.prefix], 4);
+    p += t.prefix_size[in.prefix];
+    *p = in.rex;
+    p += in.use_rex;
+    memcpy(p, &t.map_bytes[in.vex1], 2);
+    p += t.map_size[in.vex1];
+    *p++ = in.opcode;
+    if (in.has_modrm) {
+      byte* pmod = p;
+      *p++ = in.modrm;
+      if (!in.mod) {
+        *p = in.sib;
+        p += in.has_sib;
+        int disp32 = in.disp32;
+        memcpy(p, &disp32, 4);
+        unsigned disp_size = 4;
+        if (!in.fixed_base) {
+          if (disp32 == 0 && !in.force_disp) disp_size = 0;
+          else if ((char)disp32 == disp32) { *pmod |= 0x40; disp_size = 1; }
+          else *pmod |= 0x80;
+        }
+        p += disp_size;
+      }
+    }
+    // A 64-bit immediate continues into the displacement field.
+    unsigned long long imm = (unsigned)in.imm32 |
+                             ((unsigned long long)(unsigned)in.disp32 << 32);
+    memcpy(p, &imm, 8);
+    p += t.imm_size[in.flags];
+    if (ends) ends[i] = (unsigned)(p - start);
   }
   return p;
 }
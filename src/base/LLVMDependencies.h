@@ -22,6 +22,7 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <unordered_map>
@@ -217,6 +218,23 @@ inline std::ostream& operator<<(std::ostream& ss, const StringRef str) {
 } // end namespace ohmu
 
 
+namespace std {
+
+// Allows StringRef to be used as the key of a DenseMap.  This is the FNV-1a
+// hash of the characters.
+template<>
+struct hash<ohmu::StringRef> {
+  size_t operator()(ohmu::StringRef S) const {
+    uint64_t H = 14695981039346656037ULL;
+    for (size_t i = 0; i < S.size(); ++i)
+      H = (H ^ static_cast<unsigned char>(S.data()[i])) * 1099511628211ULL;
+    return static_cast<size_t>(H);
+  }
+};
+
+}  // end namespace std
+
+
 // Must be included after the above.
 #include "base/DiagnosticEmitter.h"
 
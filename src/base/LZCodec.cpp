@@ -0,0 +1,215 @@
+//===- LZCodec.cpp ---------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "LZCodec.h"
+
+#include <cstring>
+
+namespace ohmu {
+
+namespace {
+
+const unsigned HashBits  = 14;
+const size_t   MinMatch  = 4;
+const size_t   MaxOffset = 0xFFFF;
+
+// Inputs shorter than this are stored as literals.  Matches are not looked
+// for in the last few bytes, so that reads of 8 bytes stay in bounds.
+const size_t   MinInput  = 16;
+const size_t   EndMargin = 8;
+
+uint32_t load32(const uint8_t *P) {
+  uint32_t V;
+  memcpy(&V, P, sizeof(V));
+  return V;
+}
+
+uint64_t load64(const uint8_t *P) {
+  uint64_t V;
+  memcpy(&V, P, sizeof(V));
+  return V;
+}
+
+unsigned hash32(uint32_t V) {
+  return (V * 2654435761u) >> (32 - HashBits);
+}
+
+// Return the number of equal bytes at A and B, reading no further than End.
+size_t matchLength(const uint8_t *A, const uint8_t *B, const uint8_t *End) {
+  const uint8_t *Start = B;
+  while (B + 8 <= End) {
+    uint64_t X = load64(A) ^ load64(B);
+    if (X != 0) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return (B - Start) + (__builtin_ctzll(X) >> 3);
+#else
+      break;
+#endif
+    }
+    A += 8;
+    B += 8;
+  }
+  while (B < End && *A == *B) {
+    ++A;
+    ++B;
+  }
+  return B - Start;
+}
+
+// Write the extra bytes of a length which did not fit in its 4 bits.
+uint8_t *writeLength(uint8_t *Op, size_t Len) {
+  for (; Len >= 255; Len -= 255)
+    *Op++ = 255;
+  *Op++ = static_cast<uint8_t>(Len);
+  return Op;
+}
+
+// Write a command with the literals [Lit, Lit + NLit), and a match of
+// MatchLen bytes at Offset, or no match if MatchLen is zero.
+uint8_t *writeCommand(uint8_t *Op, const uint8_t *Lit, size_t NLit,
+                      size_t Offset, size_t MatchLen) {
+  uint8_t *Token = Op++;
+  *Token = static_cast<uint8_t>((NLit < 15 ? NLit : 15) << 4);
+  if (NLit >= 15)
+    Op = writeLength(Op, NLit - 15);
+  memcpy(Op, Lit, NLit);
+  Op += NLit;
+  if (MatchLen == 0)
+    return Op;
+
+  *Op++ = static_cast<uint8_t>(Offset);
+  *Op++ = static_cast<uint8_t>(Offset >> 8);
+  size_t M = MatchLen - MinMatch;
+  *Token |= static_cast<uint8_t>(M < 15 ? M : 15);
+  if (M >= 15)
+    Op = writeLength(Op, M - 15);
+  return Op;
+}
+
+// Read the extra bytes of a length.  Returns false on overrun.
+bool readLength(const uint8_t *&Ip, const uint8_t *End, size_t &Len) {
+  uint8_t B;
+  do {
+    if (Ip >= End)
+      return false;
+    B = *Ip++;
+    Len += B;
+  } while (B == 255);
+  return true;
+}
+
+}  // end anonymous namespace
+
+
+size_t LZCodec::compress(const uint8_t *Src, size_t Size, uint8_t *Dst) {
+  uint8_t *Op = Dst;
+  if (Size < MinInput)
+    return writeCommand(Op, Src, Size, 0, 0) - Dst;
+
+  // Entries hold a position plus one, so that zero means empty.
+  Table.assign(size_t(1) << HashBits, 0);
+
+  const uint8_t *Ip     = Src;
+  const uint8_t *Anchor = Src;
+  const uint8_t *End    = Src + Size;
+  const uint8_t *Limit  = End - EndMargin;
+  while (Ip < Limit) {
+    uint32_t Seq = load32(Ip);
+    uint32_t &Slot = Table[hash32(Seq)];
+    uint32_t Prev = Slot;
+    Slot = static_cast<uint32_t>(Ip - Src) + 1;
+    const uint8_t *Ref = Src + (Prev ? Prev - 1 : 0);
+    if (Prev == 0 || static_cast<size_t>(Ip - Ref) > MaxOffset ||
+        load32(Ref) != Seq) {
+      // Skip ahead faster through data which does not compress.
+      Ip += 1 + ((Ip - Anchor) >> 6);
+      continue;
+    }
+
+    // Extend the match backwards over literals which also match.
+    while (Ip > Anchor && Ref > Src && Ip[-1] == Ref[-1]) {
+      --Ip;
+      --Ref;
+    }
+    size_t Len = MinMatch + matchLength(Ref + MinMatch, Ip + MinMatch, Limit);
+    Op = writeCommand(Op, Anchor, Ip - Anchor, Ip - Ref, Len);
+    Ip += Len;
+    Anchor = Ip;
+  }
+  return writeCommand(Op, Anchor, End - Anchor, 0, 0) - Dst;
+}
+
+
+bool LZCodec::decompress(const uint8_t *Src, size_t SrcSize,
+                         uint8_t *Dst, size_t DstSize) {
+  const uint8_t *Ip   = Src;
+  const uint8_t *IEnd = Src + SrcSize;
+  uint8_t *Op   = Dst;
+  uint8_t *OEnd = Dst + DstSize;
+  while (true) {
+    if (Ip >= IEnd)
+      return false;
+    unsigned Token = *Ip++;
+
+    size_t NLit = Token >> 4;
+    if (NLit == 15 && !readLength(Ip, IEnd, NLit))
+      return false;
+    if (NLit > static_cast<size_t>(IEnd - Ip) ||
+        NLit > static_cast<size_t>(OEnd - Op))
+      return false;
+    memcpy(Op, Ip, NLit);
+    Ip += NLit;
+    Op += NLit;
+
+    // The last command has no match.
+    if (Ip == IEnd)
+      return Op == OEnd;
+
+    if (IEnd - Ip < 2)
+      return false;
+    size_t Offset = Ip[0] | (size_t(Ip[1]) << 8);
+    Ip += 2;
+    size_t Len = Token & 15;
+    if (Len == 15 && !readLength(Ip, IEnd, Len))
+      return false;
+    Len += MinMatch;
+    if (Offset == 0 || Offset > static_cast<size_t>(Op - Dst) ||
+        Len > static_cast<size_t>(OEnd - Op))
+      return false;
+
+    const uint8_t *Ref = Op - Offset;
+    if (Offset >= 8 && Len + 8 <= static_cast<size_t>(OEnd - Op)) {
+      // Copy 8 bytes at a time; the copy may run past the match, but not
+      // past the end of the output.
+      uint8_t *MEnd = Op + Len;
+      while (Op < MEnd) {
+        memcpy(Op, Ref, 8);
+        Op += 8;
+        Ref += 8;
+      }
+      Op = MEnd;
+    } else {
+      // The match may overlap the bytes which it produces.
+      for (size_t i = 0; i < Len; ++i)
+        Op[i] = Ref[i];
+      Op += Len;
+    }
+  }
+}
+
+
+}  // end namespace ohmu
@@ -0,0 +1,78 @@
+//===- LZCodec.h -----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A small, fast compressor from the LZ77 family, in the style of LZ4.  It
+// trades compression ratio for speed, and is meant for blocks of up to a few
+// hundred kilobytes, each of which is compressed independently.
+//
+// A compressed block is a sequence of commands, each of which copies a run
+// of literal bytes from the input, and then copies a match from earlier in
+// the output:
+//
+//   token            literal length in the high 4 bits, and match length
+//                    minus 4 in the low 4 bits; 15 means that more bytes of
+//                    length follow, each adding up to 255
+//   literal length   only if the high 4 bits are 15
+//   literals
+//   offset           2 bytes, little-endian; distance back to the match
+//   match length     only if the low 4 bits are 15
+//
+// The last command has literals, but no match.  The compressed form does not
+// record the size of the block, which must be stored alongside it.
+//
+//===----------------------------------------------------------------------===//
+
+
+#ifndef OHMU_LZCODEC_H
+#define OHMU_LZCODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ohmu {
+
+
+class LZCodec {
+public:
+  LZCodec() { }
+
+  /// Return the largest size which compress() can produce for a block of
+  /// Size bytes.
+  static size_t compressBound(size_t Size) {
+    return Size + Size / 255 + 16;
+  }
+
+  /// Compress the Size bytes at Src into Dst, which must have room for
+  /// compressBound(Size) bytes.  Returns the size of the compressed block.
+  size_t compress(const uint8_t *Src, size_t Size, uint8_t *Dst);
+
+  /// Decompress the SrcSize bytes at Src into Dst, which must have room for
+  /// exactly DstSize bytes.  Returns false if the block is damaged, or does
+  /// not decompress to DstSize bytes.  Never writes outside of Dst.
+  static bool decompress(const uint8_t *Src, size_t SrcSize,
+                         uint8_t *Dst, size_t DstSize);
+
+private:
+  /// Positions of recent 4-byte sequences, indexed by hash.
+  std::vector<uint32_t> Table;
+};
+
+
+}  // end namespace ohmu
+
+#endif  // OHMU_LZCODEC_H
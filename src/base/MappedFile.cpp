@@ -0,0 +1,93 @@
+//===- MappedFile.cpp ------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "MappedFile.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ohmu {
+
+
+bool MappedFile::open(const std::string &Path, size_t Padding) {
+  close();
+#if defined(_WIN32)
+  return false;
+#else
+  int Fd = ::open(Path.c_str(), O_RDONLY);
+  if (Fd < 0)
+    return false;
+  struct stat St;
+  if (fstat(Fd, &St) != 0 || St.st_size < 0) {
+    ::close(Fd);
+    return false;
+  }
+  size_t FileSize = static_cast<size_t>(St.st_size);
+
+  // Reserve zeroed memory for the file and the padding, and map the file
+  // over the start of it.  Pages past the end of the file are then
+  // anonymous memory, rather than pages which fault when they are read.
+  size_t Total = FileSize + Padding;
+  if (Total == 0)
+    Total = 1;
+  void *P = mmap(nullptr, Total, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                 -1, 0);
+  if (P == MAP_FAILED) {
+    ::close(Fd);
+    return false;
+  }
+  if (FileSize > 0 &&
+      mmap(P, FileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, Fd, 0) ==
+        MAP_FAILED) {
+    munmap(P, Total);
+    ::close(Fd);
+    return false;
+  }
+  ::close(Fd);
+
+  Addr = P;
+  Size = FileSize;
+  MapSize = Total;
+  return true;
+#endif
+}
+
+
+void MappedFile::close() {
+#if !defined(_WIN32)
+  if (Addr)
+    munmap(Addr, MapSize);
+#endif
+  Addr = nullptr;
+  Size = 0;
+  MapSize = 0;
+}
+
+
+void MappedFile::adviseSequential() {
+#if !defined(_WIN32)
+  if (Size > 0)
+    madvise(Addr, Size, MADV_SEQUENTIAL);
+#endif
+}
+
+
+}  // end namespace ohmu
@@ -0,0 +1,71 @@
+//===- MappedFile.h --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// MappedFile maps a file read-only into memory, and unmaps it when it is
+// destroyed.
+//
+//===----------------------------------------------------------------------===//
+
+
+#ifndef OHMU_MAPPEDFILE_H
+#define OHMU_MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ohmu {
+
+
+class MappedFile {
+public:
+  MappedFile() : Addr(nullptr), Size(0), MapSize(0) { }
+  ~MappedFile() { close(); }
+
+  MappedFile(const MappedFile&) = delete;
+  void operator=(const MappedFile&) = delete;
+
+  /// Map the file at Path, followed by Padding bytes of zeros, so that
+  /// readers which may overrun the end of a damaged file do not fault.
+  /// Returns false if the file cannot be mapped, which is always the case
+  /// on platforms without mmap.
+  bool open(const std::string &Path, size_t Padding = 0);
+
+  /// Unmap the file.
+  void close();
+
+  bool isOpen() const { return Addr != nullptr; }
+
+  /// Return the contents of the file.
+  const uint8_t* data() const { return static_cast<const uint8_t*>(Addr); }
+
+  /// Return the size of the file, not including the padding.
+  size_t size() const { return Size; }
+
+  /// Advise the system that the file will be read from start to end.
+  void adviseSequential();
+
+private:
+  void*  Addr;
+  size_t Size;
+  size_t MapSize;
+};
+
+
+}  // end namespace ohmu
+
+#endif  // OHMU_MAPPEDFILE_H
@@ -134,8 +134,7 @@ void ExtendCallGraph::GenerateOhmuIR(const std::string &FName,
   ohmu::til::BytecodeStringWriter WriteStream;
   ohmu::til::BytecodeWriter Writer(&WriteStream);
 
-  Writer.traverseAll(SxBuilder.topLevelSlot());
-  WriteStream.flush();
+  Writer.write(SxBuilder.topLevelSlot());
   Builder.SetOhmuIR(FName, WriteStream.str());
 }
 
@@ -2,7 +2,7 @@
 #define OHMU_LSA_GRAPHDESERIALIZER_H
 
 #include "lsa/StandaloneGraphComputation.h"
-#include "til/Bytecode.h"
+#include "clang/Analysis/Til/BytecodeContainer.h"
 
 namespace ohmu {
 namespace lsa {
@@ -10,25 +10,33 @@ namespace lsa {
 template <class UserComputation>
 class GraphDeserializer {
 public:
+  /// Read a call graph written by GraphSerializer.  The IR of each function
+  /// is neither copied nor decoded until the vertex asks for it, so the
+  /// container is kept open by the builder.
   static void read(const std::string& FileName,
                    StandaloneGraphBuilder<UserComputation> *Builder) {
-    ohmu::MemRegion Arena;
-    ohmu::til::BytecodeFileReader ReadStream(FileName,
-        ohmu::MemRegionRef(&Arena));
-
-    int32_t NFunc = ReadStream.readInt32();
-    for (unsigned i = 0; i < NFunc; i++) {
-      std::string Function = ReadStream.readString();
-      std::string OhmuIR = ReadStream.readString();
-      typename GraphTraits<UserComputation>::VertexValueType Value;
-      Builder->addVertex(Function, OhmuIR, Value);
+    auto Container = std::make_shared<ohmu::til::BytecodeContainer>();
+    if (!Container->open(FileName))
+      return;
+
+    for (size_t i = 0; i < Container->size(); i++) {
+      const auto &Entry = Container->entry(i);
+      ohmu::til::BytecodeEntryReader ReadStream(Entry.Data, Entry.Size);
+      std::string Function = Entry.Name.str();
 
       int32_t NNodes = ReadStream.readInt32();
+      ReadStream.endAtom();
       for (unsigned n = 0; n < NNodes; n++) {
-        std::string Call = ReadStream.readString();
+        std::string Call = ReadStream.readString().str();
+        ReadStream.endAtom();
         Builder->addCall(Function, Call);
       }
+
+      auto OhmuIR = ReadStream.readString();
+      typename GraphTraits<UserComputation>::VertexValueType Value;
+      Builder->addVertex(Function, OhmuIR.data(), OhmuIR.size(), Value);
     }
+    Builder->retainIRSource(std::move(Container));
   }
 };
 
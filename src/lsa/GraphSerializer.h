@@ -1,7 +1,7 @@
 #ifndef OHMU_LSA_GRAPHSERIALIZER_H
 #define OHMU_LSA_GRAPHSERIALIZER_H
 
-#include "clang/Analysis/Til/Bytecode.h"
+#include "clang/Analysis/Til/BytecodeContainer.h"
 #include "lsa/BuildCallGraph.h"
 
 namespace ohmu {
@@ -9,21 +9,27 @@ namespace lsa {
 
 class GraphSerializer {
 public:
+  /// Write the call graph as a BytecodeContainer, with one entry for each
+  /// function.  Each entry holds the calls made by the function, followed
+  /// by its IR, so that the calls can be read without touching the IR.
   static void write(const std::string& FileName,
                     DefaultCallGraphBuilder *Builder) {
-    ohmu::til::BytecodeFileWriter WriteStream(FileName);
+    ohmu::til::BytecodeContainerWriter Writer(FileName);
 
-    WriteStream.writeInt32(Builder->GetGraph().size());
     for (const auto &Pair : Builder->GetGraph()) {
-      WriteStream.writeString(Pair.first);
-      WriteStream.writeString(Pair.second->GetIR());
+      ohmu::til::ByteStreamWriterBase &WriteStream =
+          Writer.beginEntry(Pair.first);
       WriteStream.writeInt32(Pair.second->GetCalls()->size());
+      WriteStream.endAtom();
       for (const std::string &Call : *Pair.second->GetCalls()) {
         WriteStream.writeString(Call);
+        WriteStream.endAtom();
       }
+      WriteStream.writeString(Pair.second->GetIR());
+      WriteStream.endAtom();
     }
 
-    WriteStream.flush();
+    Writer.finish();
   }
 };
 
@@ -29,6 +29,7 @@
 #include <unordered_set>
 
 #include "clang/Analysis/Til/Bytecode.h"
+#include "clang/Analysis/Til/BytecodeContainer.h"
 #include "clang/Analysis/Til/CFGBuilder.h"
 
 /// Allow for custom string type.
@@ -78,7 +79,8 @@ public:
 
 public:
   GraphVertex(const string &Id)
-      : VertexId(Id), OhmuIR(nullptr), OhmuIRBuilt(false),
+      : VertexId(Id), OhmuIRData(nullptr), OhmuIRSize(0), OhmuIR(nullptr),
+        OhmuIRBuilt(false),
         Value(VertexValueType()), HaltVote(false), ReiterateVote(false) {}
 
 public:
@@ -147,6 +149,13 @@ private:
     ohmu::MemRegionRef Arena(&Region);
     ohmu::til::CFGBuilder Builder(Arena);
 
+    if (OhmuIRData) {
+      // Read the IR in place from the container it was loaded from.
+      ohmu::til::BytecodeEntryReader ReadStream(OhmuIRData, OhmuIRSize);
+      ohmu::til::BytecodeReader Reader(Builder, &ReadStream);
+      OhmuIR = Reader.read();
+      return;
+    }
     ohmu::til::InMemoryReader ReadStream(OhmuIRRaw.data(), OhmuIRRaw.length(),
                                          Arena);
     ohmu::til::BytecodeReader Reader(Builder, &ReadStream);
@@ -156,6 +165,8 @@ private:
 private:
   string VertexId;
   string OhmuIRRaw;
+  const char *OhmuIRData; // IR held by a container, instead of OhmuIRRaw.
+  size_t OhmuIRSize;
   ohmu::til::SExpr *OhmuIR;
   ohmu::MemRegion Region; // Holding the IR.
   bool OhmuIRBuilt;
@@ -282,6 +293,23 @@ public:
     GraphVertex &Vertex = getVertex(Id);
     *Vertex.mutableValue() = Value;
     Vertex.OhmuIRRaw = IRRaw;
+    Vertex.OhmuIRData = nullptr;
+  }
+
+  /// As above, but the IR is not copied.  It must remain valid until the
+  /// computation is finished; see retainIRSource.
+  void addVertex(const string &Id, const char *IRData, size_t IRSize,
+                 const VertexValueType Value) {
+    GraphVertex &Vertex = getVertex(Id);
+    *Vertex.mutableValue() = Value;
+    Vertex.OhmuIRRaw.clear();
+    Vertex.OhmuIRData = IRData;
+    Vertex.OhmuIRSize = IRSize;
+  }
+
+  /// Keep the container C open for as long as this tool exists.
+  void retainIRSource(std::shared_ptr<ohmu::til::BytecodeContainer> C) {
+    IRSources.push_back(std::move(C));
   }
 
   /// Adds a call from Source to Destination. If a vertex does not exist, it is
@@ -371,6 +399,9 @@ private:
   std::vector<GraphVertex> Vertices;
   std::unordered_map<string, MessageList> Messages;
 
+  /// Containers which hold the IR of vertices added without copying it.
+  std::vector<std::shared_ptr<ohmu::til::BytecodeContainer>> IRSources;
+
   /// 'NCores' computations to be run multithreaded, each caching the graph
   /// changes made in a computation step.
   std::vector<std::unique_ptr<GraphComputation>> UserComputations;
@@ -495,6 +526,18 @@ public:
     Tool.addVertex(Id, OhmuIR, Value);
   }
 
+  /// Adds a vertex whose IR is held in memory which outlives the builder,
+  /// such as a BytecodeContainer passed to retainIRSource.
+  void addVertex(const string &Id, const char *IRData, size_t IRSize,
+                 VertexValueType &Value) {
+    Tool.addVertex(Id, IRData, IRSize, Value);
+  }
+
+  /// Keep the container C open until the builder is destroyed.
+  void retainIRSource(std::shared_ptr<ohmu::til::BytecodeContainer> C) {
+    Tool.retainIRSource(std::move(C));
+  }
+
   /// Adds a call from Source to Destination. If a vertex does not exist, it is
   /// created using the default constructor for its value.
   void addCall(const string &Source, const string &Destination) {
@@ -0,0 +1,264 @@
+//===- BackendTest.h -------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Helpers which are shared between the backend test drivers: timing of
+// calls, comparison of JIT results with the interpreter, and a driver for
+// tests which compile every function in a set of ohmu files with and
+// without one JIT pass.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_TEST_BACKEND_BACKENDTEST_H
+#define OHMU_TEST_BACKEND_BACKENDTEST_H
+
+#include "backend/jit/JIT.h"
+#include "test/Driver.h"
+#include "til/Interpreter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace ohmu {
+
+
+/// Default minimum time to spend running each function.
+const double DefaultMinSeconds = 0.02;
+
+typedef std::chrono::steady_clock Clock;
+
+
+/// Return the time since T0 in seconds.
+inline double secondsSince(Clock::time_point T0) {
+  return std::chrono::duration<double>(Clock::now() - T0).count();
+}
+
+
+/// Return the time per call of Fn, in nanoseconds.  Fn is called twice as
+/// often in each round, until a round takes at least MinSeconds.
+template<class F>
+inline double timeCalls(F Fn, double MinSeconds = DefaultMinSeconds) {
+  uint64_t Calls = 1;
+  double   Seconds = 0;
+  while (Seconds < MinSeconds) {
+    Calls *= 2;
+    auto T0 = Clock::now();
+    for (uint64_t i = 0; i < Calls; ++i)
+      Fn();
+    Seconds = secondsSince(T0);
+  }
+  return Seconds * 1e9 / static_cast<double>(Calls);
+}
+
+
+/// Return the time per call of the JIT-compiled F, in nanoseconds.
+inline double timeCalls(jit::JITModule &Jit, jit::JITFunction *F,
+                        const int64_t *Args) {
+  int64_t Result;
+  return timeCalls([&]() { Jit.run(F, Args, &Result); });
+}
+
+
+/// Return the arguments for a call of F on the interpreter, with every
+/// parameter set to N.
+inline std::vector<til::VMValue> makeArgs(til::VMFunction *F, int64_t N) {
+  std::vector<til::VMValue> Args;
+  for (auto &Bt : F->ParamTypes) {
+    til::VMValue V;
+    V.I64 = N;
+    Args.push_back(til::Interpreter::convertValue(
+        V, til::VT_I64, til::Interpreter::getVMType(Bt)));
+  }
+  return Args;
+}
+
+
+/// Run Jf with every parameter set to N, and compare the result with Vf on
+/// the interpreter.  Prints the mismatch, tagged with Mode if it is not
+/// null, and returns false if they disagree.  Sets Expected to the result
+/// of the interpreter, if it succeeded.
+inline bool checkJIT(til::Interpreter &Interp, til::VMFunction *Vf,
+                     jit::JITModule &Jit, jit::JITFunction *Jf, int64_t N,
+                     const char *Mode, int64_t *Expected = nullptr) {
+  std::vector<til::VMValue> VArgs = makeArgs(Vf, N);
+  std::vector<int64_t> JArgs(Jf->NumParams, N);
+
+  til::VMValue VResult;
+  int64_t JResult = 0;
+  bool VOk = Interp.run(Vf, VArgs.data(), &VResult);
+  bool JOk = Jit.run(Jf, JArgs.data(), &JResult);
+  int64_t E = 0;
+  if (VOk) {
+    til::VMType Ty = til::Interpreter::getVMType(Vf->ReturnType);
+    if (Ty != til::VT_Void)
+      E = til::Interpreter::convertValue(VResult, Ty, til::VT_I64).I64;
+  }
+  if (Expected)
+    *Expected = E;
+  if (VOk == JOk && (!VOk || E == JResult))
+    return true;
+
+  printf("  %-20s  n = %-6lld  MISMATCH", Vf->Name.c_str(),
+         static_cast<long long>(N));
+  if (Mode)
+    printf(" (%s)", Mode);
+  printf(": interpreter ");
+  if (VOk)
+    printf("%lld", static_cast<long long>(E));
+  else
+    printf("error (%s)", Interp.errorMessage());
+  if (JOk)
+    printf(", jit %lld\n", static_cast<long long>(JResult));
+  else
+    printf(", jit error\n");
+  return false;
+}
+
+
+/// Parse the ohmu file FileName into G, and lower it.  Returns false if the
+/// file cannot be read.  Test drivers are run from the top-level directory.
+inline bool loadFile(til::Global &G, const char *FileName) {
+  Driver D;
+  if (!D.initParser("src/grammar/ohmu.grammar"))
+    return false;
+  if (!D.parseDefinitions(&G, FileName))
+    return false;
+  G.lower();
+  return true;
+}
+
+
+/// A JIT pass which is tested by comparing code compiled with it against
+/// code compiled without it.  See runPassTest.
+class PassTest {
+public:
+  virtual ~PassTest() { }
+
+  /// Name of the pass in messages, such as "peephole".
+  virtual const char* name() const = 0;
+
+  /// Compile Jit without the pass.
+  virtual void disable(jit::JITModule &Jit) = 0;
+
+  /// Print the time per call of one function, without (Base) and with
+  /// (Opt) the pass.
+  virtual void reportFunction(jit::JITFunction *Base, jit::JITFunction *Opt,
+                              double BaseNs, double OptNs) {
+    printf("  %-20s  %10.1f -> %10.1f ns  (%5.2fx)\n",
+           Opt->Name.c_str(), BaseNs, OptNs, BaseNs / OptNs);
+  }
+
+  /// Print the statistics of the pass, after every function in a file has
+  /// been compiled.
+  virtual void reportFile(jit::JITModule &Base, jit::JITModule &Opt) = 0;
+};
+
+
+/// Compile every function in FileName with and without the pass T, check
+/// that both agree with the interpreter on inputs 0, 1, 7 and N, and report
+/// their times.  Counts functions which disagree in NumFailed.  Returns
+/// false if the file cannot be read.
+inline bool testPassOnFile(PassTest &T, const char *FileName, int64_t N,
+                           unsigned *NumFailed) {
+  til::Global G;
+  if (!loadFile(G, FileName))
+    return false;
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  til::Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+  jit::JITModule Base;
+  T.disable(Base);
+  Base.compileModule(G.global());
+  jit::JITModule Opt;
+  Opt.compileModule(G.global());
+
+  std::string Without = std::string("without ") + T.name();
+  std::string With    = std::string("with ") + T.name();
+  const int64_t Inputs[] = { 0, 1, 7, N };
+  for (auto &Of : Opt.functions()) {
+    jit::JITFunction *Bf = Base.findFunction(Of->Name);
+    til::VMFunction  *Vf = Interp.findFunction(Of->Name);
+    if (!Of->Compiled || !Bf || !Bf->Compiled || !Vf || !Vf->Compiled)
+      continue;
+    bool Ok = true;
+    for (int64_t In : Inputs) {
+      Ok = checkJIT(Interp, Vf, Base, Bf, In, Without.c_str()) && Ok;
+      Ok = checkJIT(Interp, Vf, Opt, Of.get(), In, With.c_str()) && Ok;
+    }
+    if (!Ok) {
+      ++*NumFailed;
+      continue;
+    }
+
+    std::vector<int64_t> Args(Of->NumParams, N);
+    double BNs = timeCalls(Base, Bf, Args.data());
+    double ONs = timeCalls(Opt, Of.get(), Args.data());
+    T.reportFunction(Bf, Of.get(), BNs, ONs);
+  }
+  T.reportFile(Base, Opt);
+  return true;
+}
+
+
+/// The main function of a pass test, which is run as:
+///
+///   Tool [-nN] src/ohmu/*.ohmu
+///
+/// N defaults to 100.  Returns non-zero if any results differ, or if a
+/// file cannot be loaded.
+inline int runPassTest(PassTest &T, const char *Tool, int argc,
+                       const char **argv) {
+  if (!jit::JITModule::isSupported()) {
+    std::cerr << "The JIT is not supported on this platform.\n";
+    return 0;
+  }
+
+  int64_t N = 100;
+  int i = 1;
+  if (argc > 1 && strncmp(argv[1], "-n", 2) == 0) {
+    N = atoll(argv[1] + 2);
+    ++i;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: " << Tool << " [-nN] file.ohmu...\n";
+    return 0;
+  }
+
+  unsigned NumFailed = 0;
+  for (; i < argc; ++i) {
+    if (!testPassOnFile(T, argv[i], N, &NumFailed)) {
+      std::cerr << "Could not load " << argv[i] << "\n";
+      ++NumFailed;
+    }
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
+
+
+}  // end namespace ohmu
+
+#endif  // OHMU_TEST_BACKEND_BACKENDTEST_H
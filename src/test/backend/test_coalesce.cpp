@@ -0,0 +1,62 @@
+//===- test_coalesce.cpp ---------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compiles every function in a set of ohmu files with and without the
+// JIT's copy coalescer, and checks that both agree with the interpreter.
+// Reports the time per call for each, the number of moves which were
+// removed, the size of the generated code, and the number of spilled
+// registers.  Usage, from the top-level directory:
+//
+//   test_coalesce [-nN] src/ohmu/*.ohmu
+//
+// Each function is called with all parameters set to 0, 1, 7, and N, where
+// N defaults to 100.  Returns non-zero if any results differ, or if a file
+// cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/backend/BackendTest.h"
+
+
+using namespace ohmu;
+using namespace ohmu::jit;
+
+
+class CoalesceTest : public PassTest {
+public:
+  virtual const char* name() const override { return "coalescing"; }
+
+  virtual void disable(JITModule &Jit) override { Jit.setCoalescing(false); }
+
+  virtual void reportFile(JITModule &Base, JITModule &Opt) override {
+    const CoalesceStats &S = Opt.coalesceStats();
+    printf("  %u of %u moves coalesced, %u constrained, %u conservative, "
+           "%u blocks removed\n", S.NumCoalesced, S.NumMoves,
+           S.NumConstrained, S.NumConservative, S.NumRemovedBlocks);
+    printf("  code size %zu -> %zu bytes\n", Base.codeSize(), Opt.codeSize());
+    printf("  spilled %u -> %u, spill loads %u -> %u\n",
+           Base.regAllocStats().NumSpilled, Opt.regAllocStats().NumSpilled,
+           Base.regAllocStats().NumSpillLoads,
+           Opt.regAllocStats().NumSpillLoads);
+  }
+};
+
+
+int main(int argc, const char** argv) {
+  CoalesceTest T;
+  return runPassTest(T, "test_coalesce", argc, argv);
+}
@@ -0,0 +1,210 @@
+//===- test_codecache.cpp --------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Tests the machine code cache of the JIT.  Every function in a set of ohmu
+// files is compiled with an empty cache, which is saved to a file.  The file
+// is then opened by a new cache, and the functions are compiled again by a
+// new module, which must find all of them in the cache.  Checks that both
+// versions agree with the interpreter, that code compiled with other
+// options is not reused, and that damaged cache files are rejected, and
+// reports the compile time with and without the cache.  Usage, from the
+// top-level directory:
+//
+//   test_codecache [-nN] src/ohmu/*.ohmu
+//
+// Each function is called with all parameters set to 0, 1, 7, and N, where
+// N defaults to 100.  Returns non-zero if any results differ, or if a file
+// cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/backend/BackendTest.h"
+
+
+using namespace ohmu;
+using namespace ohmu::til;
+using namespace ohmu::jit;
+
+
+static const char* const CachePath = "test_codecache.cache";
+
+
+// Check every compiled function of Jit against the interpreter.
+static void checkModule(Interpreter &Interp, JITModule &Jit, int64_t N,
+                        const char *Mode, unsigned *NumFailed) {
+  const int64_t Inputs[] = { 0, 1, 7, N };
+  for (auto &Jf : Jit.functions()) {
+    VMFunction *Vf = Interp.findFunction(Jf->Name);
+    if (!Jf->Compiled || !Vf || !Vf->Compiled)
+      continue;
+    bool Ok = true;
+    for (int64_t In : Inputs)
+      Ok = checkJIT(Interp, Vf, Jit, Jf.get(), In, Mode) && Ok;
+    if (!Ok)
+      ++*NumFailed;
+  }
+}
+
+
+// Compile Module into Jit, and return the time taken in microseconds.
+static double timeCompile(JITModule &Jit, SExpr *Module) {
+  auto T0 = Clock::now();
+  Jit.compileModule(Module);
+  return secondsSince(T0) * 1e6;
+}
+
+
+// Write the first Size bytes of the cache file, with the byte at Flip
+// inverted if it is in range, and check that the result cannot be opened.
+static bool checkDamaged(const std::string &Data, size_t Size, size_t Flip) {
+  std::string Damaged = Data.substr(0, Size);
+  if (Flip < Damaged.size())
+    Damaged[Flip] = ~Damaged[Flip];
+  FILE *F = fopen(CachePath, "wb");
+  if (!F)
+    return false;
+  fwrite(Damaged.data(), 1, Damaged.size(), F);
+  fclose(F);
+  CodeCache Cache;
+  return !Cache.open(CachePath) && Cache.size() == 0;
+}
+
+
+static bool testFile(const char* FileName, int64_t N, unsigned *NumFailed) {
+  Global G;
+  if (!loadFile(G, FileName))
+    return false;
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+
+  // Fill an empty cache, and save it.
+  CodeCache Cold;
+  JITModule ColdJit;
+  ColdJit.setCodeCache(&Cold);
+  double ColdUs = timeCompile(ColdJit, G.global());
+  checkModule(Interp, ColdJit, N, "cold", NumFailed);
+  const CodeCacheStats &CS = ColdJit.codeCacheStats();
+  unsigned NumCompiled = 0;
+  for (auto &Jf : ColdJit.functions())
+    NumCompiled += Jf->Compiled ? 1 : 0;
+  if (CS.NumHits != 0 || CS.NumStored != NumCompiled) {
+    printf("  cold: %u hits, %u stored, expected 0 and %u\n",
+           CS.NumHits, CS.NumStored, NumCompiled);
+    ++*NumFailed;
+  }
+  if (!Cold.save(CachePath)) {
+    printf("  cannot save %s\n", CachePath);
+    ++*NumFailed;
+    return true;
+  }
+
+  // Every function must now come from the file.
+  CodeCache Warm;
+  if (!Warm.open(CachePath) || Warm.size() != Cold.size()) {
+    printf("  cannot open %s\n", CachePath);
+    ++*NumFailed;
+    remove(CachePath);
+    return true;
+  }
+  JITModule WarmJit;
+  WarmJit.setCodeCache(&Warm);
+  double WarmUs = timeCompile(WarmJit, G.global());
+  checkModule(Interp, WarmJit, N, "warm", NumFailed);
+  const CodeCacheStats &WS = WarmJit.codeCacheStats();
+  if (WS.NumHits != NumCompiled || WS.NumStored != 0) {
+    printf("  warm: %u hits, %u stored, expected %u and 0\n",
+           WS.NumHits, WS.NumStored, NumCompiled);
+    ++*NumFailed;
+  }
+  for (auto &Wf : WarmJit.functions()) {
+    JITFunction *Cf = ColdJit.findFunction(Wf->Name);
+    if (Wf->Compiled && Cf && Wf->CodeSize != Cf->CodeSize) {
+      printf("  %-20s  CODE SIZE DIFFERS\n", Wf->Name.c_str());
+      ++*NumFailed;
+    }
+  }
+
+  // Code compiled with other options must not be reused.
+  JITModule OtherJit;
+  OtherJit.setPeephole(false);
+  OtherJit.setCodeCache(&Warm);
+  OtherJit.compileModule(G.global());
+  checkModule(Interp, OtherJit, N, "other options", NumFailed);
+  if (NumCompiled > 0 && OtherJit.codeCacheStats().NumHits != 0) {
+    printf("  REUSED CODE COMPILED WITH OTHER OPTIONS\n");
+    ++*NumFailed;
+  }
+
+  // Truncated or corrupted files must be rejected.
+  std::string Data;
+  if (FILE *F = fopen(CachePath, "rb")) {
+    char Buf[4096];
+    size_t Sz;
+    while ((Sz = fread(Buf, 1, sizeof(Buf), F)) > 0)
+      Data.append(Buf, Sz);
+    fclose(F);
+  }
+  if (!checkDamaged(Data, Data.size() - 1, Data.size()) ||
+      !checkDamaged(Data, Data.size(), 0) ||
+      !checkDamaged(Data, Data.size(), 8)) {
+    printf("  OPENED A DAMAGED CACHE FILE\n");
+    ++*NumFailed;
+  }
+  remove(CachePath);
+
+  printf("  %u functions, %zu bytes of code: compiled in %.0f us, "
+         "loaded in %.0f us  (%5.2fx)\n", NumCompiled, Data.size(), ColdUs,
+         WarmUs, ColdUs / WarmUs);
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  if (!JITModule::isSupported()) {
+    std::cerr << "The JIT is not supported on this platform.\n";
+    return 0;
+  }
+
+  int64_t N = 100;
+  int i = 1;
+  if (argc > 1 && strncmp(argv[1], "-n", 2) == 0) {
+    N = atoll(argv[1] + 2);
+    ++i;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: test_codecache [-nN] file.ohmu...\n";
+    return 0;
+  }
+
+  unsigned NumFailed = 0;
+  for (; i < argc; ++i) {
+    if (!testFile(argv[i], N, &NumFailed)) {
+      std::cerr << "Could not load " << argv[i] << "\n";
+      ++NumFailed;
+    }
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
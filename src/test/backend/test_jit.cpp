@@ -0,0 +1,125 @@
+//===- test_jit.cpp --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs every function in a set of ohmu files both natively, using the JIT,
+// and on the interpreter, which serves as the reference evaluator.  Reports
+// any difference in results, and the time per call for each.  Usage, from
+// the top-level directory:
+//
+//   test_jit [-nN] src/ohmu/*.ohmu
+//
+// Each function is called with all parameters set to 0, 1, 7, and N, where
+// N defaults to 100.  Returns non-zero if any results differ, or if a file
+// cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/backend/BackendTest.h"
+
+
+using namespace ohmu;
+using namespace ohmu::til;
+using namespace ohmu::jit;
+
+
+// Run F with every parameter set to N.  Returns false on a mismatch.
+static bool testFunction(Interpreter &Interp, VMFunction *Vf,
+                         JITModule &Jit, JITFunction *Jf, int64_t N,
+                         bool Time) {
+  int64_t Expected;
+  if (!checkJIT(Interp, Vf, Jit, Jf, N, nullptr, &Expected))
+    return false;
+  if (!Time)
+    return true;
+
+  std::vector<VMValue> VArgs = makeArgs(Vf, N);
+  std::vector<int64_t> JArgs(Jf->NumParams, N);
+  VMValue VResult;
+  bool VOk = false;
+  double VNs = timeCalls([&]() {
+    VOk = Interp.run(Vf, VArgs.data(), &VResult);
+  });
+  double JNs = timeCalls(Jit, Jf, JArgs.data());
+  printf("  %-20s", Vf->Name.c_str());
+  if (VOk)
+    printf("%14lld", static_cast<long long>(Expected));
+  else
+    printf("%14s", "error");
+  printf("  interp %10.1f ns  jit %10.1f ns  (%5.1fx)\n",
+         VNs, JNs, VNs / JNs);
+  return true;
+}
+
+
+static bool testFile(const char* FileName, int64_t N, unsigned *NumFailed) {
+  Global G;
+  if (!loadFile(G, FileName))
+    return false;
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+  JITModule Jit;
+  Jit.compileModule(G.global());
+
+  const int64_t Inputs[] = { 0, 1, 7, N };
+  for (auto &Jf : Jit.functions()) {
+    VMFunction *Vf = Interp.findFunction(Jf->Name);
+    if (!Jf->Compiled || !Vf || !Vf->Compiled)
+      continue;
+    for (unsigned i = 0; i < 4; ++i) {
+      if (!testFunction(Interp, Vf, Jit, Jf.get(), Inputs[i], i == 3))
+        ++*NumFailed;
+    }
+  }
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  if (!JITModule::isSupported()) {
+    std::cerr << "The JIT is not supported on this platform.\n";
+    return 0;
+  }
+
+  int64_t N = 100;
+  int i = 1;
+  if (argc > 1 && strncmp(argv[1], "-n", 2) == 0) {
+    N = atoll(argv[1] + 2);
+    ++i;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: test_jit [-nN] file.ohmu...\n";
+    return 0;
+  }
+
+  unsigned NumFailed = 0;
+  for (; i < argc; ++i) {
+    if (!testFile(argv[i], N, &NumFailed)) {
+      std::cerr << "Could not load " << argv[i] << "\n";
+      ++NumFailed;
+    }
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,198 @@
+//===- test_layout.cpp -----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Tests profile-guided block layout in the JIT.  Every function in a set of
+// ohmu files is compiled with profile counters and run, and the profile is
+// saved to a file and loaded again.  The functions are then compiled with
+// the original block order, with the layout estimated without a profile,
+// and with the layout taken from the profile.  Checks that the counts are
+// consistent, and that every version agrees with the interpreter, and
+// reports the time per call for each.  Usage, from the top-level directory:
+//
+//   test_layout [-nN] src/ohmu/*.ohmu
+//
+// Each function is called with all parameters set to 0, 1, 7, and N, where
+// N defaults to 10000.  Returns non-zero if any results differ, or if a
+// file cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/backend/BackendTest.h"
+
+
+using namespace ohmu;
+using namespace ohmu::til;
+using namespace ohmu::jit;
+
+
+static const char* const ProfilePath = "test_layout.profile";
+
+
+// Check that the count of each block which was run is the sum of the
+// counts of the edges out of it, and that the entry block ran at least
+// once per call; recursive functions run it more often.  Returns false on
+// a mismatch.
+static bool checkCounts(const char *Name, const BlockProfile &P,
+                        uint64_t NumCalls) {
+  std::vector<uint64_t> Out(P.BlockCounts.size(), 0);
+  std::vector<bool>     HasEdges(P.BlockCounts.size(), false);
+  for (auto &E : P.Edges) {
+    Out[E.From] += E.Count;
+    HasEdges[E.From] = true;
+  }
+  bool Ok = P.BlockCounts[0] >= NumCalls;
+  for (size_t b = 0; b < P.BlockCounts.size(); ++b) {
+    if (HasEdges[b] && Out[b] != P.BlockCounts[b])
+      Ok = false;
+  }
+  if (!Ok)
+    printf("  %-20s  INCONSISTENT PROFILE\n", Name);
+  return Ok;
+}
+
+
+static bool testFile(const char* FileName, int64_t N, unsigned *NumFailed) {
+  Global G;
+  if (!loadFile(G, FileName))
+    return false;
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+  const int64_t Inputs[] = { 0, 1, 7, N };
+  const uint64_t NumInputs = sizeof(Inputs) / sizeof(Inputs[0]);
+
+  // Gather a profile, and round-trip it through a file.
+  JITModule Train;
+  Train.setInstrumentation(true);
+  Train.compileModule(G.global());
+  for (auto &Tf : Train.functions()) {
+    VMFunction *Vf = Interp.findFunction(Tf->Name);
+    if (!Tf->Compiled || !Vf || !Vf->Compiled)
+      continue;
+    bool Ok = true;
+    for (int64_t In : Inputs)
+      Ok = checkJIT(Interp, Vf, Train, Tf.get(), In, "instrumented") && Ok;
+    if (!Ok)
+      ++*NumFailed;
+  }
+  ProfileData Collected;
+  Train.collectProfile(Collected);
+  ProfileData Profile;
+  if (!Collected.save(ProfilePath) || !Profile.load(ProfilePath)) {
+    printf("  cannot save and load %s\n", ProfilePath);
+    ++*NumFailed;
+  }
+  remove(ProfilePath);
+  for (auto &Tf : Train.functions()) {
+    if (!Tf->Compiled)
+      continue;
+    const BlockProfile *P = Profile.find(Tf->Hash);
+    const BlockProfile *C = Collected.find(Tf->Hash);
+    if (!P || !C || P->BlockCounts != C->BlockCounts ||
+        P->Edges.size() != C->Edges.size()) {
+      printf("  %-20s  PROFILE NOT SAVED\n", Tf->Name.c_str());
+      ++*NumFailed;
+      continue;
+    }
+    if (!checkCounts(Tf->Name.c_str(), *P, NumInputs))
+      ++*NumFailed;
+  }
+
+  JITModule Base;
+  Base.setBlockLayout(false);
+  Base.compileModule(G.global());
+  JITModule Static;
+  Static.compileModule(G.global());
+  JITModule Opt;
+  Opt.setProfile(&Profile);
+  Opt.compileModule(G.global());
+
+  for (auto &Of : Opt.functions()) {
+    JITFunction *Bf = Base.findFunction(Of->Name);
+    JITFunction *Sf = Static.findFunction(Of->Name);
+    VMFunction  *Vf = Interp.findFunction(Of->Name);
+    if (!Of->Compiled || !Bf || !Bf->Compiled || !Sf || !Sf->Compiled ||
+        !Vf || !Vf->Compiled)
+      continue;
+    bool Ok = true;
+    for (int64_t In : Inputs) {
+      Ok = checkJIT(Interp, Vf, Base, Bf, In, "original order") && Ok;
+      Ok = checkJIT(Interp, Vf, Static, Sf, In, "static layout") && Ok;
+      Ok = checkJIT(Interp, Vf, Opt, Of.get(), In, "profile layout") && Ok;
+    }
+    if (!Ok) {
+      ++*NumFailed;
+      continue;
+    }
+
+    std::vector<int64_t> Args(Of->NumParams, N);
+    double BNs = timeCalls(Base, Bf, Args.data());
+    double SNs = timeCalls(Static, Sf, Args.data());
+    double ONs = timeCalls(Opt, Of.get(), Args.data());
+    printf("  %-20s  %10.1f -> %10.1f (static) -> %10.1f ns (profile)  "
+           "(%5.2fx)\n", Of->Name.c_str(), BNs, SNs, ONs, BNs / ONs);
+  }
+
+  const LayoutStats &S = Static.layoutStats();
+  const LayoutStats &O = Opt.layoutStats();
+  printf("  static:  %u functions, %u blocks moved, %u cold\n",
+         S.NumFunctions, S.NumMovedBlocks, S.NumColdBlocks);
+  printf("  profile: %u of %u functions profiled, %u blocks moved, "
+         "%u cold\n", O.NumProfiled, O.NumFunctions, O.NumMovedBlocks,
+         O.NumColdBlocks);
+  if (O.NumProfiled != O.NumFunctions) {
+    printf("  PROFILE NOT FOUND\n");
+    ++*NumFailed;
+  }
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  if (!JITModule::isSupported()) {
+    std::cerr << "The JIT is not supported on this platform.\n";
+    return 0;
+  }
+
+  int64_t N = 10000;
+  int i = 1;
+  if (argc > 1 && strncmp(argv[1], "-n", 2) == 0) {
+    N = atoll(argv[1] + 2);
+    ++i;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: test_layout [-nN] file.ohmu...\n";
+    return 0;
+  }
+
+  unsigned NumFailed = 0;
+  for (; i < argc; ++i) {
+    if (!testFile(argv[i], N, &NumFailed)) {
+      std::cerr << "Could not load " << argv[i] << "\n";
+      ++NumFailed;
+    }
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
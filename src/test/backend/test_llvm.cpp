@@ -1,4 +1,4 @@
-//===- test_TILParser.cpp --------------------------------------*- C++ --*-===//
+//===- test_llvm.cpp -------------------------------------------*- C++ --*-===//
 // Copyright 2014  Google
 //
 // Licensed under the Apache License, Version 2.0 (the "License");
@@ -14,94 +14,165 @@
 // limitations under the License.
 //
 //===----------------------------------------------------------------------===//
+//
+// Compiles a set of ohmu files with the LLVM backend at each optimization
+// level, and runs every function on both the generated code and the
+// interpreter, which serves as the reference evaluator.  Reports any
+// difference in results, the time spent in each phase of compilation, and
+// the time per call.  Usage, from the top-level directory:
+//
+//   test_llvm [-On] [-nN] [-emit] src/ohmu/*.ohmu
+//
+// By default every level from O0 to O3 is tested; -On tests only level n.
+// Each function is called with all parameters set to 0, 1, 7, and N, where
+// N defaults to 100.  -emit prints the optimized IR.  Returns non-zero if
+// any results differ, or if a file cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
 
-#include "backend/llvm/IRGen.h"
-#include "clang/Analysis/Analyses/ThreadSafetyTIL.h"
-#include "clang/Analysis/Analyses/ThreadSafetyTraverse.h"
-#include "parser/DefaultLexer.h"
-#include "parser/BNFParser.h"
-#include "parser/TILParser.h"
-#include "til/CFGReducer.h"
+#include "backend/llvm/LLVMJIT.h"
+#include "test/backend/BackendTest.h"
 
-#include <iostream>
 
 using namespace ohmu;
-using namespace ohmu::parsing;
-using namespace clang::threadSafety;
-
-class TILPrinter : public til::PrettyPrinter<TILPrinter, std::ostream> {
-public:
-  TILPrinter() : PrettyPrinter(false, false) { }
-};
-
-void printSExpr(til::SExpr* e) {
-  TILPrinter::print(e, std::cout);
+using namespace ohmu::til;
+using namespace ohmu::backend_llvm;
+
+
+// Return true if A and B hold the same value of type Ty.
+static bool sameValue(VMValue A, VMValue B, VMType Ty) {
+  switch (Ty) {
+    case VT_Void: return true;
+    case VT_F32:  return A.F32 == B.F32 || (A.F32 != A.F32 && B.F32 != B.F32);
+    case VT_F64:  return A.F64 == B.F64 || (A.F64 != A.F64 && B.F64 != B.F64);
+    default:
+      return Interpreter::convertValue(A, Ty, VT_U64).U64 ==
+             Interpreter::convertValue(B, Ty, VT_U64).U64;
+  }
 }
 
 
-int main(int argc, const char** argv) {
-  DefaultLexer lexer;
-  TILParser tilParser(&lexer);
-
-
-  const char* grammarFileName = "src/grammar/ohmu.grammar";
-  FILE* file = fopen(grammarFileName, "r");
-  if (!file) {
-    std::cout << "File " << grammarFileName << " not found.\n";
-    return -1;
+// Run F with every parameter set to N.  Returns false on a mismatch.
+static bool testFunction(Interpreter &Interp, VMFunction *Vf,
+                         LLVMModule &Llvm, LLVMFunction *Lf, int64_t N,
+                         bool Time) {
+  std::vector<VMValue> Args;
+  for (auto &Bt : Vf->ParamTypes) {
+    VMValue V;
+    V.I64 = N;
+    Args.push_back(Interpreter::convertValue(V, VT_I64,
+                                             Interpreter::getVMType(Bt)));
   }
 
-  bool success = BNFParser::initParserFromFile(tilParser, file, false);
-  std::cout << "\n";
-  // if (success)
-  //  tilParser.printSyntax(std::cout);
-
-  fclose(file);
+  VMType Ty = Interpreter::getVMType(Vf->ReturnType);
+  VMValue VResult, LResult;
+  VResult.U64 = 0;
+  bool VOk = Interp.run(Vf, Args.data(), &VResult);
+  bool LOk = Llvm.run(Lf, Args.data(), &LResult);
+
+  if (VOk != LOk || (VOk && !sameValue(VResult, LResult, Ty))) {
+    printf("  %-20s  n = %-6lld  MISMATCH: interpreter ",
+           Vf->Name.c_str(), static_cast<long long>(N));
+    if (VOk)
+      printf("%lld", static_cast<long long>(
+        Interpreter::convertValue(VResult, Ty, VT_I64).I64));
+    else
+      printf("error (%s)", Interp.errorMessage());
+    if (LOk)
+      printf(", llvm %lld\n", static_cast<long long>(
+        Interpreter::convertValue(LResult, Ty, VT_I64).I64));
+    else
+      printf(", llvm error\n");
+    return false;
+  }
+  if (!Time)
+    return true;
+
+  double VNs = timeCalls([&]() { Interp.run(Vf, Args.data(), &VResult); });
+  double LNs = timeCalls([&]() { Llvm.run(Lf, Args.data(), &LResult); });
+  printf("  %-20s  interp %10.1f ns  llvm %10.1f ns  (%5.1fx)\n",
+         Vf->Name.c_str(), VNs, LNs, VNs / LNs);
+  return true;
+}
 
-  if (argc == 0)
-    return 0;
 
-  // Read the ohmu file.
-  auto *startRule = tilParser.findDefinition("definitions");
-  if (!startRule) {
-    std::cout << "Grammar does not contain rule named 'definitions'.\n";
-    return -1;
+static bool testFile(const char* FileName, int MinLevel, int MaxLevel,
+                     int64_t N, bool Emit, unsigned *NumFailed) {
+  Global G;
+  if (!loadFile(G, FileName))
+    return false;
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+
+  const int64_t Inputs[] = { 0, 1, 7, N };
+  for (int Level = MinLevel; Level <= MaxLevel; ++Level) {
+    LLVMModule Llvm{ MemRegionRef(&Region) };
+    Llvm.generate(G.global());
+    std::string IR;
+    if (!Llvm.compile(Level, Emit ? &IR : nullptr)) {
+      ++*NumFailed;
+      continue;
+    }
+    if (Emit)
+      printf("%s", IR.c_str());
+
+    auto &S = Llvm.stats();
+    double Total = S.IRGenSeconds + S.OptSeconds + S.CodegenSeconds;
+    printf(" O%d: irgen %.2f ms  opt %.2f ms  codegen %.2f ms  "
+           "total %.2f ms  (%u instructions)\n",
+           Level, S.IRGenSeconds * 1e3, S.OptSeconds * 1e3,
+           S.CodegenSeconds * 1e3, Total * 1e3, S.NumInstructions);
+
+    for (auto &Lf : Llvm.functions()) {
+      VMFunction *Vf = Interp.findFunction(Lf->Name);
+      if (!Lf->Compiled || !Vf || !Vf->Compiled)
+        continue;
+      for (unsigned i = 0; i < 4; ++i) {
+        if (!testFunction(Interp, Vf, Llvm, Lf.get(), Inputs[i], i == 3))
+          ++*NumFailed;
+      }
+    }
   }
+  return true;
+}
 
-  file = fopen(argv[1], "r");
-  if (!file) {
-    std::cout << "File " << argv[1] << " not found.\n";
-    return -1;
-  }
 
-  std::cout << "\nParsing " << argv[1] << "...\n";
-  FileStream fs(file);
-  lexer.setStream(&fs);
-  // tilParser.setTrace(true);
-  ParseResult result = tilParser.parse(startRule);
-  if (tilParser.parseError())
-    return -1;
-
-  // Pretty print the parsed ohmu code.
-  auto* v = result.getList<til::SExpr>(TILParser::TILP_SExpr);
-  if (!v) {
-    std::cout << "No definitions found.\n";
+int main(int argc, const char** argv) {
+  int     MinLevel = 0;
+  int     MaxLevel = 3;
+  int64_t N = 100;
+  bool    Emit = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strncmp(argv[i], "-O", 2) == 0)
+      MinLevel = MaxLevel = atoi(argv[i] + 2);
+    else if (strncmp(argv[i], "-n", 2) == 0)
+      N = atoll(argv[i] + 2);
+    else if (strcmp(argv[i], "-emit") == 0)
+      Emit = true;
+    else
+      break;
+  }
+  if (i >= argc || MinLevel < 0 || MaxLevel > 3) {
+    std::cerr << "Usage: test_llvm [-On] [-nN] [-emit] file.ohmu...\n";
     return 0;
   }
 
-  for (SExpr* e : *v) {
-    std::cout << "\nDefinition:\n";
-    printSExpr(e);
-    std::cout << "\nCFG:\n";
-    SExpr* e2 = CFGReducer::lower(e, tilParser.arena());
-    printSExpr(e2);
-
-    //backend_llvm::generate_LLVM_IR(cfg);
+  unsigned NumFailed = 0;
+  for (; i < argc; ++i) {
+    if (!testFile(argv[i], MinLevel, MaxLevel, N, Emit, &NumFailed)) {
+      std::cerr << "Could not load " << argv[i] << "\n";
+      ++NumFailed;
+    }
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
   }
-
-  delete v;
-
-  std::cout << "\n";
   return 0;
 }
-
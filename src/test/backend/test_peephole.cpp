@@ -0,0 +1,65 @@
+//===- test_peephole.cpp ---------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compiles every function in a set of ohmu files with and without the
+// JIT's peephole optimizer, and checks that both agree with the
+// interpreter.  Reports the size of the machine code and the time per call
+// for each, and the number of MachineIR instructions before and after the
+// peephole pass.  Usage, from the top-level directory:
+//
+//   test_peephole [-nN] src/ohmu/*.ohmu
+//
+// Each function is called with all parameters set to 0, 1, 7, and N, where
+// N defaults to 100.  Returns non-zero if any results differ, or if a file
+// cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/backend/BackendTest.h"
+
+
+using namespace ohmu;
+using namespace ohmu::jit;
+
+
+class PeepholeTest : public PassTest {
+public:
+  virtual const char* name() const override { return "peephole"; }
+
+  virtual void disable(JITModule &Jit) override { Jit.setPeephole(false); }
+
+  virtual void reportFunction(JITFunction *Base, JITFunction *Opt,
+                              double BaseNs, double OptNs) override {
+    printf("  %-20s  %5zu -> %5zu bytes  %10.1f -> %10.1f ns  (%5.2fx)\n",
+           Opt->Name.c_str(), Base->CodeSize, Opt->CodeSize, BaseNs, OptNs,
+           BaseNs / OptNs);
+  }
+
+  virtual void reportFile(JITModule &Base, JITModule &Opt) override {
+    const PeepholeStats &S = Opt.peepholeStats();
+    printf("  instrs %u -> %u: %u leas, %u immediates, %u fused branches, "
+           "%u copies, %u deleted\n",
+           S.NumInstrsBefore, S.NumInstrsAfter, S.NumLeas, S.NumImmediates,
+           S.NumCondBranches, S.NumCopies, S.NumDeleted);
+  }
+};
+
+
+int main(int argc, const char** argv) {
+  PeepholeTest T;
+  return runPassTest(T, "test_peephole", argc, argv);
+}
@@ -0,0 +1,304 @@
+//===- test_regalloc.cpp ---------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs the JIT's register allocator on large synthetic machine functions,
+// built from random nests of straight-line code, diamonds, and loops, with
+// calls scattered throughout.  Reports allocation time and the number of
+// spilled intervals, spill loads, and spill stores, compared against the
+// loads and stores of giving every virtual register its own stack slot.
+// Every allocation is checked with verifyRegisters.  Usage:
+//
+//   test_regalloc [-sS] [-rR] [size...]
+//
+// Each size is the approximate number of instructions in a function, and
+// defaults to 1000, 5000, and 20000.  R functions are generated for each
+// size, from random seed S.  Returns non-zero if any allocation is invalid.
+//
+//===----------------------------------------------------------------------===//
+
+#include "backend/jit/RegAlloc.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+
+using namespace ohmu::jit;
+
+typedef std::chrono::steady_clock Clock;
+
+
+/// Builds a random, well-formed MachineFunction.
+class CFGGenerator {
+public:
+  CFGGenerator(MachineFunction &MF, unsigned Seed)
+      : MF(MF), Rng(Seed), Cur(0), Emitted(0), Budget(0) { }
+
+  void generate(unsigned NumInstrs);
+
+private:
+  unsigned random(unsigned N) { return Rng() % N; }
+
+  // Usually pick a recent value, so that most intervals are short, but
+  // sometimes reach back to keep a value live for a long time.
+  uint32_t pick() {
+    unsigned Back = 0;
+    while (Back + 1 < Pool.size() && random(4) != 0)
+      ++Back;
+    if (random(8) == 0)
+      Back = random(Pool.size());
+    return Pool[Pool.size() - 1 - Back];
+  }
+
+  unsigned newBlock() {
+    MF.Blocks.emplace_back();
+    return MF.Blocks.size() - 1;
+  }
+
+  void emit(const MInstr &I) {
+    MF.Blocks[Cur].Instrs.push_back(I);
+    ++Emitted;
+  }
+
+  void jump(unsigned Target) {
+    MInstr J = MInstr::make(MOP_Jump, 4, MInstr::NoReg);
+    J.Target0 = Target;
+    emit(J);
+  }
+
+  void straightLine(unsigned N);
+  void diamond(unsigned Depth);
+  void loop(unsigned Depth);
+  void region(unsigned Depth);
+
+  MachineFunction& MF;
+  std::mt19937 Rng;
+  std::vector<uint32_t> Pool;     ///< Values which are defined here.
+  unsigned Cur;
+  unsigned Emitted;
+  unsigned Budget;
+};
+
+
+void CFGGenerator::straightLine(unsigned N) {
+  static const MOpcode Ops[] = {
+    MOP_Add, MOP_Sub, MOP_Mul, MOP_And, MOP_Or, MOP_Xor, MOP_Shl, MOP_SDiv
+  };
+  for (unsigned i = 0; i < N; ++i) {
+    uint32_t Dst = MF.newVReg();
+    unsigned K = random(16);
+    if (K == 0) {
+      MInstr I = MInstr::make(MOP_MovImm, 8, Dst);
+      I.Imm = static_cast<int64_t>(Rng());
+      emit(I);
+    }
+    else if (K == 1) {
+      MInstr I = MInstr::make(MOP_Call, 8, Dst);
+      I.Target0 = MF.ArgRegs.size();
+      I.Target1 = 1 + random(NumParamRegs);
+      for (unsigned a = 0; a < I.Target1; ++a)
+        MF.ArgRegs.push_back(pick());
+      emit(I);
+    }
+    else {
+      MOpcode Op = Ops[random(sizeof(Ops) / sizeof(Ops[0]))];
+      emit(MInstr::make(Op, 8, Dst, pick(), pick()));
+    }
+    Pool.push_back(Dst);
+  }
+}
+
+
+// if (c) { ...; p = x } else { ...; p = y }
+void CFGGenerator::diamond(unsigned Depth) {
+  uint32_t Phi = MF.newVReg();
+  MInstr Br = MInstr::make(MOP_Branch, 4, MInstr::NoReg, pick());
+  Br.Target0 = newBlock();
+  Br.Target1 = newBlock();
+  unsigned Join = newBlock();
+  emit(Br);
+
+  size_t PoolSize = Pool.size();
+  for (unsigned Side : { Br.Target0, Br.Target1 }) {
+    Cur = Side;
+    region(Depth + 1);
+    emit(MInstr::make(MOP_Mov, 8, Phi, pick()));
+    jump(Join);
+    Pool.resize(PoolSize);
+  }
+  Cur = Join;
+  Pool.push_back(Phi);
+}
+
+
+// while (c) { ...; v1 = x1; ... vn = xn }
+void CFGGenerator::loop(unsigned Depth) {
+  std::vector<uint32_t> Carried;
+  for (unsigned i = 0, n = 1 + random(4); i < n; ++i)
+    Carried.push_back(pick());
+
+  unsigned Header = newBlock();
+  jump(Header);
+  Cur = Header;
+  uint32_t C = MF.newVReg();
+  MInstr Cmp = MInstr::make(MOP_SetCC, 8, C, pick(), Carried[0]);
+  Cmp.CC = MCC_LT;
+  emit(Cmp);
+  MInstr Br = MInstr::make(MOP_Branch, 4, MInstr::NoReg, C);
+  Br.Target0 = newBlock();
+  Br.Target1 = newBlock();
+  emit(Br);
+
+  size_t PoolSize = Pool.size();
+  Cur = Br.Target0;
+  region(Depth + 1);
+  for (uint32_t V : Carried)
+    emit(MInstr::make(MOP_Mov, 8, V, pick()));
+  jump(Header);
+  Pool.resize(PoolSize);
+  Cur = Br.Target1;
+}
+
+
+void CFGGenerator::region(unsigned Depth) {
+  unsigned Pieces = 1 + random(3);
+  for (unsigned i = 0; i < Pieces; ++i) {
+    straightLine(1 + random(12));
+    if (Emitted >= Budget || Depth >= 6)
+      continue;
+    switch (random(3)) {
+      case 0:  diamond(Depth); break;
+      case 1:  loop(Depth);    break;
+      default: break;
+    }
+  }
+}
+
+
+void CFGGenerator::generate(unsigned NumInstrs) {
+  Emitted = 0;
+  Budget = NumInstrs;
+  MF.NumParams = 1 + random(NumParamRegs);
+  MF.NumVRegs = MF.NumParams;
+  for (unsigned i = 0; i < MF.NumParams; ++i)
+    Pool.push_back(i);
+
+  Cur = newBlock();
+  while (Emitted < Budget)
+    region(0);
+  emit(MInstr::make(MOP_Return, 8, MInstr::NoReg, pick()));
+}
+
+
+struct Totals {
+  Totals() : Seconds(0), Uses(0), Defs(0) { }
+
+  RegAllocStats Stats;
+  double   Seconds;
+  unsigned Uses;     ///< Loads and stores with a stack slot for every vreg.
+  unsigned Defs;
+};
+
+
+static void add(Totals &T, const RegAllocStats &S) {
+  T.Stats.NumInstrs      += S.NumInstrs;
+  T.Stats.NumIntervals   += S.NumIntervals;
+  T.Stats.NumSpilled     += S.NumSpilled;
+  T.Stats.NumSpillLoads  += S.NumSpillLoads;
+  T.Stats.NumSpillStores += S.NumSpillStores;
+  T.Stats.NumSavedRegs   += S.NumSavedRegs;
+}
+
+
+static bool testSize(unsigned Size, unsigned Seed, unsigned Runs) {
+  Totals T;
+  unsigned NumBlocks = 0;
+  for (unsigned r = 0; r < Runs; ++r) {
+    MachineFunction MF;
+    CFGGenerator(MF, Seed + r).generate(Size);
+    NumBlocks += MF.Blocks.size();
+    for (auto &B : MF.Blocks) {
+      for (auto &I : B.Instrs) {
+        T.Uses += (I.A != MInstr::NoReg) + (I.B != MInstr::NoReg);
+        if (I.Op == MOP_Call)
+          T.Uses += I.Target1;
+        T.Defs += I.Dst != MInstr::NoReg;
+      }
+    }
+
+    RegAllocStats S;
+    auto T0 = Clock::now();
+    allocateRegisters(MF, &S);
+    T.Seconds += std::chrono::duration<double>(Clock::now() - T0).count();
+    add(T, S);
+
+    std::string Err;
+    if (!verifyRegisters(MF, &Err)) {
+      printf("  size %u, seed %u: %s\n", Size, Seed + r, Err.c_str());
+      return false;
+    }
+  }
+
+  const RegAllocStats &S = T.Stats;
+  printf("%7u %7u %8u %9u %7u %7u %7u %5.1f %9.3f %8.1f  %5.1f%% %5.1f%%\n",
+         Size, NumBlocks / Runs, S.NumInstrs / Runs, S.NumIntervals / Runs,
+         S.NumSpilled / Runs, S.NumSpillLoads / Runs, S.NumSpillStores / Runs,
+         static_cast<double>(S.NumSavedRegs) / Runs,
+         T.Seconds * 1e3 / Runs, T.Seconds * 1e9 / S.NumInstrs,
+         100.0 * S.NumSpillLoads / T.Uses, 100.0 * S.NumSpillStores / T.Defs);
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  unsigned Seed = 1;
+  unsigned Runs = 5;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strncmp(argv[i], "-s", 2) == 0)
+      Seed = atoi(argv[i] + 2);
+    else if (strncmp(argv[i], "-r", 2) == 0)
+      Runs = atoi(argv[i] + 2);
+    else
+      break;
+  }
+  std::vector<unsigned> Sizes;
+  for (; i < argc; ++i)
+    Sizes.push_back(atoi(argv[i]));
+  if (Sizes.empty())
+    Sizes = { 1000, 5000, 20000 };
+  if (Runs == 0)
+    Runs = 1;
+
+  // Loads and stores are given as a percentage of the memory operations
+  // needed when every virtual register lives in a stack slot.
+  printf("   size  blocks   instrs intervals spilled   loads  stores saved"
+         "  alloc ms ns/instr  loads stores\n");
+  unsigned NumFailed = 0;
+  for (unsigned Size : Sizes) {
+    if (!testSize(Size, Seed, Runs))
+      ++NumFailed;
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,346 @@
+//===- test_switch.cpp -----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Builds functions which switch on their argument with CFGBuilder -- dense,
+// sparse, and small-range labels, signed and unsigned, 32 and 64-bit, with
+// and without a default -- and compiles them with the JIT, with switch
+// clustering and with a linear chain of compares.  Both are checked against
+// the interpreter on every label and its neighbours, and on the extremes of
+// each type.  The time per call is reported for calls which take each case
+// in turn, and for calls which take random cases.  Usage:
+//
+//   test_switch
+//
+// Returns non-zero if any results differ.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/backend/BackendTest.h"
+#include "til/CFGBuilder.h"
+
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+
+
+using namespace ohmu;
+using namespace ohmu::til;
+using namespace ohmu::jit;
+
+
+// Number of random arguments to cycle through when timing.
+static const unsigned NumTimedArgs = 1 << 16;
+
+
+/// A function which switches on its argument x, and returns the index of
+/// the case block that was taken, or -1 for the default.
+struct SwitchSpec {
+  const char *Name;
+  BaseType    Ty;
+  bool        HasDefault;
+  std::vector<std::pair<int64_t, int>> Cases;   ///< Label, block.
+};
+
+
+template<class T>
+static T* typed(T *I, BaseType Bt) {
+  I->setBaseType(Bt);
+  return I;
+}
+
+
+static SExpr* newLabel(CFGBuilder &Bld, BaseType Ty, int64_t V) {
+  if (Ty.Base == BaseType::BT_UnsignedInt) {
+    if (Ty.Size == BaseType::ST_32)
+      return Bld.newLiteralT<uint32_t>(static_cast<uint32_t>(V));
+    return Bld.newLiteralT<uint64_t>(static_cast<uint64_t>(V));
+  }
+  if (Ty.Size == BaseType::ST_32)
+    return Bld.newLiteralT<int32_t>(static_cast<int32_t>(V));
+  return Bld.newLiteralT<int64_t>(V);
+}
+
+
+// Make the slot Name(x: Ty): Int32.
+static Slot* makeSwitch(CFGBuilder &Bld, const SwitchSpec &Spec) {
+  auto *Vd = Bld.newVarDecl(VarDecl::VK_Fun, "x",
+                            Bld.newScalarType(Spec.Ty));
+  Bld.enterScope(Vd);
+  auto *X = typed(Bld.newVariable(Vd), Spec.Ty);
+
+  int NumBlocks = 0;
+  for (auto &C : Spec.Cases)
+    NumBlocks = std::max(NumBlocks, C.second + 1);
+
+  Bld.beginCFG(nullptr);
+  auto *Cfg = Bld.currentCFG();
+  Bld.beginBlock(Cfg->entry());
+  std::vector<BasicBlock*> Blocks;
+  for (int i = 0; i < NumBlocks; ++i)
+    Blocks.push_back(Bld.newBlock());
+  auto *Default = Bld.newBlock();
+  auto *Sw = Bld.newSwitch(X, Spec.Cases.size() + 1);
+  for (auto &C : Spec.Cases)
+    Bld.addSwitchCase(Sw, newLabel(Bld, Spec.Ty, C.first), Blocks[C.second]);
+  if (Spec.HasDefault)
+    Bld.addSwitchCase(Sw, Bld.newWildcard(), Default);
+
+  for (int i = 0; i < NumBlocks; ++i) {
+    Bld.beginBlock(Blocks[i]);
+    Bld.newGoto(Cfg->exit(), Bld.newLiteralT<int32_t>(i));
+  }
+  Bld.beginBlock(Default);
+  Bld.newGoto(Cfg->exit(), Bld.newLiteralT<int32_t>(-1));
+  Bld.endCFG();
+
+  BaseType I32 = BaseType::getBaseType<int32_t>();
+  SExpr *F = Bld.newCode(Bld.newScalarType(I32), Cfg);
+  Bld.exitScope();
+  F = Bld.newFunction(Vd, F);
+  return Bld.newSlot(Spec.Name, F);
+}
+
+
+static std::vector<SwitchSpec> makeSpecs() {
+  BaseType I32 = BaseType::getBaseType<int32_t>();
+  BaseType I64 = BaseType::getBaseType<int64_t>();
+  BaseType U32 = BaseType::getBaseType<uint32_t>();
+  std::vector<SwitchSpec> Specs;
+
+  // Labels 0..63, with a later duplicate which must never be taken.
+  SwitchSpec Dense{ "dense", I32, true, {} };
+  for (int i = 0; i < 64; ++i)
+    Dense.Cases.emplace_back(i, i * 7 % 12);
+  Dense.Cases.emplace_back(10, 12);
+  Specs.push_back(Dense);
+
+  SwitchSpec Sparse{ "sparse", I32, true, {} };
+  for (int i = 0; i < 32; ++i)
+    Sparse.Cases.emplace_back((i - 16) * (i - 16) * 1237 + i, i % 6);
+  Sparse.Cases.emplace_back(std::numeric_limits<int32_t>::min(), 6);
+  Sparse.Cases.emplace_back(std::numeric_limits<int32_t>::max(), 7);
+  Specs.push_back(Sparse);
+
+  // Character classes, which span fewer than 64 values.
+  SwitchSpec Bits{ "bits", I32, true, {} };
+  for (char C : { 'A', 'E', 'I', 'O', 'U' })
+    Bits.Cases.emplace_back(C, 0);
+  for (char C : { 'W', 'Y' })
+    Bits.Cases.emplace_back(C, 1);
+  for (char C : { ' ', '!', ',', '.', '?' })
+    Bits.Cases.emplace_back(C, 2);
+  Specs.push_back(Bits);
+
+  SwitchSpec Ranges{ "ranges64", I64, true, {} };
+  for (int i = 100; i < 120; ++i)
+    Ranges.Cases.emplace_back(i, 0);
+  for (int i = 120; i < 140; ++i)
+    Ranges.Cases.emplace_back(i, 1);
+  Ranges.Cases.emplace_back(int64_t(1) << 40, 2);
+  Ranges.Cases.emplace_back(-(int64_t(1) << 40), 3);
+  for (int i = 0; i < 10; ++i)
+    Ranges.Cases.emplace_back(5000000000LL + i, 4);
+  Ranges.Cases.emplace_back(std::numeric_limits<int64_t>::min(), 5);
+  Ranges.Cases.emplace_back(std::numeric_limits<int64_t>::max(), 6);
+  Specs.push_back(Ranges);
+
+  SwitchSpec Unsigned{ "unsigned32", U32, true, {} };
+  for (int i = 1; i <= 5; ++i)
+    Unsigned.Cases.emplace_back(i, i - 1);
+  for (int i = 0; i < 4; ++i)
+    Unsigned.Cases.emplace_back(0xFFFFFFF0 + i, 5 + i);
+  Unsigned.Cases.emplace_back(0x80000000, 9);
+  Unsigned.Cases.emplace_back(0x7FFFFFFF, 10);
+  Specs.push_back(Unsigned);
+
+  SwitchSpec NoDefault{ "nodefault", I32, false, {} };
+  for (int i = 1; i <= 6; ++i)
+    NoDefault.Cases.emplace_back(i * 3, i % 3);
+  Specs.push_back(NoDefault);
+
+  // A dense cluster, a bit test cluster, and outliers.
+  SwitchSpec Mixed{ "mixed64", I64, true, {} };
+  for (int i = -20; i <= 20; ++i)
+    Mixed.Cases.emplace_back(i, (i + 20) % 8);
+  for (int i = 500; i <= 540; i += 3)
+    Mixed.Cases.emplace_back(i, 8 + i % 2);
+  for (int64_t V : { int64_t(1000), int64_t(2000), int64_t(1) << 33 })
+    Mixed.Cases.emplace_back(V, 10);
+  Specs.push_back(Mixed);
+
+  SwitchSpec DefaultOnly{ "defaultonly", I32, true, {} };
+  Specs.push_back(DefaultOnly);
+  return Specs;
+}
+
+
+static SExpr* makeModule(CFGBuilder &Bld,
+                         const std::vector<SwitchSpec> &Specs) {
+  auto *SelfVd = Bld.newVarDecl(VarDecl::VK_SFun, "self", nullptr);
+  Bld.enterScope(SelfVd);
+  auto *Rec = Bld.newRecord(Specs.size());
+  for (auto &S : Specs)
+    Rec->addSlot(Bld.arena(), makeSwitch(Bld, S));
+  Bld.exitScope();
+  return Bld.newFunction(SelfVd, Rec);
+}
+
+
+// Return the inputs to test for Spec: every label and its neighbours, a
+// range of small values, and the extremes of each type.
+static std::vector<int64_t> makeInputs(const SwitchSpec &Spec) {
+  std::vector<int64_t> In;
+  for (auto &C : Spec.Cases) {
+    for (int64_t D = -2; D <= 2; ++D)
+      In.push_back(static_cast<int64_t>(static_cast<uint64_t>(C.first) + D));
+  }
+  for (int64_t V = -300; V <= 300; ++V)
+    In.push_back(V);
+  for (int64_t V : { int64_t(0xFFFFFFFF), int64_t(0x80000000),
+                     int64_t(1) << 32, std::numeric_limits<int64_t>::min(),
+                     std::numeric_limits<int64_t>::max() })
+    In.push_back(V);
+  return In;
+}
+
+
+// Convert V to the type of x, and then to the argument passed to the JIT.
+static VMValue argValue(int64_t V, VMType Ty, int64_t *JArg) {
+  VMValue A;
+  A.I64 = V;
+  A = Interpreter::convertValue(A, VT_I64, Ty);
+  *JArg = Interpreter::convertValue(A, Ty, VT_I64).I64;
+  return A;
+}
+
+
+// Run F on In, and compare the result with the interpreter.
+static bool check(Interpreter &Interp, VMFunction *Vf, JITModule &Jit,
+                  JITFunction *Jf, int64_t In, const char *Mode) {
+  VMType Ty = Interpreter::getVMType(Vf->ParamTypes[0]);
+  int64_t JArg;
+  VMValue VArg = argValue(In, Ty, &JArg);
+  VMValue VResult;
+  int64_t JResult = 0;
+  bool VOk = Interp.run(Vf, &VArg, &VResult);
+  bool JOk = Jit.run(Jf, &JArg, &JResult);
+  if (VOk == JOk && (!VOk || VResult.I32 == JResult))
+    return true;
+
+  printf("  %-12s  x = %-20lld  MISMATCH (%s): interpreter ",
+         Vf->Name.c_str(), static_cast<long long>(JArg), Mode);
+  if (VOk)
+    printf("%d", VResult.I32);
+  else
+    printf("error");
+  if (JOk)
+    printf(", jit %lld\n", static_cast<long long>(JResult));
+  else
+    printf(", jit error\n");
+  return false;
+}
+
+
+// Return the time per call of F, cycling through Args, in nanoseconds.
+static double timeCycledCalls(JITModule &Jit, JITFunction *F,
+                              const std::vector<int64_t> &Args) {
+  size_t i = 0;
+  int64_t Result;
+  return timeCalls([&]() {
+    Jit.run(F, &Args[i++ % Args.size()], &Result);
+  });
+}
+
+
+int main(int argc, const char** argv) {
+  if (!JITModule::isSupported()) {
+    std::cerr << "The JIT is not supported on this platform.\n";
+    return 0;
+  }
+
+  std::vector<SwitchSpec> Specs = makeSpecs();
+  MemRegion Region;
+  CFGBuilder Bld{ MemRegionRef(&Region) };
+  SExpr *Module = makeModule(Bld, Specs);
+
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(Module);
+  JITModule Linear;
+  Linear.setSwitchClustering(false);
+  Linear.compileModule(Module);
+  JITModule Clustered;
+  Clustered.compileModule(Module);
+
+  unsigned NumFailed = 0;
+  for (auto &Spec : Specs) {
+    VMFunction  *Vf = Interp.findFunction(Spec.Name);
+    JITFunction *Lf = Linear.findFunction(Spec.Name);
+    JITFunction *Cf = Clustered.findFunction(Spec.Name);
+    if (!Vf || !Vf->Compiled || !Lf || !Lf->Compiled || !Cf ||
+        !Cf->Compiled) {
+      printf("  %-12s  not compiled\n", Spec.Name);
+      ++NumFailed;
+      continue;
+    }
+    bool Ok = true;
+    for (int64_t In : makeInputs(Spec)) {
+      Ok = check(Interp, Vf, Linear, Lf, In, "linear") && Ok;
+      Ok = check(Interp, Vf, Clustered, Cf, In, "clustered") && Ok;
+    }
+    if (!Ok) {
+      ++NumFailed;
+      continue;
+    }
+
+    // Time calls which go to each case and the default in turn, which the
+    // branch predictor learns, and to random cases, which it cannot.
+    if (!Spec.HasDefault)
+      continue;
+    VMType Ty = Interpreter::getVMType(Vf->ParamTypes[0]);
+    std::vector<int64_t> InOrder, Random;
+    std::mt19937 Rng(42);
+    for (unsigned i = 0; i < NumTimedArgs; ++i) {
+      unsigned k = i % (Spec.Cases.size() + 1);
+      unsigned r = Rng() % (Spec.Cases.size() + 1);
+      int64_t JArg;
+      argValue(k < Spec.Cases.size() ? Spec.Cases[k].first : -12345, Ty,
+               &JArg);
+      InOrder.push_back(JArg);
+      argValue(r < Spec.Cases.size() ? Spec.Cases[r].first : -12345, Ty,
+               &JArg);
+      Random.push_back(JArg);
+    }
+    double LNs  = timeCycledCalls(Linear, Lf, InOrder);
+    double CNs  = timeCycledCalls(Clustered, Cf, InOrder);
+    double LRNs = timeCycledCalls(Linear, Lf, Random);
+    double CRNs = timeCycledCalls(Clustered, Cf, Random);
+    printf("  %-12s  in order %6.2f -> %6.2f ns (%5.2fx),  "
+           "random %6.2f -> %6.2f ns (%5.2fx)\n", Spec.Name,
+           LNs, CNs, LNs / CNs, LRNs, CRNs, LRNs / CRNs);
+  }
+
+  const SwitchStats &S = Clustered.switchStats();
+  printf("  %u switches: %u jump tables, %u bit tests, "
+         "compares %u -> %u\n", S.NumSwitches, S.NumJumpTables,
+         S.NumBitTests, Linear.switchStats().NumCompares, S.NumCompares);
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,171 @@
+//===- test_tiered.cpp -----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs every function in a set of ohmu files on the tiered runtime, and
+// checks the results against the interpreter while functions move from the
+// interpreter to native code.  Compares startup time (time to compile the
+// module and make the first call) and steady-state time per call against
+// the interpreter and the JIT on their own.  Usage, from the top-level
+// directory:
+//
+//   test_tiered [-tT] [-nN] src/ohmu/*.ohmu
+//
+// T is the hotness threshold, which defaults to 100.  Each function is
+// called with all parameters set to N, which defaults to 100.  Returns
+// non-zero if any results differ, or if a file cannot be loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "backend/jit/TieredModule.h"
+#include "test/backend/BackendTest.h"
+
+
+using namespace ohmu;
+using namespace ohmu::til;
+using namespace ohmu::jit;
+
+
+// Number of calls to check while functions are being compiled.
+static const unsigned WarmupCalls = 2000;
+
+
+static bool sameResult(VMFunction *F, bool AOk, VMValue A,
+                       bool BOk, VMValue B) {
+  if (AOk != BOk)
+    return false;
+  VMType Ty = Interpreter::getVMType(F->ReturnType);
+  if (!AOk || Ty == VT_Void)
+    return true;
+  return Interpreter::convertValue(A, Ty, VT_U64).U64 ==
+         Interpreter::convertValue(B, Ty, VT_U64).U64;
+}
+
+
+static bool testFile(const char* FileName, uint32_t Threshold, int64_t N,
+                     unsigned *NumFailed) {
+  Global G;
+  if (!loadFile(G, FileName))
+    return false;
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  auto T0 = Clock::now();
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+  double InterpStartup = secondsSince(T0);
+
+  T0 = Clock::now();
+  JITModule Jit;
+  Jit.compileModule(G.global());
+  double JitStartup = secondsSince(T0);
+
+  T0 = Clock::now();
+  TieredModule Tiered(MemRegionRef(&Region), Threshold);
+  Tiered.compileModule(G.global());
+  double TieredStartup = secondsSince(T0);
+
+  printf("  compile: interp %.3f ms  jit %.3f ms  tiered %.3f ms\n",
+         InterpStartup * 1e3, JitStartup * 1e3, TieredStartup * 1e3);
+
+  // Check results while hot functions are being compiled.
+  for (auto &Vf : Interp.functions()) {
+    VMFunction *Tf = Tiered.findFunction(Vf->Name);
+    if (!Vf->Compiled || !Tf)
+      continue;
+    auto Args = makeArgs(Vf.get(), N);
+    VMValue Expected, Result;
+    bool EOk = Interp.run(Vf.get(), Args.data(), &Expected);
+    for (unsigned i = 0; i < WarmupCalls; ++i) {
+      bool ROk = Tiered.run(Tf, Args.data(), &Result);
+      if (!sameResult(Vf.get(), EOk, Expected, ROk, Result)) {
+        printf("  %-20s  call %u  MISMATCH\n", Vf->Name.c_str(), i);
+        ++*NumFailed;
+        break;
+      }
+    }
+  }
+  Tiered.waitForCompiles();
+  printf("  %u of %u functions running native code\n", Tiered.numNative(),
+         static_cast<unsigned>(Interp.functions().size()));
+
+  for (auto &Vf : Interp.functions()) {
+    VMFunction  *Tf = Tiered.findFunction(Vf->Name);
+    JITFunction *Jf = Jit.findFunction(Vf->Name);
+    if (!Vf->Compiled || !Tf)
+      continue;
+    auto Args = makeArgs(Vf.get(), N);
+    VMValue Expected, Result;
+    bool EOk = Interp.run(Vf.get(), Args.data(), &Expected);
+    bool ROk = Tiered.run(Tf, Args.data(), &Result);
+    if (!sameResult(Vf.get(), EOk, Expected, ROk, Result)) {
+      printf("  %-20s  MISMATCH after compilation\n", Vf->Name.c_str());
+      ++*NumFailed;
+      continue;
+    }
+
+    double VNs = timeCalls([&]() {
+      Interp.run(Vf.get(), Args.data(), &Result);
+    });
+    double TNs = timeCalls([&]() { Tiered.run(Tf, Args.data(), &Result); });
+    printf("  %-20s  interp %10.1f ns  tiered %10.1f ns", Vf->Name.c_str(),
+           VNs, TNs);
+    if (Jf && Jf->Compiled) {
+      std::vector<int64_t> JArgs(Vf->NumParams, N);
+      int64_t JResult;
+      double JNs = timeCalls([&]() {
+        Jit.run(Jf, JArgs.data(), &JResult);
+      });
+      printf("  jit %10.1f ns", JNs);
+    }
+    printf("\n");
+  }
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  uint32_t Threshold = 100;
+  int64_t  N = 100;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strncmp(argv[i], "-t", 2) == 0)
+      Threshold = atoi(argv[i] + 2);
+    else if (strncmp(argv[i], "-n", 2) == 0)
+      N = atoll(argv[i] + 2);
+    else
+      break;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: test_tiered [-tT] [-nN] file.ohmu...\n";
+    return 0;
+  }
+
+  unsigned NumFailed = 0;
+  for (; i < argc; ++i) {
+    if (!testFile(argv[i], Threshold, N, &NumFailed)) {
+      std::cerr << "Could not load " << argv[i] << "\n";
+      ++NumFailed;
+    }
+  }
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
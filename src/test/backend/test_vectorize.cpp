@@ -0,0 +1,346 @@
+//===- test_vectorize.cpp --------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Builds counted loops over arrays with CFGBuilder -- reductions, and
+// element-wise maps -- and compiles them with the LLVM backend at O3, with
+// and without vectorization.  Every loop is checked against the
+// interpreter, including maps whose source and destination overlap, and
+// the time per element is reported for each.  Usage:
+//
+//   test_vectorize [-nN] [-emit]
+//
+// N is the number of elements in each array, which defaults to 100000.
+// -emit prints the optimized IR with vectorization.  Returns non-zero if
+// any results differ.
+//
+//===----------------------------------------------------------------------===//
+
+#include "backend/llvm/LLVMJIT.h"
+#include "test/backend/BackendTest.h"
+#include "til/CFGBuilder.h"
+
+#include <functional>
+
+
+using namespace ohmu;
+using namespace ohmu::til;
+using namespace ohmu::backend_llvm;
+
+
+// Minimum time to spend running each function.  Vector loops run long
+// enough that the default is too short to time them steadily.
+static const double MinSeconds = 0.05;
+
+/// Emits the body of a loop, given the addresses of a[i] and b[i] and the
+/// accumulator, and returns the new value of the accumulator.
+typedef std::function<SExpr*(CFGBuilder &Bld, SExpr *Ea, SExpr *Eb,
+                             SExpr *Acc)> LoopBody;
+
+
+template<class T>
+static T* typed(T *I, BaseType Bt) {
+  I->setBaseType(Bt);
+  return I;
+}
+
+
+// Make the slot Name(a: Pointer, b: Pointer, n: Int), which runs Body
+// for i = 0 ... n-1, and returns the accumulator.
+static Slot* makeLoop(CFGBuilder &Bld, const char *Name, Literal *Init,
+                      LoopBody Body) {
+  BaseType PtrBt = BaseType::getBaseType<void*>();
+  BaseType IntBt = BaseType::getBaseType<int32_t>();
+  auto *PtrTy = Bld.newScalarType(PtrBt);
+  auto *IntTy = Bld.newScalarType(IntBt);
+
+  auto *VdA = Bld.newVarDecl(VarDecl::VK_Fun, "a", PtrTy);
+  Bld.enterScope(VdA);
+  auto *VdB = Bld.newVarDecl(VarDecl::VK_Fun, "b", PtrTy);
+  Bld.enterScope(VdB);
+  auto *VdN = Bld.newVarDecl(VarDecl::VK_Fun, "n", IntTy);
+  Bld.enterScope(VdN);
+  auto *A = Bld.newVariable(VdA);
+  auto *B = Bld.newVariable(VdB);
+  auto *N = Bld.newVariable(VdN);
+
+  Bld.beginCFG(nullptr);
+  auto *Cfg = Bld.currentCFG();
+  Bld.beginBlock(Cfg->entry());
+  auto *Header = Bld.newBlock(2);
+  SExpr *InitArgs[2] = { Bld.newLiteralT<int32_t>(0), Init };
+  Bld.newGoto(Header, ArrayRef<SExpr*>(InitArgs, 2));
+
+  Bld.beginBlock(Header);
+  SExpr *I   = Bld.currentBB()->arguments()[0];
+  SExpr *Acc = Bld.currentBB()->arguments()[1];
+  auto *Cond = typed(Bld.newBinaryOp(BOP_Lt, I, N),
+                     BaseType::getBaseType<bool>());
+  auto *Loop = Bld.newBlock();
+  auto *Exit = Bld.newBlock();
+  Bld.newBranch(Cond, Loop, Exit);
+
+  Bld.beginBlock(Loop);
+  auto *Ea = typed(Bld.newArrayIndex(A, I), PtrBt);
+  auto *Eb = typed(Bld.newArrayIndex(B, I), PtrBt);
+  SExpr *Acc2 = Body(Bld, Ea, Eb, Acc);
+  auto *I2 = typed(Bld.newBinaryOp(BOP_Add, I, Bld.newLiteralT<int32_t>(1)),
+                   IntBt);
+  SExpr *NextArgs[2] = { I2, Acc2 };
+  Bld.newGoto(Header, ArrayRef<SExpr*>(NextArgs, 2));
+
+  Bld.beginBlock(Exit);
+  Bld.newGoto(Cfg->exit(), Acc);
+  Bld.endCFG();
+
+  SExpr *F = Bld.newCode(Bld.newScalarType(Init->baseType()), Cfg);
+  Bld.exitScope();
+  F = Bld.newFunction(VdN, F);
+  Bld.exitScope();
+  F = Bld.newFunction(VdB, F);
+  Bld.exitScope();
+  F = Bld.newFunction(VdA, F);
+  return Bld.newSlot(Name, F);
+}
+
+
+static SExpr* makeModule(CFGBuilder &Bld) {
+  BaseType I32 = BaseType::getBaseType<int32_t>();
+  BaseType I64 = BaseType::getBaseType<int64_t>();
+  BaseType F64 = BaseType::getBaseType<double>();
+
+  auto *SelfVd = Bld.newVarDecl(VarDecl::VK_SFun, "self", nullptr);
+  Bld.enterScope(SelfVd);
+  auto *Rec = Bld.newRecord(5);
+
+  // Reductions.
+  Rec->addSlot(Bld.arena(), makeLoop(Bld, "sum64",
+      Bld.newLiteralT<int64_t>(0),
+      [&](CFGBuilder &B, SExpr *Ea, SExpr *Eb, SExpr *Acc) -> SExpr* {
+    auto *La = typed(B.newLoad(Ea), I64);
+    return typed(B.newBinaryOp(BOP_Add, Acc, La), I64);
+  }));
+  Rec->addSlot(Bld.arena(), makeLoop(Bld, "dot64",
+      Bld.newLiteralT<int64_t>(0),
+      [&](CFGBuilder &B, SExpr *Ea, SExpr *Eb, SExpr *Acc) -> SExpr* {
+    auto *La = typed(B.newLoad(Ea), I64);
+    auto *Lb = typed(B.newLoad(Eb), I64);
+    auto *M  = typed(B.newBinaryOp(BOP_Mul, La, Lb), I64);
+    return typed(B.newBinaryOp(BOP_Add, Acc, M), I64);
+  }));
+  // 32-bit values in 64-bit cells are read with a stride of two.
+  Rec->addSlot(Bld.arena(), makeLoop(Bld, "sum32",
+      Bld.newLiteralT<int32_t>(0),
+      [&](CFGBuilder &B, SExpr *Ea, SExpr *Eb, SExpr *Acc) -> SExpr* {
+    auto *La = typed(B.newLoad(Ea), I32);
+    return typed(B.newBinaryOp(BOP_Add, Acc, La), I32);
+  }));
+
+  // Maps.
+  Rec->addSlot(Bld.arena(), makeLoop(Bld, "map64",
+      Bld.newLiteralT<int64_t>(0),
+      [&](CFGBuilder &B, SExpr *Ea, SExpr *Eb, SExpr *Acc) -> SExpr* {
+    auto *La = typed(B.newLoad(Ea), I64);
+    auto *M  = typed(B.newBinaryOp(BOP_Mul, La, B.newLiteralT<int64_t>(3)),
+                     I64);
+    B.newStore(Eb, typed(B.newBinaryOp(BOP_Add, M,
+                                       B.newLiteralT<int64_t>(1)), I64));
+    return Acc;
+  }));
+  Rec->addSlot(Bld.arena(), makeLoop(Bld, "axpy",
+      Bld.newLiteralT<double>(0),
+      [&](CFGBuilder &B, SExpr *Ea, SExpr *Eb, SExpr *Acc) -> SExpr* {
+    auto *La = typed(B.newLoad(Ea), F64);
+    auto *Lb = typed(B.newLoad(Eb), F64);
+    auto *M  = typed(B.newBinaryOp(BOP_Mul, La, B.newLiteralT<double>(0.5)),
+                     F64);
+    B.newStore(Eb, typed(B.newBinaryOp(BOP_Add, Lb, M), F64));
+    return Acc;
+  }));
+
+  Bld.exitScope();
+  return Bld.newFunction(SelfVd, Rec);
+}
+
+
+// Fill the first N cells of A and B with values of type Ty.
+static void fill(VMValue *A, VMValue *B, size_t N, VMType Ty) {
+  for (size_t i = 0; i < N; ++i) {
+    int64_t X = static_cast<int64_t>(i * 7919 % 1000) - 500;
+    int64_t Y = static_cast<int64_t>(i * 104729 % 997) - 300;
+    if (Ty == VT_F64) {
+      A[i].F64 = X * 0.25;
+      B[i].F64 = Y * 0.125;
+    }
+    else {
+      A[i].I64 = X;
+      B[i].I64 = Y;
+    }
+  }
+}
+
+
+/// The arrays passed to a loop.  B may overlap A.
+struct LoopArgs {
+  const char *Name;
+  size_t      BOffset;   ///< Offset of b from the start of the b array.
+  bool        InPlace;   ///< If true, b points into a.
+};
+
+
+class VectorizeTest {
+public:
+  VectorizeTest(size_t N) : N(N), A(N + 1), B(N + 1) { }
+
+  bool run(Interpreter &Interp, LLVMModule &Scalar, LLVMModule &Vector,
+           const char *Name);
+
+private:
+  // Run Fn on fresh arrays, and save the result and the contents of b.
+  template<class F>
+  bool runOn(F Fn, const LoopArgs &La, VMType Ty, VMValue *Result,
+             std::vector<VMValue> *Out) {
+    fill(A.data(), B.data(), A.size(), Ty);
+    VMValue Args[3];
+    Args[0].Ptr = A.data();
+    Args[1].Ptr = La.InPlace ? A.data() + La.BOffset : B.data() + La.BOffset;
+    Args[2].I64 = static_cast<int32_t>(N - La.BOffset);
+    bool Ok = Fn(Args, Result);
+    *Out = La.InPlace ? A : B;
+    return Ok;
+  }
+
+  size_t N;
+  std::vector<VMValue> A;
+  std::vector<VMValue> B;
+};
+
+
+// Return true if A and B hold the same value of type Ty.
+static bool sameValue(VMValue A, VMValue B, VMType Ty) {
+  if (Ty == VT_Void)
+    return true;
+  return Interpreter::convertValue(A, Ty, VT_U64).U64 ==
+         Interpreter::convertValue(B, Ty, VT_U64).U64;
+}
+
+
+static bool sameCells(const std::vector<VMValue> &X,
+                      const std::vector<VMValue> &Y) {
+  return memcmp(X.data(), Y.data(), X.size() * sizeof(VMValue)) == 0;
+}
+
+
+bool VectorizeTest::run(Interpreter &Interp, LLVMModule &Scalar,
+                        LLVMModule &Vector, const char *Name) {
+  VMFunction   *Vf = Interp.findFunction(Name);
+  LLVMFunction *Sf = Scalar.findFunction(Name);
+  LLVMFunction *Lf = Vector.findFunction(Name);
+  if (!Vf || !Vf->Compiled || !Sf || !Sf->Compiled || !Lf || !Lf->Compiled) {
+    printf("  %-8s  not compiled\n", Name);
+    return false;
+  }
+  VMType Ty = Interpreter::getVMType(Vf->ReturnType);
+  VMType CellTy = Ty == VT_F64 ? VT_F64 : VT_I64;
+
+  static const LoopArgs Cases[] = {
+    { "disjoint", 0, false },
+    { "same",     0, true  },
+    { "overlap",  1, true  }
+  };
+  bool Ok = true;
+  for (auto &La : Cases) {
+    VMValue R0, R1, R2;
+    std::vector<VMValue> C0, C1, C2;
+    bool Ok0 = runOn([&](VMValue *Args, VMValue *R) {
+      return Interp.run(Vf, Args, R);
+    }, La, CellTy, &R0, &C0);
+    bool Ok1 = runOn([&](VMValue *Args, VMValue *R) {
+      return Scalar.run(Sf, Args, R);
+    }, La, CellTy, &R1, &C1);
+    bool Ok2 = runOn([&](VMValue *Args, VMValue *R) {
+      return Vector.run(Lf, Args, R);
+    }, La, CellTy, &R2, &C2);
+    if (!Ok0 || !Ok1 || !Ok2 || !sameValue(R0, R1, Ty) ||
+        !sameValue(R0, R2, Ty) || !sameCells(C0, C1) || !sameCells(C0, C2)) {
+      printf("  %-8s  MISMATCH (%s)\n", Name, La.Name);
+      Ok = false;
+    }
+  }
+  if (!Ok)
+    return false;
+
+  fill(A.data(), B.data(), A.size(), CellTy);
+  VMValue Args[3];
+  Args[0].Ptr = A.data();
+  Args[1].Ptr = B.data();
+  Args[2].I64 = static_cast<int32_t>(N);
+  VMValue R;
+  double SNs = timeCalls([&]() { Scalar.run(Sf, Args, &R); }, MinSeconds);
+  double VNs = timeCalls([&]() { Vector.run(Lf, Args, &R); }, MinSeconds);
+  printf("  %-8s  %8.3f -> %8.3f ns/element  (%5.2fx)\n", Name,
+         SNs / N, VNs / N, SNs / VNs);
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  size_t N = 100000;
+  bool   Emit = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "-n", 2) == 0 && atoll(argv[i] + 2) > 1) {
+      N = atoll(argv[i] + 2);
+    }
+    else if (strcmp(argv[i], "-emit") == 0) {
+      Emit = true;
+    }
+    else {
+      fprintf(stderr, "Usage: test_vectorize [-nN] [-emit]\n");
+      return 0;
+    }
+  }
+
+  MemRegion Region;
+  CFGBuilder Bld{ MemRegionRef(&Region) };
+  SExpr *Module = makeModule(Bld);
+
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(Module);
+  LLVMModule Scalar{ MemRegionRef(&Region) };
+  Scalar.setVectorize(false);
+  LLVMModule Vector{ MemRegionRef(&Region) };
+  std::string IR;
+  if (Scalar.generate(Module) == 0 || Vector.generate(Module) == 0 ||
+      !Scalar.compile(3) || !Vector.compile(3, Emit ? &IR : nullptr)) {
+    printf("Could not compile the module.\n");
+    return 1;
+  }
+  if (Emit)
+    printf("%s\n", IR.c_str());
+
+  VectorizeTest T(N);
+  unsigned NumFailed = 0;
+  for (const char *Name : { "sum64", "dot64", "sum32", "map64", "axpy" })
+    NumFailed += !T.run(Interp, Scalar, Vector, Name);
+  printf("  vector instructions: %u -> %u\n",
+         Scalar.stats().NumVectorInstructions,
+         Vector.stats().NumVectorInstructions);
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
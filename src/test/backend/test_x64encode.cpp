@@ -0,0 +1,203 @@
+//===- test_x64encode.cpp --------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Checks that Instr::encodeAll produces exactly the same bytes as encoding
+// each instruction with Instr::encode, and compares their throughput.  The
+// instruction streams are the code the JIT emits, random instructions in
+// the common (non-vex) forms, and completely random bit patterns.  Usage:
+//
+//   test_x64encode [-nN]
+//
+// N is the number of instructions in each stream, which defaults to 100000.
+// Returns non-zero if any output differs.
+//
+//===----------------------------------------------------------------------===//
+
+#include "backend/jit/X64Emitter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+
+using namespace ohmu::jit;
+
+typedef std::chrono::steady_clock Clock;
+
+
+// Minimum time to spend encoding each stream.
+static const double MinSeconds = 0.05;
+
+
+// Emit a random mix of the instructions used by the JIT.
+static std::vector<Instr> jitStream(size_t N, std::mt19937 &Rng) {
+  X64Emitter Em;
+  unsigned L = Em.newLabel();
+  Em.bind(L);
+  while (Em.numInstrs() < N) {
+    X64Reg   A = static_cast<X64Reg>(Rng() % 16);
+    X64Reg   B = static_cast<X64Reg>(Rng() % 16);
+    unsigned Sz = Rng() % 2 ? 8 : 4;
+    int32_t  Disp = static_cast<int32_t>(Rng()) >> (Rng() % 32);
+    static const X64AluOp Ops[] = {
+      X64_ADD, X64_OR, X64_AND, X64_SUB, X64_XOR, X64_CMP
+    };
+    X64AluOp Op = Ops[Rng() % 6];
+    switch (Rng() % 14) {
+      case 0:  Em.movRR(A, B, Sz);                 break;
+      case 1:  Em.load(A, B, Disp, Sz);            break;
+      case 2:  Em.store(A, Disp, B, Sz);           break;
+      case 3:  Em.aluRR(Op, A, B, Sz);             break;
+      case 4:  Em.aluRM(Op, A, B, Disp, Sz);       break;
+      case 5:  Em.aluRI(Op, A, Disp, Sz);          break;
+      case 6:  Em.movImm(A, static_cast<int64_t>(Rng()) << (Rng() % 33), Sz);
+               break;
+      case 7:  Em.imulRR(A, B, Sz);                break;
+      case 8:  Em.setcc(static_cast<X64Cond>(Rng() % 16), A);  break;
+      case 9:  Em.jcc(static_cast<X64Cond>(Rng() % 16), L);    break;
+      case 10: Em.push(A);  Em.pop(B);             break;
+      case 11: Em.movsxdRR(A, B);                  break;
+      case 12: Em.storeImm(A, Disp, Disp, Sz);     break;
+      default: Em.shlCL(A, Sz);                    break;
+    }
+  }
+  return Em.instrs();
+}
+
+
+// Random instructions, with only the fields that the common forms use.
+static std::vector<Instr> commonStream(size_t N, std::mt19937 &Rng) {
+  std::vector<Instr> Is;
+  for (size_t i = 0; i < N; ++i) {
+    int Disp = static_cast<int>(Rng()) >> (Rng() % 32);
+    Instr I(0, static_cast<int>(Rng()), Disp);
+    I.opcode = Rng();
+    I.code_map = Rng() % 4;
+    I.use_rex = Rng() % 2;
+    I.rex_1 = 1;
+    I.w = Rng() % 2;
+    I.r = Rng() % 2;
+    I.b = Rng() % 2;
+    I.size_prefix = Rng() % 8 == 0;
+    I.has_modrm = Rng() % 4 != 0;
+    I.modrm = Rng();
+    I.has_sib = (I.rm & 7) == 4;
+    I.sib = Rng();
+    I.force_disp = Rng() % 2;
+    I.has_imm = Rng() % 2;
+    I.imm_size = Rng() % 4;
+    Is.push_back(I);
+  }
+  return Is;
+}
+
+
+// Anything at all, including raw data and vex prefixes.
+static std::vector<Instr> randomStream(size_t N, std::mt19937 &Rng) {
+  std::vector<Instr> Is;
+  for (size_t i = 0; i < N; ++i) {
+    unsigned long long Bits = (static_cast<unsigned long long>(Rng()) << 32) |
+                              Rng();
+    Is.push_back(Instr(Bits, static_cast<int>(Rng()),
+                       static_cast<int>(Rng())));
+  }
+  return Is;
+}
+
+
+static Instr::byte* encodeEach(const std::vector<Instr> &Is, Instr::byte *P,
+                               unsigned *Ends) {
+  Instr::byte *Start = P;
+  for (size_t i = 0; i < Is.size(); ++i) {
+    P = Is[i].encode(P);
+    Ends[i] = static_cast<unsigned>(P - Start);
+  }
+  return P;
+}
+
+
+// Return the number of instructions encoded per second by Fn.
+template<class F>
+static double throughput(size_t N, F Fn) {
+  unsigned Runs = 0;
+  double   Seconds = 0;
+  auto T0 = Clock::now();
+  while (Seconds < MinSeconds) {
+    Fn();
+    ++Runs;
+    Seconds = std::chrono::duration<double>(Clock::now() - T0).count();
+  }
+  return static_cast<double>(N) * Runs / Seconds;
+}
+
+
+static bool testStream(const char *Name, const std::vector<Instr> &Is) {
+  size_t Size = Is.size() * Instr::MAX_SIZE + Instr::ENCODE_SLACK;
+  std::vector<Instr::byte> A(Size), B(Size);
+  std::vector<unsigned> AEnds(Is.size()), BEnds(Is.size());
+
+  size_t ALen = encodeEach(Is, A.data(), AEnds.data()) - A.data();
+  size_t BLen = Instr::encodeAll(Is.data(), Is.size(), B.data(),
+                                 BEnds.data()) - B.data();
+  bool Same = ALen == BLen && memcmp(A.data(), B.data(), ALen) == 0 &&
+              AEnds == BEnds;
+  if (!Same) {
+    size_t i = 0;
+    while (i < Is.size() && AEnds[i] == BEnds[i])
+      ++i;
+    printf("  %-8s  MISMATCH at instruction %zu\n", Name, i);
+    return false;
+  }
+
+  double Scalar = throughput(Is.size(), [&]() {
+    encodeEach(Is, A.data(), AEnds.data());
+  });
+  double Batch = throughput(Is.size(), [&]() {
+    Instr::encodeAll(Is.data(), Is.size(), B.data(), BEnds.data());
+  });
+  printf("  %-8s  %5.2f bytes/instr  encode %7.1f M/s  encodeAll %7.1f M/s"
+         "  (%4.2fx)\n", Name, static_cast<double>(ALen) / Is.size(),
+         Scalar * 1e-6, Batch * 1e-6, Batch / Scalar);
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  size_t N = 100000;
+  for (int i = 1; i < argc; ++i) {
+    if (strncmp(argv[i], "-n", 2) == 0) {
+      N = atoll(argv[i] + 2);
+    }
+    else {
+      fprintf(stderr, "Usage: test_x64encode [-nN]\n");
+      return 0;
+    }
+  }
+
+  std::mt19937 Rng(1);
+  unsigned NumFailed = 0;
+  NumFailed += !testStream("jit",    jitStream(N, Rng));
+  NumFailed += !testStream("common", commonStream(N, Rng));
+  NumFailed += !testStream("random", randomStream(N, Rng));
+  if (NumFailed > 0) {
+    printf("%u tests failed.\n", NumFailed);
+    return 1;
+  }
+  return 0;
+}
@@ -20,9 +20,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "base/LLVMDependencies.h"
+#include "base/LZCodec.h"
 #include "base/MemRegion.h"
 #include "base/ArrayTree.h"
 
+#include <cstdlib>
 #include <vector>
 
 using namespace ohmu;
@@ -116,8 +118,72 @@ void testTreeArray() {
 
 
 
+// Compress Input, check that it decompresses to the same bytes, and return
+// the compressed size.
+size_t roundTrip(LZCodec &Codec, const std::vector<uint8_t> &Input) {
+  std::vector<uint8_t> Packed(LZCodec::compressBound(Input.size()));
+  size_t N = Codec.compress(Input.data(), Input.size(), Packed.data());
+  if (N > Packed.size())
+    error("Error: LZCodec overran its bound.\n");
+
+  std::vector<uint8_t> Output(Input.size());
+  if (!LZCodec::decompress(Packed.data(), N, Output.data(), Output.size()) ||
+      Output != Input)
+    error("Error: LZCodec round trip failed.\n");
+
+  // A block must not decompress to a different size.
+  std::vector<uint8_t> Wrong(Input.size() + 1);
+  if (LZCodec::decompress(Packed.data(), N, Wrong.data(), Wrong.size()))
+    error("Error: LZCodec accepted the wrong size.\n");
+  return N;
+}
+
+
+void testLZCodec() {
+  LZCodec Codec;
+  srand(1);
+
+  // Sizes around the limits of the format, in data which compresses well,
+  // in data which does not, and in runs of a single byte.
+  const size_t Sizes[] = { 0, 1, 15, 16, 17, 100, 4096, 65535, 65536, 300000 };
+  for (size_t Sz : Sizes) {
+    std::vector<uint8_t> Text(Sz), Noise(Sz), Run(Sz, 'a');
+    for (size_t i = 0; i < Sz; ++i) {
+      Text[i] = "let x = y.z; "[(i * 7 + i / 13) % 13];
+      Noise[i] = static_cast<uint8_t>(rand());
+    }
+    size_t N = roundTrip(Codec, Text);
+    if (Sz >= 4096 && N * 4 > Sz)
+      error("Error: LZCodec did not compress text.\n");
+    roundTrip(Codec, Noise);
+    N = roundTrip(Codec, Run);
+    if (Sz >= 4096 && N * 50 > Sz)
+      error("Error: LZCodec did not compress a run.\n");
+  }
+
+  // Damaged blocks are rejected, rather than read or written out of bounds.
+  std::vector<uint8_t> Text(5000);
+  for (size_t i = 0; i < Text.size(); ++i)
+    Text[i] = "ohmu bytecode "[i % 14 + (i / 500) % 3];
+  std::vector<uint8_t> Packed(LZCodec::compressBound(Text.size()));
+  size_t N = Codec.compress(Text.data(), Text.size(), Packed.data());
+  std::vector<uint8_t> Output(Text.size());
+  for (size_t Cut = 0; Cut < N; Cut += 7) {
+    if (LZCodec::decompress(Packed.data(), Cut, Output.data(), Output.size()))
+      error("Error: LZCodec accepted a truncated block.\n");
+  }
+  for (unsigned i = 0; i < 2000; ++i) {
+    std::vector<uint8_t> Bad(Packed.begin(), Packed.begin() + N);
+    Bad[rand() % N] ^= static_cast<uint8_t>(1 + rand() % 255);
+    LZCodec::decompress(Bad.data(), Bad.size(), Output.data(), Output.size());
+  }
+}
+
+
+
 int main(int argc, char** argv) {
   testTreeArray();
+  testLZCodec();
   return 0;
 }
 
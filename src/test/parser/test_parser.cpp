@@ -56,7 +56,26 @@ int main(int argc, const char** argv) {
     return -1;
 
   // Convert high-level AST to low-level IR.
-  global.lower();
+  // -jN lowers function bodies in parallel on N threads.
+  // -cDIR reads and writes lowered function bodies in the cache DIR.
+  // If entry points are given, only lower what they depend on.
+  if (argc > 2 && strncmp("-j", argv[2], 2) == 0) {
+    global.lowerParallel(atoi(argv[2] + 2));
+  }
+  else if (argc > 2 && strncmp("-c", argv[2], 2) == 0) {
+    unsigned Hits = global.lowerCached(argv[2] + 2);
+    std::cerr << "Read " << Hits << " definitions from cache.\n";
+  }
+  else if (argc > 2) {
+    global.lowerLazily();
+    for (int i = 2; i < argc; ++i) {
+      if (!global.lowerDefinition(argv[i]))
+        std::cerr << "No definition named " << argv[i] << "\n";
+    }
+  }
+  else {
+    global.lower();
+  }
   std::cout << "\n------ Ohmu IR ------\n";
   global.print(std::cout);
 
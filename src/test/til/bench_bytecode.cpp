@@ -0,0 +1,473 @@
+//===- bench_bytecode.cpp --------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Measures how fast bytecode files can be read.  Every definition in a set of
+// ohmu files is lowered and serialized, and the results are used to write a
+// call graph with N megabytes of IR, both as a single stream and as a
+// BytecodeContainer, as written by the LSA.
+//
+// The total size of the serialized definitions is reported, along with the
+// time taken to deserialize all of them, which is the cost of decoding the
+// IR itself.
+//
+// The stream is read with a reader that copies the file through a buffer and
+// copies strings into an arena, as BytecodeFileReader once did, and with
+// BytecodeFileReader, which maps the file and reads it in place.  A copy of
+// the stream is also written with block compression, and read back with
+// BytecodeFileReader, which decompresses it before reading it in place.
+// The compression ratio of LZCodec, and its speed in each direction, are
+// reported for the serialized definitions and for the stream.  The
+// container is opened, the calls of every function are read, and the IR of
+// one function in a hundred is deserialized, which is all that an analysis
+// that visits a few vertices pays for.  Usage, from the top-level directory:
+//
+//   bench_bytecode [-mN] src/ohmu/*.ohmu
+//
+// N defaults to 64.  The files are in the page cache when they are read, so
+// this measures the cost of the readers rather than of the disk.  Returns
+// non-zero if the readers disagree.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/Driver.h"
+#include "til/Bytecode.h"
+#include "til/BytecodeContainer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+
+using namespace ohmu;
+using namespace ohmu::parsing;
+using namespace ohmu::til;
+
+
+static const char* const GraphPath = "bench_bytecode.graph";
+static const char* const CompressedPath = "bench_bytecode.graph.lz";
+static const char* const ContainerPath = "bench_bytecode.ohbc";
+
+// Number of times each reader reads the file; the fastest time is reported.
+static const int NumRuns = 5;
+
+// Number of calls recorded for each function.
+static const int CallsPerFunction = 4;
+
+// One function in this many has its IR deserialized from the container.
+static const int SampleRate = 100;
+
+// Number of times every definition is deserialized when timing the decoder.
+static const int DecodePasses = 2000;
+
+// Size of the blocks in which the codec is timed, as in a compressed stream.
+static const size_t CodecBlockSize = 64 << 10;
+
+
+/// The reader which BytecodeFileReader replaced.
+class StreamFileReader : public ByteStreamReaderBase {
+public:
+  StreamFileReader(const std::string &FileName, MemRegionRef A) : Arena(A) {
+    FileStream.open(FileName, std::ios::binary);
+    refill();
+  }
+
+  virtual int64_t readData(void *Buf, int64_t Sz) override {
+    FileStream.read(static_cast<char *>(Buf), Sz);
+    return FileStream.gcount();
+  }
+
+  virtual char* allocStringData(uint32_t Sz) override {
+    return Arena.allocateT<char>(Sz + 1);
+  }
+
+private:
+  std::ifstream FileStream;
+  MemRegionRef Arena;
+};
+
+
+// Declare the module, which is the only variable in scope for a definition.
+static void enterModuleScope(CFGBuilder &Builder, BytecodeReader &Reader) {
+  auto *Self = Builder.newVarDecl(VarDecl::VK_SFun, "self", nullptr);
+  Self->setVarIndex(1);
+  Reader.enterOuterScope(Self);
+}
+
+
+// Serialize every definition in FileName, and add it to Defs.  Definitions
+// which cannot be read back are skipped.
+static bool serializeFile(const char* FileName,
+                          std::vector<std::string> &Defs) {
+  Global G;
+  Driver D;
+  if (!D.initParser("src/grammar/ohmu.grammar"))
+    return false;
+  if (!D.parseDefinitions(&G, FileName))
+    return false;
+  G.lower();
+
+  auto *GlobalFun = dyn_cast_or_null<Function>(G.global());
+  auto *Rec = GlobalFun ? dyn_cast_or_null<Record>(GlobalFun->body())
+                        : nullptr;
+  if (!Rec)
+    return false;
+  for (auto &Slt : Rec->slots()) {
+    BytecodeStringWriter Ws;
+    BytecodeWriter Writer(&Ws);
+    Writer.write(Slt->definition());
+    Ws.flush();
+    std::string Def = Ws.str();
+
+    MemRegion Region;
+    CFGBuilder Builder{ MemRegionRef(&Region) };
+    InMemoryReader Rs(Def.data(), Def.size(), Builder.arena());
+    BytecodeReader Reader(Builder, &Rs);
+    enterModuleScope(Builder, Reader);
+    if (Reader.read() && Reader.success())
+      Defs.push_back(Def);
+  }
+  return true;
+}
+
+
+/// Reads a compressed stream, as written by BytecodeFileWriter.
+class CompressedFileReader : public BytecodeFileReader {
+public:
+  CompressedFileReader(const std::string &FileName, MemRegionRef A)
+      : BytecodeFileReader(FileName, A, true) { }
+};
+
+
+// Write the call graph of NFunc functions to Ws as a single stream.
+static void writeGraphStream(ByteStreamWriterBase &Ws,
+                             const std::vector<std::string> &Defs,
+                             int32_t NFunc) {
+  Ws.writeInt32(NFunc);
+  Ws.endAtom();
+  uint32_t Seed = 1;
+  for (int32_t i = 0; i < NFunc; ++i) {
+    Ws.writeString(StringRef("function_" + std::to_string(i)));
+    Ws.writeString(StringRef(Defs[i % Defs.size()]));
+    Ws.writeInt32(CallsPerFunction);
+    Ws.endAtom();
+    for (int c = 0; c < CallsPerFunction; ++c) {
+      Seed = Seed * 1103515245 + 12345;
+      Ws.writeString(StringRef("function_" + std::to_string(Seed % NFunc)));
+      Ws.endAtom();
+    }
+  }
+  Ws.flush();
+}
+
+
+// Write a call graph with at least Size bytes of IR, drawn from Defs, as a
+// single stream, in the format which GraphDeserializer once read, both plain
+// and compressed, and as a container, in the format it reads now.  Returns
+// the number of functions.
+static int32_t writeGraph(const std::vector<std::string> &Defs,
+                          int64_t Size) {
+  int32_t NFunc = 0;
+  for (int64_t Sz = 0; Sz < Size; ++NFunc)
+    Sz += Defs[NFunc % Defs.size()].size();
+
+  BytecodeContainerWriter Cw(ContainerPath);
+  uint32_t Seed = 1;
+  for (int32_t i = 0; i < NFunc; ++i) {
+    auto &Ws = Cw.beginEntry(StringRef("function_" + std::to_string(i)));
+    Ws.writeInt32(CallsPerFunction);
+    Ws.endAtom();
+    for (int c = 0; c < CallsPerFunction; ++c) {
+      Seed = Seed * 1103515245 + 12345;
+      Ws.writeString(StringRef("function_" + std::to_string(Seed % NFunc)));
+      Ws.endAtom();
+    }
+    Ws.writeString(StringRef(Defs[i % Defs.size()]));
+    Ws.endAtom();
+  }
+  if (!Cw.finish())
+    return 0;
+
+  BytecodeFileWriter Ws(GraphPath);
+  writeGraphStream(Ws, Defs, NFunc);
+  BytecodeFileWriter Cs(CompressedPath, true);
+  writeGraphStream(Cs, Defs, NFunc);
+  return NFunc;
+}
+
+
+// Return the contents of the file at Path.
+static std::vector<uint8_t> readFile(const char *Path) {
+  std::vector<uint8_t> Data;
+  if (FILE *F = fopen(Path, "rb")) {
+    uint8_t Buf[1 << 16];
+    size_t Sz;
+    while ((Sz = fread(Buf, 1, sizeof(Buf), F)) > 0)
+      Data.insert(Data.end(), Buf, Buf + Sz);
+    fclose(F);
+  }
+  return Data;
+}
+
+
+// Fold the bytes of S into H, so that every string is looked at.  A sum is
+// used, rather than a proper hash, so that this costs little next to the
+// readers.
+static uint64_t hashString(uint64_t H, StringRef S) {
+  uint64_t Sum = S.size();
+  for (size_t i = 0; i < S.size(); ++i)
+    Sum += static_cast<uint8_t>(S.data()[i]);
+  return H * 31 + Sum;
+}
+
+
+// Read the call graph with Rs, and return a hash of its contents.
+static uint64_t readGraph(ByteStreamReaderBase &Rs) {
+  uint64_t H = 0;
+  int32_t NFunc = Rs.readInt32();
+  Rs.endAtom();
+  for (int32_t i = 0; i < NFunc; ++i) {
+    H = hashString(H, Rs.readString());
+    H = hashString(H, Rs.readString());
+    int32_t NCalls = Rs.readInt32();
+    Rs.endAtom();
+    for (int32_t c = 0; c < NCalls; ++c) {
+      H = hashString(H, Rs.readString());
+      Rs.endAtom();
+    }
+  }
+  return H;
+}
+
+
+// Open the container, read the calls of every function, and deserialize
+// the IR of every SampleRate-th function.  Returns the number of functions
+// which could not be read, and sets Hash to a hash of the calls.
+static unsigned readContainer(uint64_t *Hash) {
+  BytecodeContainer Container;
+  if (!Container.open(ContainerPath))
+    return 1;
+  MemRegion Region;
+  CFGBuilder Builder{ MemRegionRef(&Region) };
+  uint64_t H = 0;
+  unsigned NumFailed = 0;
+  for (size_t i = 0; i < Container.size(); ++i) {
+    auto &E = Container.entry(i);
+    BytecodeEntryReader Rs(E.Data, E.Size);
+    int32_t NCalls = Rs.readInt32();
+    Rs.endAtom();
+    for (int32_t c = 0; c < NCalls; ++c) {
+      H = hashString(H, Rs.readString());
+      Rs.endAtom();
+    }
+    if (i % SampleRate == 0) {
+      StringRef IR = Rs.readString();
+      BytecodeEntryReader IRs(IR.data(), IR.size());
+      BytecodeReader Reader(Builder, &IRs);
+      enterModuleScope(Builder, Reader);
+      if (!Reader.read() || !Reader.success())
+        ++NumFailed;
+    }
+  }
+  *Hash = H;
+  return NumFailed;
+}
+
+
+typedef std::chrono::steady_clock Clock;
+
+// Return the time since T0 in seconds.
+static double elapsed(Clock::time_point T0) {
+  return std::chrono::duration<double>(Clock::now() - T0).count();
+}
+
+
+// Deserialize every definition DecodePasses times, and return the fastest
+// time in seconds for one pass.
+static double timeDecode(const std::vector<std::string> &Defs) {
+  // Definitions are read in place, which may read past their end.
+  std::vector<std::string> Padded;
+  for (auto &Def : Defs)
+    Padded.push_back(Def + std::string(BytecodeBase::MaxAtomSize, '\0'));
+
+  double Best = 1e30;
+  for (int r = 0; r < NumRuns; ++r) {
+    auto T0 = Clock::now();
+    for (int p = 0; p < DecodePasses; ++p) {
+      MemRegion Region;
+      CFGBuilder Builder{ MemRegionRef(&Region) };
+      for (auto &Def : Padded) {
+        BytecodeEntryReader Rs(Def.data(),
+                               Def.size() - BytecodeBase::MaxAtomSize);
+        BytecodeReader Reader(Builder, &Rs);
+        enterModuleScope(Builder, Reader);
+        Reader.read();
+      }
+    }
+    Best = std::min(Best, elapsed(T0) / DecodePasses);
+  }
+  return Best;
+}
+
+
+// Compress Data with LZCodec in blocks of CodecBlockSize bytes, decompress
+// it again, and print the compression ratio and the fastest speed of each
+// direction.  Returns false if the data does not survive the round trip.
+static bool timeCodec(const char *Name, const std::vector<uint8_t> &Data) {
+  size_t NBlocks = (Data.size() + CodecBlockSize - 1) / CodecBlockSize;
+  std::vector<std::vector<uint8_t>> Packed(NBlocks);
+  std::vector<uint8_t> Out(Data.size());
+  LZCodec Codec;
+  size_t PackedSize = 0;
+  double CompressT = 1e30, DecompressT = 1e30;
+  bool Ok = true;
+  for (int r = 0; r < NumRuns; ++r) {
+    auto T0 = Clock::now();
+    PackedSize = 0;
+    for (size_t b = 0; b < NBlocks; ++b) {
+      size_t Off = b * CodecBlockSize;
+      size_t Sz = std::min(CodecBlockSize, Data.size() - Off);
+      Packed[b].resize(LZCodec::compressBound(Sz));
+      Packed[b].resize(Codec.compress(Data.data() + Off, Sz,
+                                      Packed[b].data()));
+      PackedSize += Packed[b].size();
+    }
+    CompressT = std::min(CompressT, elapsed(T0));
+
+    T0 = Clock::now();
+    for (size_t b = 0; b < NBlocks; ++b) {
+      size_t Off = b * CodecBlockSize;
+      size_t Sz = std::min(CodecBlockSize, Data.size() - Off);
+      Ok &= LZCodec::decompress(Packed[b].data(), Packed[b].size(),
+                                Out.data() + Off, Sz);
+    }
+    DecompressT = std::min(DecompressT, elapsed(T0));
+  }
+
+  double MB = Data.size() / double(1 << 20);
+  printf("  %-24s %8.2fx  compress %7.1f MB/s  decompress %7.1f MB/s\n",
+         Name, Data.size() / double(PackedSize), MB / CompressT,
+         MB / DecompressT);
+  return Ok && Out == Data;
+}
+
+
+// Read the graph at Path NumRuns times with a reader of type ReaderT, and
+// return the fastest time in seconds.
+template <class ReaderT>
+static double timeReader(const char *Path, uint64_t *Hash) {
+  double Best = 1e30;
+  for (int r = 0; r < NumRuns; ++r) {
+    MemRegion Region;
+    auto T0 = Clock::now();
+    {
+      ReaderT Rs(Path, MemRegionRef(&Region));
+      *Hash = readGraph(Rs);
+    }
+    Best = std::min(Best, elapsed(T0));
+  }
+  return Best;
+}
+
+
+int main(int argc, const char** argv) {
+  int64_t MBytes = 64;
+  int i = 1;
+  if (argc > 1 && strncmp(argv[1], "-m", 2) == 0) {
+    MBytes = atoll(argv[1] + 2);
+    ++i;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: bench_bytecode [-mN] file.ohmu...\n";
+    return 0;
+  }
+
+  std::vector<std::string> Defs;
+  for (; i < argc; ++i) {
+    if (!serializeFile(argv[i], Defs))
+      std::cerr << "Could not load " << argv[i] << "\n";
+  }
+  if (Defs.empty())
+    return 0;
+
+  int64_t IRBytes = 0;
+  for (auto &Def : Defs)
+    IRBytes += Def.size();
+  double DecodeT = timeDecode(Defs);
+  printf("%u definitions, %lld bytes of IR, decoded in %.1f us\n",
+         static_cast<unsigned>(Defs.size()),
+         static_cast<long long>(IRBytes), DecodeT * 1e6);
+
+  int32_t NFunc = writeGraph(Defs, MBytes << 20);
+  if (NFunc == 0) {
+    std::cerr << "Could not write " << ContainerPath << "\n";
+    return 1;
+  }
+  std::vector<uint8_t> Graph = readFile(GraphPath);
+  double FileMB = Graph.size() / double(1 << 20);
+  double CompressedMB = readFile(CompressedPath).size() / double(1 << 20);
+  printf("%d functions, %.1f MB, %.1f MB compressed\n", NFunc, FileMB,
+         CompressedMB);
+
+  std::vector<uint8_t> IR;
+  for (auto &Def : Defs)
+    IR.insert(IR.end(), Def.begin(), Def.end());
+  bool CodecOk = timeCodec("LZCodec, definitions", IR);
+  CodecOk &= timeCodec("LZCodec, stream", Graph);
+  Graph.clear();
+
+  uint64_t StreamHash = 0, MappedHash = 0, CompressedHash = 0;
+  double StreamT = timeReader<StreamFileReader>(GraphPath, &StreamHash);
+  double MappedT = timeReader<BytecodeFileReader>(GraphPath, &MappedHash);
+  double CompressedT =
+      timeReader<CompressedFileReader>(CompressedPath, &CompressedHash);
+  remove(GraphPath);
+  remove(CompressedPath);
+
+  uint64_t CallHash = 0;
+  unsigned NumFailed = 0;
+  double IndexedT = 1e30;
+  for (int r = 0; r < NumRuns; ++r) {
+    auto T0 = Clock::now();
+    NumFailed = readContainer(&CallHash);
+    IndexedT = std::min(IndexedT, elapsed(T0));
+  }
+  remove(ContainerPath);
+
+  printf("  %-24s %8.1f ms  %8.1f MB/s\n", "buffered, copied",
+         StreamT * 1e3, FileMB / StreamT);
+  printf("  %-24s %8.1f ms  %8.1f MB/s  (%5.2fx)\n", "mapped, in place",
+         MappedT * 1e3, FileMB / MappedT, StreamT / MappedT);
+  printf("  %-24s %8.1f ms  %8.1f MB/s  (%5.2fx)\n", "compressed, in place",
+         CompressedT * 1e3, FileMB / CompressedT, StreamT / CompressedT);
+  printf("  %-24s %8.1f ms                 (%5.2fx)\n", "indexed, 1% of IR",
+         IndexedT * 1e3, StreamT / IndexedT);
+  if (!CodecOk) {
+    printf("LZCODEC ROUND TRIP FAILED\n");
+    return 1;
+  }
+  if (StreamHash != MappedHash || StreamHash != CompressedHash) {
+    printf("READERS DISAGREE\n");
+    return 1;
+  }
+  if (NumFailed > 0) {
+    printf("%u functions could not be read from the container.\n",
+           NumFailed);
+    return 1;
+  }
+  return 0;
+}
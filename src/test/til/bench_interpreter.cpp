@@ -0,0 +1,142 @@
+//===- bench_interpreter.cpp -----------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Runs every function in a set of ohmu files on the interpreter, and reports
+// the time taken per VM instruction.  Usage, from the top-level directory:
+//
+//   bench_interpreter [-nN] src/ohmu/*.ohmu
+//
+// Every parameter of every function is set to N, which defaults to 100.
+//
+//===----------------------------------------------------------------------===//
+
+#include "test/Driver.h"
+#include "til/Interpreter.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+
+using namespace ohmu;
+using namespace ohmu::parsing;
+using namespace ohmu::til;
+
+
+// Minimum time to spend running each function.
+static const double MinSeconds = 0.05;
+
+
+static void printValue(VMValue V, BaseType Bt) {
+  VMType Ty = Interpreter::getVMType(Bt);
+  if (Ty == VT_F32 || Ty == VT_F64) {
+    V = Interpreter::convertValue(V, Ty, VT_F64);
+    printf("%14g", V.F64);
+  }
+  else if (Ty <= VT_Bool) {
+    V = Interpreter::convertValue(V, Ty, VT_I64);
+    printf("%14lld", static_cast<long long>(V.I64));
+  }
+  else {
+    printf("%14s", "-");
+  }
+}
+
+
+static void benchFunction(Interpreter &Interp, VMFunction *F, int64_t N) {
+  std::vector<VMValue> Args;
+  for (auto &Bt : F->ParamTypes) {
+    VMType Ty = Interpreter::getVMType(Bt);
+    if (Ty > VT_F64)
+      return;     // Only numeric parameters are supported.
+    VMValue V;
+    V.I64 = N;
+    Args.push_back(Interpreter::convertValue(V, VT_I64, Ty));
+  }
+
+  VMValue Result;
+  uint64_t Start = Interp.numExecuted();
+  if (!Interp.run(F, Args.data(), &Result)) {
+    printf("  %-20s  error: %s\n", F->Name.c_str(), Interp.errorMessage());
+    return;
+  }
+  uint64_t PerCall = Interp.numExecuted() - Start;
+
+  // Double the number of calls until enough time has elapsed.
+  typedef std::chrono::steady_clock Clock;
+  uint64_t Calls = 1;
+  double   Seconds = 0;
+  Start = Interp.numExecuted();
+  while (Seconds < MinSeconds) {
+    Calls *= 2;
+    Start = Interp.numExecuted();
+    auto T0 = Clock::now();
+    for (uint64_t i = 0; i < Calls; ++i)
+      Interp.run(F, Args.data(), &Result);
+    Seconds = std::chrono::duration<double>(Clock::now() - T0).count();
+  }
+  uint64_t Executed = Interp.numExecuted() - Start;
+
+  printf("  %-20s", F->Name.c_str());
+  printValue(Result, F->ReturnType);
+  printf("  %10llu instrs/call  %8.2f ns/instr\n",
+         static_cast<unsigned long long>(PerCall),
+         Seconds * 1e9 / static_cast<double>(Executed));
+}
+
+
+static bool benchFile(const char* FileName, int64_t N) {
+  Global G;
+  Driver D;
+  if (!D.initParser("src/grammar/ohmu.grammar"))
+    return false;
+  if (!D.parseDefinitions(&G, FileName))
+    return false;
+  G.lower();
+
+  printf("%s\n", FileName);
+  fflush(stdout);
+
+  MemRegion Region;
+  Interpreter Interp{ MemRegionRef(&Region) };
+  Interp.compileModule(G.global());
+  for (auto &F : Interp.functions()) {
+    if (F->Compiled)
+      benchFunction(Interp, F.get(), N);
+  }
+  return true;
+}
+
+
+int main(int argc, const char** argv) {
+  int64_t N = 100;
+  int i = 1;
+  if (argc > 1 && strncmp(argv[1], "-n", 2) == 0) {
+    N = atoll(argv[1] + 2);
+    ++i;
+  }
+  if (i >= argc) {
+    std::cerr << "Usage: bench_interpreter [-nN] file.ohmu...\n";
+    return 0;
+  }
+
+  for (; i < argc; ++i) {
+    if (!benchFile(argv[i], N))
+      std::cerr << "Could not load " << argv[i] << "\n";
+  }
+  return 0;
+}
@@ -18,12 +18,16 @@
 
 
 #include "til/Bytecode.h"
+#include "til/BytecodeContainer.h"
 #include "til/CFGBuilder.h"
 #include "til/TILPrettyPrint.h"
 
 
 #include <memory>
 #include <iostream>
+#include <sstream>
+
+#include <unistd.h>
 
 using namespace ohmu;
 using namespace til;
@@ -139,6 +143,237 @@ void testByteStream() {
 }
 
 
+// Write fields of odd sizes, which are packed into bits, across several
+// refills of the read buffer.
+void testBitStream() {
+  MemRegion    region;
+  MemRegionRef arena(&region);
+  static const uint32_t VbrValues[] = {
+    0, 1, 127, 128, 16383, 16384, 2097151, 2097152, 0x0FFFFFFF, 0x10000000,
+    0xFFFFFFFF
+  };
+  const unsigned NumValues = sizeof(VbrValues) / sizeof(VbrValues[0]);
+  std::string Buffer;
+  {
+    BytecodeStringWriter writer;
+    writer.writeBits32(5, 3);
+    writer.writeBool(true);
+    writer.flush();
+    CHECK(writer.str().size() == 1);
+
+    for (unsigned i = 0; i < 40000; ++i) {
+      writer.writeBool(i & 1);
+      writer.writeBits32(i, i % 33);
+      writer.writeUInt32(VbrValues[i % NumValues]);
+      writer.writeUInt64(uint64_t(VbrValues[i % NumValues]) << (i % 33));
+      writer.writeBits64(uint64_t(i) * 0x9E3779B97F4A7C15ULL, 64 - i % 17);
+      if (i % 1000 == 0)
+        writer.writeString("odd");
+      writer.endAtom();
+    }
+    writer.writeBits32(1, 2);
+    writer.flush();
+    Buffer = writer.str();
+  }
+
+  InMemoryReader reader(Buffer.data(), Buffer.size(), arena);
+  CHECK(reader.readBits32(3) == 5);
+  CHECK(reader.readBool());
+  reader.alignToByte();
+  for (unsigned i = 0; i < 40000; ++i) {
+    CHECK(reader.readBool() == bool(i & 1));
+    uint32_t Mask = (i % 33 == 32) ? 0xFFFFFFFF : (1u << (i % 33)) - 1;
+    CHECK(reader.readBits32(i % 33) == (i & Mask));
+    CHECK(reader.readUInt32() == VbrValues[i % NumValues]);
+    CHECK(reader.readUInt64() ==
+          uint64_t(VbrValues[i % NumValues]) << (i % 33));
+    uint64_t V = uint64_t(i) * 0x9E3779B97F4A7C15ULL;
+    CHECK(reader.readBits64(64 - i % 17) == (V << (i % 17)) >> (i % 17));
+    if (i % 1000 == 0)
+      CHECK(reader.readString() == "odd");
+    reader.endAtom();
+  }
+  CHECK(reader.readBits32(2) == 1);
+  CHECK(reader.empty());
+}
+
+
+// Write a file with strings both smaller and larger than the read buffer,
+// and read it back in place.
+void testFileStream() {
+  MemRegion    region;
+  MemRegionRef arena(&region);
+  const char* FileName = "test_serialization.tmp";
+  std::string Large(200000, 'x');
+  for (unsigned i = 0; i < Large.size(); i += 7)
+    Large[i] = 'a' + (i % 26);
+  {
+    BytecodeFileWriter writer(FileName);
+    for (unsigned i = 0; i < 1000; ++i) {
+      writer.writeUInt32(i);
+      writer.writeString("name");
+      writer.endAtom();
+      if (i % 100 == 0) {
+        writer.writeString(StringRef(Large));
+        writer.endAtom();
+      }
+    }
+    writer.writeString("Done.");
+    writer.flush();
+  }
+
+  {
+    BytecodeFileReader reader(FileName, arena);
+    CHECK(reader.isMapped());
+    const char* Prev = nullptr;
+    for (unsigned i = 0; i < 1000; ++i) {
+      CHECK(reader.readUInt32() == i);
+      StringRef s = reader.readString();
+      CHECK(s == "name");
+      // Strings are not copied, so they are laid out as in the file.
+      CHECK(!Prev || s.data() > Prev);
+      Prev = s.data();
+      reader.endAtom();
+      if (i % 100 == 0) {
+        s = reader.readString();
+        CHECK(s.size() == Large.size() && s.str() == Large);
+        reader.endAtom();
+      }
+    }
+    CHECK(reader.readString() == "Done.");
+    CHECK(reader.empty());
+  }
+
+  // Strings which run past the end of a truncated file are rejected.
+  truncate(FileName, 1000);
+  {
+    BytecodeFileReader reader(FileName, arena);
+    CHECK(reader.readUInt32() == 0);
+    CHECK(reader.readString() == "name");
+    reader.endAtom();
+    CHECK(reader.readString().size() == 0);
+  }
+  remove(FileName);
+}
+
+
+/// Reads a compressed stream from memory, one block at a time.
+class CompressedStringReader : public ByteStreamReaderBase {
+public:
+  CompressedStringReader(const std::string &S, MemRegionRef A)
+      : Source(S), SourcePos(0), Arena(A) {
+    setCompressed();
+    refill();
+  }
+
+  virtual int64_t readData(void *Buf, int64_t Sz) override {
+    Sz = std::min<int64_t>(Sz, Source.size() - SourcePos);
+    memcpy(Buf, Source.data() + SourcePos, Sz);
+    SourcePos += Sz;
+    return Sz;
+  }
+
+  virtual char* allocStringData(uint32_t Sz) override {
+    return Arena.allocateT<char>(Sz + 1);
+  }
+
+private:
+  const std::string &Source;
+  size_t SourcePos;
+  MemRegionRef Arena;
+};
+
+
+// Write a compressed stream with atoms, small strings, and strings which
+// span several blocks, and read it back both block by block, and all at
+// once from a file.
+void testCompressedStream() {
+  MemRegion    region;
+  MemRegionRef arena(&region);
+  std::string Large(300000, 'x');
+  for (unsigned i = 0; i < Large.size(); i += 7)
+    Large[i] = 'a' + (i * 31 + i / 1000) % 26;
+
+  auto writeStream = [&](ByteStreamWriterBase &writer) {
+    for (unsigned i = 0; i < 5000; ++i) {
+      writer.writeUInt32(i * 1000);
+      writer.writeBits32(i, i % 13);
+      writer.writeString("name");
+      writer.endAtom();
+      if (i % 1000 == 0) {
+        writer.writeString(StringRef(Large));
+        writer.endAtom();
+      }
+    }
+    writer.writeString("Done.");
+    writer.flush();
+  };
+  auto readStream = [&](ByteStreamReaderBase &reader) {
+    for (unsigned i = 0; i < 5000; ++i) {
+      CHECK(reader.readUInt32() == i * 1000);
+      CHECK(reader.readBits32(i % 13) == (i & ((1u << (i % 13)) - 1)));
+      CHECK(reader.readString() == "name");
+      reader.endAtom();
+      if (i % 1000 == 0) {
+        StringRef s = reader.readString();
+        CHECK(s.size() == Large.size() && s.str() == Large);
+        reader.endAtom();
+      }
+    }
+    CHECK(reader.readString() == "Done.");
+    CHECK(reader.empty());
+  };
+
+  std::string Plain, Packed;
+  {
+    BytecodeStringWriter writer;
+    writeStream(writer);
+    Plain = writer.str();
+  }
+  {
+    BytecodeStringWriter writer;
+    writer.setCompressed(true);
+    writeStream(writer);
+    Packed = writer.str();
+  }
+  CHECK(Packed.size() * 2 < Plain.size());
+  {
+    CompressedStringReader reader(Packed, arena);
+    readStream(reader);
+  }
+
+  // Blocks decompress independently, to the uncompressed stream.
+  std::vector<uint8_t> Out;
+  for (unsigned NumThreads : { 1, 4 }) {
+    CHECK(ByteStreamReaderBase::decompressBlocks(Packed.data(), Packed.size(),
+                                                 Out, 16, NumThreads));
+    CHECK(Out.size() == Plain.size() + 16 &&
+          memcmp(Out.data(), Plain.data(), Plain.size()) == 0);
+  }
+  CHECK(!ByteStreamReaderBase::decompressBlocks(Packed.data(),
+                                                Packed.size() - 1, Out));
+
+  const char* FileName = "test_serialization.tmp";
+  {
+    BytecodeFileWriter writer(FileName, true);
+    writeStream(writer);
+  }
+  {
+    BytecodeFileReader reader(FileName, arena, true);
+    CHECK(reader.isMapped());
+    readStream(reader);
+  }
+
+  // A truncated file is read as an empty stream.
+  truncate(FileName, 1000);
+  {
+    BytecodeFileReader reader(FileName, arena, true);
+    CHECK(reader.empty());
+  }
+  remove(FileName);
+}
+
+
 
 
 
@@ -323,8 +558,7 @@ void testSerialization(CFGBuilder& bld, SExpr *e) {
   BytecodeStringWriter writeStream;
   BytecodeWriter writer(&writeStream);
 
-  writer.traverseAll(e);
-  writeStream.flush();
+  writer.write(e);
   std::string buffer = writeStream.str();
   int len = buffer.size();
   std::cout << "Output " << len << " bytes.\n";
@@ -396,8 +630,118 @@ void testSerialization() {
 
 
 
+std::string printExpr(SExpr *e) {
+  std::stringstream ss;
+  TILDebugPrinter::print(e, ss);
+  return ss.str();
+}
+
+
+// Names which occur more than once are written once, and share a single
+// copy when they are read back.
+void testStringTable() {
+  MemRegion    region;
+  MemRegionRef arena(&region);
+  CFGBuilder   builder(arena);
+
+  SExpr *e = builder.newIdentifier("total");
+  for (int i = 0; i < 10; ++i) {
+    auto *p = builder.newProject(builder.newIdentifier("counter"), "value");
+    e = builder.newBinaryOp(BOP_Add, e, p);
+  }
+
+  BytecodeStringWriter writeStream;
+  BytecodeWriter writer(&writeStream);
+  writer.write(e);
+  std::string buffer = writeStream.str();
+  CHECK(buffer.find("counter") == buffer.rfind("counter"));
+  CHECK(buffer.find("value") == buffer.rfind("value"));
+
+  InMemoryReader readStream(buffer.data(), buffer.size(), arena);
+  BytecodeReader reader(builder, &readStream);
+  SExpr *e2 = reader.read();
+  CHECK(e2 && reader.success());
+  CHECK(printExpr(e2) == printExpr(e));
+
+  const char *Name = nullptr;
+  for (int i = 0; i < 10; ++i) {
+    auto *b = cast<BinaryOp>(e2);
+    auto *p = cast<Project>(b->expr1());
+    CHECK(!Name || p->slotName().data() == Name);
+    Name = p->slotName().data();
+    e2 = b->expr0();
+  }
+  CHECK(cast<Identifier>(e2)->idString() == "total");
+}
+
+
+// Write several expressions to a container, and read them back one at a
+// time, in a different order.
+void testContainer() {
+  MemRegion    region;
+  MemRegionRef arena(&region);
+  CFGBuilder   builder(arena);
+  const char* FileName = "test_serialization.ohbc";
+
+  std::vector<std::pair<std::string, SExpr*>> Exprs = {
+    { "branch", makeBranch(builder) },
+    { "simpleExpr", makeSimpleExpr(builder) },
+    { "module", makeModule(builder) },
+    { "simple", makeSimple(builder) }
+  };
+  {
+    BytecodeContainerWriter writer(FileName);
+    for (auto &P : Exprs)
+      writer.addEntry(StringRef(P.first), P.second);
+    CHECK(writer.finish());
+  }
+
+  BytecodeContainer container;
+  CHECK(container.open(FileName));
+  CHECK(container.size() == Exprs.size());
+  CHECK(container.find("missing") == nullptr);
+  for (auto It = Exprs.rbegin(); It != Exprs.rend(); ++It) {
+    auto *E = container.find(StringRef(It->first));
+    CHECK(E && E->Name == StringRef(It->first));
+    SExpr *e2 = container.read(*E, builder);
+    CHECK(e2 && printExpr(e2) == printExpr(It->second));
+  }
+  container.close();
+
+  // Damaged containers are rejected.
+  std::string Data;
+  if (FILE *F = fopen(FileName, "rb")) {
+    char Buf[4096];
+    size_t Sz;
+    while ((Sz = fread(Buf, 1, sizeof(Buf), F)) > 0)
+      Data.append(Buf, Sz);
+    fclose(F);
+  }
+  for (size_t Cut : { Data.size() - 1, size_t(10) }) {
+    FILE *F = fopen(FileName, "wb");
+    fwrite(Data.data(), 1, Cut, F);
+    fclose(F);
+    CHECK(!container.open(FileName) && container.size() == 0);
+  }
+
+  // Duplicate names are an error.
+  {
+    BytecodeContainerWriter writer(FileName);
+    writer.addEntry("x", Exprs[0].second);
+    writer.addEntry("x", Exprs[1].second);
+    CHECK(!writer.finish());
+  }
+  remove(FileName);
+}
+
+
 int main(int argc, const char** argv) {
   testByteStream();
+  testBitStream();
+  testFileStream();
+  testCompressedStream();
   testSerialization();
+  testStringTable();
+  testContainer();
 }
 
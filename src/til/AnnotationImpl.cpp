@@ -21,11 +21,11 @@ InstrNameAnnot *InstrNameAnnot::copy(CFGBuilder &Builder,
 }
 
 void InstrNameAnnot::serialize(BytecodeWriter *B) {
-  B->getWriter()->writeString(Name);
+  B->writeString(Name);
 }
 
 InstrNameAnnot *InstrNameAnnot::deserialize(BytecodeReader *B) {
-  StringRef Nm = B->getReader()->readString();
+  StringRef Nm = B->readString();
   return B->getBuilder().newAnnotationT<InstrNameAnnot>(Nm);
 }
 
@@ -10,31 +10,135 @@
 
 #include "Bytecode.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 namespace ohmu {
 namespace til {
 
+namespace {
 
-void ByteStreamWriterBase::flush() {
-  if (Pos > 0)
-    writeData(Buffer.data(), Pos);
+int countTrailingZeros(uint64_t V) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(V);
+#else
+  int N = 0;
+  for (; (V & 1) == 0; V >>= 1)
+    ++N;
+  return N;
+#endif
+}
+
+void writeLE32(uint8_t *P, uint32_t V) {
+  P[0] = static_cast<uint8_t>(V);
+  P[1] = static_cast<uint8_t>(V >> 8);
+  P[2] = static_cast<uint8_t>(V >> 16);
+  P[3] = static_cast<uint8_t>(V >> 24);
+}
+
+uint32_t readLE32(const uint8_t *P) {
+  return uint32_t(P[0]) | uint32_t(P[1]) << 8 | uint32_t(P[2]) << 16 |
+         uint32_t(P[3]) << 24;
+}
+
+// Returns true if a block header holds sizes which a writer could produce.
+// Blocks are never larger than the buffer of the writer.
+bool validBlockSizes(uint32_t RawSize, uint32_t StoredSize) {
+  return RawSize > 0 && RawSize <= (BytecodeBase::MaxAtomSize << 4) &&
+         StoredSize > 0 && StoredSize <= RawSize;
+}
+
+}  // end anonymous namespace
+
+
+void ByteStreamWriterBase::flushBuffer() {
+  if (Pos > 0) {
+    if (Compressed)
+      writeBlock(Buffer.data(), Pos);
+    else
+      writeData(Buffer.data(), Pos);
+  }
   Pos = 0;
 }
 
 
+void ByteStreamWriterBase::writeBlock(const uint8_t *D, int64_t Size) {
+  const int HSize = BytecodeBase::BlockHeaderSize;
+  Packed.resize(HSize + LZCodec::compressBound(Size));
+  size_t N = Codec.compress(D, Size, Packed.data() + HSize);
+  writeLE32(Packed.data(), static_cast<uint32_t>(Size));
+  if (N >= static_cast<size_t>(Size)) {
+    // Store data which does not compress as it is.
+    writeLE32(Packed.data() + 4, static_cast<uint32_t>(Size));
+    writeData(Packed.data(), HSize);
+    writeData(D, Size);
+    return;
+  }
+  writeLE32(Packed.data() + 4, static_cast<uint32_t>(N));
+  writeData(Packed.data(), HSize + N);
+}
+
+
+void ByteStreamWriterBase::flush() {
+  alignToByte();
+  flushBuffer();
+}
+
+
+void ByteStreamWriterBase::alignToByte() {
+  while (AccBits > 0) {
+    Buffer[Pos++] = static_cast<uint8_t>(Acc);
+    Acc >>= 8;
+    AccBits -= 8;
+  }
+  Acc = 0;
+  AccBits = 0;
+}
+
+
+void ByteStreamReaderBase::alignToByte() {
+  // Whole bytes in the accumulator have not been read yet.
+  Pos -= AccBits >> 3;
+  Acc = 0;
+  AccBits = 0;
+}
+
+
+void ByteStreamReaderBase::unloadBytes() {
+  Pos -= AccBits >> 3;
+  AccBits &= 7;
+  // The rest of Acc may hold bytes which are about to be replaced.
+  Acc &= (uint64_t(1) << AccBits) - 1;
+}
+
+
 void ByteStreamReaderBase::refill() {
   if (Eof)
     return;
+  if (Buffer.empty()) {
+    Buffer.resize((Compressed ? CompressedBufferSize : BufferSize) +
+                  BufferSlack);
+    Data = Buffer.data();
+  }
+  unloadBytes();
 
   if (Pos > 0) {  // Move remaining contents to start of buffer.
-    assert(Pos > length() && "Cannot refill a nearly full buffer.");
+    // Blocks may be small, so compressed buffers can overlap.
+    assert((Compressed || Pos > length()) &&
+           "Cannot refill a nearly full buffer.");
 
-    int len = length();
+    int64_t len = length();
     if (len > 0)
-      memcpy(Buffer.data(), Buffer.data() + Pos, len);
+      memmove(Buffer.data(), Buffer.data() + Pos, len);
     Pos = 0;
     BufferLen = len;
   }
 
+  if (Compressed) {
+    readBlocks();
+    return;
+  }
   int read = readData(Buffer.data() + BufferLen, BufferSize - BufferLen);
   BufferLen += read;
   if (BufferLen < BufferSize)
@@ -42,27 +146,147 @@ void ByteStreamReaderBase::refill() {
 }
 
 
-void ByteStreamWriterBase::endAtom() {
-  if (length() <= BytecodeBase::MaxAtomSize)
-    flush();
+void ByteStreamReaderBase::readBlocks() {
+  // Refill is called with at most an atom left in the buffer, so the first
+  // block always fits.  Once a block does not fit, the buffer holds more
+  // than an atom, and its header is kept for the next refill.
+  const int HSize = BytecodeBase::BlockHeaderSize;
+  while (true) {
+    if (!HasNextBlock) {
+      uint8_t Header[HSize];
+      int64_t L = readData(Header, HSize);
+      if (L == 0) {
+        Eof = true;
+        return;
+      }
+      NextRawSize    = readLE32(Header);
+      NextStoredSize = readLE32(Header + 4);
+      if (L < HSize || !validBlockSizes(NextRawSize, NextStoredSize)) {
+        Error = true;
+        Eof = true;
+        return;
+      }
+      HasNextBlock = true;
+    }
+    if (BufferLen + NextRawSize > CompressedBufferSize)
+      return;
+
+    HasNextBlock = false;
+    uint8_t *Dest = Buffer.data() + BufferLen;
+    bool Ok;
+    if (NextStoredSize == NextRawSize) {
+      Ok = readData(Dest, NextRawSize) == NextRawSize;
+    } else {
+      Packed.resize(NextStoredSize);
+      Ok = readData(Packed.data(), NextStoredSize) == NextStoredSize &&
+           LZCodec::decompress(Packed.data(), NextStoredSize,
+                               Dest, NextRawSize);
+    }
+    if (!Ok) {
+      Error = true;
+      Eof = true;
+      return;
+    }
+    BufferLen += NextRawSize;
+  }
 }
 
 
-void ByteStreamReaderBase::endAtom() {
+bool ByteStreamReaderBase::decompressBlocks(const void *D, int64_t Size,
+                                            std::vector<uint8_t> &Out,
+                                            int64_t Padding,
+                                            unsigned NumThreads) {
+  struct Block {
+    const uint8_t* Src;
+    uint32_t       StoredSize;
+    uint32_t       RawSize;
+    uint64_t       Offset;     ///< Offset of the contents in Out.
+  };
+
+  // Find the blocks from their headers.
+  const int HSize = BytecodeBase::BlockHeaderSize;
+  const uint8_t *P   = static_cast<const uint8_t*>(D);
+  const uint8_t *End = P + Size;
+  std::vector<Block> Blocks;
+  uint64_t Total = 0;
+  while (P < End) {
+    if (End - P < HSize)
+      return false;
+    Block B;
+    B.RawSize    = readLE32(P);
+    B.StoredSize = readLE32(P + 4);
+    B.Src        = P + HSize;
+    B.Offset     = Total;
+    if (!validBlockSizes(B.RawSize, B.StoredSize) ||
+        B.StoredSize > static_cast<uint64_t>(End - B.Src))
+      return false;
+    Blocks.push_back(B);
+    P = B.Src + B.StoredSize;
+    Total += B.RawSize;
+  }
+
+  Out.assign(Total + Padding, 0);
+  std::atomic<bool> Ok(true);
+  std::atomic<size_t> Next(0);
+  auto Work = [&]() {
+    for (size_t i = Next++; i < Blocks.size(); i = Next++) {
+      const Block &B = Blocks[i];
+      uint8_t *Dest = Out.data() + B.Offset;
+      if (B.StoredSize == B.RawSize)
+        memcpy(Dest, B.Src, B.RawSize);
+      else if (!LZCodec::decompress(B.Src, B.StoredSize, Dest, B.RawSize))
+        Ok = false;
+    }
+  };
+
+  if (NumThreads == 0)
+    NumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+  NumThreads = std::min<size_t>(NumThreads, Blocks.size());
+  if (NumThreads <= 1) {
+    Work();
+    return Ok;
+  }
+  std::vector<std::thread> Threads;
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Threads.emplace_back(Work);
+  for (auto &T : Threads)
+    T.join();
+  return Ok;
+}
+
+
+void ByteStreamReaderBase::setMappedData(const void *D, int64_t Size) {
+  Data = static_cast<const uint8_t*>(D);
+  BufferLen = Size;
+  Pos = 0;
+  Eof = true;
+  Mapped = true;
+}
+
+
+void ByteStreamWriterBase::endAtom() {
   if (length() <= BytecodeBase::MaxAtomSize)
-    refill();
+    flushBuffer();
 }
 
 
 void ByteStreamWriterBase::writeBytes(const void *Data, int64_t Size) {
+  alignToByte();
   if (Size >= (BufferSize >> 1)) {   // Don't buffer large writes.
-    flush();                  // Flush current data to disk.
-    writeData(Data, Size);    // Directly write the bytes to disk.
+    flushBuffer();            // Flush current data to disk.
+    if (!Compressed) {
+      writeData(Data, Size);  // Directly write the bytes to disk.
+      return;
+    }
+    // Split the bytes into blocks which fit in the buffer of a reader.
+    const uint8_t *P = static_cast<const uint8_t*>(Data);
+    for (int64_t Off = 0; Off < Size; Off += BufferSize)
+      writeBlock(P + Off, std::min<int64_t>(Size - Off, BufferSize));
     return;
   }
   // Flush buffer if the write would fill it up.
   if (length() - Size <= BytecodeBase::MaxAtomSize)
-    flush();
+    flushBuffer();
 
   memcpy(Buffer.data() + Pos, Data, Size);
   Pos += Size;
@@ -70,19 +294,22 @@ void ByteStreamWriterBase::writeBytes(const void *Data, int64_t Size) {
 }
 
 
-void ByteStreamReaderBase::readBytes(void *Data, int64_t Size) {
-  int len = length();
+void ByteStreamReaderBase::readBytes(void *Dest, int64_t Size) {
+  alignToByte();
+  int64_t len = length();
   if (Size > len) {
-    memcpy(Data, Buffer.data() + Pos, len);   // Copy out current buffer.
+    memcpy(Dest, Data + Pos, len);   // Copy out current buffer.
+    Pos += len;
     Size = Size - len;
-    Data = reinterpret_cast<char*>(Data) + len;
+    Dest = reinterpret_cast<char*>(Dest) + len;
 
-    if (Size >= (BufferSize >> 1)) {   // Don't buffer large reads.
+    // Don't buffer large reads, unless they must be decompressed.
+    if (Size >= (BufferSize >> 1) && !Compressed) {
       if (Eof) {
         Error = true;
         return;
       }
-      int64_t L = readData(Data, Size);   // Read more data.
+      int64_t L = readData(Dest, Size);   // Read more data.
       if (L < Size)
         Eof = true;
       refill();                        // Refill buffer
@@ -90,6 +317,15 @@ void ByteStreamReaderBase::readBytes(void *Data, int64_t Size) {
     }
 
     refill();
+    // Compressed data must pass through the buffer, one block at a time.
+    while (Compressed && Size > length() && !Eof) {
+      len = length();
+      memcpy(Dest, Data + Pos, len);
+      Pos += len;
+      Size -= len;
+      Dest = reinterpret_cast<char*>(Dest) + len;
+      refill();
+    }
     if (Size > length()) {
       Error = true;
       return;
@@ -97,107 +333,67 @@ void ByteStreamReaderBase::readBytes(void *Data, int64_t Size) {
   }
 
   // Size < length() at this point.
-  memcpy(Data, Buffer.data() + Pos, Size);
+  memcpy(Dest, Data + Pos, Size);
   Pos += Size;
   if (length() < BytecodeBase::MaxAtomSize)
     refill();
 }
 
 
-void ByteStreamWriterBase::writeBits32(uint32_t V, int Nbits) {
-  while (Nbits > 0) {
-    Buffer[Pos++] = V & 0xFF;
-    V = V >> 8;
-    Nbits -= 8;
-  }
-}
-
-
-void ByteStreamWriterBase::writeBits64(uint64_t V, int Nbits) {
-  while (Nbits > 0) {
-    Buffer[Pos++] = V & 0xFF;
-    V = V >> 8;
-    Nbits -= 8;
-  }
-}
-
-
-uint32_t ByteStreamReaderBase::readBits32(int Nbits) {
-  assert(Nbits <= 32 && "Invalid number of bits.");
-  uint32_t V = 0;
-  int B = 0;
-  while (true) {
-    uint32_t Byt = Buffer[Pos++];
-    V = V | (Byt << B);
-    B += 8;
-    if (B >= Nbits)
-      break;
-  }
-  return V;
-}
-
-
-uint64_t ByteStreamReaderBase::readBits64(int Nbits) {
-  assert(Nbits <= 64 && "Invalid number of bits.");
-  uint64_t V = 0;
-  int B = 0;
-  while (true) {
-    uint64_t Byt = Buffer[Pos++];
-    V = V | (Byt << B);
-    B += 8;
-    if (B >= Nbits)
-      break;
-  }
-  return V;
-}
-
-
 void ByteStreamWriterBase::writeUInt32_Vbr(uint32_t V) {
-  if (V == 0) {
-    Buffer[Pos++] = 0;
-    return;
-  }
-  while (V > 0) {
+  // Each group holds 7 bits of V, and a high bit which is set if there are
+  // more groups to follow.  A 32-bit value has at most 5 groups.
+  uint64_t W = 0;
+  int N = 0;
+  while (true) {
     uint32_t V2 = V >> 7;
-    uint8_t Hibit = (V2 == 0) ? 0 : 0x80;
-    // Write lower 7 bits.  The 8th bit is high if there's more to write.
-    Buffer[Pos++] = static_cast<uint8_t>((V & 0x7F) | Hibit);
+    uint64_t Hibit = (V2 == 0) ? 0 : 0x80;
+    W |= ((V & 0x7F) | Hibit) << N;
+    N += 8;
+    if (V2 == 0)
+      break;
     V = V2;
   }
+  writeBits64(W, N);
 }
 
 
 void ByteStreamWriterBase::writeUInt64_Vbr(uint64_t V) {
-  if (V == 0) {
-    Buffer[Pos++] = 0;
-    return;
-  }
-  while (V > 0) {
+  while (true) {
     uint64_t V2 = V >> 7;
-    uint8_t Hibit = (V2 == 0) ? 0 : 0x80;
-    // Write lower 7 bits.  The 8th bit is high if there's more to write.
-    Buffer[Pos++] = static_cast<uint8_t>((V & 0x7Fu) | Hibit);
+    uint32_t Hibit = (V2 == 0) ? 0 : 0x80;
+    writeBits32(static_cast<uint32_t>(V & 0x7F) | Hibit, 8);
+    if (V2 == 0)
+      break;
     V = V2;
   }
 }
 
 
-uint32_t ByteStreamReaderBase::readUInt32_Vbr() {
-  uint32_t V = 0;
-  for (unsigned B = 0; B < 32; B += 7) {
-    uint32_t Byt = Buffer[Pos++];
-    V = V | ((Byt & 0x7Fu) << B);
-    if ((Byt & 0x80) == 0)
-      break;
-  }
-  return V;
+uint32_t ByteStreamReaderBase::readUInt32_VbrGroups() {
+  // Decode all of the groups at once, without a loop.  The accumulator
+  // holds at least 40 bits, which is enough for the longest encoding.  The
+  // end of the value is the first group whose high bit is clear; the high
+  // bit of the fifth group is treated as clear, as in the old byte loop.
+  uint64_t A = Acc;
+  uint64_t Stop = (~A & 0x8080808080ULL) | 0x8000000000ULL;
+  int Nbits = countTrailingZeros(Stop) + 1;        // 8, 16, ..., 40
+  uint64_t V = ( A       & 0x000000007FULL) |
+               ((A >> 1) & 0x0000003F80ULL) |
+               ((A >> 2) & 0x00001FC000ULL) |
+               ((A >> 3) & 0x000FE00000ULL) |
+               ((A >> 4) & 0x07F0000000ULL);
+  V &= (uint64_t(1) << (Nbits - (Nbits >> 3))) - 1;   // 7 bits per group
+  Acc >>= Nbits;
+  AccBits -= Nbits;
+  return static_cast<uint32_t>(V);
 }
 
 
 uint64_t ByteStreamReaderBase::readUInt64_Vbr() {
   uint64_t V = 0;
   for (unsigned B = 0; B < 64; B += 7) {
-    uint64_t Byt = Buffer[Pos++];
+    uint64_t Byt = readBits32(8);
     V = V | ((Byt & 0x7Fu) << B);
     if ((Byt & 0x80) == 0)
       break;
@@ -245,7 +441,22 @@ void ByteStreamWriterBase::writeString(StringRef S) {
 
 
 StringRef ByteStreamReaderBase::readString() {
-  uint32_t Sz = readUInt32();
+  return readStringData(readUInt32());
+}
+
+
+StringRef ByteStreamReaderBase::readStringData(uint32_t Sz) {
+  if (Mapped) {
+    alignToByte();
+    // Return the string in place.
+    if (Sz > length()) {
+      Error = true;
+      return StringRef(nullptr, 0);
+    }
+    const char* S = reinterpret_cast<const char*>(Data + Pos);
+    Pos += Sz;
+    return StringRef(S, Sz);
+  }
   char* S = allocStringData(Sz);
   if (!S) {
     Error = true;
@@ -310,6 +521,42 @@ void BytecodeReader::exitScope() {
   Vars.pop_back();
 }
 
+void BytecodeWriter::writeString(StringRef S) {
+  // The low bit tells whether the rest is the index of an earlier string,
+  // or the size of a new string, whose bytes follow.
+  auto It = StringIndex.find(S);
+  if (It != StringIndex.end()) {
+    Writer->writeUInt32((It->second << 1) | 1);
+    return;
+  }
+  StringIndex.insert(std::make_pair(S, NumStrings++));
+  Writer->writeUInt32(static_cast<uint32_t>(S.size()) << 1);
+  Writer->writeBytes(S.data(), S.size());
+}
+
+StringRef BytecodeReader::readString() {
+  uint32_t V = Reader->readUInt32();
+  if ((V & 1) == 0) {
+    StringRef S = Reader->readStringData(V >> 1);
+    Strings.push_back(S);
+    return S;
+  }
+  if ((V >> 1) >= Strings.size()) {
+    fail("Invalid string index.");
+    return StringRef(nullptr, 0);
+  }
+  return Strings[V >> 1];
+}
+
+
+void BytecodeReader::enterOuterScope(VarDecl *Vd) {
+  if (Vars.size() != Vd->varIndex()) {
+    fail("Invalid variable declaration.");
+    return;
+  }
+  Vars.push_back(Vd);
+}
+
 
 void BytecodeWriter::enterBlock(BasicBlock *B) {
   writePseudoOpcode(PSOP_EnterBlock);
@@ -460,13 +707,13 @@ void BytecodeWriter::reduceVarDecl(VarDecl* E) {
   writeOpcode(COP_VarDecl);
   writeFlag(E->kind());
   Writer->writeUInt32(E->varIndex());
-  Writer->writeString(E->varName());
+  writeString(E->varName());
 }
 
 void BytecodeReader::readVarDecl() {
   auto K = readFlag<VarDecl::VariableKind>();
   unsigned Id = Reader->readUInt32();
-  StringRef Nm = Reader->readString();
+  StringRef Nm = readString();
   auto *E = Builder.newVarDecl(K, Nm, arg(0));  // TODO: enter Scope?
   E->setVarIndex(Id);
   drop(1);
@@ -513,12 +760,12 @@ void BytecodeReader::readField() {
 void BytecodeWriter::reduceSlot(Slot *E) {
   writeOpcode(COP_Slot);
   Writer->writeUInt16(E->modifiers());
-  Writer->writeString(E->slotName());
+  writeString(E->slotName());
 }
 
 void BytecodeReader::readSlot() {
   uint16_t Mods = Reader->readUInt16();
-  StringRef S = Reader->readString();
+  StringRef S = readString();
   auto *E = Builder.newSlot(S, arg(0));
   E->setModifiers(Mods);
   drop(1);
@@ -634,11 +881,11 @@ void BytecodeReader::readApply() {
 
 void BytecodeWriter::reduceProject(Project *E) {
   writeOpcode(COP_Project);
-  Writer->writeString(E->slotName());
+  writeString(E->slotName());
 }
 
 void BytecodeReader::readProject() {
-  StringRef Nm = Reader->readString();
+  StringRef Nm = readString();
   auto *E = Builder.newProject(arg(0), Nm);
   drop(1);
   push(E);
@@ -769,16 +1016,21 @@ void BytecodeReader::readCast() {
 
 void BytecodeWriter::reducePhi(Phi *E) {
   writeOpcode(COP_Phi);
+  writeBaseType(E->baseType());
 }
 
 void BytecodeReader::readPhi() {
+  BaseType Bt = readBaseType();
+  Phi *Ph;
   if (Builder.currentBB() && CurrentArg < Builder.currentBB()->numArguments())
     // Grab the current argument, which was previously created.
     // See also readBBArgument().
-    push(Builder.currentBB()->arguments()[CurrentArg]);
+    Ph = Builder.currentBB()->arguments()[CurrentArg];
   else
     // This should never happen -- all Phi nodes should be arguments.
-    push(Builder.newPhi(0,false));
+    Ph = Builder.newPhi(0,false);
+  Ph->setBaseType(Bt);
+  push(Ph);
 }
 
 
@@ -875,11 +1127,11 @@ void BytecodeReader::readWildcard() {
 
 void BytecodeWriter::reduceIdentifier(Identifier *E) {
   writeOpcode(COP_Identifier);
-  Writer->writeString(E->idString());
+  writeString(E->idString());
 }
 
 void BytecodeReader::readIdentifier() {
-  StringRef S = Reader->readString();
+  StringRef S = readString();
   auto *E = Builder.newIdentifier(S);
   push(E);
 }
@@ -909,7 +1161,7 @@ void BytecodeReader::readIfThenElse() {
 
 
 
-void BytecodeReader::readSExpr() {
+bool BytecodeReader::readSExpr() {
   auto Psop = readPseudoOpcode();
   switch (Psop) {
     case PSOP_Null:          readNull();          break;
@@ -921,10 +1173,12 @@ void BytecodeReader::readSExpr() {
     case PSOP_EnterBlock:    enterBlock();        break;
     case PSOP_EnterCFG:      enterCFG();          break;
     case PSOP_Annotation:    readAnnotation();    break;
+    case PSOP_EndOfStream:   return false;
     default:
       readSExprByType(getOpcode(Psop));  break;
   }
   Reader->endAtom();
+  return true;
 }
 
 void BytecodeReader::readSExprByType(TIL_Opcode op) {
@@ -955,7 +1209,8 @@ void BytecodeReader::readAnnotationByKind(TIL_AnnKind Ak) {
 
 SExpr* BytecodeReader::read() {
   while (!Reader->empty() && success()) {
-    readSExpr();
+    if (!readSExpr())
+      break;
   }
   if (!success()) {
     return nullptr;
@@ -984,5 +1239,36 @@ void BytecodeStringWriter::dump() {
 }
 
 
+BytecodeFileReader::BytecodeFileReader(const std::string &FileName,
+                                       MemRegionRef A, bool Compressed)
+    : Arena(A) {
+  if (Mapping.open(FileName, BytecodeBase::MaxAtomSize)) {
+    // The file is read once, from start to end.
+    Mapping.adviseSequential();
+    if (!Compressed) {
+      setMappedData(Mapping.data(), Mapping.size());
+      return;
+    }
+    // Decompress every block at once, and read the result in place.  A
+    // damaged file is read as an empty stream.
+    const int64_t Padding = BytecodeBase::MaxAtomSize;
+    if (!decompressBlocks(Mapping.data(), Mapping.size(), Contents, Padding))
+      Contents.assign(Padding, 0);
+    Mapping.close();
+    setMappedData(Contents.data(), Contents.size() - Padding);
+    return;
+  }
+  FileStream.open(FileName, std::ios::binary);
+  if (Compressed)
+    setCompressed();
+  refill();
+}
+
+
+BytecodeFileReader::~BytecodeFileReader() {
+  FileStream.close();
+}
+
+
 }  // end namespace til
 }  // end namespace ohmu
@@ -12,6 +12,8 @@
 
 #include "AnnotationImpl.h"
 #include "CFGBuilder.h"
+#include "base/LZCodec.h"
+#include "base/MappedFile.h"
 #include "TIL.h"
 #include "TILTraverse.h"
 
@@ -30,6 +32,10 @@ public:
   // Maximum size of a single atom.
   static const int MaxAtomSize = (1 << 12);  // 4k
 
+  // Size of the header of a compressed block: the size of its contents, and
+  // the size in which they are stored, as two little-endian 32-bit words.
+  static const int BlockHeaderSize = 8;
+
   enum PseudoOpcode : uint8_t {
     PSOP_Null = 0,
     PSOP_WeakInstrRef,
@@ -40,6 +46,7 @@ public:
     PSOP_EnterBlock,
     PSOP_EnterCFG,
     PSOP_Annotation,
+    PSOP_EndOfStream,  // Streams are bit-packed, so padding looks like data.
     PSOP_Last
   };
 
@@ -66,38 +73,73 @@ public:
 /// Abstract base class for an output stream of bytes.
 /// Derived classes must implement writeData to write the binary data to
 /// a destination.  (E.g. file, network, etc.)
+///
+/// The stream is packed at the level of bits: a field of N bits takes up
+/// exactly N bits, least significant bit first.  Bits are collected in an
+/// accumulator, and moved to the buffer 32 at a time.  Blocks of bytes and
+/// strings start on a byte boundary.
+///
+/// If compression is enabled, each buffer is compressed with LZCodec before
+/// it is written, and is preceded by a block header.  Blocks do not refer
+/// to each other, so each one can be decompressed on its own.
 class ByteStreamWriterBase {
 public:
-  ByteStreamWriterBase() : Pos(0), Buffer(BufferSize) { }
+  ByteStreamWriterBase()
+      : Acc(0), AccBits(0), Pos(0), Compressed(false), Buffer(BufferSize) { }
 
   virtual ~ByteStreamWriterBase() {
-    assert(Pos == 0 && "Must flush writer before destruction.");
+    assert(Pos == 0 && AccBits == 0 &&
+           "Must flush writer before destruction.");
   }
 
   /// Write a block of data to disk.
   virtual void writeData(const void *Buf, int64_t Size) = 0;
 
-  /// Flush buffer to disk.
+  /// Compress the stream in blocks.  Must be called before anything is
+  /// written, and the stream must then be read by a compressed reader.
+  void setCompressed(bool B) {
+    assert(Pos == 0 && AccBits == 0 && "Stream has already been written.");
+    Compressed = B;
+  }
+
+  /// Pad the stream to a byte boundary, and flush buffer to disk.
   /// Derived classes should call this method in the destructor.
   void flush();
 
   /// Mark the end of an atom (an indivisible sequence of bytes).
   /// Flushes are performed on atomic boundaries, rather than byte boundaries.
+  /// Unlike flush(), this does not pad the stream.
   void endAtom();
 
-  /// Emit a block of bytes.
+  /// Pad the stream with zeros to the next byte boundary.
+  void alignToByte();
+
+  /// Emit a block of bytes, starting at the next byte boundary.
   void writeBytes(const void *Data, int64_t Size);
 
-  /// Emit up to 32 bits in little-endian byte order.
-  void writeBits32(uint32_t V, int Nbits);
+  /// Emit the low Nbits bits of V, where Nbits is at most 32.
+  void writeBits32(uint32_t V, int Nbits) {
+    assert(Nbits <= 32 && "Invalid number of bits.");
+    Acc |= (V & ((uint64_t(1) << Nbits) - 1)) << AccBits;
+    AccBits += Nbits;
+    if (AccBits >= 32)
+      spill();
+  }
 
-  /// Emit up to 64 bits in little-endian byte order.
-  void writeBits64(uint64_t V, int Nbits);
+  /// Emit the low Nbits bits of V, where Nbits is at most 64.
+  void writeBits64(uint64_t V, int Nbits) {
+    if (Nbits > 32) {
+      writeBits32(static_cast<uint32_t>(V), 32);
+      V >>= 32;
+      Nbits -= 32;
+    }
+    writeBits32(static_cast<uint32_t>(V), Nbits);
+  }
 
-  /// Emit a 32-bit unsigned int in a variable number of bytes.
+  /// Emit a 32-bit unsigned int in a variable number of 8-bit groups.
   void writeUInt32_Vbr(uint32_t V);
 
-  /// Emit a 64-bit unsigned int in a variable number of bytes.
+  /// Emit a 64-bit unsigned int in a variable number of 8-bit groups.
   void writeUInt64_Vbr(uint64_t V);
 
   void writeBool(bool V) { writeBits32(V, 1); }
@@ -120,11 +162,34 @@ private:
   /// Returns the remaining size in the buffer
   int length() { return BufferSize - Pos; }
 
+  /// Move 32 bits from the accumulator to the buffer.
+  void spill() {
+    uint32_t W = static_cast<uint32_t>(Acc);
+    Buffer[Pos]   = static_cast<uint8_t>(W);
+    Buffer[Pos+1] = static_cast<uint8_t>(W >> 8);
+    Buffer[Pos+2] = static_cast<uint8_t>(W >> 16);
+    Buffer[Pos+3] = static_cast<uint8_t>(W >> 24);
+    Pos += 4;
+    Acc >>= 32;
+    AccBits -= 32;
+  }
+
+  /// Write the buffer to disk, leaving the accumulator alone.
+  void flushBuffer();
+
+  /// Compress Size bytes at D, and write them to disk as a single block.
+  void writeBlock(const uint8_t *D, int64_t Size);
+
   /// Size of the buffer.  Default is 64k.
   static const int BufferSize = BytecodeBase::MaxAtomSize << 4;
 
+  uint64_t Acc;       ///< Bits which have not been moved to the buffer.
+  int      AccBits;   ///< Number of bits in Acc; always less than 32.
   int Pos;
+  bool Compressed;
   std::vector<uint8_t> Buffer;
+  std::vector<uint8_t> Packed;   ///< A compressed block, with its header.
+  LZCodec Codec;
 };
 
 
@@ -132,10 +197,24 @@ private:
 /// Abstract base class for an input stream of bytes.
 /// Derived classes must implement readData to read the binary data from
 /// a source.  (E.g. file, network, etc.)
+///
+/// Alternatively, a derived class which holds the entire stream in memory
+/// can call setMappedData, in which case bytes are read directly from that
+/// memory, without refilling, and strings point into it.
+///
+/// Bits are read as they were written by ByteStreamWriterBase.  The reader
+/// loads 8 bytes at a time into an accumulator, and takes fields from the
+/// bottom of it.
+///
+/// A compressed stream is decompressed into the buffer one block at a time.
+/// A derived class which holds the whole compressed stream in memory can
+/// instead decompress all of it at once with decompressBlocks, and then
+/// read the result as mapped data.
 class ByteStreamReaderBase {
 public:
-  ByteStreamReaderBase() : BufferLen(0), Pos(0), Eof(false), Error(false),
-      Buffer(BufferSize) { }
+  ByteStreamReaderBase() : Acc(0), AccBits(0), Data(nullptr), BufferLen(0),
+      Pos(0), Eof(false), Error(false), Mapped(false), Compressed(false),
+      HasNextBlock(false), NextRawSize(0), NextStoredSize(0) { }
 
   virtual ~ByteStreamReaderBase() { }
 
@@ -153,21 +232,51 @@ public:
 
   /// Finish reading the current atom.
   /// Refill operations are done on an atom-by-atom rather than byte basis.
-  void endAtom();
+  void endAtom() {
+    if (!Eof && length() <= BytecodeBase::MaxAtomSize)
+      refill();
+  }
+
+  /// Skip the padding which ByteStreamWriterBase::alignToByte emitted.
+  void alignToByte();
 
-  /// Read an interpreted blob of bytes.
+  /// Read an interpreted blob of bytes, starting at the next byte boundary.
   void readBytes(void *Data, int64_t Size);
 
   /// Read up to 32 bits, and return them as an unsigned int.
-  uint32_t readBits32(int Nbits);
+  uint32_t readBits32(int Nbits) {
+    assert(Nbits <= 32 && "Invalid number of bits.");
+    if (AccBits < Nbits)
+      fill();
+    uint32_t V = static_cast<uint32_t>(Acc & ((uint64_t(1) << Nbits) - 1));
+    Acc >>= Nbits;
+    AccBits -= Nbits;
+    return V;
+  }
 
   /// Read up to 64 bits, and return them as an unsigned int.
-  uint64_t readBits64(int Nbits);
+  uint64_t readBits64(int Nbits) {
+    if (Nbits <= 32)
+      return readBits32(Nbits);
+    uint64_t Lo = readBits32(32);
+    return Lo | (static_cast<uint64_t>(readBits32(Nbits - 32)) << 32);
+  }
 
-  /// Read a 32-bit unsigned int in a variable number of bytes.
-  uint32_t readUInt32_Vbr();
+  /// Read a 32-bit unsigned int in a variable number of 8-bit groups.
+  /// Most values fit in a single group, which is handled inline.
+  uint32_t readUInt32_Vbr() {
+    if (AccBits < 40)
+      fill();
+    if ((Acc & 0x80) == 0) {
+      uint32_t V = static_cast<uint32_t>(Acc & 0x7F);
+      Acc >>= 8;
+      AccBits -= 8;
+      return V;
+    }
+    return readUInt32_VbrGroups();
+  }
 
-  /// Read a 64-bit unsigned int in a variable number of bytes.
+  /// Read a 64-bit unsigned int in a variable number of 8-bit groups.
   uint64_t readUInt64_Vbr();
 
   bool     readBool()   { return readBits32(1); }
@@ -186,20 +295,95 @@ public:
   double    readDouble();
   StringRef readString();
 
-  bool empty() { return Eof && length() <= 0; }
+  /// Read the bytes of a string whose size has already been read.
+  StringRef readStringData(uint32_t Sz);
+
+  bool empty() { return Eof && length() * 8 + AccBits < 8; }
+
+  /// Returns true if the stream is read directly from memory, in which case
+  /// strings returned by readString point into that memory.
+  bool isMapped() const { return Mapped; }
+
+  /// Decompress the Size bytes of compressed stream at D into Out, followed
+  /// by Padding zero bytes.  Blocks are decompressed in parallel, on up to
+  /// NumThreads threads, or one per core if NumThreads is zero.  Returns
+  /// false if the stream is damaged.
+  static bool decompressBlocks(const void *D, int64_t Size,
+                               std::vector<uint8_t> &Out,
+                               int64_t Padding = BytecodeBase::MaxAtomSize,
+                               unsigned NumThreads = 0);
+
+protected:
+  /// Read the stream from the Size bytes at D, rather than calling readData.
+  /// The MaxAtomSize bytes after the end of D must also be readable, so that
+  /// a truncated atom cannot read past the end of the memory.  D must
+  /// outlive any strings which are read from it.
+  void setMappedData(const void *D, int64_t Size);
+
+  /// Read a stream which was written with compression.  Must be called
+  /// before the first refill.
+  void setCompressed() {
+    assert(Buffer.empty() && "Stream has already been read.");
+    Compressed = true;
+  }
 
 private:
-  /// Return the remaining data in the buffer.
-  int length() { return BufferLen - Pos; }
+  /// Return the remaining data in the buffer, not counting the accumulator.
+  int64_t length() { return BufferLen - Pos; }
+
+  /// Load as many whole bytes as will fit into the accumulator, leaving at
+  /// least 56 bits in it.  This may read up to 8 bytes past the end of the
+  /// data, which is why the buffer has some slack, and mapped data must be
+  /// followed by readable memory.
+  void fill() {
+    const uint8_t *P = Data + Pos;
+    uint64_t W = uint64_t(P[0])       | uint64_t(P[1]) << 8  |
+                 uint64_t(P[2]) << 16 | uint64_t(P[3]) << 24 |
+                 uint64_t(P[4]) << 32 | uint64_t(P[5]) << 40 |
+                 uint64_t(P[6]) << 48 | uint64_t(P[7]) << 56;
+    // Bits above AccBits are either zero, or were loaded from the same
+    // bytes by an earlier fill, so they can be combined with a plain or.
+    Acc |= W << AccBits;
+    int N = (63 - AccBits) >> 3;
+    Pos += N;
+    AccBits += N << 3;
+  }
+
+  /// Decode a value of up to 5 groups, once the accumulator has been filled.
+  uint32_t readUInt32_VbrGroups();
+
+  /// Return whole bytes in the accumulator to the buffer, so that the
+  /// buffer can be compacted.
+  void unloadBytes();
+
+  /// Decompress blocks into the end of the buffer, for as long as they fit.
+  void readBlocks();
 
   /// Size of the buffer.  Default is 64k.
   static const int BufferSize = BytecodeBase::MaxAtomSize << 4;
 
-  int  BufferLen;
-  int  Pos;
+  /// Extra bytes at the end of the buffer, so that fill() can overrun it.
+  static const int BufferSlack = 8;
+
+  /// Largest amount of data in the buffer of a compressed stream: up to an
+  /// atom which is left over from the last block, and one more block.
+  static const int CompressedBufferSize =
+      BufferSize + BytecodeBase::MaxAtomSize;
+
+  uint64_t Acc;           ///< Bits which have been loaded but not read.
+  int      AccBits;       ///< Number of bits in Acc.
+  const uint8_t* Data;    ///< Either Buffer, or the mapped stream.
+  int64_t BufferLen;
+  int64_t Pos;
   bool Eof;
   bool Error;
-  std::vector<uint8_t> Buffer;
+  bool Mapped;
+  bool Compressed;
+  bool HasNextBlock;             ///< The header of the next block was read.
+  uint32_t NextRawSize;
+  uint32_t NextStoredSize;
+  std::vector<uint8_t> Buffer;   ///< Allocated by the first refill.
+  std::vector<uint8_t> Packed;   ///< The compressed block being read.
 };
 
 
@@ -243,7 +427,7 @@ protected:
   void writeLitVal(float  V)    { Writer->writeFloat(V);  }
   void writeLitVal(double V)    { Writer->writeDouble(V); }
 
-  void writeLitVal(StringRef S) { Writer->writeString(S); }
+  void writeLitVal(StringRef S) { writeString(S); }
 
   void writeLitVal(void* P) {
     assert(P == nullptr && "Cannot serialize non-null pointer literal.");
@@ -331,18 +515,30 @@ public:
   void reduceLet(Let *E);
   void reduceIfThenElse(IfThenElse *E);
 
-  BytecodeWriter(ByteStreamWriterBase *W) : Writer(W) { }
+  BytecodeWriter(ByteStreamWriterBase *W) : Writer(W), NumStrings(0) { }
       // WritingAnn(false) { }
 
   ByteStreamWriterBase *getWriter() { return Writer; }
 
+  /// Write a name or string literal.  Each distinct string is written once
+  /// per stream; later occurrences are written as an index into the strings
+  /// which came before.  The characters of S are not copied, so they must
+  /// stay alive until write() returns.
+  void writeString(StringRef S);
+
   void write(SExpr* E) {
+    StringIndex.shrink_and_clear();
+    NumStrings = 0;
     traverseAll(E);
+    writePseudoOpcode(PSOP_EndOfStream);
     Writer->flush();
   }
 
 private:
   ByteStreamWriterBase *Writer;
+
+  DenseMap<StringRef, uint32_t> StringIndex;  ///< Strings written so far.
+  uint32_t NumStrings;
 };
 
 
@@ -380,7 +576,7 @@ protected:
 
   float     readLitVal(float*)     { return Reader->readFloat();  }
   double    readLitVal(double*)    { return Reader->readDouble(); }
-  StringRef readLitVal(StringRef*) { return Reader->readString(); }
+  StringRef readLitVal(StringRef*) { return readString(); }
   void*     readLitVal(void**)     { return nullptr; }
 
   ArrayRef<SExpr*> lastArgs(unsigned n) {
@@ -394,8 +590,9 @@ protected:
 
   template<class T> class ReadLiteralFun;
 
-  /// Read an SExpr from the byte stream.
-  void readSExpr();
+  /// Read an SExpr from the byte stream.  Returns false at the end of the
+  /// stream.
+  bool readSExpr();
 
   /// Read a SExpr, branching on the Opcode.
   void readSExprByType(TIL_Opcode Op);
@@ -462,11 +659,19 @@ public:
   BytecodeReader(CFGBuilder& B, ByteStreamReaderBase* R)
       : Builder(B), Reader(R), Success(true),
         CurrentInstrID(0), CurrentArg(0), CFGStackSize(0) {
+    // Avoid regrowing the vectors while reading a small definition.
+    Stack.reserve(32);
+    Vars.reserve(16);
     Vars.push_back(nullptr);  // indices start at 1.
   }
 
   SExpr* read();
 
+  /// Declare a variable from an enclosing scope, so that expressions which
+  /// were written inside that scope can be read.  Outer scopes must be
+  /// declared in order, before calling read().
+  void enterOuterScope(VarDecl *Vd);
+
   bool success() { return Success; }
 
   SExpr *arg(int i) {
@@ -487,6 +692,10 @@ public:
 
   CFGBuilder& getBuilder() { return Builder; }
 
+  /// Read a string which was written by BytecodeWriter::writeString.
+  /// Repeated strings share the storage of the first occurrence.
+  StringRef readString();
+
 private:
   CFGBuilder&            Builder;
   ByteStreamReaderBase*  Reader;
@@ -500,6 +709,7 @@ private:
   std::vector<VarDecl*>     Vars;
   std::vector<BasicBlock*>  Blocks;
   std::vector<Instruction*> Instrs;
+  std::vector<StringRef>    Strings;
 };
 
 
@@ -563,8 +773,10 @@ public:
     FileStream.close();
   }
 
-  BytecodeFileWriter(const std::string &Name) {
+  /// Write to the file Name, compressing it in blocks if Compressed is set.
+  BytecodeFileWriter(const std::string &Name, bool Compressed = false) {
     FileStream.open(Name);
+    setCompressed(Compressed);
   }
 
   /// Write a block of data to the file.
@@ -576,19 +788,26 @@ private:
   std::ofstream FileStream;
 };
 
-/// Simple reader that reads from a file.
+/// Reader for a file.  Where possible, the file is mapped into memory and
+/// read in place, without copying.  Strings returned by readString then
+/// point directly into the mapping, so the reader must outlive any SExpr
+/// which was read from it.  Otherwise, the file is read through a buffer,
+/// and strings are allocated in the arena.
+///
+/// A compressed file which can be mapped is decompressed all at once, on
+/// several threads, and then read in place from the result.
 class BytecodeFileReader: public ByteStreamReaderBase {
 public:
-  BytecodeFileReader(const std::string &FileName, MemRegionRef A) : Arena(A) {
-    FileStream.open(FileName);
-    refill();
-  }
+  /// Read the file FileName, which must have been written with the same
+  /// setting of Compressed.
+  BytecodeFileReader(const std::string &FileName, MemRegionRef A,
+                     bool Compressed = false);
+  virtual ~BytecodeFileReader();
 
-  virtual ~BytecodeFileReader() {
-    FileStream.close();
-  }
+  BytecodeFileReader(const BytecodeFileReader&) = delete;
+  void operator=(const BytecodeFileReader&) = delete;
 
-  /// Read a block of data from memory.
+  /// Read a block of data from the file, if it is not mapped.
   virtual int64_t readData(void *Buf, int64_t Sz) override {
     FileStream.read(static_cast<char *>(Buf), Sz);
     return FileStream.gcount();
@@ -601,6 +820,8 @@ public:
 private:
   std::ifstream FileStream;
   MemRegionRef Arena;
+  MappedFile   Mapping;
+  std::vector<uint8_t> Contents;   ///< The decompressed file, if mapped.
 };
 
 
@@ -0,0 +1,248 @@
+//===- BytecodeContainer.cpp -----------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "BytecodeContainer.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace ohmu {
+namespace til {
+
+namespace {
+
+const char Magic[8] = { 'O', 'H', 'M', 'U', 'B', 'C', 'T', 'R' };
+
+struct ContainerHeader {
+  char     Magic[8];
+  uint32_t Version;
+  uint32_t NumEntries;
+  uint64_t TocOffset;
+  uint64_t FileSize;
+};
+
+struct ContainerTocEntry {
+  uint64_t Offset;
+  uint64_t Size;
+  uint32_t NameOffset;   ///< Offset in the names, which follow the table.
+  uint32_t NameSize;
+};
+
+// Return true if [Offset, Offset + Size) lies within a file of FileSize
+// bytes.
+bool inFile(uint64_t Offset, uint64_t Size, uint64_t FileSize) {
+  return Offset <= FileSize && Size <= FileSize - Offset;
+}
+
+int compareNames(StringRef A, StringRef B) {
+  size_t N = std::min(A.size(), B.size());
+  int C = N > 0 ? memcmp(A.data(), B.data(), N) : 0;
+  if (C != 0)
+    return C;
+  return A.size() < B.size() ? -1 : (A.size() > B.size() ? 1 : 0);
+}
+
+}  // end anonymous namespace
+
+
+void BytecodeContainerWriter::EntryStream::writeData(const void *Buf,
+                                                     int64_t Size) {
+  if (!File || Size == 0)
+    return;
+  if (fwrite(Buf, 1, Size, File) != static_cast<size_t>(Size))
+    Failed = true;
+  Written += Size;
+}
+
+
+BytecodeContainerWriter::BytecodeContainerWriter(const std::string &P)
+    : Path(P), TmpPath(P + ".tmp"), InEntry(false) {
+  Stream.File = fopen(TmpPath.c_str(), "wb");
+  // Leave room for the header, which is written by finish().
+  ContainerHeader H;
+  memset(&H, 0, sizeof(H));
+  Stream.writeData(&H, sizeof(H));
+}
+
+
+BytecodeContainerWriter::~BytecodeContainerWriter() {
+  if (Stream.File) {
+    // The container was never finished.
+    Stream.flush();
+    fclose(Stream.File);
+    Stream.File = nullptr;
+    std::remove(TmpPath.c_str());
+  }
+}
+
+
+void BytecodeContainerWriter::endEntry() {
+  if (!InEntry)
+    return;
+  Stream.flush();
+  PendingEntry &E = Entries.back();
+  E.Size = Stream.Written - E.Offset;
+  InEntry = false;
+}
+
+
+ByteStreamWriterBase& BytecodeContainerWriter::beginEntry(StringRef Name) {
+  endEntry();
+  Entries.push_back(PendingEntry{ Name.str(), Stream.Written, 0 });
+  InEntry = true;
+  return Stream;
+}
+
+
+void BytecodeContainerWriter::addEntry(StringRef Name, SExpr *E) {
+  BytecodeWriter Writer(&beginEntry(Name));
+  Writer.write(E);
+}
+
+
+bool BytecodeContainerWriter::finish() {
+  endEntry();
+  if (!Stream.File)
+    return false;
+
+  std::sort(Entries.begin(), Entries.end(),
+    [](const PendingEntry &A, const PendingEntry &B) {
+      return A.Name < B.Name;
+    });
+  bool Ok = !Stream.Failed;
+  for (size_t i = 1; i < Entries.size(); ++i) {
+    if (Entries[i-1].Name == Entries[i].Name)
+      Ok = false;
+  }
+
+  // Write the table of contents, followed by the names.  The table is
+  // aligned, so that it can be read in place.
+  static const char Zeros[alignof(ContainerTocEntry)] = { 0 };
+  Stream.writeData(Zeros, (alignof(ContainerTocEntry) -
+                           Stream.Written % alignof(ContainerTocEntry)) %
+                          alignof(ContainerTocEntry));
+  ContainerHeader H;
+  memcpy(H.Magic, Magic, sizeof(Magic));
+  H.Version = BytecodeContainer::Version;
+  H.NumEntries = static_cast<uint32_t>(Entries.size());
+  H.TocOffset = Stream.Written;
+  std::vector<ContainerTocEntry> Toc;
+  uint32_t NameOffset = 0;
+  for (auto &E : Entries) {
+    uint32_t NameSize = static_cast<uint32_t>(E.Name.size());
+    Toc.push_back(ContainerTocEntry{ E.Offset, E.Size, NameOffset, NameSize });
+    NameOffset += NameSize;
+  }
+  if (!Toc.empty())
+    Stream.writeData(Toc.data(), Toc.size() * sizeof(ContainerTocEntry));
+  for (auto &E : Entries)
+    Stream.writeData(E.Name.data(), E.Name.size());
+  H.FileSize = Stream.Written;
+
+  Ok = Ok && !Stream.Failed && fseek(Stream.File, 0, SEEK_SET) == 0 &&
+       fwrite(&H, sizeof(H), 1, Stream.File) == 1;
+  Ok = fclose(Stream.File) == 0 && Ok;
+  Stream.File = nullptr;
+  if (Ok)
+    Ok = std::rename(TmpPath.c_str(), Path.c_str()) == 0;
+  if (!Ok)
+    std::remove(TmpPath.c_str());
+  return Ok;
+}
+
+
+bool BytecodeContainer::open(const std::string &Path) {
+  close();
+  // Entries may be followed directly by the end of the file, so pad it for
+  // the sake of BytecodeEntryReader.
+  if (!Mapping.open(Path, BytecodeBase::MaxAtomSize))
+    return false;
+
+  // Check the whole table before using any of it.
+  const uint8_t *Data = Mapping.data();
+  uint64_t Size = Mapping.size();
+  ContainerHeader H;
+  if (Size < sizeof(H)) {
+    close();
+    return false;
+  }
+  memcpy(&H, Data, sizeof(H));
+  uint64_t TocSize = uint64_t(H.NumEntries) * sizeof(ContainerTocEntry);
+  bool Ok = memcmp(H.Magic, Magic, sizeof(Magic)) == 0 &&
+            H.Version == Version && H.FileSize == Size &&
+            H.TocOffset % alignof(ContainerTocEntry) == 0 &&
+            inFile(H.TocOffset, TocSize, Size);
+  if (!Ok) {
+    close();
+    return false;
+  }
+
+  const auto *Toc =
+    reinterpret_cast<const ContainerTocEntry*>(Data + H.TocOffset);
+  const char *Names = reinterpret_cast<const char*>(Data + H.TocOffset) +
+                      TocSize;
+  uint64_t NamesSize = Size - H.TocOffset - TocSize;
+  Entries.reserve(H.NumEntries);
+  for (uint32_t i = 0; Ok && i < H.NumEntries; ++i) {
+    const ContainerTocEntry &T = Toc[i];
+    Ok = inFile(T.Offset, T.Size, H.TocOffset) &&
+         inFile(T.NameOffset, T.NameSize, NamesSize);
+    if (!Ok)
+      break;
+    StringRef Name(Names + T.NameOffset, T.NameSize);
+    Ok = i == 0 || compareNames(Entries.back().Name, Name) < 0;
+    Entries.push_back(Entry{
+      Name, reinterpret_cast<const char*>(Data + T.Offset), T.Size });
+  }
+  if (!Ok) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+
+void BytecodeContainer::close() {
+  Entries.clear();
+  Mapping.close();
+}
+
+
+const BytecodeContainer::Entry* BytecodeContainer::find(StringRef Name) const {
+  auto It = std::lower_bound(Entries.begin(), Entries.end(), Name,
+    [](const Entry &E, StringRef N) { return compareNames(E.Name, N) < 0; });
+  if (It == Entries.end() || compareNames(It->Name, Name) != 0)
+    return nullptr;
+  return &*It;
+}
+
+
+SExpr* BytecodeContainer::read(const Entry &E, CFGBuilder &Builder,
+                               const std::vector<VarDecl*> &Scope) {
+  BytecodeEntryReader Rs(E.Data, E.Size);
+  BytecodeReader Reader(Builder, &Rs);
+  for (auto *Vd : Scope)
+    Reader.enterOuterScope(Vd);
+  SExpr *Result = Reader.read();
+  if (!Reader.success())
+    return nullptr;
+  return Result;
+}
+
+
+}  // end namespace til
+}  // end namespace ohmu
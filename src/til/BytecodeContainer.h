@@ -0,0 +1,175 @@
+//===- BytecodeContainer.h -------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A file which holds many named bytecode streams, any one of which can be
+// read without reading the others.
+//
+// A plain bytecode file is a single stream, which must be decoded in order.
+// A container instead holds one independent stream per entry, such as the
+// IR of one function, followed by a table of contents which maps the name of
+// each entry to its offset and length:
+//
+//   ContainerHeader
+//   entry streams
+//   ContainerTocEntry[NumEntries], sorted by name
+//   names
+//
+// The table of contents is written last, so that entries can be streamed to
+// disk as they are produced.  A BytecodeContainer maps the file, and reads
+// entries in place, so an entry which is never read costs nothing beyond
+// its line in the table.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_TIL_BYTECODECONTAINER_H
+#define OHMU_TIL_BYTECODECONTAINER_H
+
+#include "Bytecode.h"
+#include "base/MappedFile.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace ohmu {
+namespace til {
+
+
+/// Reads one entry of a container, or any other block of bytecode which is
+/// held in memory, in place.  Strings point into the block.
+///
+/// As with ByteStreamReaderBase::setMappedData, reading may run up to
+/// MaxAtomSize bytes past the end of a damaged block, so those bytes must be
+/// readable.  This holds for every entry of a BytecodeContainer.
+class BytecodeEntryReader : public ByteStreamReaderBase {
+public:
+  BytecodeEntryReader(const char *Data, int64_t Size) {
+    setMappedData(Data, Size);
+  }
+
+  virtual int64_t readData(void *Buf, int64_t Sz) override { return 0; }
+
+  // Never called, since strings are returned in place.
+  virtual char* allocStringData(uint32_t Sz) override { return nullptr; }
+};
+
+
+/// Writes a container.  Entries are written to disk as they are added, and
+/// the file is complete once finish() has returned true.
+class BytecodeContainerWriter {
+public:
+  /// Start writing a container to Path.  The file is written under a
+  /// temporary name, and renamed when it is finished.
+  explicit BytecodeContainerWriter(const std::string &Path);
+  ~BytecodeContainerWriter();
+
+  BytecodeContainerWriter(const BytecodeContainerWriter&) = delete;
+  void operator=(const BytecodeContainerWriter&) = delete;
+
+  /// Start a new entry, and return the stream to write its contents to.
+  /// The stream is valid until the next call to beginEntry or finish.
+  /// Names must be unique.
+  ByteStreamWriterBase& beginEntry(StringRef Name);
+
+  /// Add an entry which holds the serialized form of E.
+  void addEntry(StringRef Name, SExpr *E);
+
+  /// Write the table of contents, and move the file into place.  Returns
+  /// false on an I/O error, or if two entries have the same name.
+  bool finish();
+
+private:
+  class EntryStream : public ByteStreamWriterBase {
+  public:
+    EntryStream() : File(nullptr), Written(0), Failed(false) { }
+    ~EntryStream() { flush(); }
+
+    virtual void writeData(const void *Buf, int64_t Size) override;
+
+    FILE*    File;
+    uint64_t Written;   ///< Total bytes written to File.
+    bool     Failed;
+  };
+
+  struct PendingEntry {
+    std::string Name;
+    uint64_t    Offset;
+    uint64_t    Size;
+  };
+
+  void endEntry();
+
+  std::string Path;
+  std::string TmpPath;
+  EntryStream Stream;
+  std::vector<PendingEntry> Entries;
+  bool InEntry;
+};
+
+
+/// A container which has been opened for reading.
+class BytecodeContainer {
+public:
+  /// Version of the container format.
+  static const uint32_t Version = 1;
+
+  /// An entry of the container.
+  struct Entry {
+    StringRef   Name;
+    const char* Data;
+    uint64_t    Size;
+  };
+
+  BytecodeContainer() { }
+
+  BytecodeContainer(const BytecodeContainer&) = delete;
+  void operator=(const BytecodeContainer&) = delete;
+
+  /// Map the container at Path.  Returns false if there is no such file, or
+  /// if it is not a valid container, in which case the container is left
+  /// empty.
+  bool open(const std::string &Path);
+
+  /// Unmap the file.  Entries which have been read refer to the mapping,
+  /// and must not be used afterwards.
+  void close();
+
+  /// Return the number of entries.
+  size_t size() const { return Entries.size(); }
+
+  /// Return the i-th entry, in order of name.
+  const Entry& entry(size_t i) const { return Entries[i]; }
+
+  /// Return the entry called Name, or null if there is none.
+  const Entry* find(StringRef Name) const;
+
+  /// Deserialize the entry E with Builder.  Outer scopes are declared as
+  /// with BytecodeReader::enterOuterScope.  Returns null if the entry cannot
+  /// be read.  Strings in the result point into the container.
+  SExpr* read(const Entry &E, CFGBuilder &Builder,
+              const std::vector<VarDecl*> &Scope = std::vector<VarDecl*>());
+
+private:
+  MappedFile Mapping;
+  std::vector<Entry> Entries;
+};
+
+
+}  // end namespace til
+}  // end namespace ohmu
+
+#endif  // OHMU_TIL_BYTECODECONTAINER_H
@@ -185,8 +185,9 @@ void CFGBuilder::setPhiArgument(Phi* Ph, SExpr* E, unsigned Idx) {
 
   // Update the type of the Phi node.
   // All phi arguments must have the exact same type.
-  if (Idx == 0 && Ph->baseType().Base == BaseType::BT_Void) {
-    // Set the initial type of the Phi node.
+  if (Ph->baseType().Base == BaseType::BT_Void) {
+    // Set the initial type of the Phi node.  Arguments may be set out of
+    // order when a CFG is deserialized.
     Ph->setBaseType(I->baseType());
   }
   else if (Ph->baseType() != I->baseType()) {
@@ -53,6 +53,17 @@ public:
     insertBlockMap(Orig->exit(),  S->exit());
   }
 
+  /// Enter a CFG that will be inlined into another CFG.  The entry block of
+  /// Orig maps to Entry, which may already have arguments, and the exit block
+  /// of Orig maps to Exit.
+  void enterInlinedCFG(SCFG *Orig, BasicBlock *Entry, BasicBlock *Exit) {
+    Super::enterCFG(Orig);
+
+    BlockMap.resize(Orig->numBlocks(), nullptr);
+    BlockMap[Orig->entry()->blockID()] = Entry;
+    insertBlockMap(Orig->exit(), Exit);
+  }
+
   void exitCFG() {
     Super::exitCFG();
     BlockMap.clear();
@@ -447,6 +458,12 @@ public:
   { }
   virtual ~LazyCopyFuture() { }
 
+  /// Return true if this future will be evaluated in a new CFG.
+  bool createsCFG() const { return CreateCfg; }
+
+  /// Evaluate this future with R instead of the reducer that created it.
+  void setReducer(Visitor* R) { Reducer = R; }
+
   /// Traverse PendingExpr and return the result.
   virtual SExpr* evaluate() override {
     auto* S  = Reducer->switchScope(ScopePtr);
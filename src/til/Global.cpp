@@ -16,8 +16,18 @@
 //===----------------------------------------------------------------------===//
 
 #include "Global.h"
+#include "Bytecode.h"
+#include "CFGBuilder.h"
+#include "TILVisitor.h"
 #include "TypedEvaluator.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
 namespace ohmu {
 namespace til  {
 
@@ -74,6 +84,16 @@ void Global::addDefinitions(std::vector<SExpr*>& Defs) {
 }
 
 
+// These are defined here, where TypedEvaluator is complete.
+Global::Global()
+    : GlobalRec(nullptr), GlobalSFun(nullptr),
+      LangArena(&LangRegion), StringArena(&StringRegion),
+      ParseArena(&ParseRegion), DefArena(&DefRegion)
+{ }
+
+Global::~Global() { }
+
+
 void Global::lower() {
   TypedEvaluator eval(DefArena);
   SExpr* E = eval.traverseAll(GlobalSFun);
@@ -87,6 +107,282 @@ void Global::lower() {
 }
 
 
+void Global::lowerLazily() {
+  assert(!LazyEvaluator && "Already lowered.");
+  LazyEvaluator.reset(new TypedEvaluator(DefArena));
+  SExpr* E = LazyEvaluator->traverseLazy(GlobalSFun);
+
+  GlobalSFun = dyn_cast<Function>(E);
+  if (GlobalSFun)
+    GlobalRec = dyn_cast<Record>(GlobalSFun->body());
+  else
+    GlobalRec = nullptr;
+}
+
+
+bool Global::lowerDefinition(StringRef Name) {
+  assert(LazyEvaluator && "Must call lowerLazily() first.");
+  if (!GlobalRec)
+    return false;
+
+  Slot* Slt = GlobalRec->findSlot(Name);
+  if (!Slt)
+    return false;
+
+  // Find the body of the definition, skipping over function parameters.
+  SExpr* Def = Slt->definition();
+  while (auto* Fn = dyn_cast_or_null<Function>(Def))
+    Def = Fn->body();
+
+  if (auto* C = dyn_cast_or_null<Code>(Def)) {
+    if (auto* F = dyn_cast_or_null<Future>(C->body()))
+      LazyEvaluator->lowerOnDemand(F);
+  }
+  return true;
+}
+
+
+void Global::lowerParallel(unsigned NumThreads) {
+  // Lower the global record, without lowering function bodies.
+  // This will also evaluate all of the types that are needed to check calls
+  // between functions, so the workers do not need to share any state.
+  lowerLazily();
+
+  auto& Futs = LazyEvaluator->deferredFutures();
+  if (NumThreads == 0)
+    NumThreads = std::max(std::thread::hardware_concurrency(), 1u);
+  NumThreads = std::min(NumThreads, static_cast<unsigned>(Futs.size()));
+
+  // Workers take the next function body from the list until it is empty.
+  std::atomic<unsigned> Next(0);
+  auto Worker = [&Futs, &Next](MemRegionRef A) {
+    TypedEvaluator Eval(A);
+    // The inliner reads the bodies of other functions, which may be
+    // in the middle of being lowered by another thread.
+    Eval.setInlineThreshold(0);
+    Eval.setSpecialize(false);
+    for (unsigned i = Next++; i < Futs.size(); i = Next++)
+      Eval.lowerFuture(Futs[i]);
+  };
+
+  std::vector<std::thread> Threads;
+  for (unsigned i = 0; i < NumThreads; ++i) {
+    WorkerRegions.emplace_back(new MemRegion());
+    Threads.emplace_back(Worker, MemRegionRef(WorkerRegions.back().get()));
+  }
+  for (auto &T : Threads)
+    T.join();
+  Futs.clear();
+}
+
+
+namespace {
+
+// Version of the lowered code in the cache.  Change this whenever the
+// evaluator produces different code for the same definition.
+const uint64_t LoweringCacheVersion = 3;
+
+// FNV-1a hash of a string of bytes.
+uint64_t hashBytes(const std::string &S,
+                   uint64_t H = 14695981039346656037ULL) {
+  for (unsigned char C : S) {
+    H ^= C;
+    H *= 1099511628211ULL;
+  }
+  return H;
+}
+
+uint64_t hashCombine(uint64_t H, uint64_t V) {
+  for (unsigned i = 0; i < 8; ++i) {
+    H ^= (V >> (i*8)) & 0xFF;
+    H *= 1099511628211ULL;
+  }
+  return H;
+}
+
+// Collects every name that a parsed definition may use to refer to a slot.
+class SlotNameCollector : public Visitor<SlotNameCollector> {
+public:
+  void reduceIdentifier(Identifier *E) { Names.push_back(E->idString()); }
+  void reduceProject(Project *E)       { Names.push_back(E->slotName()); }
+
+  std::vector<StringRef> Names;
+};
+
+}  // end anonymous namespace
+
+
+void Global::hashDefinitions(std::unordered_map<std::string, uint64_t> &Keys) {
+  auto &Slots = GlobalRec->slots();
+  unsigned N = Slots.size();
+
+  std::unordered_map<std::string, unsigned> SlotIndex;
+  for (unsigned i = 0; i < N; ++i)
+    SlotIndex[Slots[i]->slotName().str()] = i;
+
+  // Hash the serialized form of each definition, and find the other
+  // definitions that it refers to.  Names which are bound locally may also
+  // match a slot; that only makes the key more conservative.
+  std::vector<uint64_t> SlotHash(N);
+  std::vector<std::vector<unsigned>> Refs(N);
+  for (unsigned i = 0; i < N; ++i) {
+    BytecodeStringWriter Ws;
+    BytecodeWriter Writer(&Ws);
+    Writer.write(Slots[i].get());
+    SlotHash[i] = hashBytes(Ws.str());
+
+    SlotNameCollector Collector;
+    Collector.traverseAll(Slots[i].get());
+    for (StringRef Nm : Collector.Names) {
+      auto It = SlotIndex.find(Nm.str());
+      if (It != SlotIndex.end())
+        Refs[i].push_back(It->second);
+    }
+  }
+
+  // Lowering a definition depends on the types of the definitions that it
+  // refers to, and may inline their bodies, so the key of each definition
+  // covers everything that it can reach.
+  std::vector<bool> Seen;
+  std::vector<unsigned> Worklist;
+  std::vector<uint64_t> Reached;
+  for (unsigned i = 0; i < N; ++i) {
+    Seen.assign(N, false);
+    Seen[i] = true;
+    Worklist.assign(Refs[i].begin(), Refs[i].end());
+    Reached.clear();
+    while (!Worklist.empty()) {
+      unsigned j = Worklist.back();
+      Worklist.pop_back();
+      if (Seen[j])
+        continue;
+      Seen[j] = true;
+      Reached.push_back(SlotHash[j]);
+      Worklist.insert(Worklist.end(), Refs[j].begin(), Refs[j].end());
+    }
+    // Sort so that the key does not depend on the order of definitions.
+    std::sort(Reached.begin(), Reached.end());
+
+    uint64_t H = hashCombine(LoweringCacheVersion, SlotHash[i]);
+    for (uint64_t Rh : Reached)
+      H = hashCombine(H, Rh);
+    Keys[Slots[i]->slotName().str()] = H;
+  }
+}
+
+
+SExpr* Global::readCachedBody(const std::string &Path,
+                              const std::vector<VarDecl*> &Scope) {
+  std::ifstream In(Path, std::ios::binary);
+  if (!In)
+    return nullptr;
+  std::string Buf((std::istreambuf_iterator<char>(In)),
+                  std::istreambuf_iterator<char>());
+  if (Buf.empty())
+    return nullptr;
+
+  CFGBuilder Builder(DefArena);
+  InMemoryReader Rs(Buf.data(), Buf.size(), DefArena);
+  BytecodeReader Reader(Builder, &Rs);
+  for (auto *Vd : Scope)
+    Reader.enterOuterScope(Vd);
+
+  auto *Cfg = dyn_cast_or_null<SCFG>(Reader.read());
+  if (!Reader.success() || !Cfg)
+    return nullptr;
+  Cfg->computeNormalForm();
+  return Cfg;
+}
+
+
+void Global::writeCachedBody(const std::string &Path, SExpr *Body) {
+  // Write to a temporary file first, so that other processes sharing the
+  // cache never see a partially written entry.
+  std::string Tmp = Path + ".tmp";
+  {
+    BytecodeFileWriter Ws(Tmp);
+    BytecodeWriter Writer(&Ws);
+    Writer.write(Body);
+  }
+  if (std::rename(Tmp.c_str(), Path.c_str()) != 0)
+    std::remove(Tmp.c_str());
+}
+
+
+unsigned Global::lowerCached(const std::string &CacheDir) {
+  // Keys must be computed from the parsed definitions, before lowering.
+  std::unordered_map<std::string, uint64_t> Keys;
+  if (GlobalRec)
+    hashDefinitions(Keys);
+
+  lowerLazily();
+  if (!GlobalRec)
+    return 0;
+
+  struct Entry {
+    Code*       Cd;
+    std::string Path;
+  };
+  std::vector<Entry> Misses;
+  std::vector<VarDecl*> Scope;
+  unsigned NumHits = 0;
+
+  for (auto &Slt : GlobalRec->slots()) {
+    auto It = Keys.find(Slt->slotName().str());
+    if (It == Keys.end())
+      continue;
+
+    // Find the body of the definition, and the variables in scope.
+    Scope.clear();
+    Scope.push_back(GlobalSFun->variableDecl());
+    SExpr* Def = Slt->definition();
+    while (auto* Fn = dyn_cast_or_null<Function>(Def)) {
+      Scope.push_back(Fn->variableDecl());
+      Def = Fn->body();
+    }
+
+    auto* C = dyn_cast_or_null<Code>(Def);
+    if (!C)
+      continue;
+    auto* F = dyn_cast_or_null<Future>(C->body());
+    if (!F || F->status() != Future::FS_pending)
+      continue;
+
+    char Name[32];
+    snprintf(Name, sizeof(Name), "/%016llx.ohb",
+             static_cast<unsigned long long>(It->second));
+    std::string Path = CacheDir + Name;
+
+    if (SExpr *Body = readCachedBody(Path, Scope)) {
+      F->setResult(Body);
+      ++NumHits;
+    }
+    else {
+      Misses.push_back(Entry{ C, Path });
+    }
+  }
+
+  // Lower the remaining bodies.  Bodies which were read from the cache are
+  // already done, and may be inlined.
+  for (auto &E : Misses) {
+    if (auto* F = dyn_cast_or_null<Future>(E.Cd->body()))
+      LazyEvaluator->lowerOnDemand(F);
+  }
+  for (auto &E : Misses) {
+    if (isa<SCFG>(E.Cd->body()))
+      writeCachedBody(E.Path, E.Cd->body());
+  }
+
+  // Code which is nested inside of other expressions is not cached.
+  for (auto* F : LazyEvaluator->deferredFutures()) {
+    if (F->status() == Future::FS_pending)
+      LazyEvaluator->lowerOnDemand(F);
+  }
+  LazyEvaluator->deferredFutures().clear();
+  return NumHits;
+}
+
+
 void Global::print(std::ostream &SS) {
   TILDebugPrinter::print(GlobalSFun, SS);
 }
@@ -20,19 +20,21 @@
 
 #include "TIL.h"
 
+#include <memory>
 #include <ostream>
+#include <string>
+#include <unordered_map>
 
 namespace ohmu {
 namespace til  {
 
+class TypedEvaluator;
+
 
 class Global {
 public:
-  Global()
-      : GlobalRec(nullptr), GlobalSFun(nullptr),
-        LangArena(&LangRegion), StringArena(&StringRegion),
-        ParseArena(&ParseRegion), DefArena(&DefRegion)
-  { }
+  Global();
+  ~Global();
 
   inline SExpr* global() { return GlobalSFun; }
 
@@ -44,10 +46,43 @@ public:
   // Lower the parsed definitions.
   void lower();
 
+  // Lower the parsed definitions lazily.  Function bodies are not lowered
+  // until they are requested with lowerDefinition(), or are called from a
+  // definition which has been lowered.
+  void lowerLazily();
+
+  // Lower the definition Name, along with everything that it calls.
+  // Must be called after lowerLazily().  Returns false if there is no
+  // definition with that name.
+  bool lowerDefinition(StringRef Name);
+
+  // Lower the parsed definitions, using NumThreads worker threads to lower
+  // function bodies in parallel.  If NumThreads is 0, then use one thread
+  // per core.  Functions are not inlined into each other in this mode.
+  void lowerParallel(unsigned NumThreads = 0);
+
+  // Lower the parsed definitions, using an on-disk cache in CacheDir.
+  // Each definition is keyed by a hash of its parsed form, and of every
+  // definition that it refers to.  Function bodies with a matching entry are
+  // read from the cache; the rest are lowered and then added to the cache.
+  // Returns the number of function bodies that were read from the cache.
+  unsigned lowerCached(const std::string &CacheDir);
+
   // Dump outputs to the given stream
   void print(std::ostream &SS);
 
 private:
+  // Compute the cache key of each parsed definition.
+  void hashDefinitions(std::unordered_map<std::string, uint64_t> &Keys);
+
+  // Read a lowered function body from the cache file Path.  Scope holds the
+  // variables that are in scope for the body, starting with the global self.
+  SExpr* readCachedBody(const std::string &Path,
+                        const std::vector<VarDecl*> &Scope);
+
+  // Write a lowered function body to the cache file Path.
+  void writeCachedBody(const std::string &Path, SExpr *Body);
+
   MemRegion LangRegion;    // Standard language definitions.
   MemRegion StringRegion;  // Region to hold string constants.
   MemRegion ParseRegion;   // Region for the initial AST produced by the parser.
@@ -56,6 +91,10 @@ private:
   Record   *GlobalRec;
   Function *GlobalSFun;
   std::vector<Slot*> PreludeDefs;
+  std::unique_ptr<TypedEvaluator> LazyEvaluator;  // For lowerLazily().
+
+  // Each worker thread in lowerParallel() allocates in its own region.
+  std::vector<std::unique_ptr<MemRegion>> WorkerRegions;
 
 public:
   MemRegionRef LangArena;
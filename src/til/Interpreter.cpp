@@ -0,0 +1,1055 @@
+//===- Interpreter.cpp -----------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Interpreter.h"
+#include "TILPrettyPrint.h"
+
+#include <algorithm>
+#include <type_traits>
+
+namespace ohmu {
+namespace til  {
+
+
+namespace {
+
+inline void setValue(VMValue &V, bool X)      { V.Bool = X; }
+inline void setValue(VMValue &V, int8_t X)    { V.I8  = X; }
+inline void setValue(VMValue &V, uint8_t X)   { V.U8  = X; }
+inline void setValue(VMValue &V, int16_t X)   { V.I16 = X; }
+inline void setValue(VMValue &V, uint16_t X)  { V.U16 = X; }
+inline void setValue(VMValue &V, int32_t X)   { V.I32 = X; }
+inline void setValue(VMValue &V, uint32_t X)  { V.U32 = X; }
+inline void setValue(VMValue &V, int64_t X)   { V.I64 = X; }
+inline void setValue(VMValue &V, uint64_t X)  { V.U64 = X; }
+inline void setValue(VMValue &V, float X)     { V.F32 = X; }
+inline void setValue(VMValue &V, double X)    { V.F64 = X; }
+inline void setValue(VMValue &V, void* X)     { V.Ptr = X; }
+inline void setValue(VMValue &V, StringRef X) {
+  V.Ptr = const_cast<char*>(X.c_str());
+}
+
+inline VMValue zeroValue() {
+  VMValue V;
+  V.U64 = 0;
+  return V;
+}
+
+// Stores the value of a literal in a VMValue.
+template<class Ty>
+struct LiteralToValue {
+  typedef bool ReturnType;
+
+  static bool defaultAction(Literal *L, VMValue *V) { return false; }
+
+  static bool action(Literal *L, VMValue *V) {
+    *V = zeroValue();
+    setValue(*V, L->as<Ty>()->value());
+    return true;
+  }
+};
+
+// Signed division of MIN by -1 overflows, and faults on x86, so a divisor
+// of -1 is handled separately, with the same result as the JIT: the negated
+// dividend for division, and zero for the remainder.  B must not be zero.
+template<class CT, class UT>
+inline CT divide(CT A, CT B) {
+  if (std::is_signed<CT>::value && B == static_cast<CT>(-1))
+    return static_cast<CT>(UT(0) - static_cast<UT>(A));
+  return static_cast<CT>(A / B);
+}
+
+template<class CT, class UT>
+inline CT remainder(CT A, CT B) {
+  if (std::is_signed<CT>::value && B == static_cast<CT>(-1))
+    return 0;
+  return static_cast<CT>(A % B);
+}
+
+}  // end anonymous namespace
+
+
+const unsigned Interpreter::DefaultStackSize;
+const uint32_t Interpreter::NoReg;
+
+
+VMType Interpreter::getVMType(BaseType Bt) {
+  if (Bt.VectSize > 1)
+    return VT_Void;
+
+  switch (Bt.Base) {
+  case BaseType::BT_Void:
+    return VT_Void;
+  case BaseType::BT_Bool:
+    return VT_Bool;
+  case BaseType::BT_Int:
+    switch (Bt.Size) {
+      case BaseType::ST_8:  return VT_I8;
+      case BaseType::ST_16: return VT_I16;
+      case BaseType::ST_32: return VT_I32;
+      case BaseType::ST_64: return VT_I64;
+      default:              return VT_Void;
+    }
+  case BaseType::BT_UnsignedInt:
+    switch (Bt.Size) {
+      case BaseType::ST_8:  return VT_U8;
+      case BaseType::ST_16: return VT_U16;
+      case BaseType::ST_32: return VT_U32;
+      case BaseType::ST_64: return VT_U64;
+      default:              return VT_Void;
+    }
+  case BaseType::BT_Float:
+    switch (Bt.Size) {
+      case BaseType::ST_32: return VT_F32;
+      case BaseType::ST_64: return VT_F64;
+      default:              return VT_Void;
+    }
+  case BaseType::BT_String:
+  case BaseType::BT_Pointer:
+    return VT_Ptr;
+  }
+  return VT_Void;
+}
+
+
+VMValue Interpreter::convertValue(VMValue V, VMType From, VMType To) {
+  // Read the value as a 64-bit integer or a double.
+  bool     IsFloat = false;
+  uint64_t Bits = 0;
+  double   D = 0.0;
+  switch (From) {
+    case VT_I8:   Bits = static_cast<int64_t>(V.I8);   break;
+    case VT_U8:   Bits = V.U8;   break;
+    case VT_I16:  Bits = static_cast<int64_t>(V.I16);  break;
+    case VT_U16:  Bits = V.U16;  break;
+    case VT_I32:  Bits = static_cast<int64_t>(V.I32);  break;
+    case VT_U32:  Bits = V.U32;  break;
+    case VT_I64:  Bits = V.I64;  break;
+    case VT_U64:  Bits = V.U64;  break;
+    case VT_F32:  D = V.F32;  IsFloat = true;  break;
+    case VT_F64:  D = V.F64;  IsFloat = true;  break;
+    case VT_Bool: Bits = V.Bool; break;
+    default:      return V;
+  }
+
+  bool Signed = From == VT_I8 || From == VT_I16 || From == VT_I32 ||
+                From == VT_I64;
+  VMValue R = zeroValue();
+  switch (To) {
+#define OHMU_VM_CONVERT(Op, T, CT, UT)                                        \
+    case VT_##T:                                                              \
+      R.T = IsFloat ? static_cast<CT>(D) : static_cast<CT>(Bits);             \
+      break;
+    OHMU_VM_INT_TYPES(OHMU_VM_CONVERT, _)
+#undef OHMU_VM_CONVERT
+    case VT_F32:
+    case VT_F64: {
+      if (!IsFloat) {
+        D = Signed ? static_cast<double>(static_cast<int64_t>(Bits))
+                   : static_cast<double>(Bits);
+      }
+      if (To == VT_F32)
+        R.F32 = static_cast<float>(D);
+      else
+        R.F64 = D;
+      break;
+    }
+    case VT_Bool:
+      R.Bool = IsFloat ? D != 0.0 : Bits != 0;
+      break;
+    default:
+      return V;
+  }
+  return R;
+}
+
+
+/// Compiles a single SCFG to VM instructions.
+class VMCompiler {
+public:
+  VMCompiler(Interpreter &I, VMFunction &F)
+      : Interp(I), Fn(F), Success(true), NextReg(0) { }
+
+  bool compile(const std::vector<VarDecl*> &Params);
+
+private:
+  struct Fixup {
+    uint32_t Instr;
+    bool     IsB;      ///< Patch field B, rather than A.
+    unsigned Label;
+  };
+
+  struct EdgeStub {
+    unsigned    Label;
+    BasicBlock* Target;
+    unsigned    PhiIndex;
+  };
+
+  void fail(const char* Msg, SExpr *E = nullptr) {
+    if (Success) {
+      auto &Ds = Interp.diag().error("Cannot compile ") << Fn.Name << ": "
+                                                        << Msg;
+      if (E)
+        TILDebugPrinter::print(E, Ds.outputStream());
+    }
+    Success = false;
+  }
+
+  uint32_t emit(uint32_t Op, uint32_t Dst, uint32_t A = 0, uint32_t B = 0) {
+    Fn.Instrs.push_back(VMInstr{ Op, Dst, A, B });
+    return Fn.Instrs.size() - 1;
+  }
+
+  uint32_t newTemp() { return NextReg++; }
+
+  static BaseType typeOf(SExpr *E) {
+    if (auto *I = dyn_cast_or_null<Instruction>(E))
+      return I->baseType();
+    return BaseType::getBaseType<void>();
+  }
+
+  uint32_t reg(SExpr *E);
+  uint32_t paramReg(Variable *V);
+  uint32_t constantReg(Literal *L);
+  uint32_t int64Reg(SExpr *E);
+  uint32_t typedOp(uint32_t Op0, VMType Ty, VMType Max, SExpr *E);
+
+  unsigned blockLabel(BasicBlock *B) { return B->blockID(); }
+  unsigned edgeLabel(BasicBlock *From, BasicBlock *To);
+  void     emitJump(uint32_t Instr, bool IsB, unsigned Label) {
+    Fixups.push_back(Fixup{ Instr, IsB, Label });
+  }
+  void     emitEdgeMoves(BasicBlock *Target, unsigned PhiIndex);
+
+  void compileInstruction(Instruction *I);
+  void compileUnaryOp(UnaryOp *E, uint32_t Dst);
+  void compileBinaryOp(BinaryOp *E, uint32_t Dst);
+  void compileCast(Cast *E, uint32_t Dst);
+  void compileCall(Call *E, uint32_t Dst);
+  void compileTerminator(BasicBlock *B, BasicBlock *Next);
+
+  Interpreter& Interp;
+  VMFunction&  Fn;
+  bool         Success;
+  uint32_t     NextReg;
+
+  std::unordered_map<VarDecl*, uint32_t> ParamRegs;
+  std::unordered_map<Literal*, uint32_t> ConstRegs;
+  std::vector<uint32_t>  LabelPcs;
+  std::vector<Fixup>     Fixups;
+  std::vector<EdgeStub>  Stubs;
+  std::vector<std::pair<unsigned, unsigned>> SwitchFixups;
+  std::vector<std::pair<uint32_t, uint32_t>> Moves;
+};
+
+
+uint32_t VMCompiler::constantReg(Literal *L) {
+  auto It = ConstRegs.find(L);
+  if (It != ConstRegs.end())
+    return It->second;
+
+  VMValue V;
+  if (!BtBr<LiteralToValue>::branch(L->baseType(), L, &V)) {
+    fail("unsupported literal ", L);
+    return 0;
+  }
+  uint32_t R = newTemp();
+  Fn.Constants.push_back(VMConstant{ R, V });
+  ConstRegs[L] = R;
+  return R;
+}
+
+
+uint32_t VMCompiler::reg(SExpr *E) {
+  if (!E) {
+    fail("missing operand");
+    return 0;
+  }
+  if (Instruction *I = E->asCFGInstruction())
+    return Fn.NumParams + I->instrID();
+
+  if (auto *L = dyn_cast<Literal>(E))
+    return constantReg(L);
+
+  if (auto *V = dyn_cast<Variable>(E))
+    return paramReg(V);
+
+  fail("unsupported operand ", E);
+  return 0;
+}
+
+
+uint32_t VMCompiler::paramReg(Variable *V) {
+  auto It = ParamRegs.find(V->variableDecl());
+  if (It != ParamRegs.end())
+    return It->second;
+  if (V->variableDecl()->kind() == VarDecl::VK_Let)
+    return reg(V->variableDecl()->definition());
+
+  fail("unsupported variable ", V);
+  return 0;
+}
+
+
+uint32_t VMCompiler::int64Reg(SExpr *E) {
+  uint32_t R = reg(E);
+  VMType Ty = Interpreter::getVMType(typeOf(E));
+  if (Ty == VT_I64 || Ty == VT_U64)
+    return R;
+  if (Ty > VT_U64) {
+    fail("index is not an integer ", E);
+    return R;
+  }
+  uint32_t T = newTemp();
+  emit(VOP_Convert, T, R, (Ty << 8) | VT_I64);
+  return T;
+}
+
+
+uint32_t VMCompiler::typedOp(uint32_t Op0, VMType Ty, VMType Max,
+                             SExpr *E) {
+  if (Ty > Max) {
+    fail("unsupported type ", E);
+    return Op0;
+  }
+  return Op0 + Ty;
+}
+
+
+unsigned VMCompiler::edgeLabel(BasicBlock *From, BasicBlock *To) {
+  if (To->numArguments() == 0)
+    return blockLabel(To);
+
+  // The edge needs its own block, which moves values into the phi nodes.
+  unsigned PhiIndex = 0;
+  auto &Preds = To->predecessors();
+  while (PhiIndex < Preds.size() && Preds[PhiIndex].get() != From)
+    ++PhiIndex;
+
+  unsigned L = LabelPcs.size();
+  LabelPcs.push_back(0);
+  Stubs.push_back(EdgeStub{ L, To, PhiIndex });
+  return L;
+}
+
+
+void VMCompiler::emitEdgeMoves(BasicBlock *Target, unsigned PhiIndex) {
+  Moves.clear();
+  for (Phi *Ph : Target->arguments()) {
+    if (!Ph || Interpreter::getVMType(Ph->baseType()) == VT_Void)
+      continue;
+    if (PhiIndex >= Ph->values().size()) {
+      fail("phi node has too few arguments ", Ph);
+      return;
+    }
+    uint32_t Dst = reg(Ph);
+    uint32_t Src = reg(Ph->values()[PhiIndex].get());
+    if (Dst != Src)
+      Moves.emplace_back(Dst, Src);
+  }
+
+  // The moves happen in parallel, so any source which is also the
+  // destination of another move must be read before it is overwritten.
+  for (auto &M : Moves) {
+    for (auto &M2 : Moves) {
+      if (M2.first == M.second) {
+        uint32_t T = newTemp();
+        emit(VOP_Mov, T, M.second);
+        M.second = T;
+        break;
+      }
+    }
+  }
+  for (auto &M : Moves)
+    emit(VOP_Mov, M.first, M.second);
+}
+
+
+void VMCompiler::compileUnaryOp(UnaryOp *E, uint32_t Dst) {
+  VMType Ty = Interpreter::getVMType(typeOf(E->expr()));
+  uint32_t A = reg(E->expr());
+  switch (E->unaryOpcode()) {
+    case UOP_Negative:
+      emit(typedOp(VOP_Neg_I8, Ty, VT_F64, E), Dst, A);
+      break;
+    case UOP_BitNot:
+      emit(typedOp(VOP_BitNot_I8, Ty, VT_U64, E), Dst, A);
+      break;
+    case UOP_LogicNot:
+      emit(VOP_LogicNot, Dst, A);
+      break;
+  }
+}
+
+
+void VMCompiler::compileBinaryOp(BinaryOp *E, uint32_t Dst) {
+  VMType Ty = Interpreter::getVMType(typeOf(E->expr0()));
+  uint32_t A = reg(E->expr0());
+  uint32_t B = reg(E->expr1());
+  switch (E->binaryOpcode()) {
+    case BOP_Add:
+      emit(typedOp(VOP_Add_I8, Ty, VT_F64, E), Dst, A, B);     break;
+    case BOP_Sub:
+      emit(typedOp(VOP_Sub_I8, Ty, VT_F64, E), Dst, A, B);     break;
+    case BOP_Mul:
+      emit(typedOp(VOP_Mul_I8, Ty, VT_F64, E), Dst, A, B);     break;
+    case BOP_Div:
+      emit(typedOp(VOP_Div_I8, Ty, VT_F64, E), Dst, A, B);     break;
+    case BOP_Rem:
+      emit(typedOp(VOP_Rem_I8, Ty, VT_U64, E), Dst, A, B);     break;
+    case BOP_Shl:
+      emit(typedOp(VOP_Shl_I8, Ty, VT_U64, E), Dst, A, B);     break;
+    case BOP_Shr:
+      emit(typedOp(VOP_Shr_I8, Ty, VT_U64, E), Dst, A, B);     break;
+    case BOP_BitAnd:
+      emit(typedOp(VOP_BitAnd_I8, Ty, VT_U64, E), Dst, A, B);  break;
+    case BOP_BitXor:
+      emit(typedOp(VOP_BitXor_I8, Ty, VT_U64, E), Dst, A, B);  break;
+    case BOP_BitOr:
+      emit(typedOp(VOP_BitOr_I8, Ty, VT_U64, E), Dst, A, B);   break;
+    case BOP_Eq:
+      emit(typedOp(VOP_Eq_I8, Ty, VT_Ptr, E), Dst, A, B);      break;
+    case BOP_Neq:
+      emit(typedOp(VOP_Neq_I8, Ty, VT_Ptr, E), Dst, A, B);     break;
+    case BOP_Lt:
+      emit(typedOp(VOP_Lt_I8, Ty, VT_F64, E), Dst, A, B);      break;
+    case BOP_Leq:
+      emit(typedOp(VOP_Leq_I8, Ty, VT_F64, E), Dst, A, B);     break;
+    case BOP_Gt:
+      emit(typedOp(VOP_Lt_I8, Ty, VT_F64, E), Dst, B, A);      break;
+    case BOP_Geq:
+      emit(typedOp(VOP_Leq_I8, Ty, VT_F64, E), Dst, B, A);     break;
+    case BOP_LogicAnd:
+      emit(VOP_LogicAnd, Dst, A, B);                           break;
+    case BOP_LogicOr:
+      emit(VOP_LogicOr, Dst, A, B);                            break;
+  }
+}
+
+
+void VMCompiler::compileCast(Cast *E, uint32_t Dst) {
+  uint32_t A = reg(E->expr());
+  switch (E->castOpcode()) {
+    case CAST_extendNum:
+    case CAST_truncNum:
+    case CAST_extendToFloat:
+    case CAST_truncToFloat:
+    case CAST_truncToInt:
+    case CAST_roundToInt: {
+      VMType From = Interpreter::getVMType(typeOf(E->expr()));
+      VMType To   = Interpreter::getVMType(E->baseType());
+      if (From > VT_Bool || To > VT_Bool) {
+        fail("unsupported cast ", E);
+        return;
+      }
+      emit(VOP_Convert, Dst, A, (From << 8) | To);
+      return;
+    }
+    default:
+      // Bitwise and pointer casts do not change the register contents.
+      emit(VOP_Mov, Dst, A);
+      return;
+  }
+}
+
+
+void VMCompiler::compileCall(Call *E, uint32_t Dst) {
+  // Calls have the form global@().f(a1)...(an)().
+  std::vector<SExpr*> Args;
+  SExpr *T = E->target();
+  while (auto *Ap = dyn_cast_or_null<Apply>(T)) {
+    if (Ap->isSelfApplication())
+      break;
+    Args.push_back(Ap->arg());
+    T = Ap->fun();
+  }
+  std::reverse(Args.begin(), Args.end());
+
+  auto *Pj = dyn_cast_or_null<Project>(T);
+  auto *Self = Pj ? dyn_cast_or_null<Apply>(Pj->record()) : nullptr;
+  auto *Sv = Self ? dyn_cast_or_null<Variable>(Self->fun()) : nullptr;
+  if (!Sv || Sv->variableDecl() != Interp.GlobalVd) {
+    fail("unsupported call ", E);
+    return;
+  }
+
+  auto It = Interp.FunctionMap.find(Pj->slotName().str());
+  if (It == Interp.FunctionMap.end()) {
+    fail("call to unknown function ", E);
+    return;
+  }
+  VMFunction *Callee = Interp.Functions[It->second].get();
+  if (Callee->NumParams != Args.size()) {
+    fail("wrong number of arguments ", E);
+    return;
+  }
+
+  uint32_t Offset = Fn.ArgRegs.size();
+  for (auto *A : Args)
+    Fn.ArgRegs.push_back(reg(A));
+  emit(VOP_Call, Dst, It->second, Offset);
+}
+
+
+void VMCompiler::compileInstruction(Instruction *I) {
+  uint32_t Dst = Fn.NumParams + I->instrID();
+
+  switch (I->opcode()) {
+    case COP_Literal:
+      emit(VOP_Mov, Dst, constantReg(cast<Literal>(I)));
+      break;
+    case COP_Variable:
+      emit(VOP_Mov, Dst, paramReg(cast<Variable>(I)));
+      break;
+    case COP_Call:
+      compileCall(cast<Call>(I), Dst);
+      break;
+    case COP_Alloc: {
+      auto *Init = cast<Alloc>(I)->initializer();
+      emit(VOP_Alloc, Dst, Init ? reg(Init) : Interpreter::NoReg);
+      break;
+    }
+    case COP_Load:
+      emit(VOP_Load, Dst, reg(cast<Load>(I)->pointer()));
+      break;
+    case COP_Store: {
+      auto *S = cast<Store>(I);
+      emit(VOP_Store, Dst, reg(S->destination()), reg(S->source()));
+      break;
+    }
+    case COP_ArrayIndex: {
+      auto *Ai = cast<ArrayIndex>(I);
+      emit(VOP_ElemAddr, Dst, reg(Ai->array()), int64Reg(Ai->index()));
+      break;
+    }
+    case COP_ArrayAdd: {
+      auto *Aa = cast<ArrayAdd>(I);
+      emit(VOP_ElemAddr, Dst, reg(Aa->array()), int64Reg(Aa->index()));
+      break;
+    }
+    case COP_UnaryOp:
+      compileUnaryOp(cast<UnaryOp>(I), Dst);
+      break;
+    case COP_BinaryOp:
+      compileBinaryOp(cast<BinaryOp>(I), Dst);
+      break;
+    case COP_Cast:
+      compileCast(cast<Cast>(I), Dst);
+      break;
+    default:
+      fail("unsupported instruction ", I);
+      break;
+  }
+}
+
+
+void VMCompiler::compileTerminator(BasicBlock *B, BasicBlock *Next) {
+  Terminator *T = B->terminator();
+  if (!T) {
+    fail("block has no terminator");
+    return;
+  }
+
+  switch (T->opcode()) {
+    case COP_Goto: {
+      auto *G = cast<Goto>(T);
+      emitEdgeMoves(G->targetBlock(), G->phiIndex());
+      if (G->targetBlock() != Next) {
+        // Back edges count towards the hotness of the function.
+        VMOpcode Op = G->isBackEdge() ? VOP_LoopJump : VOP_Jump;
+        emitJump(emit(Op, 0), false, blockLabel(G->targetBlock()));
+      }
+      return;
+    }
+    case COP_Branch: {
+      auto *Br = cast<Branch>(T);
+      uint32_t I = emit(VOP_Branch, reg(Br->condition()));
+      emitJump(I, false, edgeLabel(B, Br->thenBlock()));
+      emitJump(I, true,  edgeLabel(B, Br->elseBlock()));
+      return;
+    }
+    case COP_Switch: {
+      auto *Sw = cast<Switch>(T);
+      VMType Ty = Interpreter::getVMType(typeOf(Sw->condition()));
+      if (Ty > VT_U64) {
+        fail("unsupported switch ", Sw);
+        return;
+      }
+      uint32_t Cond = int64Reg(Sw->condition());
+      unsigned Ti = Fn.SwitchTables.size();
+      Fn.SwitchTables.emplace_back();
+      // Case targets are patched once all of the labels are known.
+      VMSwitchTable Table;
+      Table.Default = Interpreter::NoReg;
+      unsigned DefaultLabel = Interpreter::NoReg;
+      for (int i = 0, n = Sw->numCases(); i < n; ++i) {
+        unsigned L = edgeLabel(B, Sw->caseBlock(i));
+        SExpr *Lab = Sw->label(i);
+        if (isa<Wildcard>(Lab)) {
+          DefaultLabel = L;
+          continue;
+        }
+        auto *Lit = dyn_cast<Literal>(Lab);
+        VMValue V;
+        if (!Lit || !BtBr<LiteralToValue>::branch(Lit->baseType(), Lit, &V)) {
+          fail("unsupported case label ", Lab);
+          return;
+        }
+        V = Interpreter::convertValue(V,
+              Interpreter::getVMType(Lit->baseType()), VT_I64);
+        Table.Cases.emplace_back(V.I64, L);
+      }
+      Fn.SwitchTables[Ti] = std::move(Table);
+      SwitchFixups.push_back(std::make_pair(Ti, DefaultLabel));
+      emit(VOP_Switch, 0, Cond, Ti);
+      return;
+    }
+    case COP_Return: {
+      auto *R = cast<Return>(T);
+      SExpr *V = R->returnValue();
+      if (!V || Interpreter::getVMType(typeOf(V)) == VT_Void)
+        emit(VOP_Return, 0, Interpreter::NoReg);
+      else
+        emit(VOP_Return, 0, reg(V));
+      return;
+    }
+    default:
+      fail("unsupported terminator ", T);
+      return;
+  }
+}
+
+
+bool VMCompiler::compile(const std::vector<VarDecl*> &Params) {
+  SCFG *Cfg = Fn.Body;
+  Fn.NumParams = Params.size();
+  for (unsigned i = 0; i < Params.size(); ++i)
+    ParamRegs[Params[i]] = i;
+  NextReg = Fn.NumParams + Cfg->numInstructions();
+
+  LabelPcs.resize(Cfg->numBlocks(), 0);
+  unsigned NumBlocks = Cfg->numBlocks();
+  for (unsigned i = 0; i < NumBlocks && Success; ++i) {
+    BasicBlock *B = Cfg->blocks()[i].get();
+    BasicBlock *Next = (i + 1 < NumBlocks) ? Cfg->blocks()[i+1].get()
+                                           : nullptr;
+    LabelPcs[blockLabel(B)] = Fn.Instrs.size();
+    for (auto *I : B->instructions()) {
+      if (I)
+        compileInstruction(I);
+    }
+    compileTerminator(B, Next);
+  }
+
+  // Emit the blocks for edges which have phi moves.
+  for (unsigned i = 0; i < Stubs.size() && Success; ++i) {
+    LabelPcs[Stubs[i].Label] = Fn.Instrs.size();
+    emitEdgeMoves(Stubs[i].Target, Stubs[i].PhiIndex);
+    emitJump(emit(VOP_Jump, 0), false, blockLabel(Stubs[i].Target));
+  }
+  if (!Success)
+    return false;
+
+  // Resolve labels.
+  for (auto &F : Fixups) {
+    auto &I = Fn.Instrs[F.Instr];
+    (F.IsB ? I.B : I.A) = LabelPcs[F.Label];
+  }
+  for (auto &Sf : SwitchFixups) {
+    auto &Table = Fn.SwitchTables[Sf.first];
+    if (Sf.second != Interpreter::NoReg)
+      Table.Default = LabelPcs[Sf.second];
+    for (auto &C : Table.Cases)
+      C.second = LabelPcs[C.second];
+    // Sort the cases for binary search, keeping the first case with each
+    // label.
+    typedef std::pair<int64_t, uint32_t> CaseEntry;
+    std::stable_sort(Table.Cases.begin(), Table.Cases.end(),
+                     [](const CaseEntry &X, const CaseEntry &Y) {
+      return X.first < Y.first;
+    });
+    Table.Cases.erase(std::unique(Table.Cases.begin(), Table.Cases.end(),
+                                  [](const CaseEntry &X, const CaseEntry &Y) {
+      return X.first == Y.first;
+    }), Table.Cases.end());
+  }
+
+  Fn.NumRegs = NextReg;
+  Fn.Compiled = true;
+  return true;
+}
+
+
+unsigned Interpreter::compileModule(SExpr *Module) {
+  auto *GlobalFun = dyn_cast_or_null<Function>(Module);
+  auto *Rec = GlobalFun ? dyn_cast_or_null<Record>(GlobalFun->body())
+                        : nullptr;
+  if (!Rec) {
+    Diag.error("Module is not a lowered global record.");
+    return 0;
+  }
+  GlobalVd = GlobalFun->variableDecl();
+
+  // Create all of the functions first, so that calls can be resolved.
+  std::vector<std::vector<VarDecl*>> Params;
+  for (auto &Slt : Rec->slots()) {
+    std::vector<VarDecl*> Ps;
+    SExpr *Def = Slt->definition();
+    while (auto *Fn = dyn_cast_or_null<Function>(Def)) {
+      Ps.push_back(Fn->variableDecl());
+      Def = Fn->body();
+    }
+    auto *C = dyn_cast_or_null<Code>(Def);
+    auto *Cfg = C ? dyn_cast_or_null<SCFG>(C->body()) : nullptr;
+    if (!Cfg)
+      continue;
+
+    auto *F = new VMFunction(Slt->slotName(), Cfg);
+    for (auto *Vd : Ps) {
+      auto *Ty = dyn_cast_or_null<ScalarType>(Vd->definition());
+      F->ParamTypes.push_back(Ty ? Ty->baseType()
+                                 : BaseType::getBaseType<void>());
+    }
+    auto *Rt = dyn_cast_or_null<ScalarType>(C->returnType());
+    F->ReturnType = Rt ? Rt->baseType() : BaseType::getBaseType<void>();
+    F->NumParams = Ps.size();
+
+    FunctionMap[Slt->slotName().str()] = Functions.size();
+    Functions.emplace_back(F);
+    Params.push_back(std::move(Ps));
+  }
+
+  unsigned NumCompiled = 0;
+  for (unsigned i = 0; i < Functions.size(); ++i) {
+    VMCompiler Compiler(*this, *Functions[i]);
+    if (Compiler.compile(Params[i]))
+      ++NumCompiled;
+  }
+  return NumCompiled;
+}
+
+
+VMFunction* Interpreter::findFunction(StringRef Name) {
+  auto It = FunctionMap.find(Name.str());
+  if (It == FunctionMap.end())
+    return nullptr;
+  return Functions[It->second].get();
+}
+
+
+
+// Threaded dispatch jumps directly from one handler to the next, which
+// gives the branch predictor a separate indirect branch for each opcode.
+#if defined(__GNUC__)
+#define OHMU_VM_THREADED 1
+#endif
+
+#ifdef OHMU_VM_THREADED
+#define VM_CASE(N)      L_##N:
+#define VM_DISPATCH()   do { ++Count; goto *Labels[Pc->Op]; } while (0)
+#else
+#define VM_CASE(N)      case VOP_##N:
+#define VM_DISPATCH()   do { ++Count; goto Dispatch; } while (0)
+#endif
+
+#define VM_NEXT()       do { ++Pc; VM_DISPATCH(); } while (0)
+#define VM_TRAP(Msg)    do { Error = Msg; goto Trap; } while (0)
+
+#define VM_COUNT_HOT(F)                                                       \
+  do {                                                                        \
+    if (++(F)->Hotness == HotThreshold && HotHandler)                         \
+      HotHandler(HotData, F);                                                 \
+  } while (0)
+
+#define VM_SYM_Add      +
+#define VM_SYM_Sub      -
+#define VM_SYM_Mul      *
+#define VM_SYM_Div      /
+#define VM_FUN_Div      divide
+#define VM_FUN_Rem      remainder
+#define VM_SYM_BitAnd   &
+#define VM_SYM_BitXor   ^
+#define VM_SYM_BitOr    |
+#define VM_SYM_Eq       ==
+#define VM_SYM_Neq      !=
+#define VM_SYM_Lt       <
+#define VM_SYM_Leq      <=
+
+// Integer arithmetic wraps around, so it is done on unsigned values.
+#define VM_INT_ARITH(Op, T, CT, UT)                                           \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = static_cast<CT>(static_cast<UT>(R[Pc->A].T) VM_SYM_##Op    \
+                                   static_cast<UT>(R[Pc->B].T));              \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_INT_DIV(Op, T, CT, UT)                                             \
+  VM_CASE(Op##_##T) {                                                         \
+    if (R[Pc->B].T == 0)                                                      \
+      VM_TRAP("Division by zero.");                                           \
+    R[Pc->Dst].T = VM_FUN_##Op<CT, UT>(R[Pc->A].T, R[Pc->B].T);               \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_BINARY(Op, T, CT, UT)                                              \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = static_cast<CT>(R[Pc->A].T VM_SYM_##Op R[Pc->B].T);        \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_COMPARE(Op, T, CT, UT)                                             \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].Bool = R[Pc->A].T VM_SYM_##Op R[Pc->B].T;                      \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_SHL(Op, T, CT, UT)                                                 \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = static_cast<CT>(static_cast<UT>(R[Pc->A].T) <<             \
+                                   (R[Pc->B].T & (sizeof(CT)*8 - 1)));        \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_SHR(Op, T, CT, UT)                                                 \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = static_cast<CT>(R[Pc->A].T >>                              \
+                                   (R[Pc->B].T & (sizeof(CT)*8 - 1)));        \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_INT_NEG(Op, T, CT, UT)                                             \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = static_cast<CT>(UT(0) - static_cast<UT>(R[Pc->A].T));      \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_FLOAT_NEG(Op, T, CT, UT)                                           \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = -R[Pc->A].T;                                               \
+    VM_NEXT();                                                                \
+  }
+
+#define VM_BITNOT(Op, T, CT, UT)                                              \
+  VM_CASE(Op##_##T) {                                                         \
+    R[Pc->Dst].T = static_cast<CT>(~R[Pc->A].T);                              \
+    VM_NEXT();                                                                \
+  }
+
+
+bool Interpreter::run(VMFunction *F, const VMValue *Args, VMValue *Result) {
+#ifdef OHMU_VM_THREADED
+  static void* const Labels[] = {
+#define OHMU_VM_OP(N)                    &&L_##N,
+#define OHMU_VM_TYPED_OP(Op, T, CT, UT)  &&L_##Op##_##T,
+    OHMU_VM_OPCODES(OHMU_VM_OP, OHMU_VM_TYPED_OP)
+#undef OHMU_VM_OP
+#undef OHMU_VM_TYPED_OP
+  };
+#endif
+
+  Error = nullptr;
+  if (!F->Compiled) {
+    Error = "Function has not been compiled.";
+    return false;
+  }
+  if (F->NumRegs > StackSize) {
+    Error = "Stack overflow.";
+    return false;
+  }
+  VM_COUNT_HOT(F);
+  if (VMNativeCode *Nc = F->Native.load(std::memory_order_acquire)) {
+    if (Nc->Invoke(Nc, Args, Result))
+      return true;
+    Error = "Runtime error in native code.";
+    return false;
+  }
+
+  VMFunction    *Fn = F;
+  VMValue       *R  = Stack.get();
+  VMValue       *StackEnd = Stack.get() + StackSize;
+  const VMInstr *Code = Fn->Instrs.data();
+  const VMInstr *Pc = Code;
+  uint64_t       Count = 0;
+
+  for (unsigned i = 0; i < Fn->NumParams; ++i)
+    R[i] = Args[i];
+  for (auto &C : Fn->Constants)
+    R[C.Reg] = C.Val;
+  Frames.clear();
+
+  VM_DISPATCH();
+
+#ifndef OHMU_VM_THREADED
+Dispatch:
+  switch (Pc->Op) {
+#endif
+
+  VM_CASE(Mov) {
+    R[Pc->Dst] = R[Pc->A];
+    VM_NEXT();
+  }
+  VM_CASE(Jump) {
+    Pc = Code + Pc->A;
+    VM_DISPATCH();
+  }
+  VM_CASE(LoopJump) {
+    VM_COUNT_HOT(Fn);
+    Pc = Code + Pc->A;
+    VM_DISPATCH();
+  }
+  VM_CASE(Branch) {
+    Pc = Code + (R[Pc->Dst].Bool ? Pc->A : Pc->B);
+    VM_DISPATCH();
+  }
+  VM_CASE(Switch) {
+    const VMSwitchTable &Table = Fn->SwitchTables[Pc->B];
+    int64_t V = R[Pc->A].I64;
+    auto It = std::lower_bound(Table.Cases.begin(), Table.Cases.end(), V,
+        [](const std::pair<int64_t, uint32_t> &C, int64_t Key) {
+      return C.first < Key;
+    });
+    uint32_t Target = Table.Default;
+    if (It != Table.Cases.end() && It->first == V)
+      Target = It->second;
+    if (Target == NoReg)
+      VM_TRAP("No matching case in switch.");
+    Pc = Code + Target;
+    VM_DISPATCH();
+  }
+  VM_CASE(Call) {
+    VMFunction *Callee = Functions[Pc->A].get();
+    if (!Callee->Compiled)
+      VM_TRAP("Call to function which has not been compiled.");
+    VMValue *NewR = R + Fn->NumRegs;
+    if (NewR + Callee->NumRegs > StackEnd)
+      VM_TRAP("Stack overflow.");
+
+    const uint32_t *ArgRegs = &Fn->ArgRegs[Pc->B];
+    for (unsigned i = 0, n = Callee->NumParams; i < n; ++i)
+      NewR[i] = R[ArgRegs[i]];
+
+    VM_COUNT_HOT(Callee);
+    if (VMNativeCode *Nc = Callee->Native.load(std::memory_order_acquire)) {
+      if (!Nc->Invoke(Nc, NewR, &R[Pc->Dst]))
+        VM_TRAP("Runtime error in native code.");
+      VM_NEXT();
+    }
+    for (auto &C : Callee->Constants)
+      NewR[C.Reg] = C.Val;
+
+    Frames.push_back(Frame{ Fn, Pc + 1, R, Pc->Dst });
+    Fn   = Callee;
+    R    = NewR;
+    Code = Fn->Instrs.data();
+    Pc   = Code;
+    VM_DISPATCH();
+  }
+  VM_CASE(Return) {
+    VMValue V = Pc->A == NoReg ? zeroValue() : R[Pc->A];
+    if (Frames.empty()) {
+      *Result = V;
+      NumExecuted += Count;
+      return true;
+    }
+    Frame &Fr = Frames.back();
+    Fn   = Fr.Fn;
+    R    = Fr.Regs;
+    Code = Fn->Instrs.data();
+    Pc   = Fr.Ret;
+    R[Fr.Dst] = V;
+    Frames.pop_back();
+    VM_DISPATCH();
+  }
+  VM_CASE(Alloc) {
+    // Allocations are never freed; they live as long as the arena.
+    VMValue *Cell = Arena.allocateT<VMValue>();
+    *Cell = Pc->A == NoReg ? zeroValue() : R[Pc->A];
+    R[Pc->Dst].Ptr = Cell;
+    VM_NEXT();
+  }
+  VM_CASE(Load) {
+    auto *P = static_cast<VMValue*>(R[Pc->A].Ptr);
+    if (!P)
+      VM_TRAP("Null pointer dereference.");
+    R[Pc->Dst] = *P;
+    VM_NEXT();
+  }
+  VM_CASE(Store) {
+    auto *P = static_cast<VMValue*>(R[Pc->A].Ptr);
+    if (!P)
+      VM_TRAP("Null pointer dereference.");
+    *P = R[Pc->B];
+    VM_NEXT();
+  }
+  VM_CASE(ElemAddr) {
+    R[Pc->Dst].Ptr = static_cast<VMValue*>(R[Pc->A].Ptr) + R[Pc->B].I64;
+    VM_NEXT();
+  }
+  VM_CASE(Convert) {
+    R[Pc->Dst] = convertValue(R[Pc->A], static_cast<VMType>(Pc->B >> 8),
+                              static_cast<VMType>(Pc->B & 0xFF));
+    VM_NEXT();
+  }
+  VM_CASE(LogicNot) {
+    R[Pc->Dst].Bool = !R[Pc->A].Bool;
+    VM_NEXT();
+  }
+  VM_CASE(LogicAnd) {
+    R[Pc->Dst].Bool = R[Pc->A].Bool && R[Pc->B].Bool;
+    VM_NEXT();
+  }
+  VM_CASE(LogicOr) {
+    R[Pc->Dst].Bool = R[Pc->A].Bool || R[Pc->B].Bool;
+    VM_NEXT();
+  }
+
+  OHMU_VM_INT_TYPES(VM_INT_ARITH, Add)
+  OHMU_VM_INT_TYPES(VM_INT_ARITH, Sub)
+  OHMU_VM_INT_TYPES(VM_INT_ARITH, Mul)
+  OHMU_VM_INT_TYPES(VM_INT_DIV,   Div)
+  OHMU_VM_INT_TYPES(VM_INT_DIV,   Rem)
+  OHMU_VM_FLOAT_TYPES(VM_BINARY,  Add)
+  OHMU_VM_FLOAT_TYPES(VM_BINARY,  Sub)
+  OHMU_VM_FLOAT_TYPES(VM_BINARY,  Mul)
+  OHMU_VM_FLOAT_TYPES(VM_BINARY,  Div)
+  OHMU_VM_INT_TYPES(VM_SHL,       Shl)
+  OHMU_VM_INT_TYPES(VM_SHR,       Shr)
+  OHMU_VM_INT_TYPES(VM_BINARY,    BitAnd)
+  OHMU_VM_INT_TYPES(VM_BINARY,    BitXor)
+  OHMU_VM_INT_TYPES(VM_BINARY,    BitOr)
+  OHMU_VM_ALL_TYPES(VM_COMPARE,   Eq)
+  OHMU_VM_ALL_TYPES(VM_COMPARE,   Neq)
+  OHMU_VM_NUM_TYPES(VM_COMPARE,   Lt)
+  OHMU_VM_NUM_TYPES(VM_COMPARE,   Leq)
+  OHMU_VM_INT_TYPES(VM_INT_NEG,   Neg)
+  OHMU_VM_FLOAT_TYPES(VM_FLOAT_NEG, Neg)
+  OHMU_VM_INT_TYPES(VM_BITNOT,    BitNot)
+
+#ifndef OHMU_VM_THREADED
+  default:
+    VM_TRAP("Invalid opcode.");
+  }
+#endif
+
+Trap:
+  NumExecuted += Count;
+  return false;
+}
+
+
+}  // end namespace til
+}  // end namespace ohmu
@@ -0,0 +1,293 @@
+//===- Interpreter.h -------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// A register-based virtual machine, which executes lowered SCFGs.
+//
+// Each SCFG is compiled to a flat array of VMInstrs.  Every instruction in
+// the CFG is assigned a register based on its instrID, and Phi nodes are
+// resolved into parallel moves on the incoming edges.  The instruction array
+// is interpreted with threaded dispatch, using computed goto where the
+// compiler supports it.
+//
+// The interpreter is also the first tier of a tiered runtime.  It counts
+// calls and loop back edges for each function, and reports functions which
+// become hot to a handler, which may compile them with a faster backend.
+// Once the handler installs native code for a function, all further calls
+// to that function are forwarded to the native code.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_TIL_INTERPRETER_H
+#define OHMU_TIL_INTERPRETER_H
+
+#include "TIL.h"
+#include "base/DiagnosticEmitter.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ohmu {
+namespace til  {
+
+
+/// The type of a value in a VM register.
+/// The numeric types must come first, and be in the same order as in the
+/// OHMU_VM_*_TYPES lists below.
+enum VMType : uint8_t {
+  VT_I8 = 0,
+  VT_U8,
+  VT_I16,
+  VT_U16,
+  VT_I32,
+  VT_U32,
+  VT_I64,
+  VT_U64,
+  VT_F32,
+  VT_F64,
+  VT_Bool,
+  VT_Ptr,
+  VT_Void
+};
+
+
+/// A value in a VM register.  The active member is determined by the type
+/// of the instruction which produced it.
+union VMValue {
+  int8_t   I8;
+  uint8_t  U8;
+  int16_t  I16;
+  uint16_t U16;
+  int32_t  I32;
+  uint32_t U32;
+  int64_t  I64;
+  uint64_t U64;
+  float    F32;
+  double   F64;
+  bool     Bool;
+  void*    Ptr;
+};
+
+
+// Lists of (Op, VMValue member, C type, unsigned C type) for each type.
+#define OHMU_VM_INT_TYPES(X, Op)          \
+  X(Op, I8,  int8_t,   uint8_t)           \
+  X(Op, U8,  uint8_t,  uint8_t)           \
+  X(Op, I16, int16_t,  uint16_t)          \
+  X(Op, U16, uint16_t, uint16_t)          \
+  X(Op, I32, int32_t,  uint32_t)          \
+  X(Op, U32, uint32_t, uint32_t)          \
+  X(Op, I64, int64_t,  uint64_t)          \
+  X(Op, U64, uint64_t, uint64_t)
+
+#define OHMU_VM_FLOAT_TYPES(X, Op)        \
+  X(Op, F32, float,  float)               \
+  X(Op, F64, double, double)
+
+#define OHMU_VM_NUM_TYPES(X, Op)          \
+  OHMU_VM_INT_TYPES(X, Op)                \
+  OHMU_VM_FLOAT_TYPES(X, Op)
+
+#define OHMU_VM_ALL_TYPES(X, Op)          \
+  OHMU_VM_NUM_TYPES(X, Op)                \
+  X(Op, Bool, bool,  bool)                \
+  X(Op, Ptr,  void*, void*)
+
+// X(Name) is an untyped opcode, XT(Op, Type, ...) is a typed opcode.
+// Typed opcodes for the same Op are consecutive, in VMType order.
+#define OHMU_VM_OPCODES(X, XT)                                               \
+  X(Mov) X(Jump) X(LoopJump) X(Branch) X(Switch) X(Call) X(Return)            \
+  X(Alloc) X(Load) X(Store) X(ElemAddr) X(Convert)                            \
+  X(LogicNot) X(LogicAnd) X(LogicOr)                                          \
+  OHMU_VM_NUM_TYPES(XT, Add)    OHMU_VM_NUM_TYPES(XT, Sub)                    \
+  OHMU_VM_NUM_TYPES(XT, Mul)    OHMU_VM_NUM_TYPES(XT, Div)                    \
+  OHMU_VM_INT_TYPES(XT, Rem)    OHMU_VM_INT_TYPES(XT, Shl)                    \
+  OHMU_VM_INT_TYPES(XT, Shr)    OHMU_VM_INT_TYPES(XT, BitAnd)                 \
+  OHMU_VM_INT_TYPES(XT, BitXor) OHMU_VM_INT_TYPES(XT, BitOr)                  \
+  OHMU_VM_ALL_TYPES(XT, Eq)     OHMU_VM_ALL_TYPES(XT, Neq)                    \
+  OHMU_VM_NUM_TYPES(XT, Lt)     OHMU_VM_NUM_TYPES(XT, Leq)                    \
+  OHMU_VM_NUM_TYPES(XT, Neg)    OHMU_VM_INT_TYPES(XT, BitNot)
+
+
+enum VMOpcode : uint32_t {
+#define OHMU_VM_OP(N)              VOP_##N,
+#define OHMU_VM_TYPED_OP(Op, T, CT, UT)  VOP_##Op##_##T,
+  OHMU_VM_OPCODES(OHMU_VM_OP, OHMU_VM_TYPED_OP)
+#undef OHMU_VM_OP
+#undef OHMU_VM_TYPED_OP
+  VOP_Last
+};
+
+
+/// A single VM instruction.
+/// Dst, A, and B are usually register numbers.  Jumps and branches store
+/// the index of the target instruction in A and B, and Call stores the
+/// index of the callee in A, and an offset into VMFunction::ArgRegs in B.
+struct VMInstr {
+  uint32_t Op;
+  uint32_t Dst;
+  uint32_t A;
+  uint32_t B;
+};
+
+
+/// A register which must be initialized to a constant on function entry.
+struct VMConstant {
+  uint32_t Reg;
+  VMValue  Val;
+};
+
+
+/// A compiled switch statement.
+struct VMSwitchTable {
+  uint32_t Default;                                   ///< Default target
+  std::vector<std::pair<int64_t, uint32_t>> Cases;    ///< Sorted by label
+};
+
+
+/// Native code for a VMFunction, which is installed by a faster tier.
+/// Invoke calls the code, and returns false on a runtime error.
+struct VMNativeCode {
+  bool (*Invoke)(VMNativeCode *Code, const VMValue *Args, VMValue *Result);
+};
+
+
+/// A function which has been compiled for the VM.
+/// Registers [0, NumParams) hold the parameters, followed by the
+/// instructions in the CFG, in instrID order, followed by constants and
+/// temporaries.
+struct VMFunction {
+  VMFunction(StringRef N, SCFG *Cfg)
+      : Name(N), Body(Cfg), NumParams(0), NumRegs(0), Compiled(false),
+        Hotness(0), Native(nullptr) { }
+
+  StringRef              Name;
+  SCFG*                  Body;
+  std::vector<BaseType>  ParamTypes;
+  BaseType               ReturnType;
+  unsigned               NumParams;
+  unsigned               NumRegs;
+  bool                   Compiled;
+
+  std::vector<VMInstr>       Instrs;
+  std::vector<VMConstant>    Constants;
+  std::vector<uint32_t>      ArgRegs;
+  std::vector<VMSwitchTable> SwitchTables;
+
+  uint32_t                   Hotness;   ///< Calls plus loop back edges.
+  std::atomic<VMNativeCode*> Native;    ///< Set once native code is ready.
+};
+
+
+/// Compiles and executes the functions in a lowered module.
+class Interpreter {
+public:
+  /// The size of the register stack, in registers.
+  static const unsigned DefaultStackSize = 1 << 20;
+
+  /// Register number that stands for "no register".
+  static const uint32_t NoReg = 0xFFFFFFFF;
+
+  /// Allocations made by the program are taken from Arena.
+  Interpreter(MemRegionRef A, unsigned StackSize = DefaultStackSize)
+      : Arena(A), Stack(new VMValue[StackSize]), StackSize(StackSize),
+        NumExecuted(0), Error(nullptr),
+        HotThreshold(0), HotHandler(nullptr), HotData(nullptr),
+        GlobalVd(nullptr) { }
+
+  /// Compile every function in Module, which is the lowered global
+  /// function, e.g. Global::global().  Functions which cannot be compiled
+  /// are reported and skipped.  Returns the number of compiled functions.
+  unsigned compileModule(SExpr *Module);
+
+  /// Return the function with the given name, or null if there is none.
+  VMFunction* findFunction(StringRef Name);
+
+  /// Return all of the functions in the module.
+  std::vector<std::unique_ptr<VMFunction>>& functions() { return Functions; }
+
+  /// Call F with the given arguments.  Returns false on a runtime error.
+  bool run(VMFunction *F, const VMValue *Args, VMValue *Result);
+
+  /// Called when the hotness of a function reaches the threshold.
+  typedef void (*HotFunctionHandler)(void *Data, VMFunction *F);
+
+  /// Call Handler(Data, F) once for each function F whose hotness reaches
+  /// Threshold.  The handler runs on the interpreter's thread, and should
+  /// return quickly.
+  void setHotFunctionHandler(uint32_t Threshold, HotFunctionHandler Handler,
+                             void *Data) {
+    HotThreshold = Threshold;
+    HotHandler   = Handler;
+    HotData      = Data;
+  }
+
+  /// Install native code for F.  This may be called from any thread;
+  /// calls to F which start afterwards will run the native code.
+  static void installNativeCode(VMFunction *F, VMNativeCode *Code) {
+    F->Native.store(Code, std::memory_order_release);
+  }
+
+  /// Return the total number of VM instructions that have been executed.
+  uint64_t numExecuted() const { return NumExecuted; }
+
+  /// Return a description of the last runtime error.
+  const char* errorMessage() const { return Error; }
+
+  DiagnosticEmitter& diag() { return Diag; }
+
+  /// Return the VM type for Bt, or VT_Void if Bt is not supported.
+  static VMType getVMType(BaseType Bt);
+
+  /// Convert V from type From to type To.
+  static VMValue convertValue(VMValue V, VMType From, VMType To);
+
+private:
+  friend class VMCompiler;
+
+  struct Frame {
+    VMFunction*    Fn;
+    const VMInstr* Ret;
+    VMValue*       Regs;
+    uint32_t       Dst;
+  };
+
+  MemRegionRef         Arena;
+  DiagnosticEmitter    Diag;
+  // The stack is not initialized, so that pages are only touched when used.
+  std::unique_ptr<VMValue[]> Stack;
+  unsigned             StackSize;
+  std::vector<Frame>   Frames;
+  uint64_t             NumExecuted;
+  const char*          Error;
+
+  uint32_t             HotThreshold;
+  HotFunctionHandler   HotHandler;
+  void*                HotData;
+
+  VarDecl* GlobalVd;
+  std::vector<std::unique_ptr<VMFunction>> Functions;
+  std::unordered_map<std::string, unsigned> FunctionMap;
+};
+
+
+}  // end namespace til
+}  // end namespace ohmu
+
+#endif  // OHMU_TIL_INTERPRETER_H
@@ -0,0 +1,313 @@
+//===- LICMPass.cpp --------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements loop-invariant code motion on CFGs in SSA form.
+//
+//===----------------------------------------------------------------------===//
+
+#include "LICMPass.h"
+
+#include <algorithm>
+
+namespace ohmu {
+namespace til  {
+
+
+bool LICMPass::isSpeculatable(Instruction *I) {
+  switch (I->opcode()) {
+    case COP_Literal:
+    case COP_Project:
+    case COP_ArrayIndex:
+    case COP_ArrayAdd:
+    case COP_UnaryOp:
+      return true;
+    case COP_BinaryOp: {
+      // Integer division by zero will trap.
+      auto *Bop = cast<BinaryOp>(I);
+      if (Bop->binaryOpcode() == BOP_Div || Bop->binaryOpcode() == BOP_Rem)
+        return Bop->baseType().Base == BaseType::BT_Float;
+      return true;
+    }
+    case COP_Cast:
+      // Checked downcasts may fail.
+      return cast<Cast>(I)->castOpcode() != CAST_downCast;
+    default:
+      // Calls, memory operations, and phi nodes stay in place.
+      return false;
+  }
+}
+
+
+bool LICMPass::isInvariant(const LoopInfo &L, SExpr *E) const {
+  if (!E)
+    return false;
+  if (auto *I = dyn_cast<Instruction>(E)) {
+    if (I->block())
+      return !inLoop(L, I->block());
+  }
+  // Instructions which are not in a block must be constants or variables.
+  return E->isTrivial();
+}
+
+
+bool LICMPass::canHoist(const LoopInfo &L, Instruction *I) const {
+  if (!isSpeculatable(I))
+    return false;
+
+  switch (I->opcode()) {
+    case COP_Literal:
+      return true;
+    case COP_Project:
+      return isInvariant(L, cast<Project>(I)->record());
+    case COP_ArrayIndex: {
+      auto *E = cast<ArrayIndex>(I);
+      return isInvariant(L, E->array()) && isInvariant(L, E->index());
+    }
+    case COP_ArrayAdd: {
+      auto *E = cast<ArrayAdd>(I);
+      return isInvariant(L, E->array()) && isInvariant(L, E->index());
+    }
+    case COP_UnaryOp:
+      return isInvariant(L, cast<UnaryOp>(I)->expr());
+    case COP_BinaryOp: {
+      auto *E = cast<BinaryOp>(I);
+      return isInvariant(L, E->expr0()) && isInvariant(L, E->expr1());
+    }
+    case COP_Cast:
+      return isInvariant(L, cast<Cast>(I)->expr());
+    default:
+      return false;
+  }
+}
+
+
+void LICMPass::findLoops(SCFG *Cfg) {
+  Loops.clear();
+
+  // A back edge is an edge from B to a block that dominates B.
+  // The target of a back edge is a loop header; all back edges to the same
+  // header belong to the same loop.
+  std::vector<int> LoopIndex(Cfg->numBlocks(), -1);
+  std::vector<BasicBlock*> Worklist;
+
+  for (auto &Bp : Cfg->blocks()) {
+    BasicBlock *B = Bp.get();
+    for (auto &Sp : B->successors()) {
+      BasicBlock *H = Sp.get();
+      if (!H || !H->dominates(*B))
+        continue;
+
+      int Li = LoopIndex[H->blockID()];
+      if (Li < 0) {
+        Li = static_cast<int>(Loops.size());
+        LoopIndex[H->blockID()] = Li;
+        Loops.emplace_back(H);
+        Loops.back().InLoop.resize(Cfg->numBlocks(), false);
+        Loops.back().InLoop[H->blockID()] = true;
+      }
+
+      // The loop body consists of the blocks which can reach the back edge
+      // without passing through the header.
+      LoopInfo &L = Loops[Li];
+      Worklist.push_back(B);
+      while (!Worklist.empty()) {
+        BasicBlock *X = Worklist.back();
+        Worklist.pop_back();
+        if (L.InLoop[X->blockID()] || !H->dominates(*X))
+          continue;
+        L.InLoop[X->blockID()] = true;
+        for (auto &P : X->predecessors())
+          Worklist.push_back(P.get());
+      }
+    }
+  }
+
+  for (auto &L : Loops) {
+    for (auto &Bp : Cfg->blocks()) {
+      if (inLoop(L, Bp.get()))
+        L.Blocks.push_back(Bp.get());
+    }
+  }
+
+  // Nested loops are strictly smaller than the loops that contain them.
+  std::stable_sort(Loops.begin(), Loops.end(),
+    [](const LoopInfo &A, const LoopInfo &B) {
+      return A.Blocks.size() < B.Blocks.size();
+    });
+}
+
+
+BasicBlock* LICMPass::getPreheader(SCFG *Cfg, LoopInfo &L) {
+  BasicBlock *Out = nullptr;
+  unsigned NumOut = 0;
+  for (auto &P : L.Header->predecessors()) {
+    if (inLoop(L, P.get()))
+      continue;
+    // Only gotos can be redirected to a new block.
+    if (!P->terminator() || !isa<Goto>(P->terminator()))
+      return nullptr;
+    Out = P.get();
+    ++NumOut;
+  }
+
+  if (NumOut == 0)
+    return nullptr;      // Unreachable loop.
+  if (NumOut == 1)
+    return Out;          // A goto has only one successor, so use Out.
+  return createPreheader(Cfg, L);
+}
+
+
+BasicBlock* LICMPass::createPreheader(SCFG *Cfg, LoopInfo &L) {
+  BasicBlock *H = L.Header;
+
+  // Split the predecessors of the header.
+  std::vector<BasicBlock*> OutPreds;
+  std::vector<BasicBlock*> LoopPreds;
+  std::vector<bool>        IsOut;
+  for (auto &P : H->predecessors()) {
+    bool Out = !inLoop(L, P.get());
+    IsOut.push_back(Out);
+    if (Out)
+      OutPreds.push_back(P.get());
+    else
+      LoopPreds.push_back(P.get());
+  }
+
+  auto *Ph = new (Arena) BasicBlock(Arena);
+  Cfg->add(Ph);
+  // Temporary ID; the CFG will be renumbered when we're done.
+  Ph->setBlockID(Cfg->numBlocks() - 1);
+
+  // Each Phi node in the header gets a corresponding Phi node in the
+  // preheader, which merges the values from outside of the loop.  The header
+  // Phi then has one value from the preheader, followed by the loop values.
+  std::vector<SExpr*> Vals;
+  Ph->reserveArguments(H->numArguments());
+  for (Phi *A : H->arguments()) {
+    auto *NewA = new (Arena) Phi(Arena, OutPreds.size());
+    NewA->setBaseType(A->baseType());
+    Ph->addArgument(NewA);
+
+    Vals.clear();
+    for (auto &V : A->values())
+      Vals.push_back(V.get());
+    assert(Vals.size() == IsOut.size() && "Phi nodes not sized properly.");
+    A->values().clear();
+    A->values().emplace_back(Arena, NewA);
+    for (unsigned i = 0, n = Vals.size(); i < n; ++i) {
+      if (IsOut[i])
+        NewA->values().emplace_back(Arena, Vals[i]);
+      else
+        A->values().emplace_back(Arena, Vals[i]);
+    }
+  }
+
+  // Redirect predecessors.
+  Ph->reservePredecessors(OutPreds.size());
+  for (unsigned i = 0, n = OutPreds.size(); i < n; ++i) {
+    cast<Goto>(OutPreds[i]->terminator())->rewrite(Ph, i);
+    Ph->predecessors().emplace_back(Arena, OutPreds[i]);
+  }
+
+  H->predecessors().clear();
+  H->predecessors().emplace_back(Arena, Ph);
+  for (unsigned i = 0, n = LoopPreds.size(); i < n; ++i) {
+    if (auto *G = dyn_cast_or_null<Goto>(LoopPreds[i]->terminator()))
+      G->rewrite(H, i + 1);
+    H->predecessors().emplace_back(Arena, LoopPreds[i]);
+  }
+
+  auto *G = new (Arena) Goto(H, 0);
+  G->setBlock(Ph);
+  Ph->setTerminator(G);
+
+  // The preheader belongs to every enclosing loop.
+  for (auto &Outer : Loops) {
+    if (&Outer == &L || !inLoop(Outer, H))
+      continue;
+    Outer.InLoop.resize(Cfg->numBlocks(), false);
+    Outer.InLoop[Ph->blockID()] = true;
+    auto It = std::find(Outer.Blocks.begin(), Outer.Blocks.end(), H);
+    Outer.Blocks.insert(It, Ph);
+  }
+  return Ph;
+}
+
+
+void LICMPass::hoistInstructions(LoopInfo &L) {
+  BasicBlock *Ph = L.Preheader;
+  std::vector<Instruction*> Remaining;
+
+  // Blocks are in topological order, and so definitions are visited before
+  // their uses.  Once an instruction has been hoisted, it is no longer in the
+  // loop, so instructions which depend on it may also be hoisted.
+  for (BasicBlock *B : L.Blocks) {
+    bool Changed = false;
+    for (auto &I : B->instructions()) {
+      if (I && canHoist(L, I)) {
+        Ph->addInstruction(I);
+        I = nullptr;
+        Changed = true;
+        ++NumHoisted;
+      }
+    }
+    if (!Changed)
+      continue;
+
+    // Compact the block.
+    Remaining.clear();
+    for (auto *I : B->instructions()) {
+      if (I)
+        Remaining.push_back(I);
+    }
+    B->instructions().clear();
+    for (auto *I : Remaining)
+      B->addInstruction(I);
+  }
+}
+
+
+void LICMPass::run(SCFG *Cfg) {
+  findLoops(Cfg);
+  if (Loops.empty())
+    return;
+
+  unsigned NumBlocks = Cfg->numBlocks();
+  for (auto &L : Loops) {
+    L.Preheader = getPreheader(Cfg, L);
+    if (L.Preheader)
+      hoistInstructions(L);
+  }
+
+  for (auto &Bp : Cfg->blocks())
+    Bp->setLoopDepth(0);
+  for (auto &L : Loops) {
+    for (auto *B : L.Blocks)
+      B->setLoopDepth(B->loopDepth() + 1);
+  }
+
+  // Sort the new preheaders into place, and renumber instructions.
+  if (Cfg->numBlocks() != NumBlocks)
+    Cfg->computeNormalForm();
+  else
+    Cfg->renumber();
+}
+
+
+}  // end namespace til
+}  // end namespace ohmu
@@ -0,0 +1,101 @@
+//===- LICMPass.h ----------------------------------------------*- C++ --*-===//
+// Copyright 2014  Google
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+//===----------------------------------------------------------------------===//
+//
+// Implements loop-invariant code motion on CFGs in SSA form.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OHMU_TIL_LICMPASS_H
+#define OHMU_TIL_LICMPASS_H
+
+#include "TIL.h"
+
+#include <vector>
+
+namespace ohmu {
+namespace til  {
+
+
+/// Loop-invariant code motion.
+/// Finds the natural loops in a CFG using the dominator tree, and moves
+/// pure, non-trapping instructions whose operands are defined outside of the
+/// loop into the loop preheader.  A preheader is created if the loop header
+/// does not already have a single predecessor outside of the loop.
+/// Inner loops are processed first, so instructions may be hoisted out of
+/// several levels of nesting.  The pass also sets the loop depth of blocks.
+class LICMPass {
+public:
+  LICMPass(MemRegionRef A) : Arena(A), NumHoisted(0) { }
+
+  /// Run the pass on Cfg, which must be in normal form.
+  /// The CFG will be renormalized if any blocks were added.
+  void run(SCFG *Cfg);
+
+  /// Return the total number of instructions that have been hoisted.
+  unsigned numHoisted() const { return NumHoisted; }
+
+  /// Return true if I can be executed speculatively, which means that it
+  /// has no side effects, and cannot trap.
+  static bool isSpeculatable(Instruction *I);
+
+private:
+  struct LoopInfo {
+    LoopInfo(BasicBlock *H) : Header(H), Preheader(nullptr) { }
+
+    BasicBlock*              Header;
+    BasicBlock*              Preheader;
+    std::vector<bool>        InLoop;   ///< Indexed by blockID.
+    std::vector<BasicBlock*> Blocks;   ///< Blocks in topological order.
+  };
+
+  /// Return true if B is part of loop L.
+  bool inLoop(const LoopInfo &L, const BasicBlock *B) const {
+    unsigned Id = static_cast<unsigned>(B->blockID());
+    return Id < L.InLoop.size() && L.InLoop[Id];
+  }
+
+  /// Return true if E has the same value on every iteration of L.
+  bool isInvariant(const LoopInfo &L, SExpr *E) const;
+
+  /// Return true if I can be hoisted out of loop L.
+  bool canHoist(const LoopInfo &L, Instruction *I) const;
+
+  /// Find all natural loops in Cfg, innermost loops first.
+  void findLoops(SCFG *Cfg);
+
+  /// Find or create a preheader for loop L.
+  BasicBlock* getPreheader(SCFG *Cfg, LoopInfo &L);
+
+  /// Create a new preheader, which becomes the only predecessor of the loop
+  /// header that is outside of the loop.
+  BasicBlock* createPreheader(SCFG *Cfg, LoopInfo &L);
+
+  /// Hoist invariant instructions in L into its preheader.
+  void hoistInstructions(LoopInfo &L);
+
+  LICMPass() = delete;
+
+  MemRegionRef          Arena;
+  unsigned              NumHoisted;
+  std::vector<LoopInfo> Loops;
+};
+
+
+}  // end namespace til
+}  // end namespace ohmu
+
+#endif  // OHMU_TIL_LICMPASS_H
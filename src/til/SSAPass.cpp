@@ -50,15 +50,10 @@ void SSAPass::enterBlock(BasicBlock *B) {
   // Warning -- adding blocks to BlockInfo will invalidate CurrentVarMap.
   CurrentVarMap = &BInfoMap[Cbb->blockID()].AllocVarMap;
 
-  // Initialize variable map to the size of the dominator's map.
-  // Local variables in the dominator are in scope.
-  unsigned PSize;
-  if (Cbb->parent())
-    PSize = BInfoMap[Cbb->parent()->blockID()].AllocVarMap.size();
-  else
-    PSize = 1;   // ID of zero means invalid ID.
-
-  CurrentVarMap->resize(PSize, nullptr);
+  // Local variables in the dominator are in scope.  The map starts out
+  // empty; their values are found by lookup in predecessors.
+  if (auto* Dom = Cbb->parent())
+    CurrentVarMap->setSize(BInfoMap[Dom->blockID()].AllocVarMap.size());
 }
 
 
@@ -91,11 +86,9 @@ void SSAPass::reduceAlloc(Alloc *Orig) {
     SExpr* Fbdy = Fld ? Fld->body() : nullptr;
     if (Fld && (Fbdy == nullptr || isa<Instruction>(Fbdy))) {
       // Add the new variable to the map for the current block.
-      unsigned Id = CurrentVarMap->size();
-      Orig->setAllocID(Id);
-
+      unsigned Id;
       if (Fbdy) {
-        CurrentVarMap->push_back(Fbdy);
+        Id = CurrentVarMap->push_back(Fbdy, FutArena);
       }
       else {
         // Variable is undefined or has an invalid definition.
@@ -106,8 +99,9 @@ void SSAPass::reduceAlloc(Alloc *Orig) {
         if (auto* Ty = dyn_cast<ScalarType>(Fld->range())) {
           Un->setBaseType(Ty->baseType());
         }
-        CurrentVarMap->push_back(Un);
+        Id = CurrentVarMap->push_back(Un, FutArena);
       }
+      Orig->setAllocID(Id);
 
       // Reset uses to zero.
       NumUses[Orig->instrID()] = 0;
@@ -139,7 +133,7 @@ void SSAPass::reduceStore(Store *Orig) {
 
       // Update the map for the current block to hold the new value.
       assert(E1 && "Invalid store operation.");
-      CurrentVarMap->at(A->allocID()) = E1;
+      CurrentVarMap->set(A->allocID(), E1, FutArena);
 
       // Return future, which will delete the Store later if not needed.
       auto *F = new (FutArena) FutureStore(Orig, A);
@@ -170,7 +164,7 @@ void SSAPass::reduceLoad(Load *Orig) {
         // Remove the use that we marked for this load during traversal.
        --NumUses[A->instrID()];
 
-        auto* Av = CurrentVarMap->at(A->allocID());
+        auto* Av = CurrentVarMap->lookup(A->allocID());
         if (Av) {
           // The value was set in the current basic block.
           if (isa<Undefined>(Av)) {
@@ -242,15 +236,15 @@ void SSAPass::replacePending() {
     if (B != CurrBB) {
       // We've switched to a new block.  Clear the cache.
       CurrVarMapCache.clear();
-      unsigned MSize = BInfoMap[B->blockID()].AllocVarMap.size();
-      CurrVarMapCache.resize(MSize, nullptr);
+      CurrVarMapCache.setSize(BInfoMap[B->blockID()].AllocVarMap.size());
       CurrBB = B;
     }
     auto  LvarID = A->allocID();
-    auto* E = CurrVarMapCache[LvarID];
+    auto* E = CurrVarMapCache.lookup(LvarID);
     if (!E) {
       E = lookupInPredecessors(B, LvarID, A->instrName());
-      CurrVarMapCache[LvarID] = E;
+      if (E)
+        CurrVarMapCache.set(LvarID, E, FutArena);
     }
     if (E) {
       F->setResult(E);  // Replace load
@@ -271,7 +265,7 @@ SExpr* SSAPass::lookupInCache(LocalVarMap *LvarMap, unsigned LvarID) {
   if (LvarID >= LvarMap->size())
     return nullptr;
 
-  SExpr *E = LvarMap->at(LvarID);
+  SExpr *E = LvarMap->lookup(LvarID);
   if (!E)
     return nullptr;
 
@@ -282,7 +276,7 @@ SExpr* SSAPass::lookupInCache(LocalVarMap *LvarMap, unsigned LvarID) {
     auto *Ph = dyn_cast<Phi>(E);
     if (Ph && Ph->status() == Phi::PH_SingleVal) {
       E = Ph->values()[0].get();
-      LvarMap->at(LvarID) = E;
+      LvarMap->set(LvarID, E, FutArena);
       continue;
     }
     break;
@@ -295,7 +289,7 @@ SExpr* SSAPass::lookupInCache(LocalVarMap *LvarMap, unsigned LvarID) {
     auto* Fut = dyn_cast_or_null<Future>(E);
     if (Fut && Fut->maybeGetResult()) {
       E = Fut->maybeGetResult();
-      LvarMap->at(LvarID) = E;
+      LvarMap->set(LvarID, E, FutArena);
       continue;
     }
     break;
@@ -330,7 +324,7 @@ SExpr* SSAPass::lookupInPredecessors(BasicBlock *B, unsigned LvarID,
   SExpr* E2 = nullptr;   // The second distinct value we find.
   Phi*   Ph = nullptr;   // The Phi node we created (if any)
   bool Incomplete = false;                // Is Ph incomplete?
-  bool SetInBlock = LvarMap->at(LvarID);  // Is var set within this block?
+  bool SetInBlock = LvarMap->lookup(LvarID);  // Is var set in this block?
   unsigned i = 0;
 
   for (auto &P : B->predecessors()) {
@@ -339,7 +333,7 @@ SExpr* SSAPass::lookupInPredecessors(BasicBlock *B, unsigned LvarID,
       // Create a dummy Phi node to avoid infinite recursion before lookup.
       Ph = makeNewPhiNode(i, E, B->numPredecessors());
       Incomplete = true;
-      LvarMap->at(LvarID) = Ph;
+      LvarMap->set(LvarID, Ph, FutArena);
       SetInBlock = true;
     }
 
@@ -374,7 +368,7 @@ SExpr* SSAPass::lookupInPredecessors(BasicBlock *B, unsigned LvarID,
       Ph->values().emplace_back(arena(), E2);
       Incomplete = false;
       if (!SetInBlock) {
-        LvarMap->at(LvarID) = Ph;
+        LvarMap->set(LvarID, Ph, FutArena);
         SetInBlock = true;
       }
     }
@@ -383,9 +377,9 @@ SExpr* SSAPass::lookupInPredecessors(BasicBlock *B, unsigned LvarID,
 
   if (Ph) {
     if (Incomplete) {
-      assert(LvarMap->at(LvarID) == Ph && "Phi should have been cached.");
+      assert(LvarMap->lookup(LvarID) == Ph && "Phi should have been cached.");
       // Replace Phi node in cache.
-      LvarMap->at(LvarID) = E;
+      LvarMap->set(LvarID, E, FutArena);
 
       // Ph may have been cached elsewhere, so mark it as single val.
       // It will be eliminated by lookupInCache/
@@ -426,7 +420,7 @@ SExpr* SSAPass::lookup(BasicBlock *B, unsigned LvarID, StringRef Nm) {
   // Lookup variable in predecessor blocks.
   auto* E = lookupInPredecessors(B, LvarID, Nm);
   // Cache the result.
-  LvarMap->at(LvarID) = E;
+  LvarMap->set(LvarID, E, FutArena);
 
   return E;
 }
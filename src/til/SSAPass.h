@@ -28,8 +28,81 @@ namespace ohmu {
 namespace til  {
 
 
-// Map from local variables (allocID) to their definitions (SExpr*).
-typedef std::vector<SExpr*> LocalVarMap;
+// Sparse map from local variables (allocID) to their definitions (SExpr*).
+// Variables with IDs in [1, size()) are in scope; a block's map only stores
+// entries for the variables that were set or looked up in that block, and
+// all other variables map to null.  Entries are kept sorted by ID in an
+// array that is allocated from the given arena.
+class LocalVarMap {
+public:
+  LocalVarMap() : NumVars(1) { }   // ID of zero means invalid ID.
+
+  /// Return one past the largest variable ID that is in scope.
+  unsigned size() const { return NumVars; }
+
+  /// Bring variables with IDs in [1, N) into scope.
+  void setSize(unsigned N) { NumVars = N; }
+
+  /// Return the definition for variable ID, or null if it's not set.
+  SExpr* lookup(unsigned ID) const {
+    unsigned i = findIndex(ID);
+    if (i < Entries.size() && Entries[i].ID == ID)
+      return Entries[i].Exp;
+    return nullptr;
+  }
+
+  /// Set the definition for variable ID to E.
+  void set(unsigned ID, SExpr* E, MemRegionRef A) {
+    assert(ID < NumVars && "Variable is not in scope.");
+    unsigned i = findIndex(ID);
+    if (i < Entries.size() && Entries[i].ID == ID) {
+      Entries[i].Exp = E;
+      return;
+    }
+    // Insert a new entry at position i.  New variables always have the
+    // largest ID, so this is usually an append.
+    Entries.reserveCheck(1, A);
+    Entries.push_back(Entry(ID, E));
+    for (unsigned j = Entries.size() - 1; j > i; --j)
+      Entries[j] = Entries[j - 1];
+    Entries[i] = Entry(ID, E);
+  }
+
+  /// Add a new variable to the map, with definition E, and return its ID.
+  unsigned push_back(SExpr* E, MemRegionRef A) {
+    unsigned ID = NumVars++;
+    set(ID, E, A);
+    return ID;
+  }
+
+  /// Remove all entries, but keep the allocated memory.
+  void clear() { Entries.clear(); }
+
+private:
+  struct Entry {
+    Entry(unsigned I, SExpr* E) : ID(I), Exp(E) { }
+
+    unsigned ID;
+    SExpr*   Exp;
+  };
+
+  /// Return the index of the first entry with an ID >= ID.
+  unsigned findIndex(unsigned ID) const {
+    unsigned Lo = 0;
+    unsigned Hi = Entries.size();
+    while (Lo < Hi) {
+      unsigned Mid = (Lo + Hi) / 2;
+      if (Entries[Mid].ID < ID)
+        Lo = Mid + 1;
+      else
+        Hi = Mid;
+    }
+    return Lo;
+  }
+
+  SimpleArray<Entry> Entries;
+  unsigned NumVars;
+};
 
 // Maintain a variable map for each basic block.
 struct SSABlockInfo {
@@ -1216,6 +1216,12 @@ public:
   Goto(BasicBlock *B, unsigned I)
       : Terminator(COP_Goto), TargetBlock(B), Index(I) {}
 
+  /// Redirect this goto to block B, with argument index I into its Phis.
+  void rewrite(BasicBlock *B, unsigned I) {
+    TargetBlock.reset(B);
+    Index = I;
+  }
+
   const BasicBlock *targetBlock() const { return TargetBlock.get(); }
   BasicBlock *targetBlock() { return TargetBlock.get(); }
 
@@ -17,7 +17,9 @@
 
 
 #include "Evaluator.h"
+#include "LICMPass.h"
 #include "SSAPass.h"
+#include "TILCompare.h"
 #include "TypedEvaluator.h"
 
 
@@ -29,6 +31,7 @@ void TypedEvaluator::enterCFG(SCFG *Cfg) {
   Super::enterCFG(Cfg);
   scope()->setCurrentContinuation(Builder.currentCFG()->exit());
   Builder.beginBlock(Builder.currentCFG()->entry());
+  InlinedSize = 0;
 }
 
 
@@ -51,6 +54,9 @@ void TypedEvaluator::exitCFG(SCFG *Cfg) {
   // TODO: also enter builder scope
   ssaPass.traverseAll(ncfg);
 
+  LICMPass licmPass(Builder.arena());
+  licmPass.run(ncfg);
+
   /*
   TILDebugPrinter::print(ncfg, std::cout);
   */
@@ -58,6 +64,15 @@ void TypedEvaluator::exitCFG(SCFG *Cfg) {
 
 
 
+void TypedEvaluator::enterBlock(BasicBlock *B) {
+  // The entry block of an inlined function continues the current block.
+  if (Builder.currentBB() && lookupBlock(B) == Builder.currentBB())
+    return;
+  Super::enterBlock(B);
+}
+
+
+
 static TypedCopyAttr::Relation
 getRelationFromVarDecl(VarDecl::VariableKind K) {
   switch (K) {
@@ -353,6 +368,20 @@ void TypedEvaluator::reduceCall(Call *Orig) {
   if (reduceNestedCall(Orig, C))
     return;
 
+  // Lower the callee if it hasn't been lowered yet.
+  if (LowerOnDemand) {
+    auto* F = dyn_cast_or_null<Future>(C->body());
+    if (F && F->status() == Future::FS_pending)
+      DemandQueue.push(F);
+  }
+
+  // The substitution is consumed by evaluateTypeExpr, so save a copy of it
+  // if we are going to inline the call.
+  SCFG* Callee = getInlineCandidate(C, Ca);
+  Substitution<TypedCopyAttr> InlineSubst;
+  if (Callee)
+    InlineSubst = Ca.Subst;
+
   // Set the result type.
   Res.TypeExpr = C->returnType();
   Res.Rel      = TypedCopyAttr::BT_Type;
@@ -361,6 +390,15 @@ void TypedEvaluator::reduceCall(Call *Orig) {
   // TODO: FIXME!!  Res is not a stable reference; it may be invalidated.
   evaluateTypeExpr(Res);
 
+  if (Callee) {
+    auto* E = inlineCall(C, Callee, std::move(InlineSubst));
+    // Inlining traverses the callee, which may invalidate Res.
+    auto& Res2 = resultAttr();
+    setBaseTypeFromExpr(cast<Instruction>(E), Res2.TypeExpr);
+    Res2.Exp = E;
+    return;
+  }
+
   // Set the result residual.
   if (Ce) {
     auto* E = Builder.newCall(Ce);
@@ -571,6 +609,21 @@ void TypedEvaluator::reduceBinaryOp(BinaryOp *Orig) {
 
 
 
+void TypedEvaluator::reduceBranch(Branch *Orig) {
+  // Eliminate static conditionals.  The block that is not taken will not be
+  // mapped, and copyBlocks() will skip it.
+  Literal* Lc = dyn_cast_or_null<Literal>(attr(0).Exp);
+  if (Lc && Lc->baseType().Base == BaseType::BT_Bool) {
+    BasicBlock* B = Lc->as<bool>()->value() ? Orig->thenBlock()
+                                            : Orig->elseBlock();
+    resultAttr().Exp = Builder.newGoto(lookupBlock(B));
+    return;
+  }
+  Super::reduceBranch(Orig);
+}
+
+
+
 void TypedEvaluator::reduceIdentifier(Identifier *Orig) {
   auto& Res = resultAttr();
 
@@ -815,6 +868,67 @@ void TypedEvaluator::traverseFuture(Future* Orig) {
 
 
 
+SExpr* TypedEvaluator::traverseLazy(SExpr *E) {
+  assert(emptyAttrs() && "In the middle of a traversal.");
+  LowerOnDemand = true;
+
+  traverse(E, TRV_Tail);
+  SExpr *Result = attr(0).Exp;
+  popAttr();
+
+  forceNonCFGFutures();
+  clearAttrFrames();
+  return Result;
+}
+
+
+// Force pending futures, except for the bodies of functions, which are
+// added to Deferred and left unforced until they are needed.  The remaining
+// futures are types and other definitions, which are needed to type check
+// a call.
+void TypedEvaluator::forceNonCFGFutures() {
+  while (!FutureQueue.empty()) {
+    auto *Fut = FutureQueue.front();
+    FutureQueue.pop();
+    if (Fut->createsCFG())
+      Deferred.push_back(Fut);
+    else
+      Fut->force();
+  }
+}
+
+
+void TypedEvaluator::lowerFuture(TypedEvalFuture *F) {
+  assert(emptyAttrs() && "In the middle of a traversal.");
+  F->setReducer(this);
+  F->force();
+
+  while (!FutureQueue.empty()) {
+    auto *Fut = FutureQueue.front();
+    FutureQueue.pop();
+    Fut->force();
+  }
+  clearAttrFrames();
+}
+
+
+void TypedEvaluator::lowerOnDemand(Future *F) {
+  assert(LowerOnDemand && "Not in lazy mode.");
+  DemandQueue.push(F);
+
+  while (!DemandQueue.empty()) {
+    auto *D = DemandQueue.front();
+    DemandQueue.pop();
+    if (D->status() != Future::FS_pending)
+      continue;
+    D->force();
+    forceNonCFGFutures();
+  }
+  clearAttrFrames();
+}
+
+
+
 void TypedEvaluator::traverseNestedCode(Code* Orig) {
   // Code blocks within a CFG are eliminated; we add them to pendingBlocks.
   // TODO: prevent nested blocks from escaping.
@@ -913,6 +1027,285 @@ bool TypedEvaluator::reduceNestedCall(Call* Orig, Code* C) {
 
 
 
+// Return true if I can be copied into another CFG by the inliner.
+static bool isInlinableInstr(Instruction *I) {
+  switch (I->opcode()) {
+    case COP_Literal:
+    case COP_UnaryOp:
+    case COP_BinaryOp:
+    case COP_Cast:
+    case COP_Phi:
+    case COP_Goto:
+    case COP_Branch:
+    case COP_Return:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+// Return the number of instructions in Cfg, not counting phi nodes.
+static unsigned countInstructions(SCFG* Cfg) {
+  unsigned Size = 0;
+  for (auto &B : Cfg->blocks()) {
+    for (auto *I : B->instructions()) {
+      if (I)
+        ++Size;
+    }
+  }
+  return Size;
+}
+
+
+// Return the lowered body of C if a call to C should be inlined, given the
+// arguments in Ca.  The body may be specialized to the constant arguments.
+// Returns null if the call should not be inlined.
+SCFG* TypedEvaluator::getInlineCandidate(Code* C, TypedCopyAttr &Ca) {
+  if (InlineThreshold == 0 || !Ca.Exp)
+    return nullptr;
+  if (!Builder.emitInstrs() || !Builder.currentBB())
+    return nullptr;
+
+  // Only inline functions which have already been lowered.  A function whose
+  // body is still a future is either being lowered right now (i.e. it is
+  // recursive), or has not been lowered yet.
+  auto* Callee = dyn_cast_or_null<SCFG>(C->body());
+  if (!Callee)
+    return nullptr;
+
+  // Recursion cutoff.
+  if (InlineStack.size() >= MaxInlineDepth)
+    return nullptr;
+  for (auto* Ic : InlineStack) {
+    if (Ic == C)
+      return nullptr;
+  }
+
+  // Variables which are not substituted must be in scope at the call site.
+  if (Ca.Subst.numNullVars() > Builder.deBruinIndex())
+    return nullptr;
+
+  for (auto &B : Callee->blocks()) {
+    for (auto *I : B->instructions()) {
+      if (I && !isInlinableInstr(I))
+        return nullptr;
+    }
+    if (B->terminator() && !isInlinableInstr(B->terminator()))
+      return nullptr;
+  }
+
+  // Nothing more can be inlined once the budget is used up.
+  if (InlinedSize >= InlineBudget)
+    return nullptr;
+
+  // Constant arguments are likely to simplify the inlined body.
+  unsigned Bonus = 0;
+  for (auto &At : Ca.Subst.varAttrs()) {
+    if (At.Exp && isa<Literal>(At.Exp))
+      Bonus += InlineConstArgBonus;
+  }
+  unsigned Limit = InlineThreshold + Bonus;
+  unsigned Size  = countInstructions(Callee);
+
+  // Specialization folds the constant arguments into a copy of the callee,
+  // which is then measured without the bonus.  The copy is only used if it
+  // is inlined, so don't build it for callees which are far too large.
+  SCFG* Body = Callee;
+  if (Specialize && Size <= Limit * MaxSpecializeFactor)
+    Body = getSpecialization(C, Callee, Ca.Subst);
+  if (Body != Callee) {
+    Size  = countInstructions(Body);
+    Limit = InlineThreshold;
+  }
+
+  if (Size > Limit || InlinedSize + Size > InlineBudget)
+    return nullptr;
+  InlinedSize += Size;
+  return Body;
+}
+
+
+// Copy the blocks of Callee into the current CFG, substituting arguments
+// for parameters.  Returns the result of the call.
+SExpr* TypedEvaluator::inlineCall(Code* C, SCFG* Callee,
+                                  Substitution<TypedCopyAttr> &&S) {
+  InlineStack.push_back(C);
+
+  // The callee entry continues the current block, and the callee exit
+  // becomes a new block, whose argument is the return value.
+  auto* Xb = Builder.newBlock(1);
+  Xb->arguments()[0]->setBaseType(Callee->exit()->arguments()[0]->baseType());
+
+  ScopeCPS Ns(std::move(S));
+  Ns.enterInlinedCFG(Callee, Builder.currentBB(), Xb);
+
+  // The entry block of a specialized body has an argument for each
+  // non-constant parameter.
+  auto& Params = Callee->entry()->arguments();
+  if (Params.size() > 0) {
+    unsigned i = 0;
+    for (unsigned Vi = Ns.numNullVars(), n = Ns.size(); Vi < n; ++Vi) {
+      auto& At = Ns.var(Vi);
+      if (isa<Literal>(At.Exp))
+        continue;
+      assert(i < Params.size() && "Specialized body has too few arguments.");
+      Ns.insertInstructionMap(Params[i++], TypedCopyAttr(At.Exp));
+    }
+  }
+
+  auto* Sc = switchScope(&Ns);
+  copyBlocks(Callee);
+  Ns.exitCFG();
+  restoreScope(Sc);
+
+  Builder.beginBlock(Xb);
+  InlineStack.pop_back();
+  return Xb->arguments()[0];
+}
+
+
+
+// Copy the blocks of Orig, other than the exit block, into the current CFG.
+void TypedEvaluator::copyBlocks(SCFG* Orig) {
+  for (auto &B : Orig->blocks()) {
+    if (B.get() == Orig->exit())
+      continue;
+    // Blocks are sorted topologically, so if B has not been mapped by now,
+    // then all of its predecessors were eliminated by reduceBranch().
+    if (B.get() != Orig->entry() && !scope()->lookupBlock(B.get()))
+      continue;
+    traverse(B.get(), TRV_Decl);
+    popAttr();
+  }
+}
+
+
+
+/// Hashes the value of a literal; used with BtBr.
+template<class Ty>
+class LiteralHasher {
+public:
+  typedef size_t ReturnType;
+
+  static size_t defaultAction(const Literal *L) { return 0; }
+  static size_t action(const Literal *L) {
+    return std::hash<Ty>()(L->as<Ty>()->value());
+  }
+};
+
+template<>
+class LiteralHasher<StringRef> {
+public:
+  typedef size_t ReturnType;
+
+  static size_t action(const Literal *L) {
+    StringRef S = L->as<StringRef>()->value();
+    return std::hash<std::string>()(std::string(S.data(), S.size()));
+  }
+};
+
+
+// Return true if the constant arguments in A and B are the same.
+static bool sameConstantArgs(const std::vector<Literal*> &A,
+                             const std::vector<Literal*> &B) {
+  if (A.size() != B.size())
+    return false;
+  for (unsigned i = 0, n = A.size(); i < n; ++i) {
+    if (!A[i] || !B[i]) {
+      if (A[i] != B[i])
+        return false;
+    }
+    else if (!EqualsComparator::compareExprs(A[i], B[i]))
+      return false;
+  }
+  return true;
+}
+
+
+// Return a copy of Callee that has been specialized to the constant
+// arguments in S, or Callee itself if there are no constant arguments.
+// Specializations are cached, keyed by the function and constant arguments.
+SCFG* TypedEvaluator::getSpecialization(Code* C, SCFG* Callee,
+                                        Substitution<TypedCopyAttr> &S) {
+  std::vector<Literal*> Args;
+  bool   HasConst = false;
+  size_t H        = std::hash<Code*>()(C);
+
+  for (auto &At : S.varAttrs()) {
+    auto* L = dyn_cast_or_null<Literal>(At.Exp);
+    if (L) {
+      HasConst = true;
+      H = H*31 + BtBr<LiteralHasher>::branch(L->baseType(), L);
+    }
+    else {
+      // Non-constant arguments are passed to the specialized body as
+      // block arguments, so they must have scalar types.
+      auto* I = dyn_cast_or_null<Instruction>(At.Exp);
+      if (!I || !I->baseType().isSimple())
+        return Callee;
+      H = H*31;
+    }
+    Args.push_back(L);
+  }
+  if (!HasConst)
+    return Callee;
+
+  auto R = SpecCache.equal_range(H);
+  for (auto It = R.first; It != R.second; ++It) {
+    if (It->second.Fun == C && sameConstantArgs(It->second.Args, Args))
+      return It->second.Body;
+  }
+
+  // The current CFG is still under construction, so build the specialized
+  // body with a new evaluator.
+  TypedEvaluator Spec(arena());
+  Spec.setInlineThreshold(0);
+  SCFG* Body = Spec.specializeCFG(Callee, S);
+
+  Specialization Sp = { C, std::move(Args), Body };
+  SpecCache.insert(std::make_pair(H, std::move(Sp)));
+  return Body;
+}
+
+
+// Copy Orig to a new CFG, substituting the constant arguments in S.
+// The remaining arguments become arguments of the new entry block.
+SCFG* TypedEvaluator::specializeCFG(SCFG* Orig,
+                                    Substitution<TypedCopyAttr> &S) {
+  std::vector<Phi*> Params;
+  Substitution<TypedCopyAttr> Ss(S.numNullVars());
+  for (auto &At : S.varAttrs()) {
+    if (isa<Literal>(At.Exp)) {
+      Ss.push_back(TypedCopyAttr(At.Exp));
+      continue;
+    }
+    auto* Ph = new (arena()) Phi();
+    Ph->setBaseType(cast<Instruction>(At.Exp)->baseType());
+    Params.push_back(Ph);
+    Ss.push_back(TypedCopyAttr(Ph));
+  }
+
+  ScopeCPS Ns(std::move(Ss));
+  auto* Sc = switchScope(&Ns);
+
+  enterCFG(Orig);
+  SCFG* Cfg = Builder.currentCFG();
+  for (auto* Ph : Params)
+    Cfg->entry()->addArgument(Ph);
+  Cfg->exit()->arguments()[0]->setBaseType(
+      Orig->exit()->arguments()[0]->baseType());
+
+  copyBlocks(Orig);
+  Super::exitCFG(Orig);
+  Cfg->computeNormalForm();
+
+  restoreScope(Sc);
+  return Cfg;
+}
+
+
+
 void TypedEvaluator::processPendingBlocks() {
   while (!PendingBlockQueue.empty()) {
     auto* Pb = PendingBlockQueue.front();
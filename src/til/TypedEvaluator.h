@@ -24,6 +24,7 @@
 #include "CopyReducer.h"
 
 #include <queue>
+#include <unordered_map>
 
 
 namespace ohmu {
@@ -178,6 +179,9 @@ struct PendingBlock {
 
 
 class CFGFuture;
+class TypedEvaluator;
+
+typedef LazyCopyFuture<TypedEvaluator, ScopeCPS> TypedEvalFuture;
 
 
 /// TypedEvaluator will rewrite a high-level ohmu AST to a CFG.
@@ -194,6 +198,7 @@ public:
 
   void enterCFG(SCFG *Cfg);
   void exitCFG(SCFG *Cfg);
+  void enterBlock(BasicBlock *B);
 
   /** reduceX(...) methods */
 
@@ -215,6 +220,7 @@ public:
   void reduceLoad    (Load      *Orig);
   void reduceUnaryOp (UnaryOp   *Orig);
   void reduceBinaryOp(BinaryOp  *Orig);
+  void reduceBranch  (Branch    *Orig);
 
   void reduceIdentifier(Identifier *Orig);
 
@@ -233,6 +239,21 @@ public:
 
   void traverseFuture(Future *Orig);
 
+  /// Traverse E, but do not lower the bodies of any functions.
+  /// Function bodies are left as futures, which will be lowered on demand.
+  SExpr* traverseLazy(SExpr *E);
+
+  /// Force F, which was created by traverseLazy(), and then lower the
+  /// bodies of all functions that are called from F, transitively.
+  void lowerOnDemand(Future *F);
+
+  /// Return the function bodies that were not lowered by traverseLazy().
+  std::vector<TypedEvalFuture*>& deferredFutures() { return Deferred; }
+
+  /// Lower F, which may have been created by a different evaluator, along
+  /// with any futures that are created while lowering it.
+  void lowerFuture(TypedEvalFuture *F);
+
 private:
   friend class CFGFuture;
 
@@ -245,6 +266,22 @@ private:
   void traverseNestedCode(Code* Orig);
   bool reduceNestedCall(Call* Orig, Code* C);
   void processPendingBlocks();
+  void forceNonCFGFutures();
+
+  SCFG*  getInlineCandidate(Code* C, TypedCopyAttr &Ca);
+  SExpr* inlineCall(Code* C, SCFG* Callee, Substitution<TypedCopyAttr> &&S);
+  void   copyBlocks(SCFG* Orig);
+
+  SCFG*  getSpecialization(Code* C, SCFG* Callee,
+                           Substitution<TypedCopyAttr> &S);
+  SCFG*  specializeCFG(SCFG* Orig, Substitution<TypedCopyAttr> &S);
+
+  /// A copy of a function body, specialized to a set of constant arguments.
+  struct Specialization {
+    Code*                 Fun;
+    std::vector<Literal*> Args;   ///< Null for non-constant arguments.
+    SCFG*                 Body;
+  };
 
   enum EvaluationMode {
     TEval_Copy,      ///< Do a deep copy of a term, traversing inside values
@@ -259,20 +296,60 @@ private:
 
 public:
   TypedEvaluator(MemRegionRef A)
-    : Super(A), EvalMode(TEval_Copy)
+    : Super(A), EvalMode(TEval_Copy), InlineThreshold(DefaultInlineThreshold),
+      InlineBudget(DefaultInlineBudget), MaxInlineDepth(DefaultInlineDepth),
+      InlinedSize(0), Specialize(true), LowerOnDemand(false)
   { }
 
+  /// Calls to functions with at most this many instructions are inlined.
+  /// Each constant argument raises the threshold by InlineConstArgBonus.
+  /// A threshold of zero disables inlining.
+  void setInlineThreshold(unsigned N) { InlineThreshold = N; }
+
+  /// Set the maximum number of instructions that may be inlined into a
+  /// single CFG.
+  void setInlineBudget(unsigned N) { InlineBudget = N; }
+
+  /// Set the maximum depth of inlining within inlined function bodies.
+  void setMaxInlineDepth(unsigned N) { MaxInlineDepth = N; }
+
+  /// Turn specialization on or off.  When specialization is on, calls with
+  /// constant arguments use a copy of the callee in which the arguments have
+  /// been substituted and folded.  Copies are cached, and are reused by
+  /// later calls with the same constant arguments.
+  void setSpecialize(bool B) { Specialize = B; }
+
+  /// Return the number of specialized function bodies that were created.
+  unsigned numSpecializations() const { return SpecCache.size(); }
+
+  static const unsigned DefaultInlineThreshold = 24;
+  static const unsigned DefaultInlineBudget    = 512;
+  static const unsigned DefaultInlineDepth     = 4;
+  static const unsigned InlineConstArgBonus    = 8;
+
+  /// Callees which are more than this many times over the inline threshold
+  /// are not specialized, since the copy would almost never be small
+  /// enough to inline.
+  static const unsigned MaxSpecializeFactor    = 4;
+
 protected:
   EvaluationMode                             EvalMode;
+  unsigned                                   InlineThreshold;
+  unsigned                                   InlineBudget;
+  unsigned                                   MaxInlineDepth;
+  unsigned                                   InlinedSize;  ///< In current CFG
+  std::vector<Code*>                         InlineStack;
+  bool                                       Specialize;
+  std::unordered_multimap<size_t, Specialization> SpecCache;
+  bool                                       LowerOnDemand;
+  std::queue<Future*>                        DemandQueue;
+  std::vector<TypedEvalFuture*>              Deferred;
   std::vector<std::unique_ptr<PendingBlock>> PendingBlks;
   std::queue<PendingBlock*>                  PendingBlockQueue;
   DenseMap<Code*, PendingBlock*>             CodeMap;
 };
 
 
-typedef LazyCopyFuture<TypedEvaluator, ScopeCPS> TypedEvalFuture;
-
-
 
 template<class T>
 void TypedEvaluator::reduceLiteralT(LiteralT<T> *Orig) {